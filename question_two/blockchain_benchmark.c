@@ -0,0 +1,620 @@
+/**
+ * This program benchmarks the persistent blockchain in blockchain_full_persistent.c.
+ *
+ * It builds a synthetic chain with a configurable number of blocks and transactions
+ * per block, and times hashing, appending blocks and transactions, validation,
+ * saving and loading. For each operation it reports throughput and p50/p99 latency,
+ * along with the peak resident set size of the process. Whole-chain operations are
+ * repeated to give their latencies a distribution; a percentile with too few
+ * samples is reported as n/a.
+ *
+ * Results are written to a JSON file. Given a baseline file from an earlier run,
+ * it reports the change in throughput of each operation and exits with status 1
+ * if any operation got slower than the allowed threshold.
+ */
+
+#define BLOCKCHAIN_NO_MAIN
+#include "blockchain_full_persistent.c"
+
+#include <sys/resource.h>
+
+// Constants
+#define BENCH_DEFAULT_BLOCKS 1000
+#define BENCH_DEFAULT_TRANSACTIONS 4
+#define BENCH_DEFAULT_ACCOUNTS 1000
+#define BENCH_DEFAULT_THRESHOLD 10.0
+#define BENCH_DEFAULT_OUTPUT "benchmark.json"
+#define BENCH_DEFAULT_FILE "benchmark.dat"
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_MAX_SAMPLES (1 << 20)
+#define BENCH_MAX_RESULTS 8
+#define BENCH_NAME_SIZE 32
+
+// Latency samples of one operation
+// Runs with more operations than BENCH_MAX_SAMPLES record every stride-th one
+typedef struct BenchSamples
+{
+        double *latencies;
+        int count;
+        int capacity;
+        long long stride;
+        long long seen;
+} BenchSamples;
+
+// Measurements of one benchmarked operation
+typedef struct BenchResult
+{
+        char name[BENCH_NAME_SIZE];
+        long long operations;
+        double seconds;
+        double p50_ns; // Negative when there are too few samples
+        double p99_ns;
+} BenchResult;
+
+// Benchmark settings taken from the command line
+typedef struct BenchConfig
+{
+        int blocks;
+        int transactions;
+        int accounts;
+        double threshold;
+        const char *output;
+        const char *baseline;
+        const char *file;
+        int runs; // Repetitions of each whole-chain operation
+} BenchConfig;
+
+// Function prototypes
+int parseBenchArguments(int argc, char **argv, BenchConfig *config);
+double getTimeNs(void);
+int initBenchSamples(BenchSamples *samples, long long operations);
+void recordBenchSample(BenchSamples *samples, double latency);
+int compareLatencies(const void *a, const void *b);
+void finishBenchResult(BenchResult *result, const char *name, BenchSamples *samples, long long operations, double seconds);
+double getPercentile(const double *latencies, int count, double percentile);
+const char *formatLatency(double ns, char *buffer, size_t size);
+long getPeakRssKb(void);
+int writeBenchResults(const BenchConfig *config, const BenchResult *results, int count, long peak_rss_kb);
+int readBaselineRate(const char *json, const char *name, double *rate);
+int compareWithBaseline(const BenchConfig *config, const BenchResult *results, int count);
+void removeBenchSideFiles(const char *filename);
+
+// Main function
+int main(int argc, char **argv)
+{
+        BenchConfig config;
+        if (!parseBenchArguments(argc, argv, &config))
+        {
+                printf("Usage: %s [--blocks N] [--transactions N] [--accounts N] [--output FILE]\n"
+                       "          [--baseline FILE] [--threshold PERCENT] [--file FILE] [--io stdio|io_uring]\n"
+                       "          [--runs N]\n",
+                       argv[0]);
+                return 1;
+        }
+
+        printf("Benchmarking %d blocks with %d transactions each (SHA-256 backend: %s, I/O backend: %s)\n",
+               config.blocks, config.transactions, sha256BackendName(getSha256Backend()), ioBackendName(getIoBackend()));
+
+        Blockchain *chain = createBlockchain();
+        if (!chain)
+        {
+                printf("Error: Could not create blockchain\n");
+                return 1;
+        }
+
+        BenchResult results[BENCH_MAX_RESULTS];
+        int result_count = 0;
+        BenchSamples block_samples;
+        BenchSamples transaction_samples;
+        long long transaction_total = (long long)config.blocks * config.transactions;
+        if (!initBenchSamples(&block_samples, config.blocks) ||
+            !initBenchSamples(&transaction_samples, transaction_total))
+        {
+                printf("Error: Could not allocate latency samples\n");
+                freeBlockchain(chain);
+                return 1;
+        }
+
+        // Build the chain, timing every append
+        double block_seconds = 0;
+        double transaction_seconds = 0;
+        char data[MAX_DATA_SIZE];
+        char sender[MAX_SENDER_SIZE];
+        char receiver[MAX_RECEIVER_SIZE];
+        for (int b = 0; b < config.blocks; b++)
+        {
+                snprintf(data, sizeof(data), "Benchmark block %d", b);
+                double start = getTimeNs();
+                int added = addBlock(chain, data);
+                double elapsed = getTimeNs() - start;
+                if (!added)
+                {
+                        printf("Error: Could not add block %d\n", b);
+                        freeBlockchain(chain);
+                        return 1;
+                }
+                block_seconds += elapsed / 1e9;
+                recordBenchSample(&block_samples, elapsed);
+
+                Block *block = getLatestBlock(chain);
+                for (int t = 0; t < config.transactions; t++)
+                {
+                        long long n = (long long)b * config.transactions + t;
+                        snprintf(sender, sizeof(sender), "account%lld", n % config.accounts);
+                        snprintf(receiver, sizeof(receiver), "account%lld", (n * 7 + 1) % config.accounts);
+
+                        start = getTimeNs();
+                        added = addTransaction(block, sender, receiver, (double)(n % 100) + 0.5);
+                        elapsed = getTimeNs() - start;
+                        if (!added)
+                        {
+                                printf("Error: Could not add transaction to block %d\n", b);
+                                freeBlockchain(chain);
+                                return 1;
+                        }
+                        transaction_seconds += elapsed / 1e9;
+                        recordBenchSample(&transaction_samples, elapsed);
+                }
+        }
+        finishBenchResult(&results[result_count++], "addBlock", &block_samples, config.blocks, block_seconds);
+        finishBenchResult(&results[result_count++], "addTransaction", &transaction_samples, transaction_total, transaction_seconds);
+
+        // Rehash every block
+        BenchSamples samples;
+        double seconds = 0;
+        unsigned char digest[DIGEST_SIZE];
+        if (!initBenchSamples(&samples, chain->length))
+        {
+                printf("Error: Could not allocate latency samples\n");
+                freeBlockchain(chain);
+                return 1;
+        }
+        for (int b = 0; b < chain->length; b++)
+        {
+                double start = getTimeNs();
+                calculateHash(getBlock(chain, b), digest);
+                double elapsed = getTimeNs() - start;
+                seconds += elapsed / 1e9;
+                recordBenchSample(&samples, elapsed);
+        }
+        finishBenchResult(&results[result_count++], "calculateHash", &samples, chain->length, seconds);
+
+        // Whole-chain operations are repeated config.runs times, one latency
+        // sample each, and counted in blocks. Every run verifies every block;
+        // the checkpoint would let later runs skip them.
+        long long run_blocks = (long long)config.runs * chain->length;
+        seconds = 0;
+        if (!initBenchSamples(&samples, config.runs))
+        {
+                printf("Error: Could not allocate latency samples\n");
+                freeBlockchain(chain);
+                return 1;
+        }
+        for (int run = 0; run < config.runs; run++)
+        {
+                double start = getTimeNs();
+                int valid = reverifyBlockchain(chain) < 0;
+                double elapsed = getTimeNs() - start;
+                if (!valid)
+                {
+                        printf("Error: Benchmark chain failed validation\n");
+                        free(samples.latencies);
+                        freeBlockchain(chain);
+                        return 1;
+                }
+                seconds += elapsed / 1e9;
+                recordBenchSample(&samples, elapsed);
+        }
+        finishBenchResult(&results[result_count++], "validateBlockchain", &samples, run_blocks, seconds);
+
+        seconds = 0;
+        if (!initBenchSamples(&samples, config.runs))
+        {
+                printf("Error: Could not allocate latency samples\n");
+                freeBlockchain(chain);
+                return 1;
+        }
+        for (int run = 0; run < config.runs; run++)
+        {
+                double start = getTimeNs();
+                int saved = saveBlockchain(chain, config.file);
+                double elapsed = getTimeNs() - start;
+                if (!saved)
+                {
+                        free(samples.latencies);
+                        freeBlockchain(chain);
+                        return 1;
+                }
+                seconds += elapsed / 1e9;
+                recordBenchSample(&samples, elapsed);
+        }
+        finishBenchResult(&results[result_count++], "saveBlockchain", &samples, run_blocks, seconds);
+        freeBlockchain(chain);
+
+        // A warm load takes the indexes and ledger state from the side files
+        // written by the save; a cold load rebuilds them from the blocks, so
+        // they are removed before every cold run
+        const char *load_names[2] = {"loadBlockchainWarm", "loadBlockchain"};
+        for (int pass = 0; pass < 2; pass++)
+        {
+                seconds = 0;
+                if (!initBenchSamples(&samples, config.runs))
+                {
+                        printf("Error: Could not allocate latency samples\n");
+                        removeBenchSideFiles(config.file);
+                        remove(config.file);
+                        return 1;
+                }
+                for (int run = 0; run < config.runs; run++)
+                {
+                        if (pass == 1)
+                                removeBenchSideFiles(config.file);
+
+                        double start = getTimeNs();
+                        Blockchain *loaded = loadBlockchain(config.file);
+                        double elapsed = getTimeNs() - start;
+                        if (!loaded)
+                        {
+                                free(samples.latencies);
+                                removeBenchSideFiles(config.file);
+                                remove(config.file);
+                                return 1;
+                        }
+                        freeBlockchain(loaded);
+                        seconds += elapsed / 1e9;
+                        recordBenchSample(&samples, elapsed);
+                }
+                finishBenchResult(&results[result_count++], load_names[pass], &samples, run_blocks, seconds);
+        }
+
+        // Remove the chain file and everything saved next to it
+        removeBenchSideFiles(config.file);
+        remove(config.file);
+
+        // Report
+        long peak_rss_kb = getPeakRssKb();
+        printf("\n%-20s %12s %14s %12s %12s\n", "operation", "count", "ops/s", "p50 (us)", "p99 (us)");
+        for (int i = 0; i < result_count; i++)
+        {
+                char p50[32];
+                char p99[32];
+                printf("%-20s %12lld %14.0f %12s %12s\n", results[i].name, results[i].operations,
+                       results[i].seconds > 0 ? results[i].operations / results[i].seconds : 0,
+                       formatLatency(results[i].p50_ns, p50, sizeof(p50)),
+                       formatLatency(results[i].p99_ns, p99, sizeof(p99)));
+        }
+        printf("Peak RSS: %ld KB\n", peak_rss_kb);
+
+        if (!writeBenchResults(&config, results, result_count, peak_rss_kb))
+                return 1;
+        printf("Results written to %s\n", config.output);
+
+        if (config.baseline)
+                return compareWithBaseline(&config, results, result_count) ? 0 : 1;
+        return 0;
+}
+
+/**
+ * Parses the command line into benchmark settings
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param config Settings to fill, starting from the defaults
+ * @return 1 if successful, 0 if an argument is unknown or out of range
+ */
+int parseBenchArguments(int argc, char **argv, BenchConfig *config)
+{
+        config->blocks = BENCH_DEFAULT_BLOCKS;
+        config->transactions = BENCH_DEFAULT_TRANSACTIONS;
+        config->accounts = BENCH_DEFAULT_ACCOUNTS;
+        config->threshold = BENCH_DEFAULT_THRESHOLD;
+        config->output = BENCH_DEFAULT_OUTPUT;
+        config->baseline = NULL;
+        config->file = BENCH_DEFAULT_FILE;
+        config->runs = BENCH_DEFAULT_RUNS;
+
+        for (int i = 1; i < argc; i++)
+        {
+                // Every option takes a value
+                if (i + 1 >= argc)
+                        return 0;
+                const char *value = argv[++i];
+
+                if (strcmp(argv[i - 1], "--blocks") == 0)
+                        config->blocks = atoi(value);
+                else if (strcmp(argv[i - 1], "--transactions") == 0)
+                        config->transactions = atoi(value);
+                else if (strcmp(argv[i - 1], "--accounts") == 0)
+                        config->accounts = atoi(value);
+                else if (strcmp(argv[i - 1], "--threshold") == 0)
+                        config->threshold = atof(value);
+                else if (strcmp(argv[i - 1], "--output") == 0)
+                        config->output = value;
+                else if (strcmp(argv[i - 1], "--baseline") == 0)
+                        config->baseline = value;
+                else if (strcmp(argv[i - 1], "--file") == 0)
+                        config->file = value;
+                else if (strcmp(argv[i - 1], "--runs") == 0)
+                        config->runs = atoi(value);
+                else if (strcmp(argv[i - 1], "--io") == 0)
+                {
+                        // Saving and loading go through the chosen backend
+                        if (strcmp(value, ioBackendName(IO_BACKEND_STDIO)) == 0)
+                                setIoBackend(IO_BACKEND_STDIO);
+                        else if (strcmp(value, ioBackendName(IO_BACKEND_URING)) != 0 || !setIoBackend(IO_BACKEND_URING))
+                                return 0;
+                }
+                else
+                        return 0;
+        }
+
+        return config->blocks > 0 && config->transactions >= 0 &&
+               config->transactions <= MAX_BLOCK_TRANSACTIONS && config->accounts > 0 &&
+               config->threshold >= 0 && config->runs > 0;
+}
+
+/**
+ * Gets the current time of the monotonic clock
+ * @return Time in nanoseconds
+ */
+double getTimeNs(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+/**
+ * Allocates a sample buffer for an operation
+ * @param samples Samples to prepare; freed by finishBenchResult
+ * @param operations Number of operations that will be recorded
+ * @return 1 if successful, 0 if allocation fails
+ */
+int initBenchSamples(BenchSamples *samples, long long operations)
+{
+        memset(samples, 0, sizeof(*samples));
+
+        long long stride = operations > BENCH_MAX_SAMPLES ? (operations + BENCH_MAX_SAMPLES - 1) / BENCH_MAX_SAMPLES : 1;
+        int capacity = (int)((operations + stride - 1) / stride);
+        if (capacity < 1)
+                capacity = 1;
+        samples->latencies = (double *)malloc(sizeof(double) * capacity);
+        if (!samples->latencies)
+                return 0;
+        samples->capacity = capacity;
+        samples->count = 0;
+        samples->stride = stride;
+        samples->seen = 0;
+        return 1;
+}
+
+/**
+ * Records the latency of one operation
+ * @param samples Samples of the operation
+ * @param latency Latency in nanoseconds
+ */
+void recordBenchSample(BenchSamples *samples, double latency)
+{
+        if (samples->seen++ % samples->stride == 0 && samples->count < samples->capacity)
+                samples->latencies[samples->count++] = latency;
+}
+
+/**
+ * Orders latencies for qsort
+ * @param a First latency
+ * @param b Second latency
+ * @return Negative, zero or positive as a is less than, equal to or greater than b
+ */
+int compareLatencies(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+/**
+ * Fills in a result from the samples of an operation and frees the samples
+ * @param result Result to fill
+ * @param name Name of the operation
+ * @param samples Latency samples of the operation
+ * @param operations Number of operations performed
+ * @param seconds Total time spent in the operation
+ */
+void finishBenchResult(BenchResult *result, const char *name, BenchSamples *samples, long long operations, double seconds)
+{
+        snprintf(result->name, sizeof(result->name), "%s", name);
+        result->operations = operations;
+        result->seconds = seconds;
+        qsort(samples->latencies, samples->count, sizeof(double), compareLatencies);
+        result->p50_ns = getPercentile(samples->latencies, samples->count, 0.50);
+        result->p99_ns = getPercentile(samples->latencies, samples->count, 0.99);
+
+        free(samples->latencies);
+        samples->latencies = NULL;
+        samples->count = 0;
+        samples->capacity = 0;
+}
+
+/**
+ * Gets a percentile of sorted latencies
+ * Below 1 / (1 - percentile) samples, the percentile cannot be told apart
+ * from the largest sample, so none is given.
+ * @param latencies Latencies in ascending order
+ * @param count Number of latencies
+ * @param percentile Fraction of samples at or below the result, such as 0.99
+ * @return Latency at the percentile, or -1 if there are too few samples
+ */
+double getPercentile(const double *latencies, int count, double percentile)
+{
+        if (count * (1.0 - percentile) < 0.999)
+                return -1;
+        return latencies[(int)((count - 1) * percentile)];
+}
+
+/**
+ * Formats a latency in microseconds for the report
+ * @param ns Latency in nanoseconds, negative if there were too few samples
+ * @param buffer Buffer for the text
+ * @param size Size of the buffer
+ * @return buffer, holding the latency or "n/a"
+ */
+const char *formatLatency(double ns, char *buffer, size_t size)
+{
+        if (ns < 0)
+                snprintf(buffer, size, "n/a");
+        else
+                snprintf(buffer, size, "%.2f", ns / 1e3);
+        return buffer;
+}
+
+/**
+ * Gets the peak resident set size of the process
+ * @return Peak RSS in kilobytes, or 0 if unavailable
+ */
+long getPeakRssKb(void)
+{
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+                return 0;
+        return usage.ru_maxrss;
+}
+
+/**
+ * Writes benchmark results as JSON
+ * @param config Settings of the run
+ * @param results Results of each operation
+ * @param count Number of results
+ * @param peak_rss_kb Peak RSS of the run
+ * @return 1 if successful, 0 if the file cannot be written
+ */
+int writeBenchResults(const BenchConfig *config, const BenchResult *results, int count, long peak_rss_kb)
+{
+        FILE *file = fopen(config->output, "w");
+        if (!file)
+        {
+                printf("Error: Could not open %s for writing\n", config->output);
+                return 0;
+        }
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"blocks\": %d,\n", config->blocks);
+        fprintf(file, "  \"transactions_per_block\": %d,\n", config->transactions);
+        fprintf(file, "  \"accounts\": %d,\n", config->accounts);
+        fprintf(file, "  \"runs\": %d,\n", config->runs);
+        fprintf(file, "  \"sha256_backend\": \"%s\",\n", sha256BackendName(getSha256Backend()));
+        fprintf(file, "  \"io_backend\": \"%s\",\n", ioBackendName(getIoBackend()));
+        fprintf(file, "  \"worker_threads\": %d,\n", getWorkerCount());
+        fprintf(file, "  \"peak_rss_kb\": %ld,\n", peak_rss_kb);
+        fprintf(file, "  \"results\": [\n");
+        for (int i = 0; i < count; i++)
+        {
+                // Percentiles without enough samples are written as null
+                char p50[32] = "null";
+                char p99[32] = "null";
+                if (results[i].p50_ns >= 0)
+                        snprintf(p50, sizeof(p50), "%.1f", results[i].p50_ns);
+                if (results[i].p99_ns >= 0)
+                        snprintf(p99, sizeof(p99), "%.1f", results[i].p99_ns);
+                fprintf(file, "    {\"name\": \"%s\", \"operations\": %lld, \"seconds\": %.9f, "
+                              "\"ops_per_second\": %.3f, \"p50_ns\": %s, \"p99_ns\": %s}%s\n",
+                        results[i].name, results[i].operations, results[i].seconds,
+                        results[i].seconds > 0 ? results[i].operations / results[i].seconds : 0, p50, p99,
+                        i + 1 < count ? "," : "");
+        }
+        fprintf(file, "  ]\n");
+        fprintf(file, "}\n");
+
+        return fclose(file) == 0;
+}
+
+/**
+ * Finds the throughput of an operation in a results file written by
+ * writeBenchResults
+ * @param json Contents of the results file
+ * @param name Name of the operation
+ * @param rate Receives the operations per second
+ * @return 1 if the operation was found, 0 otherwise
+ */
+int readBaselineRate(const char *json, const char *name, double *rate)
+{
+        char key[BENCH_NAME_SIZE + 16];
+        snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+        const char *entry = strstr(json, key);
+        if (!entry)
+                return 0;
+
+        // The rate belongs to this entry only if it comes before the entry closes
+        const char *field = strstr(entry, "\"ops_per_second\":");
+        const char *close = strchr(entry, '}');
+        if (!field || (close && field > close))
+                return 0;
+
+        return sscanf(field, "\"ops_per_second\": %lf", rate) == 1;
+}
+
+/**
+ * Compares the throughput of each operation with a baseline results file
+ * @param config Settings of the run, including the baseline file and threshold
+ * @param results Results of this run
+ * @param count Number of results
+ * @return 1 if no operation regressed by more than the threshold, 0 otherwise
+ */
+int compareWithBaseline(const BenchConfig *config, const BenchResult *results, int count)
+{
+        FILE *file = fopen(config->baseline, "rb");
+        if (!file)
+        {
+                printf("Error: Could not open baseline %s\n", config->baseline);
+                return 0;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        rewind(file);
+        char *json = (char *)malloc(size > 0 ? (size_t)size + 1 : 1);
+        if (!json)
+        {
+                fclose(file);
+                return 0;
+        }
+        size_t read = size > 0 ? fread(json, 1, (size_t)size, file) : 0;
+        json[read] = '\0';
+        fclose(file);
+
+        int regressions = 0;
+        printf("\nCompared with %s (threshold %.1f%%):\n", config->baseline, config->threshold);
+        for (int i = 0; i < count; i++)
+        {
+                double baseline_rate;
+                if (!readBaselineRate(json, results[i].name, &baseline_rate) || baseline_rate <= 0)
+                {
+                        printf("%-20s not in baseline\n", results[i].name);
+                        continue;
+                }
+
+                double rate = results[i].seconds > 0 ? results[i].operations / results[i].seconds : 0;
+                double change = (rate - baseline_rate) / baseline_rate * 100.0;
+                int regressed = change < -config->threshold;
+                regressions += regressed;
+                printf("%-20s %+8.1f%%%s\n", results[i].name, change, regressed ? "  REGRESSION" : "");
+        }
+
+        free(json);
+        return regressions == 0;
+}
+
+/**
+ * Removes the index file and ledger snapshots saved next to a chain file
+ * @param filename Chain file the side files belong to
+ */
+void removeBenchSideFiles(const char *filename)
+{
+        char side_filename[FILENAME_BUFFER_SIZE];
+        getIndexFilename(filename, side_filename, sizeof(side_filename));
+        remove(side_filename);
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+        {
+                getStateFilename(filename, slot, side_filename, sizeof(side_filename));
+                remove(side_filename);
+        }
+}
@@ -11,27 +11,355 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <openssl/sha.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define ASYNC_IO_URING 1
+#endif
+#endif
 
 // Constants
 #define MAX_DATA_SIZE 256
 #define HASH_SIZE 64
-#define MAX_TRANSACTIONS 10
+#define DIGEST_SIZE SHA256_DIGEST_LENGTH
+#define LEGACY_MAX_TRANSACTIONS 10
+#define MAX_BLOCK_TRANSACTIONS (1 << 24)
 #define MAX_SENDER_SIZE 50
 #define MAX_RECEIVER_SIZE 50
+#define MAX_ACCOUNT_NAME_SIZE 50
+#define ACCOUNT_TABLE_MIN_SIZE 16
+#define TOP_ACCOUNTS_COUNT 10
 #define TRANS_STR_SIZE 150
 #define INPUT_BUFFER_SIZE 1024
 #define FILENAME "blockchain.dat"
+#define FILE_MAGIC "BCHN"
+#define FILE_VERSION 4       // Varint records in optionally compressed groups
+#define FILE_VERSION_FIXED 3 // Fixed-width records, still readable
+#define FILE_FORMAT_LEGACY 0
+#define FILE_FORMAT_FIXED 1
+#define FILE_FORMAT_COMPACT 2
+#define FILE_FLAG_COMPRESSED 1
+#define FILE_FLAG_INDEXED 2
+#define FILE_FOOTER_MAGIC "BEND"
+#define DECODE_HEADERS_ONLY 0 // Transactions are skipped
+#define DECODE_SEALED 1       // Transactions go into an exactly sized array
+#define DECODE_PAGED 2        // Transactions go into a size-class array that can be recycled
+#define TRANSACTION_CACHE_DEFAULT_BYTES (64 << 20)
+#define TRANSACTION_CACHE_PINNED -2
+#define FILE_GROUP_BLOCKS 64
+#define FILE_GROUP_MAX_SIZE (1u << 30)
+#define FILE_COMPRESSION_LEVEL 6
+
+// Backends for the block group I/O of compact files
+#define IO_BACKEND_STDIO 0
+#define IO_BACKEND_URING 1
+#define ASYNC_IO_BUFFER_COUNT 4 // Transfers in flight at once
+#define ASYNC_IO_BUFFER_SIZE (1 << 20)
+#define SEGMENT_MANIFEST_FILENAME "blockchain.seg"
+#define SEGMENT_MANIFEST_MAGIC "BSEG"
+#define SEGMENT_MANIFEST_VERSION 1
+#define SEGMENT_FILE_DEFAULT_BYTES (32LL << 20)
+#define MAX_SEGMENT_FILES 1000000
+#define INDEX_FILE_SUFFIX ".idx"
+#define INDEX_FILE_MAGIC "BIDX"
+#define INDEX_FILE_VERSION 2
+#define STATE_FILE_SUFFIX ".state"
+#define STATE_FILE_MAGIC "BSTA"
+#define STATE_FILE_VERSION 3
+#define STATE_FILE_SLOTS 2
+#define STATE_CHECKSUM_SEED 14695981039346656037ull
+#define STATE_SNAPSHOT_POLL_NS 10000000
+#define FILENAME_BUFFER_SIZE 512
+#define POSTING_LIST_MIN_SIZE 8
+#define HASH_TABLE_MIN_BITS 6
+#define MAX_WORKER_THREADS 64
+#define PARALLEL_MIN_ITEMS 256
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_SIZE_CLASSES 25
+#define POOL_ALIGNMENT 8
+#define BLOCK_SEGMENT_SHIFT 8
+#define BLOCK_SEGMENT_SIZE (1 << BLOCK_SEGMENT_SHIFT)
+#define BLOCK_SEGMENT_MASK (BLOCK_SEGMENT_SIZE - 1)
+#define CACHE_LINE_SIZE 64
+#define MAX_EPOCH_READERS 64
+
+// Batch ingest: input formats, read chunking and pipeline queue depth
+#define INGEST_FORMAT_AUTO 0
+#define INGEST_FORMAT_CSV 1
+#define INGEST_FORMAT_JSONL 2
+#define INGEST_CHUNK_SIZE (1 << 20)
+#define INGEST_CHUNK_COUNT 4
+#define INGEST_QUEUE_SIZE 16
+#define INGEST_LINE_SIZE 1024
+#define INGEST_DEFAULT_BLOCK_SIZE 1000
+#define INGEST_MAX_REPORTED_ERRORS 10
+
+// Mempool of pending transactions and the sealer thread that drains it
+#define MEMPOOL_DEFAULT_CAPACITY (1 << 16)
+#define MEMPOOL_IDLE_SLEEP_NS 100000
+
+// Write-ahead journal of the changes made since the chain was last saved
+#define JOURNAL_FILENAME "blockchain.wal"
+#define JOURNAL_MAGIC "BWAL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORD_BLOCK 1
+#define JOURNAL_RECORD_TRANSACTION 2
+#define JOURNAL_RECORD_HEADER_SIZE 8 // Payload length and CRC-32
+#define JOURNAL_MAX_RECORD_SIZE 1024
+#define JOURNAL_MAX_HEADER_SIZE (12 + DIGEST_SIZE + 2 + FILENAME_BUFFER_SIZE + 4)
+#define JOURNAL_GROUP_BYTES (1 << 20) // Pending bytes that end a group before its window does
+#define JOURNAL_DEFAULT_LATENCY_MS 2
+
+// States of a background save
+#define SAVE_RUNNING 0
+#define SAVE_SUCCEEDED 1
+#define SAVE_FAILED 2
+
+// Hash modes: canonical binary encoding, the original string encoding
+// kept so files written before the binary encoding still verify, or the
+// canonical encoding followed by a proof-of-work difficulty and nonce
+#define HASH_MODE_CANONICAL 0
+#define HASH_MODE_LEGACY 1
+#define HASH_MODE_WORK 2
+
+// Sizes of the canonical fixed-width encodings fed to SHA-256
+// Transactions are committed to through the Merkle root in the header
+#define ENCODED_HEADER_SIZE (8 + 8 + MAX_DATA_SIZE + DIGEST_SIZE + DIGEST_SIZE + 4)
+#define ENCODED_WORK_HEADER_SIZE (ENCODED_HEADER_SIZE + 4 + 8)
+#define ENCODED_TRANSACTION_SIZE (4 + 4 + 8 + 8)
+
+// Merkle tree domain separation prefixes and maximum tree height
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+#define MERKLE_MAX_LEAF_SIZE (1 + ENCODED_TRANSACTION_SIZE + 2 * MAX_ACCOUNT_NAME_SIZE)
+#define MERKLE_MAX_DEPTH 32
+
+// Proof-of-work difficulty is the number of leading zero bits of the hash
+// Mining hashes the whole 64-byte blocks of a work header once and then
+// only the remaining suffix, which holds the nonce, per attempt
+#define MAX_DIFFICULTY 64
+#define MAX_INTERACTIVE_DIFFICULTY 32 // About 4 billion hashes per block on average
+#define MINING_PREFIX_SIZE (ENCODED_WORK_HEADER_SIZE - ENCODED_WORK_HEADER_SIZE % SHA256_BLOCK_SIZE)
+#define MINING_SUFFIX_SIZE (ENCODED_WORK_HEADER_SIZE - MINING_PREFIX_SIZE)
+
+// Batch SHA-256 kernels, chosen at runtime from what the CPU supports
+#define SHA256_BACKEND_PORTABLE 0
+#define SHA256_BACKEND_AVX2 1
+#define SHA256_BACKEND_SHANI 2
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_MAX_LANES 8
+#define HASH_BATCH_SIZE 64
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// SHA-256 round constants
+static const unsigned int SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// SHA-256 initial hash value
+static const unsigned int SHA256_INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 
 // Struct definition for Transaction
+// Accounts are referenced by their ID in the chain's account dictionary
 typedef struct Transaction
+{
+        unsigned int sender_id;
+        unsigned int receiver_id;
+        double amount;
+        time_t timestamp;
+} Transaction;
+
+// Transaction record layout used by files written before account interning
+typedef struct LegacyTransaction
 {
         char sender[MAX_SENDER_SIZE];
         char receiver[MAX_RECEIVER_SIZE];
         double amount;
         time_t timestamp;
-} Transaction;
+} LegacyTransaction;
+
+// Announcement of one reader of an epoch domain; 0 marks a free slot
+// Every slot has its own cache line so readers never contend on it.
+typedef struct EpochSlot
+{
+        _Alignas(CACHE_LINE_SIZE) atomic_ullong epoch;
+} EpochSlot;
+
+// Pointer the writer has unpublished, freed once no reader can still hold it
+typedef struct RetiredPointer
+{
+        void *pointer;
+        unsigned long long epoch; // Global epoch when the pointer was retired
+        struct RetiredPointer *next;
+} RetiredPointer;
+
+// Epoch-based reclamation for structures that readers traverse without locks
+// Readers announce the global epoch while they hold published pointers.
+// The writer advances the epoch on every retire and frees a retired
+// pointer once every announced epoch is newer than it.
+typedef struct EpochDomain
+{
+        EpochSlot readers[MAX_EPOCH_READERS];
+        atomic_ullong global_epoch;
+        RetiredPointer *retired; // Only touched by the writer
+} EpochDomain;
+
+// Interns account names into dense integer IDs
+// names[id] is the name of account id; slots is an open-addressing
+// table of id + 1 keyed on the name's hash. Readers that may run
+// alongside internAccount only use visible_names and visible_count.
+typedef struct AccountDictionary
+{
+        char **names;
+        unsigned int *hashes;
+        int count;
+        int capacity;
+        unsigned int *slots;
+        int slot_capacity;
+        _Atomic(char **) visible_names;
+        atomic_int visible_count;
+        EpochDomain *epochs; // Defers freeing replaced names arrays
+} AccountDictionary;
+
+// Roots of the perfect subtrees covering the leaves appended so far;
+// nodes[level] is set when bit level of count is set
+typedef struct MerkleFrontier
+{
+        unsigned int count;
+        unsigned char nodes[MERKLE_MAX_DEPTH][DIGEST_SIZE];
+} MerkleFrontier;
+
+// SHA-256 state after the whole 64-byte blocks of a message prefix
+typedef struct Sha256Midstate
+{
+        unsigned int state[8];
+        unsigned long long length; // Bytes of the prefix absorbed into state
+} Sha256Midstate;
+
+// Sibling hashes from a leaf up to the Merkle root
+typedef struct MerkleProof
+{
+        int tx_index;
+        int tx_count;
+        int length;
+        unsigned char path[MERKLE_MAX_DEPTH][DIGEST_SIZE];
+} MerkleProof;
+
+// Current balance of every account, indexed directly by account ID
+typedef struct BalanceIndex
+{
+        double *balances;
+        int capacity;
+} BalanceIndex;
+
+// Reference to a transaction (or a block, with tx_slot -1) ordered by time
+typedef struct Posting
+{
+        time_t timestamp;
+        int block_index;
+        int tx_slot;
+} Posting;
+
+// Postings kept sorted by timestamp
+typedef struct PostingList
+{
+        Posting *items;
+        int count;
+        int capacity;
+} PostingList;
+
+// Secondary indexes over the chain
+// accounts[id] lists every transaction sent or received by account id;
+// transactions and blocks list everything by timestamp.
+typedef struct ChainIndex
+{
+        PostingList *accounts;
+        int account_capacity;
+        PostingList transactions;
+        PostingList blocks;
+} ChainIndex;
+
+// Slot of the hash lookup table; block_index is stored + 1 so 0 marks an empty slot
+// The tag is written before block_index is released, so a reader that
+// sees the index also sees the tag.
+typedef struct HashSlot
+{
+        unsigned long long tag;
+        atomic_int block_index;
+} HashSlot;
+
+// Slots of the hash lookup table, replaced as a whole when it grows
+typedef struct HashSlotArray
+{
+        int bits;
+        int capacity;
+        HashSlot slots[];
+} HashSlotArray;
+
+// Open-addressing table from the hash of every sealed block to its index
+// Entries are addressed by the top bits of the hash, so hashes sharing a
+// prefix sit next to each other. The open tip is left out because its
+// hash changes with every transaction; lookups compare it directly.
+typedef struct BlockHashTable
+{
+        _Atomic(HashSlotArray *) array;
+        int count;
+} BlockHashTable;
+
+// Slab of raw storage that transaction arrays are carved from
+typedef struct PoolSlab
+{
+        struct PoolSlab *next;
+        size_t size;
+        size_t used;
+        unsigned char data[];
+} PoolSlab;
+
+// Link stored inside a recycled transaction array
+typedef struct PoolFreeNode
+{
+        struct PoolFreeNode *next;
+} PoolFreeNode;
+
+// Per-chain allocator for transaction arrays
+// Open blocks grow through power-of-two size classes with free lists;
+// sealed blocks are compacted into exactly sized arrays.
+typedef struct TransactionPool
+{
+        PoolSlab *slabs;
+        PoolFreeNode *free_lists[POOL_SIZE_CLASSES];
+        size_t bytes_reserved;
+} TransactionPool;
 
 // Struct definition for Block
 typedef struct Block
@@ -39,58 +367,694 @@ typedef struct Block
         int index;
         time_t timestamp;
         char data[MAX_DATA_SIZE];
-        Transaction transactions[MAX_TRANSACTIONS];
+        Transaction *transactions; // Allocated from the owning chain's pool
         int transaction_count;
-        char previous_hash[HASH_SIZE + 1];
-        char hash[HASH_SIZE + 1];
-        struct Block *next;
+        int transaction_capacity;
+        struct Blockchain *chain;
+        int hash_mode;
+        unsigned char merkle_root[DIGEST_SIZE];
+        unsigned char previous_hash[DIGEST_SIZE];
+        unsigned char hash[DIGEST_SIZE];
+        int difficulty;           // Leading zero bits the hash must have
+        unsigned long long nonce; // Found by mineBlock when difficulty is set
+        MerkleFrontier *frontier; // Only kept while the block is open for transactions
 } Block;
 
+// Prefix of the chain that has already passed validation
+// Later validations trust it as long as its last block keeps this hash.
+typedef struct ValidationCheckpoint
+{
+        int length;                      // Verified blocks, 0 if none
+        unsigned char hash[DIGEST_SIZE]; // Hash of block length - 1
+} ValidationCheckpoint;
+
+// Cost of the last nonce search
+typedef struct MiningStats
+{
+        unsigned long long attempts;
+        double seconds;
+} MiningStats;
+
 // Struct definition for Blockchain
+// Blocks live in fixed-size segments so appends never move existing blocks.
+// Appends are serialized by append_lock; readers take a ChainSnapshot
+// instead and never block them.
 typedef struct Blockchain
 {
-        Block *head;
+        Block **segments;
+        int segment_count;
+        int segment_capacity;
         int length;
+        _Atomic(Block **) published_segments; // Segment directory as seen by readers
+        atomic_int published_length;          // Sealed blocks, all but the open tip
+        atomic_int concurrent_reads;          // Snapshots leave out the open tip
+        atomic_int saving;                    // A background save is reading the sealed blocks
+        pthread_mutex_t append_lock;
+        EpochDomain epochs;
+        TransactionPool pool;
+        AccountDictionary accounts;
+        BalanceIndex balances;
+        ChainIndex index;
+        BlockHashTable hash_table;
+        int enforce_balances; // Reject transfers the sender cannot cover
+        int difficulty;       // Proof-of-work difficulty of new blocks
+        MiningStats last_mining;
+        ValidationCheckpoint checkpoint;
+        pthread_mutex_t checkpoint_lock; // Validations may run on several reader threads
+        int first_index;                 // Index of the first block held, nonzero only for a loaded range
+        struct TransactionCache *cache;  // Set when transactions are paged in from a mapped file
+        struct Journal *journal;         // Set when changes are journaled until the next save
 } Blockchain;
 
+// Consistent view of the chain for a reader
+// Blocks below length, and the hash table entries of those below
+// sealed_length, stay valid until endChainRead.
+typedef struct ChainSnapshot
+{
+        struct Blockchain *chain;
+        Block **segments;
+        const HashSlotArray *hash_slots;
+        int length;
+        int sealed_length;
+        int epoch_slot;
+} ChainSnapshot;
+
+// Derived ledger state as of a height: the secondary indexes over the
+// first height blocks
+// Balances are not kept: they are cheap to recompute from verified
+// blocks, and a saved copy could not be checked without doing so.
+typedef struct LedgerState
+{
+        int height;
+        int account_count;               // One past the highest account ID seen
+        unsigned char hash[DIGEST_SIZE]; // Hash of block height - 1
+        ChainIndex index;
+} LedgerState;
+
+// Fixed header of a ledger state file
+// The body follows directly: the block, transaction and account_count
+// account posting lists, encoded by encodeChainIndex.
+typedef struct LedgerStateHeader
+{
+        char magic[4];
+        unsigned int version;
+        int height;
+        int account_count;
+        unsigned char hash[DIGEST_SIZE];
+        unsigned long long checksum; // FNV-1a of the body
+} LedgerStateHeader;
+
+// Background writer of periodic ledger state snapshots
+typedef struct LedgerSnapshotter
+{
+        struct Blockchain *chain;
+        char state_filenames[STATE_FILE_SLOTS][FILENAME_BUFFER_SIZE];
+        int interval; // Sealed blocks between snapshots
+        LedgerState state;                   // Private copy, advanced from sealed blocks
+        int next_slot;
+        int snapshots_written;
+        atomic_int stopping;
+        pthread_t thread;
+} LedgerSnapshotter;
+
+// Transaction waiting in the mempool; names are interned by the sealer
+typedef struct PendingTransaction
+{
+        char sender[MAX_SENDER_SIZE];
+        char receiver[MAX_RECEIVER_SIZE];
+        double amount;
+} PendingTransaction;
+
+// Slot of the mempool ring
+// sequence == position means free for the producer of that position;
+// sequence == position + 1 means filled for its consumer.
+typedef struct MempoolCell
+{
+        atomic_size_t sequence;
+        PendingTransaction transaction;
+} MempoolCell;
+
+// Called by the sealer thread for each block it closes
+typedef void (*BlockSealedCallback)(Block *block, void *context);
+
+// Limits that decide when the sealer cuts a new block
+typedef struct MempoolConfig
+{
+        int capacity;            // Ring size, a power of two
+        int max_transactions;    // Transactions per block
+        size_t max_bytes;        // Submitted bytes per block, or 0 for no limit
+        long long max_latency_ms; // Longest a block stays open after its first transaction, or 0 for no limit
+        BlockSealedCallback on_sealed;
+        void *context;
+} MempoolConfig;
+
+// Counters reported when a mempool stops
+typedef struct MempoolStats
+{
+        long long accepted;
+        long long failed;
+        long long full_rejections;
+        int blocks_sealed;
+        int halted;
+} MempoolStats;
+
+// Bounded lock-free multi-producer queue of pending transactions
+// Producer and consumer positions are kept on separate cache lines.
+typedef struct Mempool
+{
+        MempoolCell *cells;
+        size_t mask;
+        _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_position;
+        _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_position;
+        _Alignas(CACHE_LINE_SIZE) atomic_int stopping;
+        atomic_int active_submitters;
+        atomic_llong accepted;
+        atomic_llong failed;
+        atomic_llong full_rejections;
+        Blockchain *chain;
+        MempoolConfig config;
+        pthread_t sealer;
+        size_t open_bytes;
+        long long open_since_ns;
+        int blocks_sealed;
+        int halted;
+} Mempool;
+
+// Block of raw input read by the ingest reader thread
+typedef struct IngestChunk
+{
+        size_t length;
+        char data[INGEST_CHUNK_SIZE];
+} IngestChunk;
+
+// Bounded blocking queue that hands items between ingest pipeline stages
+typedef struct IngestQueue
+{
+        void *items[INGEST_QUEUE_SIZE];
+        int head;
+        int count;
+        int closed;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+} IngestQueue;
+
+// Growable array of bytes
+typedef struct ByteBuffer
+{
+        unsigned char *data;
+        size_t size;
+        size_t capacity;
+} ByteBuffer;
+
+// Chain state the records of a journal apply on top of
+typedef struct JournalBase
+{
+        int length;                          // Blocks of the saved chain, 0 for a new chain
+        unsigned char hash[DIGEST_SIZE];     // Hash of block length - 1
+        char filename[FILENAME_BUFFER_SIZE]; // File the chain was saved to, empty for a new chain
+} JournalBase;
+
+// One change recorded in a journal
+// Block records carry the new block's header; transaction records the
+// transfer and the nonce its block was mined with. Both carry the block
+// hash after the change, which replay must reproduce.
+typedef struct JournalRecord
+{
+        int type;
+        int block_index;
+        time_t timestamp;
+        char data[MAX_DATA_SIZE];
+        int difficulty;
+        char sender[MAX_SENDER_SIZE];
+        char receiver[MAX_RECEIVER_SIZE];
+        double amount;
+        unsigned long long nonce;
+        unsigned char hash[DIGEST_SIZE];
+} JournalRecord;
+
+// Append-only log of the changes made to a chain since it was last saved
+// Appenders encode records into pending; the flusher thread writes each
+// group of them out with a single fdatasync once the oldest has waited
+// latency_ns, so concurrent appenders share the cost of the sync.
+typedef struct Journal
+{
+        int fd;
+        char filename[FILENAME_BUFFER_SIZE];
+        long long latency_ns;
+        pthread_mutex_t lock;
+        pthread_cond_t appended; // Signalled when a group starts or fills up
+        pthread_cond_t synced;   // Broadcast after every group is written
+        ByteBuffer pending;
+        ByteBuffer spare; // Buffer the flusher hands back after writing
+        long long first_pending_ns;
+        long long appended_bytes; // Size of the journal once everything appended is written
+        long long appended_records;
+        long long durable_records;
+        long long group_commits;
+        int writing; // Set while the flusher writes outside the lock
+        int stopping;
+        int failed;
+        pthread_t flusher;
+} Journal;
+
+// Called on the save thread once a background save has finished
+typedef void (*SaveCompletedCallback)(const char *filename, int succeeded, void *context);
+
+// Save of a point-in-time copy of a chain, written on its own thread
+// The sealed blocks are read in place through a snapshot, since they no
+// longer change; only the open tip is copied.
+typedef struct BackgroundSave
+{
+        Blockchain *chain;
+        char filename[FILENAME_BUFFER_SIZE];
+        ChainSnapshot snapshot;
+        Block tip; // Copy of the open tip, with its own transactions array
+        int has_tip;
+        int account_count;         // Accounts the copied blocks can refer to
+        JournalBase base;          // Chain state the saved file holds
+        long long journal_offset;  // Journal size when the copy was taken
+        SaveCompletedCallback on_complete;
+        void *context;
+        atomic_int status;
+        pthread_t thread;
+} BackgroundSave;
+
+// Where one block's record is in a compact file
+typedef struct BlockOffset
+{
+        long long group_offset;     // File offset of the group holding the record
+        unsigned int record_offset; // Offset of the record in the decompressed group
+        unsigned int record_size;
+} BlockOffset;
+
+// Trailer at the very end of an indexed compact file
+// The index of BlockOffset entries, one per block, starts at index_offset.
+typedef struct BlockFileFooter
+{
+        long long dictionary_offset;
+        long long index_offset;
+        int length;
+        char magic[4];
+} BlockFileFooter;
+
+// Staging buffer of an AsyncFile and the transfer it holds
+typedef struct AsyncBuffer
+{
+        unsigned char *data;
+        long long offset; // File offset of data[0]
+        size_t length;    // Bytes to transfer
+        size_t position;  // Bytes the reader has taken
+        int in_flight;
+} AsyncBuffer;
+
+// Block group I/O through an io_uring
+// Transfers go through staging buffers registered with the ring, at
+// explicit file offsets, so the caller keeps encoding or decoding groups
+// while up to ASYNC_IO_BUFFER_COUNT earlier transfers are in flight.
+// Writers fill the buffers in turn; readers keep them filled with the
+// chunks ahead of the one being consumed.
+typedef struct AsyncFile
+{
+        int ring_fd;
+        int fd;
+        int writing;
+        int fixed; // Buffers are registered, so transfers use the fixed opcodes
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring; // Same mapping as sq_ring on kernels with a single ring mapping
+        size_t cq_ring_size;
+        void *sqes;
+        size_t sqes_size;
+        unsigned int *sq_tail;
+        unsigned int sq_mask;
+        unsigned int *sq_array;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        void *cqes;
+        unsigned char *memory; // Backing store of all staging buffers
+        AsyncBuffer buffers[ASYNC_IO_BUFFER_COUNT];
+        int current;      // Buffer being filled or consumed
+        long long offset; // Writing: offset of the next byte; reading: next chunk to request
+        long long end;    // Reading: size of the file
+        int failed;
+} AsyncFile;
+
+// Writes block records to a compact file
+// Records are collected into groups of FILE_GROUP_BLOCKS, and each group
+// is compressed as a whole when the file is flagged compressed.
+typedef struct BlockFileWriter
+{
+        FILE *file;
+        int flags;
+        ByteBuffer group;  // Encoded records of the group being filled
+        ByteBuffer packed; // Compressed form of the group
+        int group_blocks;
+        const Block *previous; // Last block of the group so far
+        BlockOffset *offsets;  // Position of every record written, for the footer
+        int offset_capacity;
+        int blocks_written;
+        int failed;
+        AsyncFile *async; // Set when groups are written through an io_uring
+} BlockFileWriter;
+
+// Reads block records in order from a file of any supported version
+typedef struct BlockFileReader
+{
+        FILE *file;
+        int format;
+        int flags;
+        ByteBuffer group;  // Decompressed records of the current group
+        ByteBuffer packed; // Compressed form of the group as read
+        size_t position;   // Next unread byte of the group
+        time_t previous_timestamp;          // Of the record before, 0 at the start of a group
+        const unsigned char *previous_hash; // Of the record before, NULL at the start of a group
+        int blocks_read;
+        int headers_only;      // Skip over transactions, keeping only their count
+        TransactionPool *pool; // Pool for decoded transactions, NULL for the block's chain pool
+        AsyncFile *async;      // Set when groups are read ahead through an io_uring
+} BlockFileReader;
+
+// Transactions of a lazily loaded chain, paged in from the mapped file
+// Evictable arrays are kept on a recency list threaded through the block
+// indexes; pinned blocks are left off it and never evicted.
+typedef struct TransactionCache
+{
+        const unsigned char *map;
+        size_t map_size;
+        long long index_offset; // Start of the block index in the map
+        int paged_length;       // Blocks that came from the file
+        int *lru_prev;          // TRANSACTION_CACHE_PINNED for pinned blocks
+        int *lru_next;
+        int lru_head; // Most recently used block, -1 if none
+        int lru_tail; // Least recently used block, -1 if none
+        size_t budget;
+        size_t resident_bytes; // Evictable transaction bytes paged in
+        ByteBuffer group;      // Decompressed group the last block came from
+        long long group_offset; // Offset of that group, -1 if none
+} TransactionCache;
+
+// One segment file of segmented storage, as listed in the manifest
+typedef struct SegmentEntry
+{
+        int first_block;
+        int block_count;
+        long long file_size;
+        unsigned char digest[DIGEST_SIZE]; // SHA-256 over the hashes of its blocks
+} SegmentEntry;
+
+// Manifest of segmented storage; every segment but the last is sealed
+typedef struct SegmentManifest
+{
+        long long segment_bytes; // Size at which a segment was sealed
+        int segment_count;
+        SegmentEntry *segments;
+} SegmentManifest;
+
+// State shared by the stages of a batch ingest
+// Chunks cycle between free_chunks and full_chunks; sealed blocks go to
+// the writer through sealed_blocks.
+typedef struct IngestPipeline
+{
+        Blockchain *chain;
+        Mempool *mempool;
+        FILE *input;
+        FILE *output;
+        BlockFileWriter writer; // Owned by the writer stage until it exits
+        int format;
+        IngestQueue free_chunks;
+        IngestQueue full_chunks;
+        IngestQueue sealed_blocks;
+        long long lines;
+        long long rejected;
+        long long transactions;
+        long long bytes;
+        int blocks_written;
+} IngestPipeline;
+
+// Compresses one 64-byte block into each of several SHA-256 states
+typedef void (*Sha256Compress)(unsigned int (*states)[8], const unsigned char *const *blocks, int lanes);
+
+// Work function run by each worker over the half-open range [begin, end)
+typedef void (*ParallelTask)(void *context, int begin, int end);
+
 // Function prototypes
-void calculateHash(Block *block, char *output);
-Block *createBlock(int index, const char *data, const char *previous_hash);
+void calculateHash(Block *block, unsigned char *output);
+void calculateCanonicalHash(Block *block, unsigned char *output);
+void calculateLegacyHash(Block *block, unsigned char *output);
+void digestToHex(const unsigned char *digest, char *output);
+size_t encodeBlockHeader(const Block *block, unsigned char *dst);
+unsigned char *encodeInteger(unsigned char *dst, unsigned long long value, int width);
+void sha256Batch(const unsigned char *const *messages, const size_t *lengths, int count, unsigned char (*digests)[DIGEST_SIZE]);
+void sha256Midstate(const unsigned char *prefix, size_t length, Sha256Midstate *midstate);
+void sha256FinishBatch(const Sha256Midstate *midstate, const unsigned char *const *suffixes, size_t length, int count, unsigned char (*digests)[DIGEST_SIZE]);
+int getSha256Backend(void);
+int setSha256Backend(int backend);
+const char *sha256BackendName(int backend);
+int computeMerkleRoot(const AccountDictionary *accounts, const Transaction *transactions, int count, unsigned char *root);
+int buildMerkleProof(Block *block, int tx_index, MerkleProof *proof);
+int verifyMerkleProof(const AccountDictionary *accounts, const Transaction *trans, const MerkleProof *proof,
+                      const unsigned char *merkle_root);
+int hexToDigest(const char *hex, unsigned char *digest);
+void initBlock(Block *block, int index, const char *data, const unsigned char *previous_hash);
+int meetsDifficulty(const unsigned char *digest, int difficulty);
+int followsBlock(const Block *block, const Block *previous);
+void mineBlock(Block *block, MiningStats *stats);
+void displayMiningStats(const Block *block, const MiningStats *stats);
 void displayBlock(Block *block);
 Blockchain *createBlockchain(void);
+Block *getBlock(Blockchain *chain, int index);
+Block *getLatestBlock(Blockchain *chain);
+Block *appendBlockSlot(Blockchain *chain);
+void initEpochDomain(EpochDomain *domain);
+int enterEpoch(EpochDomain *domain);
+void exitEpoch(EpochDomain *domain, int slot);
+void retirePointer(EpochDomain *domain, void *pointer);
+void reclaimRetired(EpochDomain *domain);
+void freeEpochDomain(EpochDomain *domain);
+void setConcurrentReads(Blockchain *chain, int enabled);
+void beginChainRead(Blockchain *chain, ChainSnapshot *snapshot);
+void endChainRead(ChainSnapshot *snapshot);
+Block *getSnapshotBlock(const ChainSnapshot *snapshot, int index);
+Transaction *allocateTransactions(TransactionPool *pool, int count);
+int reserveTransaction(Block *block);
+void compactTransactions(Block *block);
+void freeTransactionPool(TransactionPool *pool);
+int internAccount(AccountDictionary *dict, const char *name, unsigned int *id);
+int findAccount(const AccountDictionary *dict, const char *name, unsigned int *id);
+const char *getAccountName(const AccountDictionary *dict, unsigned int id);
+void freeAccountDictionary(AccountDictionary *dict);
+void writeAccountDictionary(FILE *file, const AccountDictionary *dict);
+void writeAccountNames(FILE *file, char *const *names, int count);
+int readAccountDictionary(FILE *file, AccountDictionary *dict);
+int checkAccountIds(const Block *block, int account_count);
+int applyTransactionToBalances(BalanceIndex *index, const Transaction *trans);
+double getBalanceById(Blockchain *chain, unsigned int id);
+int getAccountBalance(Blockchain *chain, const char *name, double *balance);
+int canAffordTransfer(Blockchain *chain, const char *sender, double amount);
+int getTopAccounts(Blockchain *chain, int n, unsigned int *ids);
+void freeBalanceIndex(BalanceIndex *index);
+int reservePosting(PostingList *list);
+int reserveTransactionIndex(ChainIndex *index, const Transaction *trans);
+int indexTransaction(ChainIndex *index, const Transaction *trans, int block_index, int tx_slot);
+int indexBlock(ChainIndex *index, const Block *block, int block_index);
+int buildChainIndex(Blockchain *chain);
+int getAccountHistory(Blockchain *chain, const char *name, time_t from, time_t to, const Posting **first);
+int getTransactionsInRange(Blockchain *chain, time_t from, time_t to, const Posting **first);
+int getBlocksInRange(Blockchain *chain, time_t from, time_t to, const Posting **first);
+int encodePostingList(ByteBuffer *buffer, const PostingList *list);
+const unsigned char *decodePostingList(const unsigned char *src, const unsigned char *end, PostingList *list);
+int encodeChainIndex(ByteBuffer *buffer, const ChainIndex *index, int account_count);
+int decodeChainIndex(const unsigned char *src, const unsigned char *end, ChainIndex *index, int account_count);
+int saveChainIndex(Blockchain *chain, const char *filename);
+int loadChainIndex(Blockchain *chain, const char *filename);
+void freeChainIndex(ChainIndex *index);
+void getIndexFilename(const char *filename, char *output, size_t size);
+int reserveBlockHash(Blockchain *chain);
+int insertBlockHash(Blockchain *chain, Block *block, int position);
+void removeBlockHash(Blockchain *chain, Block *block);
+Block *findBlockByHash(Blockchain *chain, const unsigned char *digest);
+Block *findSnapshotBlockByHash(const ChainSnapshot *snapshot, const unsigned char *digest);
+int containsBlockHash(Blockchain *chain, const unsigned char *digest);
+int findBlockByHashPrefix(Blockchain *chain, const char *prefix, Block **result);
+void freeBlockHashTable(BlockHashTable *table);
+time_t getTimeInput(const char *prompt, time_t fallback);
 int addBlock(Blockchain *chain, const char *data);
+int addBlockLocked(Blockchain *chain, const char *data);
+int commitBlockLocked(Blockchain *chain, const char *data, const JournalRecord *replayed);
+int restoreJournaledBlock(Block *block, int index, const JournalRecord *record, const Block *previous);
 int validateBlockchain(Blockchain *chain);
+int findFirstInvalidBlock(Blockchain *chain);
+int reverifyBlockchain(Blockchain *chain);
+int verifyBlocks(Blockchain *chain, int trust_checkpoint);
+void lowerValidationCheckpoint(Blockchain *chain, int length);
+void getStateFilename(const char *filename, int slot, char *output, size_t size);
+int writeLedgerState(const char *filename, int height, const unsigned char *hash, int account_count,
+                     const ChainIndex *index);
+int saveLedgerState(Blockchain *chain, const char *filename);
+int loadLedgerState(Blockchain *chain, const char *filename);
+int replayLedger(Blockchain *chain, int index_from);
+int advanceLedgerState(LedgerState *state, const ChainSnapshot *snapshot, int height);
+LedgerSnapshotter *startLedgerSnapshots(Blockchain *chain, const char *filename, int interval);
+int stopLedgerSnapshots(LedgerSnapshotter *snapshotter);
+int getWorkerCount(void);
+void runParallel(int count, ParallelTask task, void *context);
 void displayBlockchain(Blockchain *chain);
 void freeBlockchain(Blockchain *chain);
 int addTransaction(Block *block, const char *sender, const char *receiver, double amount);
+int addTransactionLocked(Block *block, const char *sender, const char *receiver, double amount);
+int commitTransactionLocked(Block *block, const char *sender, const char *receiver, double amount,
+                            const JournalRecord *replayed);
 void displayTransactions(Block *block);
 int saveBlockchain(Blockchain *chain, const char *filename);
+int writeChainFile(const char *filename, Block **segments, int length, const Block *tip, char *const *names,
+                   int name_count);
+void saveChainState(Blockchain *chain, const char *filename);
 Blockchain *loadBlockchain(const char *filename);
+int restoreChainState(Blockchain *chain, const char *filename);
+int upgradeLegacyBlocks(Blockchain *chain);
+long long getRemainingBytes(FILE *file);
+int readBlock(FILE *file, Block *block, int legacy);
+int reserveBytes(ByteBuffer *buffer, size_t extra);
+void freeByteBuffer(ByteBuffer *buffer);
+unsigned char *putVarint(unsigned char *dst, unsigned long long value);
+const unsigned char *getVarint(const unsigned char *src, const unsigned char *end, unsigned long long *value);
+unsigned long long zigzagEncode(long long value);
+long long zigzagDecode(unsigned long long value);
+unsigned long long getAmountCode(double amount);
+unsigned char *putColumn(unsigned char *dst, const unsigned long long *values, int count);
+const unsigned char *getColumn(const unsigned char *src, const unsigned char *end, unsigned long long *values, int count,
+                               int max_width);
+int encodeCompactBlock(ByteBuffer *buffer, const Block *block, const Block *previous);
+int decodeCompactBlock(const unsigned char **cursor, const unsigned char *end, Block *block, int index,
+                       time_t previous_timestamp, const unsigned char *previous_hash, TransactionPool *pool, int mode);
+void writeFileHeader(FILE *file, int length, int flags);
+int readFileHeader(FILE *file, int *format, int *flags, int *length);
+int detectIoBackend(void);
+int getIoBackend(void);
+int setIoBackend(int backend);
+const char *ioBackendName(int backend);
+AsyncFile *openAsyncFile(FILE *file, int writing);
+int submitAsyncBuffer(AsyncFile *async, int index);
+int waitAsyncBuffer(AsyncFile *async, int index);
+int writeAsyncFile(AsyncFile *async, const void *data, size_t size);
+int readAsyncFile(AsyncFile *async, void *data, size_t size);
+int closeAsyncFile(AsyncFile *async, FILE *file);
+void initBlockFileWriter(BlockFileWriter *writer, FILE *file, int flags);
+long long tellBlockFileWriter(BlockFileWriter *writer);
+int flushBlockGroup(BlockFileWriter *writer);
+int writeBlockRecord(BlockFileWriter *writer, const Block *block);
+int finishBlockFileWriter(BlockFileWriter *writer);
+int writeBlockFileFooter(BlockFileWriter *writer, long long dictionary_offset);
+void freeBlockFileWriter(BlockFileWriter *writer);
+int readBlockFileFooter(FILE *file, BlockFileFooter *footer);
+int seekBlockRecord(BlockFileReader *reader, const BlockOffset *offsets, int count, int index);
+Blockchain *loadBlockRange(const char *filename, int first, int count);
+int inspectBlocks(const char *filename, int first, int count);
+void initBlockFileReader(BlockFileReader *reader, FILE *file, int format, int flags);
+int readBlockGroup(BlockFileReader *reader);
+int readGroupBytes(BlockFileReader *reader, void *data, size_t size);
+int readBlockRecord(BlockFileReader *reader, Block *block);
+void freeBlockFileReader(BlockFileReader *reader);
+int unpackBlockGroup(ByteBuffer *group, const unsigned char *stored, unsigned int stored_size, unsigned int raw_size);
+TransactionCache *openTransactionCache(FILE *file, const BlockFileFooter *footer, int paged_length, size_t budget);
+void freeTransactionCache(TransactionCache *cache);
+void unlinkCachedBlock(TransactionCache *cache, int index);
+void linkCachedBlock(TransactionCache *cache, int index);
+void evictTransactions(Blockchain *chain, size_t needed);
+int pageInTransactions(Block *block, int pin);
+Transaction *getBlockTransactions(Block *block);
+int pinTransactions(Block *block);
+Blockchain *loadBlockchainLazy(const char *filename, size_t cache_budget);
+void getSegmentFilename(const char *filename, int segment, char *output, size_t size);
+void hashSegmentBlocks(Blockchain *chain, int first, int count, unsigned char *digest);
+int writeSegmentManifest(const char *filename, const SegmentManifest *manifest);
+int readSegmentManifest(const char *filename, SegmentManifest *manifest);
+void freeSegmentManifest(SegmentManifest *manifest);
+int writeSegmentFile(Blockchain *chain, const char *filename, int first, long long segment_bytes, SegmentEntry *entry);
+int saveSegmentedChain(Blockchain *chain, const char *filename, long long segment_bytes);
+void mergeTransactionPool(TransactionPool *into, TransactionPool *from);
+int readSegmentFile(Blockchain *chain, const char *filename, const SegmentEntry *entry, TransactionPool *pool);
+Blockchain *loadSegmentedChain(const char *filename);
+void getJournalBase(Blockchain *chain, const char *filename, JournalBase *base);
+int writeJournalHeader(int fd, const JournalBase *base);
+size_t encodeJournalHeader(const JournalBase *base, unsigned char *header);
+size_t readJournalHeader(const unsigned char *src, size_t size, JournalBase *base);
+unsigned char *encodeJournalRecord(unsigned char *dst, const JournalRecord *record);
+int decodeJournalRecord(const unsigned char *src, const unsigned char *end, JournalRecord *record);
+int writeJournalBytes(int fd, const unsigned char *data, size_t size);
+int appendJournalRecord(Journal *journal, const JournalRecord *record);
+void journalBlock(Journal *journal, const Block *block);
+void journalTransaction(Journal *journal, const Block *block, const char *sender, const char *receiver,
+                        const Transaction *trans);
+int applyJournalRecord(Blockchain *chain, const JournalRecord *record);
+int replayJournal(Blockchain *chain, const unsigned char *src, size_t size, size_t *valid_size);
+size_t findJournalResumePoint(const unsigned char *src, size_t size, int block_index, const unsigned char *hash);
+int rewriteJournal(const char *filename, const JournalBase *base, const unsigned char *records, size_t size);
+int rebaseJournal(Journal *journal, const JournalBase *base, long long offset);
+Journal *openJournal(Blockchain *chain, const char *filename, const char *base_name, int replay, long long latency_ms);
+int syncJournal(Journal *journal);
+int resetJournal(Journal *journal, Blockchain *chain, const char *base_name);
+void closeJournal(Journal *journal);
+Blockchain *recoverBlockchain(const char *filename, long long latency_ms);
+BackgroundSave *startBackgroundSave(Blockchain *chain, const char *filename, SaveCompletedCallback on_complete,
+                                    void *context);
+int getBackgroundSaveStatus(BackgroundSave *save);
+int finishBackgroundSave(BackgroundSave *save);
+int reportBackgroundSave(BackgroundSave **save, int wait);
+int ingestTransactions(const char *input_name, const char *output_name, int format, const MempoolConfig *sealing,
+                       int snapshot_interval, int file_flags);
+long long getMonotonicNs(void);
+int submitTransaction(Mempool *mempool, const char *sender, const char *receiver, double amount);
+int takePendingTransaction(Mempool *mempool, PendingTransaction *pending);
+Mempool *createMempool(Blockchain *chain, const MempoolConfig *config);
+int isMempoolStopped(Mempool *mempool);
+void stopMempool(Mempool *mempool, MempoolStats *stats);
+int runBatchMode(int argc, char **argv);
 double getDoubleInput(const char *prompt);
 void getStringInput(const char *prompt, char *buffer, size_t size);
 
 // Main function
-int main()
+// Programs that reuse this file, such as the benchmark, define BLOCKCHAIN_NO_MAIN
+#ifndef BLOCKCHAIN_NO_MAIN
+int main(int argc, char **argv)
 {
-        // Create a new blockchain
-        Blockchain *chain = createBlockchain();
+        // Any arguments select the non-interactive batch mode
+        if (argc > 1)
+                return runBatchMode(argc, argv);
+
+        // Recover the chain the journal was recording, or create a new one
+        // whose changes are journaled from the start
+        Blockchain *chain = recoverBlockchain(JOURNAL_FILENAME, JOURNAL_DEFAULT_LATENCY_MS);
         if (!chain)
         {
-                printf("Failed to create blockchain!\n");
-                return 1;
+                chain = createBlockchain();
+                if (!chain)
+                {
+                        printf("Failed to create blockchain!\n");
+                        return 1;
+                }
+                if (access(JOURNAL_FILENAME, F_OK) != 0)
+                        chain->journal = openJournal(chain, JOURNAL_FILENAME, NULL, 0, JOURNAL_DEFAULT_LATENCY_MS);
+                else
+                        printf("Warning: %s is left as it is; changes are not journaled until a chain is loaded\n",
+                               JOURNAL_FILENAME);
         }
 
         // Create genesis block
-        printf("Creating the genesis block...\n");
-        if (addBlock(chain, "Genesis Block"))
+        if (chain->length == 0)
         {
-                printf("Genesis block created successfully!\n");
-        }
-        else
-        {
-                printf("Failed to create genesis block!\n");
-                freeBlockchain(chain);
-                return 1;
+                printf("Creating the genesis block...\n");
+                if (addBlock(chain, "Genesis Block") && syncJournal(chain->journal))
+                {
+                        printf("Genesis block created successfully!\n");
+                }
+                else
+                {
+                        printf("Failed to create genesis block!\n");
+                        freeBlockchain(chain);
+                        return 1;
+                }
         }
 
         // Menu loop
@@ -99,6 +1063,7 @@ int main()
         char receiver[MAX_RECEIVER_SIZE];
         double amount;
         int choice;
+        BackgroundSave *pending_save = NULL;
 
         do
         {
@@ -110,7 +1075,16 @@ int main()
                 printf("4. Validate blockchain\n");
                 printf("5. Save blockchain\n");
                 printf("6. Load blockchain\n");
-                printf("7. Exit\n");
+                printf("7. Show account balance\n");
+                printf("8. Show top accounts\n");
+                printf("9. Show account history\n");
+                printf("10. Find block by hash\n");
+                printf("11. Set mining difficulty\n");
+                printf("12. Re-verify entire blockchain\n");
+                printf("13. Load blockchain headers only\n");
+                printf("14. Save blockchain as segments\n");
+                printf("15. Load blockchain segments\n");
+                printf("16. Exit\n");
                 printf("Enter choice: ");
 
                 // Get user input
@@ -124,43 +1098,74 @@ int main()
                         choice = 0;
                 }
 
+                // A background save is reported once it has ended, and waited
+                // for before the chain is saved again, replaced or freed
+                reportBackgroundSave(&pending_save, choice == 5 || choice == 6 || (choice >= 13 && choice <= 16));
+
                 switch (choice)
                 {
                 case 1:
                         getStringInput("Enter data for new block: ", input, MAX_DATA_SIZE);
                         if (addBlock(chain, input))
+                        {
                                 printf("Block added successfully!\n");
+                                if (!syncJournal(chain->journal))
+                                        printf("Warning: The block is not journaled; save the blockchain to keep it\n");
+                                if (chain->difficulty > 0)
+                                        displayMiningStats(getLatestBlock(chain), &chain->last_mining);
+                        }
                         else
                                 printf("Failed to add block!\n");
                         break;
 
                 case 2:
-                        if (!chain->head)
+                {
+                        Block *latest = getLatestBlock(chain);
+                        if (!latest)
                         {
                                 printf("Create a block first!\n");
                                 break;
                         }
 
-                        Block *latest = chain->head;
-                        while (latest->next)
-                                latest = latest->next;
-
                         getStringInput("Enter sender: ", sender, MAX_SENDER_SIZE);
                         getStringInput("Enter receiver: ", receiver, MAX_RECEIVER_SIZE);
                         amount = getDoubleInput("Enter amount: ");
 
                         if (addTransaction(latest, sender, receiver, amount))
+                        {
                                 printf("Transaction added successfully!\n");
+                                if (!syncJournal(chain->journal))
+                                        printf("Warning: The transaction is not journaled; save the blockchain to keep it\n");
+                                if (latest->difficulty > 0)
+                                        displayMiningStats(latest, &chain->last_mining);
+                        }
                         else
                                 printf("Failed to add transaction!\n");
-                        break;
+                }
+                break;
 
                 case 3:
                         displayBlockchain(chain);
                         break;
 
+                case 4:
+                {
+                        int invalid = findFirstInvalidBlock(chain);
+                        if (invalid < 0)
+                                printf("Blockchain is valid!\n");
+                        else
+                                printf("Blockchain is invalid! First invalid block: #%d\n", invalid);
+                }
+                break;
+
                 case 5:
-                        if (saveBlockchain(chain, FILENAME))
+                        // The menu stays usable while the chain is written
+                        pending_save = startBackgroundSave(chain, FILENAME, NULL, NULL);
+                        if (pending_save)
+                        {
+                                printf("Saving blockchain in the background...\n");
+                        }
+                        else if (saveBlockchain(chain, FILENAME))
                         {
                                 printf("Blockchain saved successfully!\n");
                         }
@@ -175,8 +1180,10 @@ int main()
                         Blockchain *loaded_chain = loadBlockchain(FILENAME);
                         if (loaded_chain)
                         {
+                                // The journal now records changes to the loaded chain
                                 freeBlockchain(chain);
                                 chain = loaded_chain;
+                                chain->journal = openJournal(chain, JOURNAL_FILENAME, FILENAME, 0, JOURNAL_DEFAULT_LATENCY_MS);
                                 printf("Blockchain loaded successfully!\n");
                         }
                         else
@@ -187,18 +1194,159 @@ int main()
                 break;
 
                 case 7:
+                {
+                        double balance;
+                        getStringInput("Enter account: ", sender, MAX_SENDER_SIZE);
+                        if (getAccountBalance(chain, sender, &balance))
+                                printf("Balance of %s: %.2f\n", sender, balance);
+                        else
+                                printf("Unknown account!\n");
+                }
+                break;
+
+                case 8:
+                {
+                        unsigned int top[TOP_ACCOUNTS_COUNT];
+                        int count = getTopAccounts(chain, TOP_ACCOUNTS_COUNT, top);
+                        if (count == 0)
+                                printf("No accounts yet\n");
+                        for (int i = 0; i < count; i++)
+                        {
+                                printf("%d. %s: %.2f\n", i + 1, getAccountName(&chain->accounts, top[i]),
+                                       getBalanceById(chain, top[i]));
+                        }
+                }
+                break;
+
+                case 9:
+                {
+                        const Posting *history;
+                        getStringInput("Enter account: ", sender, MAX_SENDER_SIZE);
+                        time_t from = getTimeInput("From (Unix time, blank for start): ", 0);
+                        time_t to = getTimeInput("To (Unix time, blank for now): ", time(NULL));
+                        int count = getAccountHistory(chain, sender, from, to, &history);
+                        if (count == 0)
+                                printf("No transactions found\n");
+                        for (int i = 0; i < count; i++)
+                        {
+                                Block *block = getBlock(chain, history[i].block_index);
+                                Transaction *transactions = block ? getBlockTransactions(block) : NULL;
+                                if (!transactions || history[i].tx_slot < 0 ||
+                                    history[i].tx_slot >= block->transaction_count)
+                                        break;
+                                Transaction *trans = &transactions[history[i].tx_slot];
+                                printf("Block #%d: %s -> %s %.2f at %s", history[i].block_index,
+                                       getAccountName(&chain->accounts, trans->sender_id),
+                                       getAccountName(&chain->accounts, trans->receiver_id),
+                                       trans->amount, ctime(&trans->timestamp));
+                        }
+                }
+                break;
+
+                case 10:
+                {
+                        Block *found;
+                        getStringInput("Enter hash or hash prefix: ", input, MAX_DATA_SIZE);
+                        int matches = findBlockByHashPrefix(chain, input, &found);
+                        if (matches == 0)
+                                printf("No block found\n");
+                        else if (matches > 1)
+                                printf("Prefix is ambiguous: %d blocks match\n", matches);
+                        else
+                                displayBlock(found);
+                }
+                break;
+
+                case 11:
+                {
+                        // Validation refuses a block mined below the one before it,
+                        // and the nonce search cannot be cancelled, so the range is bounded
+                        int minimum = chain->length > 0 ? getLatestBlock(chain)->difficulty : 0;
+                        double difficulty = getDoubleInput("Enter difficulty in leading zero bits (0 disables mining): ");
+                        if (difficulty < minimum || difficulty > MAX_INTERACTIVE_DIFFICULTY || difficulty != (int)difficulty)
+                        {
+                                printf("Difficulty must be a whole number between %d and %d\n", minimum,
+                                       MAX_INTERACTIVE_DIFFICULTY);
+                                break;
+                        }
+                        chain->difficulty = (int)difficulty;
+                        printf("New blocks will be mined at difficulty %d\n", chain->difficulty);
+                }
+                break;
+
+                case 12:
+                {
+                        // Ignores the checkpoint, for audits
+                        int invalid = reverifyBlockchain(chain);
+                        if (invalid < 0)
+                                printf("Blockchain is valid! All %d blocks were re-verified\n", chain->length);
+                        else
+                                printf("Blockchain is invalid! First invalid block: #%d\n", invalid);
+                }
+                break;
+
+                case 13:
+                {
+                        // Transactions are read from the file as they are needed
+                        Blockchain *loaded_chain = loadBlockchainLazy(FILENAME, TRANSACTION_CACHE_DEFAULT_BYTES);
+                        if (loaded_chain)
+                        {
+                                // The journal now records changes to the loaded chain
+                                freeBlockchain(chain);
+                                chain = loaded_chain;
+                                chain->journal = openJournal(chain, JOURNAL_FILENAME, FILENAME, 0, JOURNAL_DEFAULT_LATENCY_MS);
+                                printf("Blockchain loaded successfully!\n");
+                        }
+                        else
+                        {
+                                printf("Failed to load blockchain!\n");
+                        }
+                }
+                break;
+
+                case 14:
+                        if (saveSegmentedChain(chain, SEGMENT_MANIFEST_FILENAME, SEGMENT_FILE_DEFAULT_BYTES))
+                        {
+                                printf("Blockchain saved successfully!\n");
+                        }
+                        else
+                        {
+                                printf("Failed to save blockchain!\n");
+                        }
+                        break;
+
+                case 15:
+                {
+                        Blockchain *loaded_chain = loadSegmentedChain(SEGMENT_MANIFEST_FILENAME);
+                        if (loaded_chain)
+                        {
+                                // The journal now records changes to the loaded chain
+                                freeBlockchain(chain);
+                                chain = loaded_chain;
+                                chain->journal = openJournal(chain, JOURNAL_FILENAME, SEGMENT_MANIFEST_FILENAME, 0, JOURNAL_DEFAULT_LATENCY_MS);
+                                printf("Blockchain loaded successfully!\n");
+                        }
+                        else
+                        {
+                                printf("Failed to load blockchain!\n");
+                        }
+                }
+                break;
+
+                case 16:
                         printf("Exiting...\n");
                         break;
 
                 default:
-                        printf("Invalid choice! Please enter a number between 1 and 7.\n");
+                        printf("Invalid choice! Please enter a number between 1 and 16.\n");
                 }
-        } while (choice != 7);
+        } while (choice != 16);
 
         // Free the blockchain
         freeBlockchain(chain);
         return 0;
 }
+#endif
 
 /**
  * Creates a new blockchain
@@ -206,461 +1354,8617 @@ int main()
  */
 Blockchain *createBlockchain(void)
 {
-        // Allocate memory for the blockchain
-        Blockchain *chain = (Blockchain *)malloc(sizeof(Blockchain));
+        // Allocate memory for the blockchain; reader slots are cache-line aligned
+        Blockchain *chain = (Blockchain *)aligned_alloc(CACHE_LINE_SIZE, sizeof(Blockchain));
         if (chain)
         {
-                chain->head = NULL;
+                if (pthread_mutex_init(&chain->append_lock, NULL) != 0)
+                {
+                        free(chain);
+                        return NULL;
+                }
+                if (pthread_mutex_init(&chain->checkpoint_lock, NULL) != 0)
+                {
+                        pthread_mutex_destroy(&chain->append_lock);
+                        free(chain);
+                        return NULL;
+                }
+
+                chain->segments = NULL;
+                chain->cache = NULL;
+                chain->journal = NULL;
+                chain->segment_count = 0;
+                chain->segment_capacity = 0;
                 chain->length = 0;
+                atomic_init(&chain->published_segments, NULL);
+                atomic_init(&chain->published_length, 0);
+                atomic_init(&chain->concurrent_reads, 0);
+                atomic_init(&chain->saving, 0);
+                initEpochDomain(&chain->epochs);
+                memset(&chain->pool, 0, sizeof(chain->pool));
+                memset(&chain->accounts, 0, sizeof(chain->accounts));
+                atomic_init(&chain->accounts.visible_names, NULL);
+                atomic_init(&chain->accounts.visible_count, 0);
+                chain->accounts.epochs = &chain->epochs;
+                memset(&chain->balances, 0, sizeof(chain->balances));
+                memset(&chain->index, 0, sizeof(chain->index));
+                atomic_init(&chain->hash_table.array, NULL);
+                chain->hash_table.count = 0;
+                chain->enforce_balances = 0;
+                chain->difficulty = 0;
+                memset(&chain->last_mining, 0, sizeof(chain->last_mining));
+                chain->first_index = 0;
+                memset(&chain->checkpoint, 0, sizeof(chain->checkpoint));
         }
         return chain;
 }
 
 /**
- * Calculates SHA-256 hash for a block including transaction data
- * @param block Block to be hashed
- * @param output Buffer to store the resulting hash
+ * Gets a block by its position in the chain
+ * Only for the appending thread; other threads read through a snapshot.
+ * @param chain Pointer to the blockchain
+ * @param index Position of the block (0 is the genesis block)
+ * @return Pointer to the block or NULL if index is out of range
  */
-void calculateHash(Block *block, char *output)
+Block *getBlock(Blockchain *chain, int index)
 {
-        // Create a string representation of the block data
-        char input[INPUT_BUFFER_SIZE];
-        char trans_data[INPUT_BUFFER_SIZE / 2] = "";
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_CTX sha256;
+        if (!chain || index < 0 || index >= chain->length)
+                return NULL;
 
-        // Create transaction string for hashing
-        for (int i = 0; i < block->transaction_count; i++)
-        {
-                char trans_str[TRANS_STR_SIZE];
-                snprintf(trans_str, TRANS_STR_SIZE, "%s%s%.2f",
-                         block->transactions[i].sender,
-                         block->transactions[i].receiver,
-                         block->transactions[i].amount);
-                if (strlen(trans_data) + strlen(trans_str) < sizeof(trans_data) - 1)
-                {
-                        strcat(trans_data, trans_str);
-                }
-        }
+        return &chain->segments[index >> BLOCK_SEGMENT_SHIFT][index & BLOCK_SEGMENT_MASK];
+}
+
+/**
+ * Gets the last block of the chain
+ * @param chain Pointer to the blockchain
+ * @return Pointer to the latest block or NULL if the chain is empty
+ */
+Block *getLatestBlock(Blockchain *chain)
+{
+        if (!chain)
+                return NULL;
+
+        return getBlock(chain, chain->length - 1);
+}
+
+/**
+ * Reserves storage for one more block at the end of the chain
+ * Only the segment directory is ever replaced, so pointers to existing
+ * blocks stay valid across appends. The old directory is retired rather
+ * than freed because snapshots may still be reading it.
+ * @param chain Pointer to the blockchain
+ * @return Pointer to the uninitialised block slot or NULL if allocation fails
+ */
+Block *appendBlockSlot(Blockchain *chain)
+{
+        if (!chain)
+                return NULL;
+
+        int segment = chain->length >> BLOCK_SEGMENT_SHIFT;
+        if (segment == chain->segment_count)
+        {
+                // Grow the segment directory geometrically
+                if (chain->segment_count == chain->segment_capacity)
+                {
+                        int capacity = chain->segment_capacity ? chain->segment_capacity * 2 : 4;
+                        Block **segments = (Block **)malloc(capacity * sizeof(Block *));
+                        if (!segments)
+                                return NULL;
+                        if (chain->segment_count > 0)
+                                memcpy(segments, chain->segments, chain->segment_count * sizeof(Block *));
+
+                        Block **old_segments = chain->segments;
+                        chain->segments = segments;
+                        chain->segment_capacity = capacity;
+                        atomic_store(&chain->published_segments, segments);
+                        retirePointer(&chain->epochs, old_segments);
+                }
+
+                Block *blocks = (Block *)malloc(BLOCK_SEGMENT_SIZE * sizeof(Block));
+                if (!blocks)
+                        return NULL;
+                chain->segments[chain->segment_count++] = blocks;
+        }
+
+        Block *block = &chain->segments[segment][chain->length & BLOCK_SEGMENT_MASK];
+        block->chain = chain;
+        block->transactions = NULL;
+        block->transaction_count = 0;
+        block->transaction_capacity = 0;
+        block->frontier = NULL;
+        chain->length++;
+        return block;
+}
+
+/**
+ * Initialises an epoch domain with every reader slot free
+ * @param domain Domain to initialise
+ */
+void initEpochDomain(EpochDomain *domain)
+{
+        for (int i = 0; i < MAX_EPOCH_READERS; i++)
+                atomic_init(&domain->readers[i].epoch, 0);
+
+        // Epochs start at 1 so 0 can mark a free slot
+        atomic_init(&domain->global_epoch, 1);
+        domain->retired = NULL;
+}
+
+/**
+ * Announces a reader so nothing it loads from now on is freed under it
+ * @param domain Domain to enter
+ * @return Reader slot to pass to exitEpoch
+ */
+int enterEpoch(EpochDomain *domain)
+{
+        // Threads usually find the slot they used last time still free
+        static _Thread_local int hint;
+
+        for (;;)
+        {
+                for (int i = 0; i < MAX_EPOCH_READERS; i++)
+                {
+                        int slot = (hint + i) % MAX_EPOCH_READERS;
+                        unsigned long long expected = 0;
+                        unsigned long long epoch = atomic_load(&domain->global_epoch);
+                        if (atomic_compare_exchange_strong(&domain->readers[slot].epoch, &expected, epoch))
+                        {
+                                hint = slot;
+                                return slot;
+                        }
+                }
+
+                // Every slot is taken; wait for a reader to leave
+                sched_yield();
+        }
+}
+
+/**
+ * Releases a reader slot taken by enterEpoch
+ * @param domain Domain to leave
+ * @param slot Slot returned by enterEpoch
+ */
+void exitEpoch(EpochDomain *domain, int slot)
+{
+        atomic_store_explicit(&domain->readers[slot].epoch, 0, memory_order_release);
+}
+
+/**
+ * Frees every retired pointer that no announced reader can still hold
+ * @param domain Domain to reclaim from (writer only)
+ */
+void reclaimRetired(EpochDomain *domain)
+{
+        // A reader announcing epoch e loaded its pointers at or after e
+        unsigned long long oldest = atomic_load(&domain->global_epoch);
+        for (int i = 0; i < MAX_EPOCH_READERS; i++)
+        {
+                unsigned long long epoch = atomic_load(&domain->readers[i].epoch);
+                if (epoch && epoch < oldest)
+                        oldest = epoch;
+        }
+
+        RetiredPointer **link = &domain->retired;
+        while (*link)
+        {
+                RetiredPointer *entry = *link;
+                if (entry->epoch < oldest)
+                {
+                        *link = entry->next;
+                        free(entry->pointer);
+                        free(entry);
+                }
+                else
+                {
+                        link = &entry->next;
+                }
+        }
+}
+
+/**
+ * Frees a pointer once every reader that could have loaded it has left
+ * The pointer must already be replaced in every published location.
+ * @param domain Domain readers of the pointer enter (writer only)
+ * @param pointer Pointer to free, or NULL
+ */
+void retirePointer(EpochDomain *domain, void *pointer)
+{
+        if (!pointer)
+                return;
+
+        RetiredPointer *entry = (RetiredPointer *)malloc(sizeof(RetiredPointer));
+        if (!entry)
+        {
+                // Without a list entry, wait for the readers to drain instead
+                unsigned long long epoch = atomic_fetch_add(&domain->global_epoch, 1);
+                for (int i = 0; i < MAX_EPOCH_READERS; i++)
+                {
+                        unsigned long long announced = atomic_load(&domain->readers[i].epoch);
+                        while (announced && announced <= epoch)
+                        {
+                                sched_yield();
+                                announced = atomic_load(&domain->readers[i].epoch);
+                        }
+                }
+                free(pointer);
+                return;
+        }
+
+        // Readers announcing a later epoch can only have loaded the replacement
+        entry->pointer = pointer;
+        entry->epoch = atomic_fetch_add(&domain->global_epoch, 1);
+        entry->next = domain->retired;
+        domain->retired = entry;
+        reclaimRetired(domain);
+}
+
+/**
+ * Frees every retired pointer of a domain that no reader uses any more
+ * @param domain Domain to free
+ */
+void freeEpochDomain(EpochDomain *domain)
+{
+        while (domain->retired)
+        {
+                RetiredPointer *entry = domain->retired;
+                domain->retired = entry->next;
+                free(entry->pointer);
+                free(entry);
+        }
+}
+
+/**
+ * Switches the chain between interactive and concurrent reading
+ * With concurrent reads on, snapshots only contain sealed blocks, which
+ * never change, so readers can traverse them while blocks and
+ * transactions are appended on other threads. Transactions can then
+ * only be added to the open tip.
+ * @param chain Pointer to the blockchain
+ * @param enabled 1 to let readers run alongside appends, 0 for single-threaded use
+ */
+void setConcurrentReads(Blockchain *chain, int enabled)
+{
+        pthread_mutex_lock(&chain->append_lock);
+        atomic_store(&chain->concurrent_reads, enabled != 0);
+        pthread_mutex_unlock(&chain->append_lock);
+}
+
+/**
+ * Takes a snapshot of the chain without blocking appends
+ * Balances, indexes and account lookups are not covered and must not be
+ * read while another thread appends.
+ * @param chain Pointer to the blockchain
+ * @param snapshot Receives the snapshot; release it with endChainRead
+ */
+void beginChainRead(Blockchain *chain, ChainSnapshot *snapshot)
+{
+        snapshot->chain = chain;
+        snapshot->epoch_slot = enterEpoch(&chain->epochs);
+
+        // The length is loaded first: the directory and hash table loaded
+        // after it cover at least every block it counts
+        snapshot->sealed_length = atomic_load(&chain->published_length);
+        snapshot->length = atomic_load(&chain->concurrent_reads) ? snapshot->sealed_length : chain->length;
+        snapshot->segments = atomic_load(&chain->published_segments);
+        snapshot->hash_slots = atomic_load(&chain->hash_table.array);
+}
+
+/**
+ * Releases a snapshot taken by beginChainRead
+ * @param snapshot Snapshot to release
+ */
+void endChainRead(ChainSnapshot *snapshot)
+{
+        exitEpoch(&snapshot->chain->epochs, snapshot->epoch_slot);
+}
+
+/**
+ * Gets a block of a snapshot
+ * @param snapshot Snapshot taken by beginChainRead
+ * @param index Position of the block (0 is the genesis block)
+ * @return Pointer to the block or NULL if index is outside the snapshot
+ */
+Block *getSnapshotBlock(const ChainSnapshot *snapshot, int index)
+{
+        if (index < 0 || index >= snapshot->length)
+                return NULL;
+
+        return &snapshot->segments[index >> BLOCK_SEGMENT_SHIFT][index & BLOCK_SEGMENT_MASK];
+}
+
+/**
+ * Hashes an account name with 32-bit FNV-1a
+ * @param name Name to hash
+ * @param length Length of the name in bytes
+ * @return Hash of the name
+ */
+unsigned int hashAccountName(const char *name, size_t length)
+{
+        unsigned int hash = 2166136261u;
+        for (size_t i = 0; i < length; i++)
+        {
+                hash ^= (unsigned char)name[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+/**
+ * Finds the table slot holding a name, or the empty slot where it belongs
+ * @param dict Dictionary to search
+ * @param name Name to look up
+ * @param length Length of the name in bytes
+ * @param hash Hash of the name
+ * @return Index of the slot
+ */
+int findAccountSlot(const AccountDictionary *dict, const char *name, size_t length, unsigned int hash)
+{
+        int mask = dict->slot_capacity - 1;
+        int slot = (int)(hash & (unsigned int)mask);
+
+        // Slots hold id + 1, so 0 marks an empty slot
+        while (dict->slots[slot])
+        {
+                unsigned int id = dict->slots[slot] - 1;
+                if (dict->hashes[id] == hash && strlen(dict->names[id]) == length &&
+                    memcmp(dict->names[id], name, length) == 0)
+                        break;
+                slot = (slot + 1) & mask;
+        }
+        return slot;
+}
+
+/**
+ * Doubles the hash table of a dictionary and reinserts every account
+ * @param dict Dictionary to grow
+ * @return 1 if successful, 0 if allocation fails
+ */
+int growAccountTable(AccountDictionary *dict)
+{
+        int capacity = dict->slot_capacity ? dict->slot_capacity * 2 : ACCOUNT_TABLE_MIN_SIZE;
+        unsigned int *slots = (unsigned int *)calloc(capacity, sizeof(unsigned int));
+        if (!slots)
+                return 0;
+
+        free(dict->slots);
+        dict->slots = slots;
+        dict->slot_capacity = capacity;
+        for (int id = 0; id < dict->count; id++)
+        {
+                int slot = (int)(dict->hashes[id] & (unsigned int)(capacity - 1));
+                while (slots[slot])
+                        slot = (slot + 1) & (capacity - 1);
+                slots[slot] = (unsigned int)id + 1;
+        }
+        return 1;
+}
+
+/**
+ * Looks up the ID of an account without adding it
+ * @param dict Dictionary to search
+ * @param name Account name (truncated to MAX_ACCOUNT_NAME_SIZE - 1 characters)
+ * @param id Receives the account ID if found
+ * @return 1 if the account exists, 0 otherwise
+ */
+int findAccount(const AccountDictionary *dict, const char *name, unsigned int *id)
+{
+        if (dict->slot_capacity == 0)
+                return 0;
+
+        size_t length = strnlen(name, MAX_ACCOUNT_NAME_SIZE - 1);
+        int slot = findAccountSlot(dict, name, length, hashAccountName(name, length));
+        if (!dict->slots[slot])
+                return 0;
+
+        *id = dict->slots[slot] - 1;
+        return 1;
+}
+
+/**
+ * Gets the ID of an account, adding it to the dictionary if it is new
+ * IDs are assigned densely in the order accounts are first seen.
+ * @param dict Dictionary to update
+ * @param name Account name (truncated to MAX_ACCOUNT_NAME_SIZE - 1 characters)
+ * @param id Receives the account ID
+ * @return 1 if successful, 0 if allocation fails
+ */
+int internAccount(AccountDictionary *dict, const char *name, unsigned int *id)
+{
+        if (findAccount(dict, name, id))
+                return 1;
+
+        // Keep the table at most half full
+        if ((dict->count + 1) * 2 > dict->slot_capacity && !growAccountTable(dict))
+                return 0;
+
+        if (dict->count == dict->capacity)
+        {
+                // Readers may still hold the old names array, so it is copied and
+                // retired. Both arrays are allocated before either is swapped in,
+                // so a failure leaves the dictionary as it was.
+                int capacity = dict->capacity ? dict->capacity * 2 : ACCOUNT_TABLE_MIN_SIZE;
+                char **names = (char **)malloc(capacity * sizeof(char *));
+                if (!names)
+                        return 0;
+                unsigned int *hashes = (unsigned int *)realloc(dict->hashes, capacity * sizeof(unsigned int));
+                if (!hashes)
+                {
+                        free(names);
+                        return 0;
+                }
+                dict->hashes = hashes;
+                if (dict->count > 0)
+                        memcpy(names, dict->names, dict->count * sizeof(char *));
+
+                char **old_names = dict->names;
+                dict->names = names;
+                atomic_store(&dict->visible_names, names);
+                if (dict->epochs)
+                        retirePointer(dict->epochs, old_names);
+                else
+                        free(old_names);
+                dict->capacity = capacity;
+        }
+
+        size_t length = strnlen(name, MAX_ACCOUNT_NAME_SIZE - 1);
+        char *copy = (char *)malloc(length + 1);
+        if (!copy)
+                return 0;
+        memcpy(copy, name, length);
+        copy[length] = '\0';
+
+        unsigned int hash = hashAccountName(copy, length);
+        int slot = findAccountSlot(dict, copy, length, hash);
+        *id = (unsigned int)dict->count;
+        dict->names[dict->count] = copy;
+        dict->hashes[dict->count] = hash;
+        dict->slots[slot] = (unsigned int)dict->count + 1;
+        dict->count++;
+        atomic_store_explicit(&dict->visible_count, dict->count, memory_order_release);
+        return 1;
+}
+
+/**
+ * Gets the name of an account
+ * Safe alongside internAccount for a reader holding a chain snapshot.
+ * @param dict Dictionary to read
+ * @param id Account ID
+ * @return Name of the account, or "?" if the ID is unknown
+ */
+const char *getAccountName(const AccountDictionary *dict, unsigned int id)
+{
+        // Any names array published after the count holds at least that many names
+        if (id >= (unsigned int)atomic_load_explicit(&dict->visible_count, memory_order_acquire))
+                return "?";
+        return atomic_load(&dict->visible_names)[id];
+}
+
+/**
+ * Frees all memory held by an account dictionary
+ * @param dict Dictionary to free
+ */
+void freeAccountDictionary(AccountDictionary *dict)
+{
+        for (int id = 0; id < dict->count; id++)
+        {
+                free(dict->names[id]);
+        }
+        free(dict->names);
+        free(dict->hashes);
+        free(dict->slots);
+        memset(dict, 0, sizeof(*dict));
+}
+
+/**
+ * Writes an account dictionary as a count followed by length-prefixed names
+ * @param file File to write to
+ * @param dict Dictionary to write
+ */
+void writeAccountDictionary(FILE *file, const AccountDictionary *dict)
+{
+        writeAccountNames(file, dict->names, dict->count);
+}
+
+/**
+ * Writes account names in the layout of writeAccountDictionary
+ * @param file File to write to
+ * @param names Names in ID order
+ * @param count Number of names
+ */
+void writeAccountNames(FILE *file, char *const *names, int count)
+{
+        fwrite(&count, sizeof(int), 1, file);
+        for (int id = 0; id < count; id++)
+        {
+                unsigned char length = (unsigned char)strlen(names[id]);
+                fwrite(&length, sizeof(unsigned char), 1, file);
+                fwrite(names[id], sizeof(char), length, file);
+        }
+}
+
+/**
+ * Reads an account dictionary written by writeAccountDictionary
+ * Accounts are interned in file order, so they get back their saved IDs.
+ * @param file File positioned at the dictionary
+ * @param dict Empty dictionary to fill
+ * @return 1 if successful, 0 if the dictionary is truncated or malformed
+ */
+int readAccountDictionary(FILE *file, AccountDictionary *dict)
+{
+        int count;
+        if (fread(&count, sizeof(int), 1, file) != 1 || count < 0)
+                return 0;
+
+        for (int i = 0; i < count; i++)
+        {
+                char name[MAX_ACCOUNT_NAME_SIZE];
+                unsigned char length;
+                unsigned int id;
+                if (fread(&length, sizeof(unsigned char), 1, file) != 1 || length >= MAX_ACCOUNT_NAME_SIZE ||
+                    fread(name, sizeof(char), length, file) != length)
+                        return 0;
+                name[length] = '\0';
+
+                // Duplicate names would shift every later ID
+                if (!internAccount(dict, name, &id) || id != (unsigned int)i)
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Checks that the transactions of a block only refer to known accounts
+ * IDs are read from files as stored, and balances and postings are
+ * indexed by them, so an unknown ID must be refused before either is built.
+ * @param block Block whose resident transactions to check
+ * @param account_count Number of accounts in the dictionary
+ * @return 1 if every ID is below account_count, 0 otherwise
+ */
+int checkAccountIds(const Block *block, int account_count)
+{
+        for (int i = 0; i < block->transaction_count && block->transactions; i++)
+        {
+                if (block->transactions[i].sender_id >= (unsigned int)account_count ||
+                    block->transactions[i].receiver_id >= (unsigned int)account_count)
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Makes sure the balance index has a slot for an account
+ * @param index Balance index to grow
+ * @param id Account ID that must be addressable
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reserveBalance(BalanceIndex *index, unsigned int id)
+{
+        if (id < (unsigned int)index->capacity)
+                return 1;
+
+        // Capacities are ints, so the doubling stops at INT_MAX
+        if (id >= (unsigned int)INT_MAX)
+                return 0;
+        size_t capacity = index->capacity ? (size_t)index->capacity : ACCOUNT_TABLE_MIN_SIZE;
+        while (capacity <= id)
+                capacity *= 2;
+        if (capacity > (size_t)INT_MAX)
+                capacity = (size_t)INT_MAX;
+        if (capacity > SIZE_MAX / sizeof(double))
+                return 0;
+
+        double *balances = (double *)realloc(index->balances, capacity * sizeof(double));
+        if (!balances)
+                return 0;
+        memset(balances + index->capacity, 0, (capacity - (size_t)index->capacity) * sizeof(double));
+        index->balances = balances;
+        index->capacity = (int)capacity;
+        return 1;
+}
+
+/**
+ * Applies one transaction to the balance index
+ * @param index Balance index to update
+ * @param trans Transaction moving amount from sender to receiver
+ * @return 1 if successful, 0 if allocation fails
+ */
+int applyTransactionToBalances(BalanceIndex *index, const Transaction *trans)
+{
+        if (!reserveBalance(index, trans->sender_id) || !reserveBalance(index, trans->receiver_id))
+                return 0;
+
+        index->balances[trans->sender_id] -= trans->amount;
+        index->balances[trans->receiver_id] += trans->amount;
+        return 1;
+}
+
+/**
+ * Gets the balance of an account by ID
+ * @param chain Pointer to the blockchain
+ * @param id Account ID
+ * @return Current balance; accounts without transactions have 0
+ */
+double getBalanceById(Blockchain *chain, unsigned int id)
+{
+        if (id >= (unsigned int)chain->balances.capacity)
+                return 0.0;
+        return chain->balances.balances[id];
+}
+
+/**
+ * Gets the balance of an account by name
+ * @param chain Pointer to the blockchain
+ * @param name Account name
+ * @param balance Receives the balance
+ * @return 1 if the account exists, 0 otherwise
+ */
+int getAccountBalance(Blockchain *chain, const char *name, double *balance)
+{
+        unsigned int id;
+        if (!chain || !findAccount(&chain->accounts, name, &id))
+                return 0;
+
+        *balance = getBalanceById(chain, id);
+        return 1;
+}
+
+/**
+ * Checks whether a sender can cover a transfer
+ * Only positive, finite amounts are transfers; anything else would move
+ * funds the other way or poison the balances.
+ * @param chain Pointer to the blockchain
+ * @param sender Sending account name
+ * @param amount Amount to send
+ * @return 1 if amount is a valid transfer and the sender's balance is at least amount, 0 otherwise
+ */
+int canAffordTransfer(Blockchain *chain, const char *sender, double amount)
+{
+        if (!(amount > 0) || !isfinite(amount))
+                return 0;
+
+        double balance = 0.0;
+        getAccountBalance(chain, sender, &balance);
+        return balance >= amount;
+}
+
+/**
+ * Restores the min-heap property below a node of a balance heap
+ * @param chain Pointer to the blockchain
+ * @param heap Account IDs ordered by balance
+ * @param size Number of entries in the heap
+ * @param node Position to sift down from
+ */
+void siftDownBalanceHeap(Blockchain *chain, unsigned int *heap, int size, int node)
+{
+        while (1)
+        {
+                int smallest = node;
+                int left = 2 * node + 1;
+                int right = left + 1;
+                if (left < size && getBalanceById(chain, heap[left]) < getBalanceById(chain, heap[smallest]))
+                        smallest = left;
+                if (right < size && getBalanceById(chain, heap[right]) < getBalanceById(chain, heap[smallest]))
+                        smallest = right;
+                if (smallest == node)
+                        return;
+
+                unsigned int temp = heap[node];
+                heap[node] = heap[smallest];
+                heap[smallest] = temp;
+                node = smallest;
+        }
+}
+
+/**
+ * Finds the accounts with the highest balances
+ * Keeps a min-heap of the best n accounts seen so far, so the cost is
+ * O(accounts * log n).
+ * @param chain Pointer to the blockchain
+ * @param n Maximum number of accounts to return
+ * @param ids Output array of at least n account IDs, highest balance first
+ * @return Number of accounts written
+ */
+int getTopAccounts(Blockchain *chain, int n, unsigned int *ids)
+{
+        int size = 0;
+        if (!chain || n <= 0)
+                return 0;
+
+        for (int id = 0; id < chain->accounts.count; id++)
+        {
+                if (size < n)
+                {
+                        // Sift the new entry up
+                        int node = size++;
+                        ids[node] = (unsigned int)id;
+                        while (node > 0 && getBalanceById(chain, ids[(node - 1) / 2]) > getBalanceById(chain, ids[node]))
+                        {
+                                unsigned int temp = ids[node];
+                                ids[node] = ids[(node - 1) / 2];
+                                ids[(node - 1) / 2] = temp;
+                                node = (node - 1) / 2;
+                        }
+                }
+                else if (getBalanceById(chain, (unsigned int)id) > getBalanceById(chain, ids[0]))
+                {
+                        ids[0] = (unsigned int)id;
+                        siftDownBalanceHeap(chain, ids, size, 0);
+                }
+        }
+
+        // Pop the minimum to the back repeatedly, leaving the array sorted descending
+        for (int end = size - 1; end > 0; end--)
+        {
+                unsigned int temp = ids[0];
+                ids[0] = ids[end];
+                ids[end] = temp;
+                siftDownBalanceHeap(chain, ids, end, 0);
+        }
+        return size;
+}
+
+/**
+ * Frees the balance index
+ * @param index Balance index to free
+ */
+void freeBalanceIndex(BalanceIndex *index)
+{
+        free(index->balances);
+        index->balances = NULL;
+        index->capacity = 0;
+}
+
+/**
+ * Finds the first posting at or after a timestamp
+ * @param items Postings sorted by timestamp
+ * @param count Number of postings
+ * @param timestamp Timestamp to search for
+ * @return Position of the first posting with timestamp >= the given one
+ */
+int lowerBoundPosting(const Posting *items, int count, time_t timestamp)
+{
+        int low = 0, high = count;
+        while (low < high)
+        {
+                int mid = low + (high - low) / 2;
+                if (items[mid].timestamp < timestamp)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/**
+ * Finds the first posting strictly after a timestamp
+ * @param items Postings sorted by timestamp
+ * @param count Number of postings
+ * @param timestamp Timestamp to search for
+ * @return Position of the first posting with timestamp > the given one
+ */
+int upperBoundPosting(const Posting *items, int count, time_t timestamp)
+{
+        int low = 0, high = count;
+        while (low < high)
+        {
+                int mid = low + (high - low) / 2;
+                if (items[mid].timestamp <= timestamp)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/**
+ * Makes sure a posting list has room for one more posting
+ * @param list List to grow
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reservePosting(PostingList *list)
+{
+        if (list->count < list->capacity)
+                return 1;
+
+        int capacity = list->capacity ? list->capacity * 2 : POSTING_LIST_MIN_SIZE;
+        Posting *items = (Posting *)realloc(list->items, capacity * sizeof(Posting));
+        if (!items)
+                return 0;
+        list->items = items;
+        list->capacity = capacity;
+        return 1;
+}
+
+/**
+ * Inserts a posting, keeping the list ordered by timestamp
+ * Postings almost always arrive in time order and are simply appended;
+ * an out-of-order timestamp is placed after equal timestamps.
+ * @param list List to insert into
+ * @param posting Posting to insert
+ * @return 1 if successful, 0 if allocation fails
+ */
+int insertPosting(PostingList *list, Posting posting)
+{
+        if (!reservePosting(list))
+                return 0;
+
+        int position = list->count;
+        if (position > 0 && list->items[position - 1].timestamp > posting.timestamp)
+        {
+                position = upperBoundPosting(list->items, list->count, posting.timestamp);
+                memmove(&list->items[position + 1], &list->items[position],
+                        (list->count - position) * sizeof(Posting));
+        }
+
+        list->items[position] = posting;
+        list->count++;
+        return 1;
+}
+
+/**
+ * Gets the postings of a list that fall inside a time window
+ * @param list List to search
+ * @param from Start of the window (inclusive)
+ * @param to End of the window (inclusive)
+ * @param first Receives a pointer to the first matching posting
+ * @return Number of matching postings, which are contiguous from *first
+ */
+int findPostingRange(const PostingList *list, time_t from, time_t to, const Posting **first)
+{
+        int begin = lowerBoundPosting(list->items, list->count, from);
+        int end = upperBoundPosting(list->items, list->count, to);
+        *first = list->items + begin;
+        return end > begin ? end - begin : 0;
+}
+
+/**
+ * Makes sure the secondary indexes have room for one more transaction
+ * Once this succeeds, indexTransaction cannot fail for the transaction.
+ * @param index Indexes to grow
+ * @param trans Transaction about to be recorded
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reserveTransactionIndex(ChainIndex *index, const Transaction *trans)
+{
+        unsigned int highest = trans->sender_id > trans->receiver_id ? trans->sender_id : trans->receiver_id;
+
+        if (highest >= (unsigned int)index->account_capacity)
+        {
+                // Capacities are ints, so the doubling stops at INT_MAX
+                if (highest >= (unsigned int)INT_MAX)
+                        return 0;
+                size_t capacity = index->account_capacity ? (size_t)index->account_capacity : ACCOUNT_TABLE_MIN_SIZE;
+                while (capacity <= highest)
+                        capacity *= 2;
+                if (capacity > (size_t)INT_MAX)
+                        capacity = (size_t)INT_MAX;
+                if (capacity > SIZE_MAX / sizeof(PostingList))
+                        return 0;
+
+                PostingList *accounts = (PostingList *)realloc(index->accounts, capacity * sizeof(PostingList));
+                if (!accounts)
+                        return 0;
+                memset(accounts + index->account_capacity, 0,
+                       (capacity - (size_t)index->account_capacity) * sizeof(PostingList));
+                index->accounts = accounts;
+                index->account_capacity = (int)capacity;
+        }
+
+        return reservePosting(&index->transactions) && reservePosting(&index->accounts[trans->sender_id]) &&
+               reservePosting(&index->accounts[trans->receiver_id]);
+}
+
+/**
+ * Records one transaction in the secondary indexes
+ * @param index Indexes to update
+ * @param trans Transaction to record
+ * @param block_index Index of the block holding the transaction
+ * @param tx_slot Position of the transaction in the block
+ * @return 1 if successful, 0 if allocation fails
+ */
+int indexTransaction(ChainIndex *index, const Transaction *trans, int block_index, int tx_slot)
+{
+        Posting posting = {trans->timestamp, block_index, tx_slot};
+        if (!reserveTransactionIndex(index, trans) || !insertPosting(&index->transactions, posting) ||
+            !insertPosting(&index->accounts[trans->sender_id], posting))
+                return 0;
+
+        // A transfer to oneself is listed once in that account's history
+        if (trans->receiver_id != trans->sender_id &&
+            !insertPosting(&index->accounts[trans->receiver_id], posting))
+                return 0;
+        return 1;
+}
+
+/**
+ * Records one block in the block timestamp index
+ * @param index Indexes to update
+ * @param block Block to record
+ * @param block_index Position of the block in the chain
+ * @return 1 if successful, 0 if allocation fails
+ */
+int indexBlock(ChainIndex *index, const Block *block, int block_index)
+{
+        Posting posting = {block->timestamp, block_index, -1};
+        return insertPosting(&index->blocks, posting);
+}
+
+/**
+ * Builds the secondary indexes from scratch in one pass over the chain
+ * @param chain Pointer to the blockchain
+ * @return 1 if successful, 0 if allocation fails
+ */
+int buildChainIndex(Blockchain *chain)
+{
+        freeChainIndex(&chain->index);
+        for (int i = 0; i < chain->length; i++)
+        {
+                Block *block = getBlock(chain, i);
+                Transaction *transactions = getBlockTransactions(block);
+                if (!indexBlock(&chain->index, block, i) || (block->transaction_count > 0 && !transactions))
+                        return 0;
+                for (int j = 0; j < block->transaction_count; j++)
+                {
+                        if (!indexTransaction(&chain->index, &transactions[j], i, j))
+                                return 0;
+                }
+        }
+        return 1;
+}
+
+/**
+ * Gets the transactions involving an account inside a time window
+ * Runs in O(log n) plus the size of the result.
+ * @param chain Pointer to the blockchain
+ * @param name Account name
+ * @param from Start of the window (inclusive)
+ * @param to End of the window (inclusive)
+ * @param first Receives a pointer to the first matching posting
+ * @return Number of matching postings, which are contiguous from *first
+ */
+int getAccountHistory(Blockchain *chain, const char *name, time_t from, time_t to, const Posting **first)
+{
+        unsigned int id;
+        *first = NULL;
+        if (!chain || !findAccount(&chain->accounts, name, &id) || id >= (unsigned int)chain->index.account_capacity)
+                return 0;
+        return findPostingRange(&chain->index.accounts[id], from, to, first);
+}
+
+/**
+ * Gets all transactions inside a time window, ordered by timestamp
+ * @param chain Pointer to the blockchain
+ * @param from Start of the window (inclusive)
+ * @param to End of the window (inclusive)
+ * @param first Receives a pointer to the first matching posting
+ * @return Number of matching postings, which are contiguous from *first
+ */
+int getTransactionsInRange(Blockchain *chain, time_t from, time_t to, const Posting **first)
+{
+        return findPostingRange(&chain->index.transactions, from, to, first);
+}
+
+/**
+ * Gets the blocks created inside a time window, ordered by timestamp
+ * @param chain Pointer to the blockchain
+ * @param from Start of the window (inclusive)
+ * @param to End of the window (inclusive)
+ * @param first Receives a pointer to the first matching posting (tx_slot is -1)
+ * @return Number of matching postings, which are contiguous from *first
+ */
+int getBlocksInRange(Blockchain *chain, time_t from, time_t to, const Posting **first)
+{
+        return findPostingRange(&chain->index.blocks, from, to, first);
+}
+
+/**
+ * Appends a posting list to a buffer as a varint count and varint postings
+ * Postings are sorted, so each is stored as zigzag deltas of its timestamp
+ * and block index from the one before it, then its slot plus one.
+ * @param buffer Buffer to append to
+ * @param list List to encode
+ * @return 1 if successful, 0 if allocation fails
+ */
+int encodePostingList(ByteBuffer *buffer, const PostingList *list)
+{
+        if (!reserveBytes(buffer, 5 + (size_t)list->count * (10 + 5 + 5)))
+                return 0;
+
+        unsigned char *dst = putVarint(buffer->data + buffer->size, (unsigned long long)list->count);
+        time_t timestamp = 0;
+        int block_index = 0;
+        for (int i = 0; i < list->count; i++)
+        {
+                const Posting *posting = &list->items[i];
+                dst = putVarint(dst, zigzagEncode((long long)(posting->timestamp - timestamp)));
+                dst = putVarint(dst, zigzagEncode((long long)posting->block_index - block_index));
+                dst = putVarint(dst, (unsigned long long)((long long)posting->tx_slot + 1));
+                timestamp = posting->timestamp;
+                block_index = posting->block_index;
+        }
+        buffer->size = dst - buffer->data;
+        return 1;
+}
+
+/**
+ * Decodes a posting list written by encodePostingList
+ * @param src Start of the encoded list
+ * @param end End of the readable bytes
+ * @param list Empty list to fill
+ * @return Byte after the list, or NULL if it is truncated, out of range or allocation fails
+ */
+const unsigned char *decodePostingList(const unsigned char *src, const unsigned char *end, PostingList *list)
+{
+        // Each posting takes at least three bytes, so a count the bytes
+        // left cannot hold is refused before anything is allocated
+        unsigned long long count;
+        if (!(src = getVarint(src, end, &count)) || count > INT_MAX || count > (unsigned long long)(end - src) / 3)
+                return NULL;
+        if (count == 0)
+                return src;
+
+        list->items = (Posting *)malloc(count * sizeof(Posting));
+        if (!list->items)
+                return NULL;
+        list->capacity = (int)count;
+
+        time_t timestamp = 0;
+        long long block_index = 0;
+        for (unsigned long long i = 0; i < count; i++)
+        {
+                unsigned long long timestamp_delta, block_delta, slot;
+                if (!(src = getVarint(src, end, &timestamp_delta)) || !(src = getVarint(src, end, &block_delta)) ||
+                    !(src = getVarint(src, end, &slot)) || block_delta > 2ull * INT_MAX + 1 || slot > INT_MAX)
+                        return NULL;
+                timestamp += (time_t)zigzagDecode(timestamp_delta);
+                block_index += zigzagDecode(block_delta);
+                if (block_index < 0 || block_index > INT_MAX)
+                        return NULL;
+
+                Posting *posting = &list->items[list->count++];
+                posting->timestamp = timestamp;
+                posting->block_index = (int)block_index;
+                posting->tx_slot = (int)slot - 1;
+        }
+        return src;
+}
+
+/**
+ * Appends the secondary indexes to a buffer: the block, transaction and
+ * account posting lists, each encoded by encodePostingList
+ * @param buffer Buffer to append to
+ * @param index Indexes to encode
+ * @param account_count Number of account histories to write
+ * @return 1 if successful, 0 if allocation fails
+ */
+int encodeChainIndex(ByteBuffer *buffer, const ChainIndex *index, int account_count)
+{
+        static const PostingList empty;
+        if (!encodePostingList(buffer, &index->blocks) || !encodePostingList(buffer, &index->transactions))
+                return 0;
+        for (int id = 0; id < account_count; id++)
+        {
+                if (!encodePostingList(buffer, id < index->account_capacity ? &index->accounts[id] : &empty))
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Decodes secondary indexes written by encodeChainIndex
+ * Whatever was allocated before a failure is left in the index for
+ * freeChainIndex.
+ * @param src Start of the encoded indexes
+ * @param end End of the encoded indexes, which must all be used
+ * @param index Empty indexes to fill
+ * @param account_count Number of account histories to read
+ * @return 1 if successful, 0 if the bytes are malformed or allocation fails
+ */
+int decodeChainIndex(const unsigned char *src, const unsigned char *end, ChainIndex *index, int account_count)
+{
+        if (account_count > 0)
+        {
+                index->accounts = (PostingList *)calloc(account_count, sizeof(PostingList));
+                if (!index->accounts)
+                        return 0;
+                index->account_capacity = account_count;
+        }
+
+        src = decodePostingList(src, end, &index->blocks);
+        src = src ? decodePostingList(src, end, &index->transactions) : NULL;
+        for (int id = 0; src && id < account_count; id++)
+                src = decodePostingList(src, end, &index->accounts[id]);
+        return src == end;
+}
+
+/**
+ * Checks one posting read from a file against the chain
+ * A posting must name a block, or a transaction, below height and carry
+ * its timestamp. Postings come in the order indexing the blocks in turn
+ * would give them: by timestamp, then by position in the chain.
+ * @param chain Chain the posting was read for
+ * @param posting Posting to check
+ * @param previous Posting before it in its list, or NULL for the first
+ * @param height Number of blocks the list covers
+ * @param trans Receives the named transaction, or NULL if the posting names a block
+ * @return 1 if the posting is valid, 0 otherwise
+ */
+int checkPosting(Blockchain *chain, const Posting *posting, const Posting *previous, int height,
+                 const Transaction **trans)
+{
+        if (previous && (posting->timestamp < previous->timestamp ||
+                         (posting->timestamp == previous->timestamp &&
+                          (posting->block_index < previous->block_index ||
+                           (posting->block_index == previous->block_index && posting->tx_slot <= previous->tx_slot)))))
+                return 0;
+        if (posting->block_index < 0 || posting->block_index >= height)
+                return 0;
+
+        Block *block = getBlock(chain, posting->block_index);
+        if (!trans)
+                return posting->tx_slot == -1 && posting->timestamp == block->timestamp;
+
+        Transaction *transactions = getBlockTransactions(block);
+        if (!transactions || posting->tx_slot < 0 || posting->tx_slot >= block->transaction_count)
+                return 0;
+        *trans = &transactions[posting->tx_slot];
+        return posting->timestamp == (*trans)->timestamp;
+}
+
+/**
+ * Checks that indexes read from a file are exactly those of the first
+ * height blocks of a verified chain
+ * Every posting must be valid and in order, so no list repeats an entry.
+ * With the counts matching, every block and transaction is then listed
+ * once, and each transaction once under each account it involves.
+ * @param chain Verified chain
+ * @param index Indexes to check
+ * @param height Number of blocks the indexes cover
+ * @param account_count Number of account histories in the indexes
+ * @return 1 if the indexes match the chain, 0 otherwise
+ */
+int verifyChainIndex(Blockchain *chain, const ChainIndex *index, int height, int account_count)
+{
+        long long transactions = 0;
+        long long involvements = 0;
+        for (int i = 0; i < height; i++)
+        {
+                Block *block = getBlock(chain, i);
+                Transaction *items = getBlockTransactions(block);
+                if (block->transaction_count > 0 && !items)
+                        return 0;
+                transactions += block->transaction_count;
+                for (int j = 0; j < block->transaction_count; j++)
+                        involvements += items[j].sender_id == items[j].receiver_id ? 1 : 2;
+        }
+        if (index->blocks.count != height || index->transactions.count != transactions ||
+            account_count > index->account_capacity)
+                return 0;
+
+        const Transaction *trans;
+        for (int i = 0; i < index->blocks.count; i++)
+        {
+                if (!checkPosting(chain, &index->blocks.items[i], i > 0 ? &index->blocks.items[i - 1] : NULL, height, NULL))
+                        return 0;
+        }
+        for (int i = 0; i < index->transactions.count; i++)
+        {
+                if (!checkPosting(chain, &index->transactions.items[i], i > 0 ? &index->transactions.items[i - 1] : NULL,
+                                  height, &trans))
+                        return 0;
+        }
+        for (int id = 0; id < account_count; id++)
+        {
+                const PostingList *list = &index->accounts[id];
+                for (int i = 0; i < list->count; i++)
+                {
+                        if (!checkPosting(chain, &list->items[i], i > 0 ? &list->items[i - 1] : NULL, height, &trans) ||
+                            (trans->sender_id != (unsigned int)id && trans->receiver_id != (unsigned int)id))
+                                return 0;
+                }
+                involvements -= list->count;
+        }
+        return involvements == 0;
+}
+
+/**
+ * Saves the secondary indexes next to a chain file
+ * The file records the chain length and tip hash so a stale index is
+ * never used for a different chain.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the index file
+ * @return 1 if successful, 0 if failed
+ */
+int saveChainIndex(Blockchain *chain, const char *filename)
+{
+        FILE *file = fopen(filename, "wb");
+        if (!file)
+                return 0;
+
+        Block *latest = getLatestBlock(chain);
+        unsigned char tip[DIGEST_SIZE] = {0};
+        unsigned int version = INDEX_FILE_VERSION;
+        if (latest)
+                memcpy(tip, latest->hash, DIGEST_SIZE);
+
+        fwrite(INDEX_FILE_MAGIC, sizeof(char), 4, file);
+        fwrite(&version, sizeof(unsigned int), 1, file);
+        fwrite(&chain->length, sizeof(int), 1, file);
+        fwrite(tip, sizeof(unsigned char), DIGEST_SIZE, file);
+        fwrite(&chain->accounts.count, sizeof(int), 1, file);
+
+        ByteBuffer body = {0};
+        int ok = encodeChainIndex(&body, &chain->index, chain->accounts.count);
+        if (ok && body.size > 0)
+                ok = fwrite(body.data, 1, body.size, file) == body.size;
+        freeByteBuffer(&body);
+        if (fclose(file) != 0)
+                ok = 0;
+        return ok;
+}
+
+/**
+ * Loads the secondary indexes saved next to a chain file
+ * @param chain Loaded blockchain the index must belong to
+ * @param filename Name of the index file
+ * @return 1 if a matching index was loaded, 0 if it is missing, stale or corrupt
+ */
+int loadChainIndex(Blockchain *chain, const char *filename)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+                return 0;
+
+        char magic[4];
+        unsigned int version;
+        int length, account_count;
+        unsigned char tip[DIGEST_SIZE];
+        Block *latest = getLatestBlock(chain);
+
+        int ok = fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, INDEX_FILE_MAGIC, 4) == 0 &&
+                 fread(&version, sizeof(unsigned int), 1, file) == 1 && version == INDEX_FILE_VERSION &&
+                 fread(&length, sizeof(int), 1, file) == 1 && length == chain->length &&
+                 fread(tip, sizeof(unsigned char), DIGEST_SIZE, file) == DIGEST_SIZE &&
+                 (!latest || memcmp(tip, latest->hash, DIGEST_SIZE) == 0) &&
+                 fread(&account_count, sizeof(int), 1, file) == 1 && account_count == chain->accounts.count;
+
+        // The postings fill the rest of the file
+        long long body_size = ok ? getRemainingBytes(file) : -1;
+        unsigned char *body = body_size >= 0 ? (unsigned char *)malloc(body_size > 0 ? body_size : 1) : NULL;
+        ok = body && fread(body, 1, body_size, file) == (size_t)body_size;
+        fclose(file);
+
+        // The file could have been replaced, so the postings are only used
+        // if they are exactly those of the verified blocks
+        freeChainIndex(&chain->index);
+        ok = ok && decodeChainIndex(body, body + body_size, &chain->index, account_count) &&
+             verifyChainIndex(chain, &chain->index, chain->length, account_count);
+        free(body);
+        if (!ok)
+                freeChainIndex(&chain->index);
+        return ok;
+}
+
+/**
+ * Frees the secondary indexes
+ * @param index Indexes to free
+ */
+void freeChainIndex(ChainIndex *index)
+{
+        for (int id = 0; id < index->account_capacity; id++)
+        {
+                free(index->accounts[id].items);
+        }
+        free(index->accounts);
+        free(index->transactions.items);
+        free(index->blocks.items);
+        memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Builds the name of the index file stored next to a chain file
+ * @param filename Name of the chain file
+ * @param output Buffer for the index file name
+ * @param size Size of the buffer
+ */
+void getIndexFilename(const char *filename, char *output, size_t size)
+{
+        snprintf(output, size, "%s%s", filename, INDEX_FILE_SUFFIX);
+}
+
+/**
+ * Builds the name of one ledger state slot stored next to a chain file
+ * @param filename Name of the chain file
+ * @param slot Slot number, 0 to STATE_FILE_SLOTS - 1
+ * @param output Buffer for the state file name
+ * @param size Size of the buffer
+ */
+void getStateFilename(const char *filename, int slot, char *output, size_t size)
+{
+        snprintf(output, size, "%s%s.%d", filename, STATE_FILE_SUFFIX, slot);
+}
+
+/**
+ * Extends a 64-bit FNV-1a checksum over a range of bytes
+ * @param checksum Checksum so far (STATE_CHECKSUM_SEED to start)
+ * @param data Bytes to add
+ * @param length Number of bytes
+ * @return Updated checksum
+ */
+unsigned long long updateStateChecksum(unsigned long long checksum, const void *data, size_t length)
+{
+        const unsigned char *bytes = (const unsigned char *)data;
+        for (size_t i = 0; i < length; i++)
+        {
+                checksum ^= bytes[i];
+                checksum *= 1099511628211ull;
+        }
+        return checksum;
+}
+
+/**
+ * Writes bytes to a state file and adds them to its checksum
+ * @param file File to write to
+ * @param data Bytes to write
+ * @param length Number of bytes
+ * @param checksum Running checksum to update
+ */
+void writeStateBytes(FILE *file, const void *data, size_t length, unsigned long long *checksum)
+{
+        if (length == 0)
+                return;
+        fwrite(data, 1, length, file);
+        *checksum = updateStateChecksum(*checksum, data, length);
+}
+
+/**
+ * Writes derived ledger state as of a height to a state file
+ * The file is written under a temporary name, synced and renamed, so a
+ * slot always holds either the old snapshot or the complete new one.
+ * @param filename Name of the state file
+ * @param height Number of blocks the state covers
+ * @param hash Hash of block height - 1
+ * @param account_count One past the highest account ID to write
+ * @param index Secondary indexes over the first height blocks
+ * @return 1 if successful, 0 if failed
+ */
+int writeLedgerState(const char *filename, int height, const unsigned char *hash, int account_count,
+                     const ChainIndex *index)
+{
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+        FILE *file = fopen(temp_filename, "wb");
+        if (!file)
+                return 0;
+
+        ByteBuffer body = {0};
+        if (!encodeChainIndex(&body, index, account_count))
+        {
+                fclose(file);
+                remove(temp_filename);
+                return 0;
+        }
+
+        LedgerStateHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STATE_FILE_MAGIC, 4);
+        header.version = STATE_FILE_VERSION;
+        header.height = height;
+        header.account_count = account_count;
+        memcpy(header.hash, hash, DIGEST_SIZE);
+        header.checksum = updateStateChecksum(STATE_CHECKSUM_SEED, body.data, body.size);
+
+        fwrite(&header, sizeof(header), 1, file);
+        if (body.size > 0)
+                fwrite(body.data, 1, body.size, file);
+        freeByteBuffer(&body);
+
+        int ok = fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+        if (fclose(file) != 0)
+                ok = 0;
+        if (ok && rename(temp_filename, filename) != 0)
+                ok = 0;
+        if (!ok)
+                remove(temp_filename);
+        return ok;
+}
+
+/**
+ * Gets the height recorded in a state file's header
+ * @param filename Name of the state file
+ * @return Height of the snapshot, or -1 if the file is missing or not a state file
+ */
+int readLedgerStateHeight(const char *filename)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+                return -1;
+
+        LedgerStateHeader header;
+        int ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, STATE_FILE_MAGIC, 4) == 0 &&
+                 header.version == STATE_FILE_VERSION;
+        fclose(file);
+        return ok ? header.height : -1;
+}
+
+/**
+ * Picks the state slot to overwrite next: the missing or oldest one
+ * @param filename Name of the chain file
+ * @return Slot number
+ */
+int pickLedgerStateSlot(const char *filename)
+{
+        int oldest_slot = 0;
+        int oldest_height = 0;
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+        {
+                char state_filename[FILENAME_BUFFER_SIZE];
+                getStateFilename(filename, slot, state_filename, sizeof(state_filename));
+                int height = readLedgerStateHeight(state_filename);
+                if (slot == 0 || height < oldest_height)
+                {
+                        oldest_slot = slot;
+                        oldest_height = height;
+                }
+        }
+        return oldest_slot;
+}
+
+/**
+ * Writes the chain's current ledger state as a snapshot of its full height
+ * Used when the chain is saved, so the next load has no blocks to index.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the chain file
+ * @return 1 if successful, 0 if failed
+ */
+int saveLedgerState(Blockchain *chain, const char *filename)
+{
+        Block *latest = getLatestBlock(chain);
+        if (!latest)
+                return 1;
+
+        char state_filename[FILENAME_BUFFER_SIZE];
+        getStateFilename(filename, pickLedgerStateSlot(filename), state_filename, sizeof(state_filename));
+        return writeLedgerState(state_filename, chain->length, latest->hash, chain->accounts.count, &chain->index);
+}
+
+/**
+ * Maps a state file and checks that it belongs to a chain
+ * @param filename Name of the state file
+ * @param chain Loaded blockchain the snapshot must match
+ * @param size Receives the size of the mapping
+ * @return Mapped header, or NULL if the file is missing, corrupt or for another chain
+ */
+const LedgerStateHeader *mapLedgerState(const char *filename, Blockchain *chain, size_t *size)
+{
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+
+        struct stat info;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(LedgerStateHeader))
+                map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return NULL;
+        *size = (size_t)info.st_size;
+
+        // The snapshot must end on a block of this chain and fit its dictionary
+        const LedgerStateHeader *header = (const LedgerStateHeader *)map;
+        int ok = memcmp(header->magic, STATE_FILE_MAGIC, 4) == 0 && header->version == STATE_FILE_VERSION &&
+                 header->height > 0 && header->height <= chain->length &&
+                 header->account_count >= 0 && header->account_count <= chain->accounts.count &&
+                 memcmp(header->hash, getBlock(chain, header->height - 1)->hash, DIGEST_SIZE) == 0;
+
+        // Its body must match the checksum
+        ok = ok && updateStateChecksum(STATE_CHECKSUM_SEED, header + 1, *size - sizeof(LedgerStateHeader)) ==
+                           header->checksum;
+        if (!ok)
+        {
+                munmap(map, *size);
+                return NULL;
+        }
+        return header;
+}
+
+/**
+ * Restores the indexes from the newest state snapshot that matches a
+ * verified chain
+ * @param chain Verified blockchain with empty indexes
+ * @param filename Name of the chain file
+ * @return Number of blocks the restored state covers, 0 if no snapshot matched
+ */
+int loadLedgerState(Blockchain *chain, const char *filename)
+{
+        const LedgerStateHeader *best = NULL;
+        size_t best_size = 0;
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+        {
+                char state_filename[FILENAME_BUFFER_SIZE];
+                size_t size;
+                getStateFilename(filename, slot, state_filename, sizeof(state_filename));
+                const LedgerStateHeader *header = mapLedgerState(state_filename, chain, &size);
+                if (!header)
+                        continue;
+
+                if (!best || header->height > best->height)
+                {
+                        if (best)
+                                munmap((void *)best, best_size);
+                        best = header;
+                        best_size = size;
+                }
+                else
+                {
+                        munmap((void *)header, size);
+                }
+        }
+        if (!best)
+                return 0;
+
+        // The checksum only catches damage and the file could have been
+        // replaced, so the postings are only used if they decode within the
+        // mapping and are exactly those of the verified blocks
+        int account_count = best->account_count;
+        int height = best->height;
+        const unsigned char *body = (const unsigned char *)(best + 1);
+        freeChainIndex(&chain->index);
+        int ok = decodeChainIndex(body, (const unsigned char *)best + best_size, &chain->index, account_count);
+        munmap((void *)best, best_size);
+        if (!ok || !verifyChainIndex(chain, &chain->index, height, account_count))
+        {
+                freeChainIndex(&chain->index);
+                return 0;
+        }
+        return height;
+}
+
+/**
+ * Computes balances from every block, and indexes the blocks not yet indexed
+ * @param chain Pointer to the blockchain, with empty balances
+ * @param index_from First block missing from the indexes, chain->length if they are complete
+ * @return 1 if successful, 0 if allocation fails
+ */
+int replayLedger(Blockchain *chain, int index_from)
+{
+        for (int i = 0; i < chain->length; i++)
+        {
+                Block *block = getBlock(chain, i);
+                Transaction *transactions = getBlockTransactions(block);
+                int rebuild_index = i >= index_from;
+                if ((rebuild_index && !indexBlock(&chain->index, block, i)) || (block->transaction_count > 0 && !transactions))
+                        return 0;
+                for (int j = 0; j < block->transaction_count; j++)
+                {
+                        if (!applyTransactionToBalances(&chain->balances, &transactions[j]) ||
+                            (rebuild_index && !indexTransaction(&chain->index, &transactions[j], i, j)))
+                                return 0;
+                }
+        }
+        return 1;
+}
+
+/**
+ * Advances a private ledger state through the sealed blocks of a snapshot
+ * @param state State to advance
+ * @param snapshot Snapshot holding at least height blocks
+ * @param height Number of blocks the state should cover
+ * @return 1 if successful, 0 if allocation fails
+ */
+int advanceLedgerState(LedgerState *state, const ChainSnapshot *snapshot, int height)
+{
+        for (int i = state->height; i < height; i++)
+        {
+                Block *block = getSnapshotBlock(snapshot, i);
+                if (!indexBlock(&state->index, block, i))
+                        return 0;
+                for (int j = 0; j < block->transaction_count; j++)
+                {
+                        const Transaction *trans = &block->transactions[j];
+                        if (!indexTransaction(&state->index, trans, i, j))
+                                return 0;
+
+                        unsigned int highest = trans->sender_id > trans->receiver_id ? trans->sender_id : trans->receiver_id;
+                        if ((int)highest >= state->account_count)
+                                state->account_count = (int)highest + 1;
+                }
+                memcpy(state->hash, block->hash, DIGEST_SIZE);
+                state->height = i + 1;
+        }
+        return 1;
+}
+
+/**
+ * Takes ledger snapshots until asked to stop
+ * The snapshotter keeps its own copy of the derived state and advances
+ * it from sealed blocks read through chain snapshots, so appends never
+ * wait for it.
+ * @param arg Pointer to the LedgerSnapshotter
+ * @return NULL
+ */
+void *ledgerSnapshotterMain(void *arg)
+{
+        LedgerSnapshotter *snapshotter = (LedgerSnapshotter *)arg;
+        struct timespec pause = {0, STATE_SNAPSHOT_POLL_NS};
+
+        while (!atomic_load(&snapshotter->stopping))
+        {
+                nanosleep(&pause, NULL);
+
+                ChainSnapshot snapshot;
+                beginChainRead(snapshotter->chain, &snapshot);
+                int due = snapshot.sealed_length - snapshotter->state.height >= snapshotter->interval;
+                int ok = !due || advanceLedgerState(&snapshotter->state, &snapshot, snapshot.sealed_length);
+                endChainRead(&snapshot);
+                if (!ok)
+                        break;
+                if (!due)
+                        continue;
+
+                LedgerState *state = &snapshotter->state;
+                if (writeLedgerState(snapshotter->state_filenames[snapshotter->next_slot], state->height, state->hash,
+                                     state->account_count, &state->index))
+                {
+                        snapshotter->snapshots_written++;
+                        snapshotter->next_slot = (snapshotter->next_slot + 1) % STATE_FILE_SLOTS;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Starts writing a ledger snapshot every interval sealed blocks
+ * Turns on concurrent reads, so transactions can then only be added to
+ * the open tip.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the chain file the snapshots belong to
+ * @param interval Sealed blocks between snapshots
+ * @return Snapshotter to pass to stopLedgerSnapshots, or NULL if it could not start
+ */
+LedgerSnapshotter *startLedgerSnapshots(Blockchain *chain, const char *filename, int interval)
+{
+        if (!chain || interval <= 0)
+                return NULL;
+
+        LedgerSnapshotter *snapshotter = (LedgerSnapshotter *)calloc(1, sizeof(LedgerSnapshotter));
+        if (!snapshotter)
+                return NULL;
+
+        snapshotter->chain = chain;
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+                getStateFilename(filename, slot, snapshotter->state_filenames[slot], FILENAME_BUFFER_SIZE);
+        snapshotter->interval = interval;
+        snapshotter->next_slot = pickLedgerStateSlot(filename);
+        atomic_init(&snapshotter->stopping, 0);
+
+        setConcurrentReads(chain, 1);
+        if (pthread_create(&snapshotter->thread, NULL, ledgerSnapshotterMain, snapshotter) != 0)
+        {
+                free(snapshotter);
+                return NULL;
+        }
+        return snapshotter;
+}
+
+/**
+ * Stops a snapshotter and frees it
+ * @param snapshotter Snapshotter returned by startLedgerSnapshots
+ * @return Number of snapshots it wrote
+ */
+int stopLedgerSnapshots(LedgerSnapshotter *snapshotter)
+{
+        if (!snapshotter)
+                return 0;
+
+        atomic_store(&snapshotter->stopping, 1);
+        pthread_join(snapshotter->thread, NULL);
+
+        int written = snapshotter->snapshots_written;
+        freeChainIndex(&snapshotter->state.index);
+        free(snapshotter);
+        return written;
+}
+
+/**
+ * Gets the 64-bit tag of a digest: its first eight bytes, big-endian,
+ * so the tag orders and prefixes the same way as the hex string
+ * @param digest Raw digest
+ * @return Tag of the digest
+ */
+unsigned long long getHashTag(const unsigned char *digest)
+{
+        unsigned long long tag = 0;
+        for (int i = 0; i < 8; i++)
+                tag = (tag << 8) | digest[i];
+        return tag;
+}
+
+/**
+ * Gets the home slot of a tag: its top bits, so hashes sharing a prefix
+ * have neighbouring home slots
+ * @param array Slots to address
+ * @param tag Tag of the digest
+ * @return Home slot of the tag
+ */
+int getHashHome(const HashSlotArray *array, unsigned long long tag)
+{
+        return (int)(tag >> (64 - array->bits));
+}
+
+/**
+ * Places an entry in the first free slot from its home
+ * @param array Slots with at least one free slot
+ * @param tag Tag of the block hash
+ * @param block_index Block the hash belongs to
+ */
+void placeHashEntry(HashSlotArray *array, unsigned long long tag, int block_index)
+{
+        int mask = array->capacity - 1;
+        int slot = getHashHome(array, tag);
+        while (atomic_load_explicit(&array->slots[slot].block_index, memory_order_relaxed))
+                slot = (slot + 1) & mask;
+        array->slots[slot].tag = tag;
+        atomic_store_explicit(&array->slots[slot].block_index, block_index + 1, memory_order_release);
+}
+
+/**
+ * Doubles a hash table and reinserts every entry
+ * The new slots are published whole and the old ones retired, so
+ * snapshots keep probing a complete table.
+ * @param chain Pointer to the blockchain
+ * @return 1 if successful, 0 if allocation fails
+ */
+int growHashTable(Blockchain *chain)
+{
+        BlockHashTable *table = &chain->hash_table;
+        HashSlotArray *old_array = atomic_load_explicit(&table->array, memory_order_relaxed);
+        int bits = old_array ? old_array->bits + 1 : HASH_TABLE_MIN_BITS;
+
+        HashSlotArray *array = (HashSlotArray *)calloc(1, sizeof(HashSlotArray) + ((size_t)1 << bits) * sizeof(HashSlot));
+        if (!array)
+                return 0;
+
+        array->bits = bits;
+        array->capacity = 1 << bits;
+        for (int i = 0; old_array && i < old_array->capacity; i++)
+        {
+                int stored = atomic_load_explicit(&old_array->slots[i].block_index, memory_order_relaxed);
+                if (stored)
+                        placeHashEntry(array, old_array->slots[i].tag, stored - 1);
+        }
+        atomic_store(&table->array, array);
+        retirePointer(&chain->epochs, old_array);
+        return 1;
+}
+
+/**
+ * Makes sure the hash lookup table has room for one more entry
+ * The table is kept at most half full so probe runs stay short.
+ * @param chain Pointer to the blockchain
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reserveBlockHash(Blockchain *chain)
+{
+        BlockHashTable *table = &chain->hash_table;
+        HashSlotArray *array = atomic_load_explicit(&table->array, memory_order_relaxed);
+        return (array && (table->count + 1) * 2 <= array->capacity) || growHashTable(chain);
+}
+
+/**
+ * Adds a sealed block's hash to the lookup table
+ * Loaders pass the position the block was read at rather than the index
+ * stored in it, which validation has not checked yet.
+ * @param chain Pointer to the blockchain
+ * @param block Block to add
+ * @param position Position of the block in the chain
+ * @return 1 if successful, 0 if allocation fails
+ */
+int insertBlockHash(Blockchain *chain, Block *block, int position)
+{
+        if (!reserveBlockHash(chain))
+                return 0;
+
+        HashSlotArray *array = atomic_load_explicit(&chain->hash_table.array, memory_order_relaxed);
+        placeHashEntry(array, getHashTag(block->hash), position);
+        chain->hash_table.count++;
+        return 1;
+}
+
+/**
+ * Removes a sealed block's hash from the lookup table
+ * Later entries of the probe run are shifted back so lookups never need
+ * tombstones. Entries move in place, so this is only used when no
+ * snapshot is being read concurrently.
+ * @param chain Pointer to the blockchain
+ * @param block Block whose hash is about to change
+ */
+void removeBlockHash(Blockchain *chain, Block *block)
+{
+        BlockHashTable *table = &chain->hash_table;
+        HashSlotArray *array = atomic_load_explicit(&table->array, memory_order_relaxed);
+        if (table->count == 0)
+                return;
+
+        int mask = array->capacity - 1;
+        HashSlot *slots = array->slots;
+        int slot = getHashHome(array, getHashTag(block->hash));
+        while (slots[slot].block_index && slots[slot].block_index != block->index + 1)
+                slot = (slot + 1) & mask;
+        if (!slots[slot].block_index)
+                return;
+
+        // Backward-shift deletion
+        int hole = slot;
+        for (int next = (hole + 1) & mask; slots[next].block_index; next = (next + 1) & mask)
+        {
+                int home = getHashHome(array, slots[next].tag);
+
+                // The entry may move into the hole only if its home is not between the hole and it
+                int distance_to_home = (next - home) & mask;
+                int distance_to_hole = (next - hole) & mask;
+                if (distance_to_home >= distance_to_hole)
+                {
+                        slots[hole].tag = slots[next].tag;
+                        slots[hole].block_index = slots[next].block_index;
+                        hole = next;
+                }
+        }
+        slots[hole].block_index = 0;
+        table->count--;
+}
+
+/**
+ * Finds a block of a snapshot by its exact hash
+ * @param snapshot Snapshot taken by beginChainRead
+ * @param digest Raw hash to look for
+ * @return Pointer to the block or NULL if no block of the snapshot has this hash
+ */
+Block *findSnapshotBlockByHash(const ChainSnapshot *snapshot, const unsigned char *digest)
+{
+        // The open tip is not in the table
+        if (snapshot->length > snapshot->sealed_length)
+        {
+                Block *tip = getSnapshotBlock(snapshot, snapshot->length - 1);
+                if (memcmp(tip->hash, digest, DIGEST_SIZE) == 0)
+                        return tip;
+        }
+
+        const HashSlotArray *array = snapshot->hash_slots;
+        if (!array)
+                return NULL;
+
+        unsigned long long tag = getHashTag(digest);
+        int mask = array->capacity - 1;
+        for (int slot = getHashHome(array, tag);; slot = (slot + 1) & mask)
+        {
+                int stored = atomic_load_explicit(&array->slots[slot].block_index, memory_order_acquire);
+                if (!stored)
+                        break;
+
+                // Skip blocks sealed after the snapshot was taken
+                if (stored > snapshot->sealed_length || array->slots[slot].tag != tag)
+                        continue;
+
+                Block *block = getSnapshotBlock(snapshot, stored - 1);
+                if (memcmp(block->hash, digest, DIGEST_SIZE) == 0)
+                        return block;
+        }
+        return NULL;
+}
+
+/**
+ * Finds a block by its exact hash
+ * @param chain Pointer to the blockchain
+ * @param digest Raw hash to look for
+ * @return Pointer to the block or NULL if no block has this hash
+ */
+Block *findBlockByHash(Blockchain *chain, const unsigned char *digest)
+{
+        if (!chain)
+                return NULL;
+
+        // Blocks are never freed while the chain exists, so the result outlives the snapshot
+        ChainSnapshot snapshot;
+        beginChainRead(chain, &snapshot);
+        Block *block = findSnapshotBlockByHash(&snapshot, digest);
+        endChainRead(&snapshot);
+        return block;
+}
+
+/**
+ * Checks whether a hash belongs to a block of this chain
+ * @param chain Pointer to the blockchain
+ * @param digest Raw hash to look for
+ * @return 1 if the chain contains the block, 0 otherwise
+ */
+int containsBlockHash(Blockchain *chain, const unsigned char *digest)
+{
+        return findBlockByHash(chain, digest) != NULL;
+}
+
+/**
+ * Checks whether a block's hex hash starts with the given nibbles
+ * @param block Block to check
+ * @param digits Nibbles of the prefix
+ * @param length Number of nibbles
+ * @return 1 if the hash matches, 0 otherwise
+ */
+int matchesHashPrefix(const Block *block, const unsigned char *digits, int length)
+{
+        for (int d = 0; d < length; d++)
+        {
+                unsigned char nibble = d % 2 ? block->hash[d / 2] & 0x0f : block->hash[d / 2] >> 4;
+                if (nibble != digits[d])
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Finds blocks whose hex hash starts with a prefix
+ * Hashes sharing a prefix have neighbouring home slots, so only the
+ * probe runs starting in that range are scanned. A prefix at least as
+ * long as the table's address bits is a single probe.
+ * @param chain Pointer to the blockchain
+ * @param prefix Hex prefix of the hash (1 to 64 characters)
+ * @param result Receives the first matching block, or NULL
+ * @return Number of matching blocks (more than 1 means the prefix is ambiguous)
+ */
+int findBlockByHashPrefix(Blockchain *chain, const char *prefix, Block **result)
+{
+        unsigned char digits[HASH_SIZE];
+        int length = (int)strlen(prefix);
+        unsigned long long tag = 0;
+
+        *result = NULL;
+        if (!chain || length == 0 || length > HASH_SIZE)
+                return 0;
+
+        // Parse the prefix into nibbles and the matching tag bits
+        for (int i = 0; i < length; i++)
+        {
+                char c = prefix[i];
+                if (c >= '0' && c <= '9')
+                        digits[i] = (unsigned char)(c - '0');
+                else if (c >= 'a' && c <= 'f')
+                        digits[i] = (unsigned char)(c - 'a' + 10);
+                else if (c >= 'A' && c <= 'F')
+                        digits[i] = (unsigned char)(c - 'A' + 10);
+                else
+                        return 0;
+                if (i < 16)
+                        tag |= (unsigned long long)digits[i] << (60 - 4 * i);
+        }
+
+        ChainSnapshot snapshot;
+        beginChainRead(chain, &snapshot);
+
+        // The open tip is not in the table
+        int matches = 0;
+        if (snapshot.length > snapshot.sealed_length)
+        {
+                Block *tip = getSnapshotBlock(&snapshot, snapshot.length - 1);
+                if (matchesHashPrefix(tip, digits, length))
+                {
+                        *result = tip;
+                        matches++;
+                }
+        }
+
+        const HashSlotArray *array = snapshot.hash_slots;
+        if (array)
+        {
+                // Range of home slots [low, high) that hashes with this prefix map to
+                int prefix_bits = length < 16 ? 4 * length : 64;
+                long long low = getHashHome(array, tag);
+                long long high = prefix_bits >= array->bits ? low + 1 : low + (1LL << (array->bits - prefix_bits));
+
+                int mask = array->capacity - 1;
+                for (long long i = low; i - low < array->capacity; i++)
+                {
+                        const HashSlot *slot = &array->slots[i & mask];
+                        int stored = atomic_load_explicit(&slot->block_index, memory_order_acquire);
+                        if (!stored)
+                        {
+                                if (i >= high)
+                                        break;
+                                continue;
+                        }
+                        if (stored > snapshot.sealed_length)
+                                continue;
+
+                        Block *block = getSnapshotBlock(&snapshot, stored - 1);
+                        if (matchesHashPrefix(block, digits, length))
+                        {
+                                if (!*result)
+                                        *result = block;
+                                matches++;
+                        }
+                }
+        }
+
+        endChainRead(&snapshot);
+        return matches;
+}
+
+/**
+ * Frees the hash lookup table
+ * @param table Table to free
+ */
+void freeBlockHashTable(BlockHashTable *table)
+{
+        free(atomic_load(&table->array));
+        atomic_store(&table->array, NULL);
+        table->count = 0;
+}
+
+/**
+ * Gets the size class of a transaction array
+ * @param capacity Number of transactions the array must hold
+ * @return Smallest class whose capacity (1 << class) is at least capacity
+ */
+int getPoolClass(int capacity)
+{
+        int size_class = 0;
+        while ((1 << size_class) < capacity)
+                size_class++;
+        return size_class;
+}
+
+/**
+ * Carves raw storage out of the pool's slabs
+ * Storage is bump-allocated from the newest slab; a new slab is started
+ * when it is full, and requests larger than a slab get a slab of their own.
+ * @param pool Pool to allocate from
+ * @param bytes Number of bytes needed
+ * @return Pointer to the storage or NULL if allocation fails
+ */
+void *allocateFromSlab(TransactionPool *pool, size_t bytes)
+{
+        // Keep every allocation aligned for Transaction
+        bytes = (bytes + POOL_ALIGNMENT - 1) & ~(size_t)(POOL_ALIGNMENT - 1);
+
+        PoolSlab *slab = pool->slabs;
+        if (!slab || slab->size - slab->used < bytes)
+        {
+                size_t size = bytes > POOL_SLAB_SIZE ? bytes : POOL_SLAB_SIZE;
+                slab = (PoolSlab *)malloc(sizeof(PoolSlab) + size);
+                if (!slab)
+                        return NULL;
+                slab->size = size;
+                slab->used = 0;
+
+                // An oversized slab is full at once, so keep bump allocating from the current one
+                if (bytes > POOL_SLAB_SIZE && pool->slabs)
+                {
+                        slab->next = pool->slabs->next;
+                        pool->slabs->next = slab;
+                }
+                else
+                {
+                        slab->next = pool->slabs;
+                        pool->slabs = slab;
+                }
+        }
+
+        void *storage = slab->data + slab->used;
+        slab->used += bytes;
+        pool->bytes_reserved += bytes;
+        return storage;
+}
+
+/**
+ * Allocates a growable transaction array from a size class
+ * Recycled arrays of the same class are reused before new slab space.
+ * @param pool Pool to allocate from
+ * @param size_class Size class; the array holds 1 << size_class transactions
+ * @return Pointer to the array or NULL if allocation fails
+ */
+Transaction *allocateTransactionClass(TransactionPool *pool, int size_class)
+{
+        PoolFreeNode *node = pool->free_lists[size_class];
+        if (node)
+        {
+                pool->free_lists[size_class] = node->next;
+                return (Transaction *)node;
+        }
+
+        return (Transaction *)allocateFromSlab(pool, ((size_t)1 << size_class) * sizeof(Transaction));
+}
+
+/**
+ * Returns an outgrown transaction array to the pool for reuse
+ * Arrays whose capacity is a power of two fit their size class exactly
+ * and are recycled; other exactly sized arrays stay in their slab until
+ * the chain is freed.
+ * @param pool Pool the array came from
+ * @param transactions Array to recycle
+ * @param capacity Number of transactions the array holds
+ */
+void recycleTransactions(TransactionPool *pool, Transaction *transactions, int capacity)
+{
+        if (capacity <= 0 || (capacity & (capacity - 1)) != 0)
+                return;
+
+        int size_class = getPoolClass(capacity);
+        PoolFreeNode *node = (PoolFreeNode *)transactions;
+        node->next = pool->free_lists[size_class];
+        pool->free_lists[size_class] = node;
+}
+
+/**
+ * Allocates an exactly sized transaction array for a sealed block
+ * @param pool Pool to allocate from
+ * @param count Number of transactions
+ * @return Pointer to the array, NULL if count is 0 or allocation fails
+ */
+Transaction *allocateTransactions(TransactionPool *pool, int count)
+{
+        if (count == 0)
+                return NULL;
+        return (Transaction *)allocateFromSlab(pool, (size_t)count * sizeof(Transaction));
+}
+
+/**
+ * Makes room for one more transaction in an open block
+ * The array doubles through the pool's size classes, and the outgrown
+ * array is recycled for other blocks.
+ * @param block Block to grow
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reserveTransaction(Block *block)
+{
+        if (block->transaction_count < block->transaction_capacity)
+                return 1;
+
+        TransactionPool *pool = &block->chain->pool;
+        int size_class = getPoolClass(block->transaction_count + 1);
+        if (size_class >= POOL_SIZE_CLASSES)
+                return 0;
+
+        Transaction *transactions = allocateTransactionClass(pool, size_class);
+        if (!transactions)
+                return 0;
+
+        if (block->transaction_count > 0)
+                memcpy(transactions, block->transactions, (size_t)block->transaction_count * sizeof(Transaction));
+        recycleTransactions(pool, block->transactions, block->transaction_capacity);
+
+        block->transactions = transactions;
+        block->transaction_capacity = 1 << size_class;
+        return 1;
+}
+
+/**
+ * Shrinks a sealed block's transactions to an exactly sized array
+ * so long-lived blocks do not keep the slack left by doubling
+ * @param block Block that has just been sealed
+ */
+void compactTransactions(Block *block)
+{
+        if (block->transaction_capacity == block->transaction_count || block->transaction_capacity == 0)
+                return;
+
+        TransactionPool *pool = &block->chain->pool;
+        Transaction *transactions = allocateTransactions(pool, block->transaction_count);
+        if (block->transaction_count > 0 && !transactions)
+                return;
+
+        if (block->transaction_count > 0)
+                memcpy(transactions, block->transactions, (size_t)block->transaction_count * sizeof(Transaction));
+        recycleTransactions(pool, block->transactions, block->transaction_capacity);
+        block->transactions = transactions;
+        block->transaction_capacity = block->transaction_count;
+}
+
+/**
+ * Releases every slab of a pool in one pass
+ * @param pool Pool to release
+ */
+void freeTransactionPool(TransactionPool *pool)
+{
+        PoolSlab *slab = pool->slabs;
+        while (slab)
+        {
+                PoolSlab *next = slab->next;
+                free(slab);
+                slab = next;
+        }
+        memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Writes an unsigned integer in little-endian byte order
+ * @param dst Destination buffer
+ * @param value Value to encode
+ * @param width Number of bytes to write
+ * @return Pointer just past the encoded bytes
+ */
+unsigned char *encodeInteger(unsigned char *dst, unsigned long long value, int width)
+{
+        for (int i = 0; i < width; i++)
+        {
+                dst[i] = (unsigned char)(value >> (8 * i));
+        }
+        return dst + width;
+}
+
+/**
+ * Writes a string into a zero-padded fixed-width field
+ * @param dst Destination buffer
+ * @param src String to encode (may be unterminated if it fills the field)
+ * @param width Width of the field in bytes
+ * @return Pointer just past the field
+ */
+unsigned char *encodeFixedString(unsigned char *dst, const char *src, size_t width)
+{
+        size_t len = strnlen(src, width);
+        memcpy(dst, src, len);
+        memset(dst + len, 0, width - len);
+        return dst + width;
+}
+
+/**
+ * Writes the canonical encoding of a transaction
+ * @param trans Transaction to encode
+ * @param dst Buffer of at least ENCODED_TRANSACTION_SIZE bytes
+ */
+void encodeTransaction(const Transaction *trans, unsigned char *dst)
+{
+        unsigned long long amount_bits;
+        memcpy(&amount_bits, &trans->amount, sizeof(amount_bits));
+
+        dst = encodeInteger(dst, trans->sender_id, 4);
+        dst = encodeInteger(dst, trans->receiver_id, 4);
+        dst = encodeInteger(dst, amount_bits, 8);
+        encodeInteger(dst, (unsigned long long)trans->timestamp, 8);
+}
+
+/**
+ * Writes the canonical encoding of a block header
+ * Work headers end with the difficulty and then the nonce.
+ * @param block Block to encode
+ * @param dst Buffer of at least ENCODED_WORK_HEADER_SIZE bytes
+ * @return Number of bytes written
+ */
+size_t encodeBlockHeader(const Block *block, unsigned char *dst)
+{
+        dst = encodeInteger(dst, (unsigned long long)(long long)block->index, 8);
+        dst = encodeInteger(dst, (unsigned long long)block->timestamp, 8);
+        dst = encodeFixedString(dst, block->data, MAX_DATA_SIZE);
+        memcpy(dst, block->previous_hash, DIGEST_SIZE);
+        dst += DIGEST_SIZE;
+        memcpy(dst, block->merkle_root, DIGEST_SIZE);
+        dst += DIGEST_SIZE;
+        dst = encodeInteger(dst, (unsigned long long)block->transaction_count, 4);
+        if (block->hash_mode != HASH_MODE_WORK)
+                return ENCODED_HEADER_SIZE;
+
+        dst = encodeInteger(dst, (unsigned long long)block->difficulty, 4);
+        encodeInteger(dst, block->nonce, 8);
+        return ENCODED_WORK_HEADER_SIZE;
+}
+
+/**
+ * Calculates the SHA-256 hash of a block using the hash mode it was sealed with
+ * @param block Block to be hashed
+ * @param output Buffer of DIGEST_SIZE bytes to store the resulting hash
+ */
+void calculateHash(Block *block, unsigned char *output)
+{
+        if (block->hash_mode == HASH_MODE_LEGACY)
+                calculateLegacyHash(block, output);
+        else
+                calculateCanonicalHash(block, output);
+}
+
+/**
+ * Calculates SHA-256 hash over the canonical binary encoding of a block header
+ * Transactions are covered through the Merkle root stored in the header,
+ * which must be up to date before calling this.
+ * @param block Block to be hashed
+ * @param output Buffer of DIGEST_SIZE bytes to store the resulting hash
+ */
+void calculateCanonicalHash(Block *block, unsigned char *output)
+{
+        unsigned char header[ENCODED_WORK_HEADER_SIZE];
+        SHA256_CTX sha256;
+
+        SHA256_Init(&sha256);
+        size_t length = encodeBlockHeader(block, header);
+        SHA256_Update(&sha256, header, length);
+        SHA256_Final(output, &sha256);
+}
+
+/**
+ * Calculates SHA-256 hash for a block using the original string encoding
+ * Only used to verify blocks loaded from files written before the
+ * canonical binary encoding existed.
+ * @param block Block to be hashed
+ * @param output Buffer of DIGEST_SIZE bytes to store the resulting hash
+ */
+void calculateLegacyHash(Block *block, unsigned char *output)
+{
+        // Create a string representation of the block data
+        char input[INPUT_BUFFER_SIZE];
+        char trans_data[INPUT_BUFFER_SIZE / 2] = "";
+        char previous_hash[HASH_SIZE + 1] = "0";
+        SHA256_CTX sha256;
+
+        // Create transaction string for hashing
+        const AccountDictionary *accounts = &block->chain->accounts;
+        for (int i = 0; i < block->transaction_count; i++)
+        {
+                char trans_str[TRANS_STR_SIZE];
+                snprintf(trans_str, TRANS_STR_SIZE, "%s%s%.2f",
+                         getAccountName(accounts, block->transactions[i].sender_id),
+                         getAccountName(accounts, block->transactions[i].receiver_id),
+                         block->transactions[i].amount);
+                if (strlen(trans_data) + strlen(trans_str) < sizeof(trans_data) - 1)
+                {
+                        strcat(trans_data, trans_str);
+                }
+        }
+
+        // The legacy genesis block stored "0" rather than a full hash
+        static const unsigned char zero_digest[DIGEST_SIZE];
+        if (memcmp(block->previous_hash, zero_digest, DIGEST_SIZE) != 0)
+        {
+                digestToHex(block->previous_hash, previous_hash);
+        }
+
+        // Combine all block data including transactions for hashing
+        snprintf(input, sizeof(input), "%d%ld%s%s%s",
+                 block->index, block->timestamp, block->data,
+                 previous_hash, trans_data);
+
+        // Calculate SHA-256 hash
+        SHA256_Init(&sha256);
+        SHA256_Update(&sha256, input, strlen(input));
+        SHA256_Final(output, &sha256);
+}
+
+/**
+ * Converts a raw digest to a hex string for display
+ * @param digest Raw digest of DIGEST_SIZE bytes
+ * @param output Buffer of at least HASH_SIZE + 1 characters
+ */
+void digestToHex(const unsigned char *digest, char *output)
+{
+        static const char hex_digits[] = "0123456789abcdef";
+
+        for (int i = 0; i < DIGEST_SIZE; i++)
+        {
+                output[i * 2] = hex_digits[digest[i] >> 4];
+                output[i * 2 + 1] = hex_digits[digest[i] & 0x0f];
+        }
+        output[HASH_SIZE] = '\0';
+}
+
+/**
+ * Parses a hex string into a raw digest
+ * The single character "0" used by legacy genesis blocks maps to an all-zero digest.
+ * @param hex Hex string to parse
+ * @param digest Buffer of DIGEST_SIZE bytes for the result
+ * @return 1 if successful, 0 if the string is not a valid hash
+ */
+int hexToDigest(const char *hex, unsigned char *digest)
+{
+        if (strcmp(hex, "0") == 0)
+        {
+                memset(digest, 0, DIGEST_SIZE);
+                return 1;
+        }
+
+        if (strlen(hex) != HASH_SIZE)
+                return 0;
+
+        for (int i = 0; i < HASH_SIZE; i++)
+        {
+                char c = hex[i];
+                int value;
+                if (c >= '0' && c <= '9')
+                        value = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                        value = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                        value = c - 'A' + 10;
+                else
+                        return 0;
+
+                if (i % 2 == 0)
+                        digest[i / 2] = (unsigned char)(value << 4);
+                else
+                        digest[i / 2] |= (unsigned char)value;
+        }
+        return 1;
+}
+
+/**
+ * Reads a big-endian 32-bit word
+ * @param p Pointer to four bytes
+ * @return Decoded word
+ */
+unsigned int loadBigEndian32(const unsigned char *p)
+{
+        return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+               ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+/**
+ * Compresses one 64-byte block per lane with the portable C kernel
+ * @param states Per-lane hash states
+ * @param blocks Per-lane pointers to the 64-byte block to absorb
+ * @param lanes Number of lanes
+ */
+void sha256CompressPortable(unsigned int (*states)[8], const unsigned char *const *blocks, int lanes)
+{
+        for (int lane = 0; lane < lanes; lane++)
+        {
+                unsigned int *state = states[lane];
+                unsigned int w[64];
+                for (int t = 0; t < 16; t++)
+                        w[t] = loadBigEndian32(blocks[lane] + 4 * t);
+                for (int t = 16; t < 64; t++)
+                {
+                        unsigned int s0 = ROTR32(w[t - 15], 7) ^ ROTR32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+                        unsigned int s1 = ROTR32(w[t - 2], 17) ^ ROTR32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+                        w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+                }
+
+                unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+                unsigned int e = state[4], f = state[5], g = state[6], h = state[7];
+                for (int t = 0; t < 64; t++)
+                {
+                        unsigned int s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+                        unsigned int ch = (e & f) ^ (~e & g);
+                        unsigned int temp1 = h + s1 + ch + SHA256_K[t] + w[t];
+                        unsigned int s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+                        unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+                        unsigned int temp2 = s0 + maj;
+                        h = g;
+                        g = f;
+                        f = e;
+                        e = d + temp1;
+                        d = c;
+                        c = b;
+                        b = a;
+                        a = temp1 + temp2;
+                }
+
+                state[0] += a;
+                state[1] += b;
+                state[2] += c;
+                state[3] += d;
+                state[4] += e;
+                state[5] += f;
+                state[6] += g;
+                state[7] += h;
+        }
+}
+
+#ifdef SHA256_X86
+/**
+ * Compresses one 64-byte block in each of two lanes with the SHA-NI
+ * instructions. The two message streams are interleaved so one lane's
+ * rounds run while the other's are still in flight.
+ * @param states Per-lane hash states
+ * @param blocks Per-lane pointers to the 64-byte block to absorb
+ * @param lanes Number of lanes (1 or 2)
+ */
+__attribute__((target("sha,sse4.1"))) void sha256CompressShaNi(unsigned int (*states)[8], const unsigned char *const *blocks, int lanes)
+{
+        const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i abef[2], cdgh[2], abef_save[2], cdgh_save[2], msg[2][4];
+
+        for (int lane = 0; lane < lanes; lane++)
+        {
+                // Rearrange the state into the ABEF/CDGH layout the instructions use
+                __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&states[lane][0]), 0xB1);
+                __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&states[lane][4]), 0x1B);
+                abef[lane] = _mm_alignr_epi8(tmp, efgh, 8);
+                cdgh[lane] = _mm_blend_epi16(efgh, tmp, 0xF0);
+                abef_save[lane] = abef[lane];
+                cdgh_save[lane] = cdgh[lane];
+                for (int i = 0; i < 4; i++)
+                        msg[lane][i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks[lane] + 16 * i)), byte_swap);
+        }
+
+        // Sixteen groups of four rounds; the schedule is kept in a ring of four words
+        for (int group = 0; group < 16; group++)
+        {
+                __m128i k = _mm_loadu_si128((const __m128i *)&SHA256_K[4 * group]);
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                        __m128i *w = msg[lane];
+                        __m128i wk = _mm_add_epi32(w[group & 3], k);
+                        cdgh[lane] = _mm_sha256rnds2_epu32(cdgh[lane], abef[lane], wk);
+                        abef[lane] = _mm_sha256rnds2_epu32(abef[lane], cdgh[lane], _mm_shuffle_epi32(wk, 0x0E));
+
+                        if (group < 12)
+                        {
+                                __m128i next = _mm_sha256msg1_epu32(w[group & 3], w[(group + 1) & 3]);
+                                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(group + 3) & 3], w[(group + 2) & 3], 4));
+                                w[group & 3] = _mm_sha256msg2_epu32(next, w[(group + 3) & 3]);
+                        }
+                }
+        }
+
+        for (int lane = 0; lane < lanes; lane++)
+        {
+                __m128i a = _mm_add_epi32(abef[lane], abef_save[lane]);
+                __m128i c = _mm_add_epi32(cdgh[lane], cdgh_save[lane]);
+                __m128i feba = _mm_shuffle_epi32(a, 0x1B);
+                __m128i dchg = _mm_shuffle_epi32(c, 0xB1);
+                _mm_storeu_si128((__m128i *)&states[lane][0], _mm_blend_epi16(feba, dchg, 0xF0));
+                _mm_storeu_si128((__m128i *)&states[lane][4], _mm_alignr_epi8(dchg, feba, 8));
+        }
+}
+
+// Eight-lane helpers: each vector holds the same word for eight messages
+#define AVX2_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * Compresses one 64-byte block in each of up to eight lanes with AVX2,
+ * running the eight message schedules and round functions side by side
+ * @param states Per-lane hash states
+ * @param blocks Per-lane pointers to the 64-byte block to absorb
+ * @param lanes Number of lanes (at most 8)
+ */
+__attribute__((target("avx2"))) void sha256CompressAvx2(unsigned int (*states)[8], const unsigned char *const *blocks, int lanes)
+{
+        unsigned int transposed[16][8] __attribute__((aligned(32)));
+        __m256i w[64];
+        __m256i s[8];
+
+        // Gather word t of every lane into one vector (missing lanes repeat lane 0)
+        for (int t = 0; t < 16; t++)
+        {
+                for (int lane = 0; lane < 8; lane++)
+                        transposed[t][lane] = loadBigEndian32(blocks[lane < lanes ? lane : 0] + 4 * t);
+                w[t] = _mm256_load_si256((const __m256i *)transposed[t]);
+        }
+        for (int i = 0; i < 8; i++)
+        {
+                for (int lane = 0; lane < 8; lane++)
+                        transposed[i][lane] = states[lane < lanes ? lane : 0][i];
+                s[i] = _mm256_load_si256((const __m256i *)transposed[i]);
+        }
+
+        for (int t = 16; t < 64; t++)
+        {
+                __m256i w15 = w[t - 15], w2 = w[t - 2];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(w15, 7), AVX2_ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(w2, 17), AVX2_ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+                w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0), _mm256_add_epi32(w[t - 7], s1));
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; t++)
+        {
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(e, 6), AVX2_ROTR(e, 11)), AVX2_ROTR(e, 25));
+                __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+                __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(h, s1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int)SHA256_K[t]), w[t])));
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(a, 2), AVX2_ROTR(a, 13)), AVX2_ROTR(a, 22));
+                __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c));
+                h = g;
+                g = f;
+                f = e;
+                e = _mm256_add_epi32(d, temp1);
+                d = c;
+                c = b;
+                b = a;
+                a = _mm256_add_epi32(temp1, _mm256_add_epi32(s0, maj));
+        }
+
+        s[0] = _mm256_add_epi32(s[0], a);
+        s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c);
+        s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e);
+        s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g);
+        s[7] = _mm256_add_epi32(s[7], h);
+
+        for (int i = 0; i < 8; i++)
+        {
+                _mm256_store_si256((__m256i *)transposed[i], s[i]);
+                for (int lane = 0; lane < lanes; lane++)
+                        states[lane][i] = transposed[i][lane];
+        }
+}
+#endif
+
+/**
+ * Detects the fastest SHA-256 kernel this CPU supports
+ * @return One of the SHA256_BACKEND_* constants
+ */
+int detectSha256Backend(void)
+{
+#ifdef SHA256_X86
+        unsigned int eax, ebx, ecx, edx;
+        __builtin_cpu_init();
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) &&
+            __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+                return SHA256_BACKEND_SHANI;
+        if (__builtin_cpu_supports("avx2"))
+                return SHA256_BACKEND_AVX2;
+#endif
+        return SHA256_BACKEND_PORTABLE;
+}
+
+// Selected kernel; -1 until first use
+atomic_int sha256_backend = -1;
+
+/**
+ * Gets the SHA-256 kernel used by sha256Batch, detecting it on first use
+ * @return One of the SHA256_BACKEND_* constants
+ */
+int getSha256Backend(void)
+{
+        int backend = atomic_load(&sha256_backend);
+        if (backend < 0)
+        {
+                backend = detectSha256Backend();
+                atomic_store(&sha256_backend, backend);
+        }
+        return backend;
+}
+
+/**
+ * Overrides the SHA-256 kernel, e.g. to compare kernels in a benchmark
+ * @param backend One of the SHA256_BACKEND_* constants
+ * @return 1 if the CPU supports the kernel, 0 if it was left unchanged
+ */
+int setSha256Backend(int backend)
+{
+        int supported = backend == SHA256_BACKEND_PORTABLE || backend == detectSha256Backend();
+#ifdef SHA256_X86
+        if (backend == SHA256_BACKEND_AVX2 && __builtin_cpu_supports("avx2"))
+                supported = 1;
+#endif
+        if (supported)
+                atomic_store(&sha256_backend, backend);
+        return supported;
+}
+
+/**
+ * Gets a printable name for a SHA-256 kernel
+ * @param backend One of the SHA256_BACKEND_* constants
+ * @return Name of the kernel
+ */
+const char *sha256BackendName(int backend)
+{
+        switch (backend)
+        {
+        case SHA256_BACKEND_SHANI:
+                return "sha-ni";
+        case SHA256_BACKEND_AVX2:
+                return "avx2";
+        default:
+                return "portable";
+        }
+}
+
+/**
+ * Gets the compression kernel of the selected SHA-256 backend
+ * @param compress Receives the kernel
+ * @return Number of messages the kernel compresses at once
+ */
+int getSha256Kernel(Sha256Compress *compress)
+{
+        *compress = sha256CompressPortable;
+#ifdef SHA256_X86
+        switch (getSha256Backend())
+        {
+        case SHA256_BACKEND_SHANI:
+                *compress = sha256CompressShaNi;
+                return 2;
+        case SHA256_BACKEND_AVX2:
+                *compress = sha256CompressAvx2;
+                return SHA256_MAX_LANES;
+        }
+#endif
+        return 1;
+}
+
+/**
+ * Writes a SHA-256 state out as a big-endian digest
+ * @param state Final state
+ * @param digest Buffer of DIGEST_SIZE bytes
+ */
+void storeSha256Digest(const unsigned int *state, unsigned char *digest)
+{
+        for (int i = 0; i < 8; i++)
+        {
+                digest[4 * i] = (unsigned char)(state[i] >> 24);
+                digest[4 * i + 1] = (unsigned char)(state[i] >> 16);
+                digest[4 * i + 2] = (unsigned char)(state[i] >> 8);
+                digest[4 * i + 3] = (unsigned char)state[i];
+        }
+}
+
+/**
+ * Hashes many independent messages in one call
+ * Messages are processed in groups as wide as the selected kernel (8 for
+ * AVX2, 2 for SHA-NI, 1 for the portable kernel). Lanes whose message has
+ * fewer blocks than the longest one in the group keep their finished
+ * digest while the others continue.
+ * @param messages Pointers to the messages
+ * @param lengths Length of each message in bytes
+ * @param count Number of messages
+ * @param digests Output array of count digests
+ */
+void sha256Batch(const unsigned char *const *messages, const size_t *lengths, int count, unsigned char (*digests)[DIGEST_SIZE])
+{
+        static const unsigned char idle_block[SHA256_BLOCK_SIZE];
+
+        Sha256Compress compress;
+        int width = getSha256Kernel(&compress);
+
+        for (int first = 0; first < count; first += width)
+        {
+                int lanes = count - first < width ? count - first : width;
+                unsigned int states[SHA256_MAX_LANES][8];
+                unsigned char tails[SHA256_MAX_LANES][2 * SHA256_BLOCK_SIZE];
+                size_t full_blocks[SHA256_MAX_LANES];
+                size_t total_blocks[SHA256_MAX_LANES];
+                size_t max_blocks = 0;
+
+                // Build the padded tail (last partial block, 0x80, bit length) of each message
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                        size_t length = lengths[first + lane];
+                        size_t remainder = length % SHA256_BLOCK_SIZE;
+                        size_t tail_size = remainder + 9 <= SHA256_BLOCK_SIZE ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+                        unsigned long long bits = (unsigned long long)length * 8;
+
+                        memcpy(states[lane], SHA256_INITIAL_STATE, sizeof(SHA256_INITIAL_STATE));
+                        full_blocks[lane] = length / SHA256_BLOCK_SIZE;
+                        total_blocks[lane] = full_blocks[lane] + tail_size / SHA256_BLOCK_SIZE;
+                        memcpy(tails[lane], messages[first + lane] + length - remainder, remainder);
+                        tails[lane][remainder] = 0x80;
+                        memset(tails[lane] + remainder + 1, 0, tail_size - remainder - 1);
+                        for (int i = 0; i < 8; i++)
+                                tails[lane][tail_size - 1 - i] = (unsigned char)(bits >> (8 * i));
+
+                        if (total_blocks[lane] > max_blocks)
+                                max_blocks = total_blocks[lane];
+                }
+
+                for (size_t block = 0; block < max_blocks; block++)
+                {
+                        unsigned int scratch[SHA256_MAX_LANES][8];
+                        unsigned int (*lane_states)[8] = states;
+                        const unsigned char *inputs[SHA256_MAX_LANES];
+                        int finished = 0;
+
+                        for (int lane = 0; lane < lanes; lane++)
+                        {
+                                if (block < full_blocks[lane])
+                                        inputs[lane] = messages[first + lane] + block * SHA256_BLOCK_SIZE;
+                                else if (block < total_blocks[lane])
+                                        inputs[lane] = tails[lane] + (block - full_blocks[lane]) * SHA256_BLOCK_SIZE;
+                                else
+                                {
+                                        inputs[lane] = idle_block;
+                                        finished = 1;
+                                }
+                        }
+
+                        // Finished lanes run on a scratch copy so their state is left intact
+                        if (finished)
+                        {
+                                memcpy(scratch, states, sizeof(scratch[0]) * lanes);
+                                lane_states = scratch;
+                        }
+                        compress(lane_states, inputs, lanes);
+                        if (finished)
+                        {
+                                for (int lane = 0; lane < lanes; lane++)
+                                {
+                                        if (block < total_blocks[lane])
+                                                memcpy(states[lane], scratch[lane], sizeof(states[lane]));
+                                }
+                        }
+                }
+
+                for (int lane = 0; lane < lanes; lane++)
+                        storeSha256Digest(states[lane], digests[first + lane]);
+        }
+}
+
+/**
+ * Absorbs the whole 64-byte blocks of a message prefix
+ * Messages sharing the prefix can then be finished with sha256FinishBatch
+ * without hashing the prefix again.
+ * @param prefix Start of the message
+ * @param length Length of the prefix; only its whole blocks are absorbed
+ * @param midstate Receives the state and the number of bytes absorbed
+ */
+void sha256Midstate(const unsigned char *prefix, size_t length, Sha256Midstate *midstate)
+{
+        memcpy(midstate->state, SHA256_INITIAL_STATE, sizeof(SHA256_INITIAL_STATE));
+        midstate->length = 0;
+        for (; midstate->length + SHA256_BLOCK_SIZE <= length; midstate->length += SHA256_BLOCK_SIZE)
+        {
+                const unsigned char *block = prefix + midstate->length;
+                sha256CompressPortable(&midstate->state, &block, 1);
+        }
+}
+
+/**
+ * Hashes several messages that share a midstate and differ only in a
+ * suffix of the same length. Only the suffix and padding are compressed,
+ * several messages at a time on the selected SHA-256 kernel.
+ * @param midstate State after the shared prefix
+ * @param suffixes Bytes of each message after the prefix absorbed by midstate
+ * @param length Length of every suffix
+ * @param count Number of messages
+ * @param digests Output array of count digests
+ */
+void sha256FinishBatch(const Sha256Midstate *midstate, const unsigned char *const *suffixes, size_t length, int count, unsigned char (*digests)[DIGEST_SIZE])
+{
+        Sha256Compress compress;
+        int width = getSha256Kernel(&compress);
+
+        size_t remainder = length % SHA256_BLOCK_SIZE;
+        size_t tail_size = remainder + 9 <= SHA256_BLOCK_SIZE ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+        size_t full_blocks = length / SHA256_BLOCK_SIZE;
+        size_t total_blocks = full_blocks + tail_size / SHA256_BLOCK_SIZE;
+        unsigned long long bits = (midstate->length + length) * 8;
+
+        for (int first = 0; first < count; first += width)
+        {
+                int lanes = count - first < width ? count - first : width;
+                unsigned int states[SHA256_MAX_LANES][8];
+                unsigned char tails[SHA256_MAX_LANES][2 * SHA256_BLOCK_SIZE];
+
+                // Every lane has the same length, so they all finish together
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                        memcpy(states[lane], midstate->state, sizeof(midstate->state));
+                        memcpy(tails[lane], suffixes[first + lane] + length - remainder, remainder);
+                        tails[lane][remainder] = 0x80;
+                        memset(tails[lane] + remainder + 1, 0, tail_size - remainder - 1);
+                        for (int i = 0; i < 8; i++)
+                                tails[lane][tail_size - 1 - i] = (unsigned char)(bits >> (8 * i));
+                }
+
+                for (size_t block = 0; block < total_blocks; block++)
+                {
+                        const unsigned char *inputs[SHA256_MAX_LANES];
+                        for (int lane = 0; lane < lanes; lane++)
+                        {
+                                if (block < full_blocks)
+                                        inputs[lane] = suffixes[first + lane] + block * SHA256_BLOCK_SIZE;
+                                else
+                                        inputs[lane] = tails[lane] + (block - full_blocks) * SHA256_BLOCK_SIZE;
+                        }
+                        compress(states, inputs, lanes);
+                }
+
+                for (int lane = 0; lane < lanes; lane++)
+                        storeSha256Digest(states[lane], digests[first + lane]);
+        }
+}
+
+/**
+ * Writes the input hashed for a Merkle leaf: 0x00, the canonical
+ * transaction encoding, then the sender and receiver names, each
+ * prefixed by its length
+ * The names tie the account IDs to the dictionary saved with the chain,
+ * which no hash would cover otherwise.
+ * @param accounts Dictionary the transaction's account IDs refer to
+ * @param trans Transaction to encode
+ * @param dst Buffer of at least MERKLE_MAX_LEAF_SIZE bytes
+ * @return Number of bytes written
+ */
+size_t encodeMerkleLeaf(const AccountDictionary *accounts, const Transaction *trans, unsigned char *dst)
+{
+        unsigned char *start = dst;
+        *dst++ = MERKLE_LEAF_PREFIX;
+        encodeTransaction(trans, dst);
+        dst += ENCODED_TRANSACTION_SIZE;
+
+        const char *names[2] = {getAccountName(accounts, trans->sender_id), getAccountName(accounts, trans->receiver_id)};
+        for (int i = 0; i < 2; i++)
+        {
+                size_t length = strnlen(names[i], MAX_ACCOUNT_NAME_SIZE - 1);
+                *dst++ = (unsigned char)length;
+                memcpy(dst, names[i], length);
+                dst += length;
+        }
+        return (size_t)(dst - start);
+}
+
+/**
+ * Hashes the leaves of a Merkle tree
+ * Each leaf is the SHA-256 of encodeMerkleLeaf; leaves are hashed
+ * HASH_BATCH_SIZE at a time with sha256Batch.
+ * @param accounts Dictionary the transactions' account IDs refer to
+ * @param transactions Transactions to hash
+ * @param count Number of transactions
+ * @param leaves Output array of count digests
+ */
+void hashMerkleLeaves(const AccountDictionary *accounts, const Transaction *transactions, int count,
+                      unsigned char (*leaves)[DIGEST_SIZE])
+{
+        unsigned char buffer[HASH_BATCH_SIZE][MERKLE_MAX_LEAF_SIZE];
+        const unsigned char *messages[HASH_BATCH_SIZE];
+        size_t lengths[HASH_BATCH_SIZE];
+
+        for (int first = 0; first < count; first += HASH_BATCH_SIZE)
+        {
+                int batch = count - first < HASH_BATCH_SIZE ? count - first : HASH_BATCH_SIZE;
+                for (int i = 0; i < batch; i++)
+                {
+                        lengths[i] = encodeMerkleLeaf(accounts, &transactions[first + i], buffer[i]);
+                        messages[i] = buffer[i];
+                }
+                sha256Batch(messages, lengths, batch, leaves + first);
+        }
+}
+
+/**
+ * Hashes two child nodes into their parent: SHA-256(0x01 || left || right)
+ * @param left Left child digest
+ * @param right Right child digest
+ * @param output Buffer of DIGEST_SIZE bytes for the parent digest
+ */
+void hashMerkleNode(const unsigned char *left, const unsigned char *right, unsigned char *output)
+{
+        unsigned char input[1 + 2 * DIGEST_SIZE];
+        input[0] = MERKLE_NODE_PREFIX;
+        memcpy(input + 1, left, DIGEST_SIZE);
+        memcpy(input + 1 + DIGEST_SIZE, right, DIGEST_SIZE);
+        SHA256(input, sizeof(input), output);
+}
+
+/**
+ * Reduces one level of a Merkle tree in place
+ * Nodes are paired left to right; an unpaired last node moves up unchanged.
+ * All pairs of a level are hashed together with sha256Batch.
+ * @param nodes Digests of the level, overwritten with the next level up
+ * @param count Number of nodes in the level
+ * @return Number of nodes in the next level
+ */
+int reduceMerkleLevel(unsigned char (*nodes)[DIGEST_SIZE], int count)
+{
+        unsigned char buffer[HASH_BATCH_SIZE][1 + 2 * DIGEST_SIZE];
+        const unsigned char *messages[HASH_BATCH_SIZE];
+        size_t lengths[HASH_BATCH_SIZE];
+        int pairs = count / 2;
+
+        for (int first = 0; first < pairs; first += HASH_BATCH_SIZE)
+        {
+                int batch = pairs - first < HASH_BATCH_SIZE ? pairs - first : HASH_BATCH_SIZE;
+                for (int i = 0; i < batch; i++)
+                {
+                        buffer[i][0] = MERKLE_NODE_PREFIX;
+                        memcpy(buffer[i] + 1, nodes[2 * (first + i)], 2 * DIGEST_SIZE);
+                        messages[i] = buffer[i];
+                        lengths[i] = sizeof(buffer[i]);
+                }
+                // Parents never overwrite children that are still to be read
+                sha256Batch(messages, lengths, batch, nodes + first);
+        }
+
+        if (count % 2)
+                memcpy(nodes[pairs], nodes[count - 1], DIGEST_SIZE);
+        return pairs + count % 2;
+}
+
+/**
+ * Computes the Merkle root of a list of transactions from scratch
+ * An empty list has an all-zero root.
+ * @param accounts Dictionary the transactions' account IDs refer to
+ * @param transactions Transactions to commit to
+ * @param count Number of transactions
+ * @param root Buffer of DIGEST_SIZE bytes for the root
+ * @return 1 if successful, 0 if memory could not be allocated
+ */
+int computeMerkleRoot(const AccountDictionary *accounts, const Transaction *transactions, int count, unsigned char *root)
+{
+        if (count == 0)
+        {
+                memset(root, 0, DIGEST_SIZE);
+                return 1;
+        }
+
+        // Small blocks are reduced on the stack
+        unsigned char stack_nodes[HASH_BATCH_SIZE][DIGEST_SIZE];
+        unsigned char (*nodes)[DIGEST_SIZE] = stack_nodes;
+        if (count > HASH_BATCH_SIZE)
+        {
+                nodes = (unsigned char (*)[DIGEST_SIZE])malloc((size_t)count * DIGEST_SIZE);
+                if (!nodes)
+                        return 0;
+        }
+
+        hashMerkleLeaves(accounts, transactions, count, nodes);
+        while (count > 1)
+                count = reduceMerkleLevel(nodes, count);
+
+        memcpy(root, nodes[0], DIGEST_SIZE);
+        if (nodes != stack_nodes)
+                free(nodes);
+        return 1;
+}
+
+/**
+ * Appends one leaf to a Merkle frontier
+ * Completed subtrees are merged upwards like a binary counter, so an
+ * append re-hashes at most one node per level.
+ * @param frontier Frontier to extend
+ * @param leaf Digest of the new leaf
+ */
+void appendMerkleLeaf(MerkleFrontier *frontier, const unsigned char *leaf)
+{
+        unsigned char carry[DIGEST_SIZE];
+        int level = 0;
+
+        memcpy(carry, leaf, DIGEST_SIZE);
+        while (frontier->count & (1u << level))
+        {
+                hashMerkleNode(frontier->nodes[level], carry, carry);
+                level++;
+        }
+        memcpy(frontier->nodes[level], carry, DIGEST_SIZE);
+        frontier->count++;
+}
+
+/**
+ * Computes the root of the tree held by a frontier
+ * Subtree roots are folded from the smallest (rightmost) to the largest,
+ * which touches at most one node per level.
+ * @param frontier Frontier to read
+ * @param root Buffer of DIGEST_SIZE bytes for the root
+ */
+void getMerkleFrontierRoot(const MerkleFrontier *frontier, unsigned char *root)
+{
+        int started = 0;
+
+        memset(root, 0, DIGEST_SIZE);
+        for (int level = 0; level < MERKLE_MAX_DEPTH; level++)
+        {
+                if (!(frontier->count & (1u << level)))
+                        continue;
+
+                if (started)
+                        hashMerkleNode(frontier->nodes[level], root, root);
+                else
+                        memcpy(root, frontier->nodes[level], DIGEST_SIZE);
+                started = 1;
+        }
+}
+
+/**
+ * Builds the Merkle frontier of a block from its current transactions
+ * Only needed the first time a transaction is appended to a block that
+ * was loaded from disk; afterwards the frontier is updated incrementally.
+ * @param block Block whose frontier to build
+ * @return 1 if successful, 0 if memory could not be allocated
+ */
+int buildMerkleFrontier(Block *block)
+{
+        MerkleFrontier *frontier = (MerkleFrontier *)calloc(1, sizeof(MerkleFrontier));
+        if (!frontier)
+                return 0;
+
+        unsigned char leaf[1][DIGEST_SIZE];
+        for (int i = 0; i < block->transaction_count; i++)
+        {
+                hashMerkleLeaves(&block->chain->accounts, &block->transactions[i], 1, leaf);
+                appendMerkleLeaf(frontier, leaf[0]);
+        }
+
+        block->frontier = frontier;
+        return 1;
+}
+
+/**
+ * Builds an inclusion proof for one transaction of a block
+ * @param block Block containing the transaction
+ * @param tx_index Position of the transaction in the block
+ * @param proof Proof to fill
+ * @return 1 if successful, 0 if the index is out of range or memory could not be allocated
+ */
+int buildMerkleProof(Block *block, int tx_index, MerkleProof *proof)
+{
+        int count = block->transaction_count;
+        Transaction *transactions = getBlockTransactions(block);
+        if (tx_index < 0 || tx_index >= count || !transactions)
+                return 0;
+
+        unsigned char (*nodes)[DIGEST_SIZE] = (unsigned char (*)[DIGEST_SIZE])malloc((size_t)count * DIGEST_SIZE);
+        if (!nodes)
+                return 0;
+
+        proof->tx_index = tx_index;
+        proof->tx_count = count;
+        proof->length = 0;
+
+        // Record the sibling at each level while reducing the tree
+        hashMerkleLeaves(&block->chain->accounts, transactions, count, nodes);
+        for (int index = tx_index; count > 1; index /= 2)
+        {
+                int sibling = index ^ 1;
+                if (sibling < count)
+                        memcpy(proof->path[proof->length++], nodes[sibling], DIGEST_SIZE);
+                count = reduceMerkleLevel(nodes, count);
+        }
+
+        free(nodes);
+        return 1;
+}
+
+/**
+ * Verifies that a transaction is committed to by a Merkle root
+ * Needs only the transaction, its proof and the root from the block
+ * header, not the other transactions of the block.
+ * @param accounts Dictionary the transaction's account IDs refer to
+ * @param trans Transaction to check
+ * @param proof Inclusion proof produced by buildMerkleProof
+ * @param merkle_root Root from the block header
+ * @return 1 if the proof is valid, 0 otherwise
+ */
+int verifyMerkleProof(const AccountDictionary *accounts, const Transaction *trans, const MerkleProof *proof,
+                      const unsigned char *merkle_root)
+{
+        unsigned char hash[1][DIGEST_SIZE];
+        int used = 0;
+
+        if (proof->tx_index < 0 || proof->tx_index >= proof->tx_count)
+                return 0;
+
+        hashMerkleLeaves(accounts, trans, 1, hash);
+        for (int index = proof->tx_index, count = proof->tx_count; count > 1; index /= 2, count = (count + 1) / 2)
+        {
+                // The last node of an odd level has no sibling and moves up unchanged
+                if ((index ^ 1) >= count)
+                        continue;
+                if (used >= proof->length)
+                        return 0;
+
+                if (index & 1)
+                        hashMerkleNode(proof->path[used], hash[0], hash[0]);
+                else
+                        hashMerkleNode(hash[0], proof->path[used], hash[0]);
+                used++;
+        }
+
+        return used == proof->length && memcmp(hash[0], merkle_root, DIGEST_SIZE) == 0;
+}
+
+/**
+ * Checks whether a hash meets a proof-of-work target
+ * @param digest Raw hash to check
+ * @param difficulty Number of leading zero bits required
+ * @return 1 if the hash has at least difficulty leading zero bits, 0 otherwise
+ */
+int meetsDifficulty(const unsigned char *digest, int difficulty)
+{
+        int bytes = difficulty / 8;
+        for (int i = 0; i < bytes; i++)
+        {
+                if (digest[i])
+                        return 0;
+        }
+
+        int bits = difficulty % 8;
+        return bits == 0 || (digest[bytes] >> (8 - bits)) == 0;
+}
+
+/**
+ * Checks that a block links to the one before it
+ * The difficulty may only rise along the chain, so a rewritten suffix
+ * cannot be mined more cheaply than the blocks it replaces.
+ * @param block Block to check
+ * @param previous Block before it
+ * @return 1 if the block follows previous, 0 otherwise
+ */
+int followsBlock(const Block *block, const Block *previous)
+{
+        return memcmp(block->previous_hash, previous->hash, DIGEST_SIZE) == 0 &&
+               block->difficulty >= previous->difficulty;
+}
+
+// Shared state of one nonce search
+typedef struct MiningContext
+{
+        Sha256Midstate midstate;          // State after the constant header prefix
+        const unsigned char *suffix;      // Rest of the header, ending with the nonce
+        int difficulty;
+        int worker_count;
+        atomic_int found;
+        unsigned long long nonce;
+        atomic_ullong attempts;
+} MiningContext;
+
+// Arguments for one mining worker
+typedef struct MiningWorker
+{
+        MiningContext *mining;
+        int worker;
+} MiningWorker;
+
+/**
+ * Thread entry point that searches the nonces of one worker
+ * Worker w tries nonces w, w + workers, w + 2 * workers, ... in batches
+ * of HASH_BATCH_SIZE, and stops once any worker has found a solution.
+ * Each attempt only hashes the header suffix on top of the shared midstate.
+ * @param arg Pointer to the worker's MiningWorker
+ * @return Always NULL
+ */
+void *miningWorkerMain(void *arg)
+{
+        MiningWorker *worker = (MiningWorker *)arg;
+        MiningContext *mining = worker->mining;
+        unsigned char buffer[HASH_BATCH_SIZE][MINING_SUFFIX_SIZE];
+        const unsigned char *suffixes[HASH_BATCH_SIZE];
+        unsigned char digests[HASH_BATCH_SIZE][DIGEST_SIZE];
+        unsigned long long stride = (unsigned long long)mining->worker_count;
+        unsigned long long nonce = (unsigned long long)worker->worker;
+        unsigned long long attempts = 0;
+
+        for (int j = 0; j < HASH_BATCH_SIZE; j++)
+        {
+                memcpy(buffer[j], mining->suffix, MINING_SUFFIX_SIZE);
+                suffixes[j] = buffer[j];
+        }
+
+        while (!atomic_load_explicit(&mining->found, memory_order_relaxed))
+        {
+                // The nonce is the last field of the header
+                for (int j = 0; j < HASH_BATCH_SIZE; j++)
+                        encodeInteger(buffer[j] + MINING_SUFFIX_SIZE - 8, nonce + stride * (unsigned long long)j, 8);
+
+                sha256FinishBatch(&mining->midstate, suffixes, MINING_SUFFIX_SIZE, HASH_BATCH_SIZE, digests);
+                attempts += HASH_BATCH_SIZE;
+
+                for (int j = 0; j < HASH_BATCH_SIZE; j++)
+                {
+                        if (!meetsDifficulty(digests[j], mining->difficulty))
+                                continue;
+
+                        // Only the first solution is kept
+                        int expected = 0;
+                        if (atomic_compare_exchange_strong(&mining->found, &expected, 1))
+                                mining->nonce = nonce + stride * (unsigned long long)j;
+                        break;
+                }
+                nonce += stride * HASH_BATCH_SIZE;
+        }
+
+        atomic_fetch_add(&mining->attempts, attempts);
+        return NULL;
+}
+
+/**
+ * Seals a block by searching for a nonce whose hash meets the block's
+ * difficulty, using one worker per CPU. Blocks with no difficulty are
+ * simply hashed.
+ * @param block Block to seal; its hash and nonce are updated
+ * @param stats Receives the number of hashes tried and the time taken, or NULL
+ */
+void mineBlock(Block *block, MiningStats *stats)
+{
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        unsigned long long attempts = 1;
+        block->nonce = 0;
+        if (block->hash_mode == HASH_MODE_WORK && block->difficulty > 0)
+        {
+                unsigned char header[ENCODED_WORK_HEADER_SIZE];
+                encodeBlockHeader(block, header);
+
+                MiningContext mining;
+                sha256Midstate(header, MINING_PREFIX_SIZE, &mining.midstate);
+                mining.suffix = header + MINING_PREFIX_SIZE;
+                mining.difficulty = block->difficulty;
+                mining.worker_count = getWorkerCount();
+                mining.nonce = 0;
+                atomic_init(&mining.found, 0);
+                atomic_init(&mining.attempts, 0);
+
+                MiningWorker args[MAX_WORKER_THREADS];
+                pthread_t threads[MAX_WORKER_THREADS];
+                int started[MAX_WORKER_THREADS] = {0};
+                for (int w = 0; w < mining.worker_count; w++)
+                {
+                        args[w].mining = &mining;
+                        args[w].worker = w;
+                }
+                for (int w = 1; w < mining.worker_count; w++)
+                {
+                        started[w] = pthread_create(&threads[w], NULL, miningWorkerMain, &args[w]) == 0;
+                }
+
+                // The calling thread searches too; it only returns once a
+                // solution is found, so the nonces of a worker whose thread
+                // failed to start are simply skipped
+                miningWorkerMain(&args[0]);
+                for (int w = 1; w < mining.worker_count; w++)
+                {
+                        if (started[w])
+                                pthread_join(threads[w], NULL);
+                }
+
+                block->nonce = mining.nonce;
+                attempts = atomic_load(&mining.attempts);
+        }
+        calculateHash(block, block->hash);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (stats)
+        {
+                stats->attempts = attempts;
+                stats->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+}
+
+/**
+ * Displays how long sealing a block took
+ * @param block Block that was sealed
+ * @param stats Statistics reported by mineBlock
+ */
+void displayMiningStats(const Block *block, const MiningStats *stats)
+{
+        double rate = stats->seconds > 0 ? (double)stats->attempts / stats->seconds : 0;
+        printf("Mined block %d at difficulty %d: nonce %llu after %llu hashes in %.3f s (%.0f hashes/s)\n",
+               block->index, block->difficulty, block->nonce, stats->attempts, stats->seconds, rate);
+}
+
+/**
+ * Initializes a new block in place
+ * @param block Block storage to initialize
+ * @param index Block index
+ * @param data Block data
+ * @param previous_hash Raw hash of previous block, or NULL for the genesis block
+ */
+void initBlock(Block *block, int index, const char *data, const unsigned char *previous_hash)
+{
+        // Initialize block data
+        block->index = index;
+        block->timestamp = time(NULL);
+        block->transaction_count = 0;
+        strncpy(block->data, data, MAX_DATA_SIZE - 1);
+        block->data[MAX_DATA_SIZE - 1] = '\0';
+        block->hash_mode = HASH_MODE_WORK;
+        block->difficulty = block->chain ? block->chain->difficulty : 0;
+        block->nonce = 0;
+        block->frontier = NULL;
+        memset(block->merkle_root, 0, DIGEST_SIZE);
+        if (previous_hash)
+                memcpy(block->previous_hash, previous_hash, DIGEST_SIZE);
+        else
+                memset(block->previous_hash, 0, DIGEST_SIZE);
+
+        // Calculate hash for the new block, mining it if the chain has a difficulty
+        mineBlock(block, block->chain ? &block->chain->last_mining : NULL);
+}
+
+/**
+ * Adds a new block to the blockchain
+ * @param chain Pointer to the blockchain
+ * @param data Data for the new block
+ * @return 1 if successful, 0 if failed
+ */
+int addBlock(Blockchain *chain, const char *data)
+{
+        // Check if the blockchain is valid
+        if (!chain)
+                return 0;
+
+        // Appends are serialized; readers never take this lock
+        pthread_mutex_lock(&chain->append_lock);
+        int added = addBlockLocked(chain, data);
+        pthread_mutex_unlock(&chain->append_lock);
+        return added;
+}
+
+/**
+ * Appends a new block while holding the append lock
+ * @param chain Pointer to the blockchain
+ * @param data Data for the new block
+ * @return 1 if successful, 0 if failed
+ */
+int addBlockLocked(Blockchain *chain, const char *data)
+{
+        return commitBlockLocked(chain, data, NULL);
+}
+
+/**
+ * Appends a new block while holding the append lock, or replays one
+ * from the journal
+ * @param chain Pointer to the blockchain
+ * @param data Data for the new block
+ * @param replayed Journal record to take the header from, or NULL to mine a new block and journal it
+ * @return 1 if successful, 0 if failed
+ */
+int commitBlockLocked(Blockchain *chain, const char *data, const JournalRecord *replayed)
+{
+        // The tail is known directly, so appending never walks the chain.
+        // Room for the previous block's hash and the new block's posting is
+        // reserved first, so nothing can fail once the block is appended
+        // but its journaled header.
+        Block *previous = getLatestBlock(chain);
+        if ((previous && !reserveBlockHash(chain)) || !reservePosting(&chain->index.blocks))
+                return 0;
+        Block *newBlock = appendBlockSlot(chain);
+        if (!newBlock)
+                return 0;
+
+        // A replayed block keeps its journaled header instead of being mined
+        // again, and is dropped if that header does not hash as recorded
+        if (replayed && !restoreJournaledBlock(newBlock, chain->length - 1, replayed, previous))
+        {
+                chain->length--;
+                return 0;
+        }
+
+        // The previous block is sealed now, so its Merkle frontier and
+        // transaction slack are no longer needed
+        if (previous)
+        {
+                free(previous->frontier);
+                previous->frontier = NULL;
+                compactTransactions(previous);
+        }
+
+        // Create a new block with the index of the last block + 1
+        if (!replayed)
+                initBlock(newBlock, chain->length - 1, data, previous ? previous->hash : NULL);
+        if (previous)
+                insertBlockHash(chain, previous, chain->length - 2);
+        indexBlock(&chain->index, newBlock, chain->length - 1);
+
+        // Publish the now immutable previous block to snapshots
+        atomic_store(&chain->published_length, chain->length - 1);
+        if (chain->epochs.retired)
+                reclaimRetired(&chain->epochs);
+
+        // Failures to journal are reported by syncJournal
+        if (!replayed && chain->journal)
+                journalBlock(chain->journal, newBlock);
+        return 1;
+}
+
+/**
+ * Fills a block slot with the header of a journaled block
+ * @param block Block slot to fill
+ * @param index Position of the block in the chain
+ * @param record Journal record of the block
+ * @param previous Block before it, or NULL for the genesis block
+ * @return 1 if the header hashes to the journaled hash, 0 if not
+ */
+int restoreJournaledBlock(Block *block, int index, const JournalRecord *record, const Block *previous)
+{
+        block->index = index;
+        block->timestamp = record->timestamp;
+        block->transaction_count = 0;
+        memcpy(block->data, record->data, MAX_DATA_SIZE);
+        block->hash_mode = HASH_MODE_WORK;
+        block->difficulty = record->difficulty;
+        block->nonce = record->nonce;
+        block->frontier = NULL;
+        memset(block->merkle_root, 0, DIGEST_SIZE);
+        if (previous)
+                memcpy(block->previous_hash, previous->hash, DIGEST_SIZE);
+        else
+                memset(block->previous_hash, 0, DIGEST_SIZE);
+
+        calculateHash(block, block->hash);
+        return memcmp(block->hash, record->hash, DIGEST_SIZE) == 0;
+}
+
+/**
+ * Gets the number of worker threads to use for parallel work
+ * @return Number of online CPUs, clamped to [1, MAX_WORKER_THREADS]
+ */
+int getWorkerCount(void)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 1)
+                return 1;
+        if (cpus > MAX_WORKER_THREADS)
+                return MAX_WORKER_THREADS;
+        return (int)cpus;
+}
+
+// Arguments for one worker started by runParallel
+typedef struct ParallelWorker
+{
+        ParallelTask task;
+        void *context;
+        int begin;
+        int end;
+} ParallelWorker;
+
+/**
+ * Thread entry point that runs a task over one worker's range
+ * @param arg Pointer to the worker's ParallelWorker
+ * @return Always NULL
+ */
+void *parallelWorkerMain(void *arg)
+{
+        ParallelWorker *worker = (ParallelWorker *)arg;
+        worker->task(worker->context, worker->begin, worker->end);
+        return NULL;
+}
+
+/**
+ * Splits [0, count) into contiguous ranges and runs a task on each range
+ * across a pool of threads sized to the machine. The calling thread works
+ * on the first range, and small inputs are handled on the calling thread
+ * only. Falls back to fewer threads if a thread cannot be started.
+ * @param count Number of items to process
+ * @param task Function run on each range
+ * @param context Shared state passed to every call of task
+ */
+void runParallel(int count, ParallelTask task, void *context)
+{
+        int workers = getWorkerCount();
+        if (workers > count / PARALLEL_MIN_ITEMS)
+                workers = count / PARALLEL_MIN_ITEMS;
+        if (workers <= 1)
+        {
+                if (count > 0)
+                        task(context, 0, count);
+                return;
+        }
+
+        ParallelWorker args[MAX_WORKER_THREADS];
+        pthread_t threads[MAX_WORKER_THREADS];
+        int started[MAX_WORKER_THREADS] = {0};
+        int chunk = (count + workers - 1) / workers;
+
+        for (int w = 0; w < workers; w++)
+        {
+                args[w].task = task;
+                args[w].context = context;
+                args[w].begin = w * chunk;
+                args[w].end = (w + 1) * chunk < count ? (w + 1) * chunk : count;
+        }
+
+        for (int w = 1; w < workers; w++)
+        {
+                started[w] = pthread_create(&threads[w], NULL, parallelWorkerMain, &args[w]) == 0;
+        }
+
+        // The calling thread takes the first range, and any range whose
+        // thread failed to start
+        task(context, args[0].begin, args[0].end);
+        for (int w = 1; w < workers; w++)
+        {
+                if (started[w])
+                        pthread_join(threads[w], NULL);
+                else
+                        task(context, args[w].begin, args[w].end);
+        }
+}
+
+// Shared state for the parallel self-hash check
+typedef struct ValidationContext
+{
+        const ChainSnapshot *snapshot;
+        int start;       // Index of the first block to check; ranges are relative to it
+        int first_index; // Index the block at position 0 must have
+        atomic_int first_invalid;
+} ValidationContext;
+
+/**
+ * Records a failed block, keeping the lowest failing index
+ * @param validation Shared validation state
+ * @param index Index of the block that failed
+ */
+void reportInvalidBlock(ValidationContext *validation, int index)
+{
+        int current = atomic_load(&validation->first_invalid);
+        while (index < current &&
+               !atomic_compare_exchange_weak(&validation->first_invalid, &current, index))
+                ;
+}
+
+/**
+ * Recomputes the hash of every block in a range and records the lowest
+ * index whose stored hash, or stored index, does not match. Canonical blocks are encoded
+ * HASH_BATCH_SIZE at a time and hashed with one sha256Batch call, after
+ * their Merkle root has been checked against their transactions.
+ * @param context Pointer to the ValidationContext
+ * @param begin First block to check, counted from validation->start
+ * @param end One past the last block to check, counted from validation->start
+ */
+void validateBlockRange(void *context, int begin, int end)
+{
+        ValidationContext *validation = (ValidationContext *)context;
+        begin += validation->start;
+        end += validation->start;
+        unsigned char buffer[HASH_BATCH_SIZE][ENCODED_WORK_HEADER_SIZE];
+        const unsigned char *messages[HASH_BATCH_SIZE];
+        size_t lengths[HASH_BATCH_SIZE];
+        int indices[HASH_BATCH_SIZE];
+        unsigned char digests[HASH_BATCH_SIZE][DIGEST_SIZE];
+
+        for (int i = begin; i < end;)
+        {
+                // A lower invalid block has already been found elsewhere
+                if (i >= atomic_load_explicit(&validation->first_invalid, memory_order_relaxed))
+                        break;
+
+                // Encode the next batch; legacy blocks are checked individually
+                int count = 0;
+                for (; i < end && count < HASH_BATCH_SIZE; i++)
+                {
+                        // A block's index must match its position; the hash table
+                        // and indexes are keyed by position
+                        Block *block = getSnapshotBlock(validation->snapshot, i);
+                        if (block->index != validation->first_index + i)
+                        {
+                                reportInvalidBlock(validation, i);
+                                end = i;
+                                break;
+                        }
+                        if (block->hash_mode == HASH_MODE_LEGACY)
+                        {
+                                calculateLegacyHash(block, digests[0]);
+                                if (memcmp(block->hash, digests[0], DIGEST_SIZE) != 0)
+                                {
+                                        reportInvalidBlock(validation, i);
+                                        end = i;
+                                        break;
+                                }
+                                continue;
+                        }
+
+                        // The header commits to the transactions only if its Merkle root
+                        // matches them; transactions not paged in are checked when they are
+                        if ((block->transactions || block->transaction_count == 0) &&
+                            (!computeMerkleRoot(&block->chain->accounts, block->transactions, block->transaction_count, digests[0]) ||
+                             memcmp(block->merkle_root, digests[0], DIGEST_SIZE) != 0))
+                        {
+                                reportInvalidBlock(validation, i);
+                                end = i;
+                                break;
+                        }
+
+                        lengths[count] = encodeBlockHeader(block, buffer[count]);
+                        messages[count] = buffer[count];
+                        indices[count] = i;
+                        count++;
+                }
+
+                sha256Batch(messages, lengths, count, digests);
+                for (int j = 0; j < count; j++)
+                {
+                        // Mined blocks must also meet the target they were sealed with
+                        Block *block = getSnapshotBlock(validation->snapshot, indices[j]);
+                        if (memcmp(block->hash, digests[j], DIGEST_SIZE) != 0 ||
+                            !meetsDifficulty(digests[j], block->difficulty))
+                        {
+                                reportInvalidBlock(validation, indices[j]);
+                                end = i;
+                                break;
+                        }
+                }
+        }
+
+}
+
+/**
+ * Finds the first block that fails validation, from genesis or from the
+ * chain's checkpoint
+ * Every block checked is hashed exactly once, in parallel, and compared
+ * with its stored hash. The cheap previous_hash links are then checked
+ * sequentially. Sealed blocks found valid become the new checkpoint.
+ * @param chain Pointer to the blockchain
+ * @param trust_checkpoint 1 to skip the blocks covered by the checkpoint
+ * @return Index of the first invalid block, or -1 if the chain is valid
+ */
+int verifyBlocks(Blockchain *chain, int trust_checkpoint)
+{
+        if (!chain)
+                return -1;
+
+        // The workers read through this thread's snapshot, which outlives them
+        ChainSnapshot snapshot;
+        beginChainRead(chain, &snapshot);
+
+        // The checkpoint only counts if its last block still has the recorded hash
+        int start = 0;
+        if (trust_checkpoint)
+        {
+                pthread_mutex_lock(&chain->checkpoint_lock);
+                ValidationCheckpoint checkpoint = chain->checkpoint;
+                pthread_mutex_unlock(&chain->checkpoint_lock);
+
+                if (checkpoint.length > 0 && checkpoint.length <= snapshot.length &&
+                    memcmp(getSnapshotBlock(&snapshot, checkpoint.length - 1)->hash, checkpoint.hash, DIGEST_SIZE) == 0)
+                        start = checkpoint.length;
+        }
+
+        int result = -1;
+        if (snapshot.length > start)
+        {
+                ValidationContext validation;
+                validation.snapshot = &snapshot;
+                validation.start = start;
+                validation.first_index = chain->first_index;
+                atomic_init(&validation.first_invalid, snapshot.length);
+                runParallel(snapshot.length - start, validateBlockRange, &validation);
+
+                // Check each block links to the stored hash of the one before it,
+                // and keeps its difficulty, starting with the link to the last
+                // trusted block
+                int first_invalid = atomic_load(&validation.first_invalid);
+                if (first_invalid < snapshot.length)
+                        result = first_invalid;
+                for (int i = start > 0 ? start : 1; i < first_invalid; i++)
+                {
+                        if (!followsBlock(getSnapshotBlock(&snapshot, i), getSnapshotBlock(&snapshot, i - 1)))
+                        {
+                                result = i;
+                                break;
+                        }
+                }
+        }
+
+        // Sealed blocks before the first failure are verified; the open tip
+        // may still change, so it is never part of the checkpoint
+        int verified = result < 0 || result > snapshot.sealed_length ? snapshot.sealed_length : result;
+        pthread_mutex_lock(&chain->checkpoint_lock);
+        if (start == 0 || verified > chain->checkpoint.length)
+        {
+                chain->checkpoint.length = verified;
+                if (verified > 0)
+                        memcpy(chain->checkpoint.hash, getSnapshotBlock(&snapshot, verified - 1)->hash, DIGEST_SIZE);
+        }
+        pthread_mutex_unlock(&chain->checkpoint_lock);
+
+        endChainRead(&snapshot);
+        return result;
+}
+
+/**
+ * Finds the first block that fails validation
+ * Blocks covered by the chain's checkpoint are trusted, so only blocks
+ * added since the last successful validation are hashed.
+ * @param chain Pointer to the blockchain
+ * @return Index of the first invalid block, or -1 if the chain is valid
+ */
+int findFirstInvalidBlock(Blockchain *chain)
+{
+        return verifyBlocks(chain, 1);
+}
+
+/**
+ * Re-verifies every block from genesis, ignoring the checkpoint
+ * @param chain Pointer to the blockchain
+ * @return Index of the first invalid block, or -1 if the chain is valid
+ */
+int reverifyBlockchain(Blockchain *chain)
+{
+        return verifyBlocks(chain, 0);
+}
+
+/**
+ * Validates the integrity of the blockchain
+ * @param chain Pointer to the blockchain
+ * @return 1 if valid, 0 if invalid
+ */
+int validateBlockchain(Blockchain *chain)
+{
+        return findFirstInvalidBlock(chain) < 0;
+}
+
+/**
+ * Shortens the checkpoint so it no longer covers a block that changed
+ * @param chain Pointer to the blockchain
+ * @param length Number of leading blocks that are still verified
+ */
+void lowerValidationCheckpoint(Blockchain *chain, int length)
+{
+        pthread_mutex_lock(&chain->checkpoint_lock);
+        if (length < chain->checkpoint.length)
+        {
+                chain->checkpoint.length = length;
+                if (length > 0)
+                        memcpy(chain->checkpoint.hash, getBlock(chain, length - 1)->hash, DIGEST_SIZE);
+        }
+        pthread_mutex_unlock(&chain->checkpoint_lock);
+}
+
+/**
+ * Adds a new transaction to a block
+ * @param block Target block
+ * @param sender Transaction sender
+ * @param receiver Transaction receiver
+ * @param amount Transaction amount
+ * @return 1 if successful, 0 if failed
+ */
+int addTransaction(Block *block, const char *sender, const char *receiver, double amount)
+{
+        // Check if the block is valid
+        if (!block || !block->chain)
+                return 0;
+
+        // Appends are serialized; readers never take this lock
+        Blockchain *chain = block->chain;
+        pthread_mutex_lock(&chain->append_lock);
+        int added = addTransactionLocked(block, sender, receiver, amount);
+        pthread_mutex_unlock(&chain->append_lock);
+        return added;
+}
+
+/**
+ * Adds a new transaction to a block while holding the append lock
+ * @param block Target block
+ * @param sender Transaction sender
+ * @param receiver Transaction receiver
+ * @param amount Transaction amount
+ * @return 1 if successful, 0 if failed
+ */
+int addTransactionLocked(Block *block, const char *sender, const char *receiver, double amount)
+{
+        return commitTransactionLocked(block, sender, receiver, amount, NULL);
+}
+
+/**
+ * Adds a new transaction to a block while holding the append lock, or
+ * replays one from the journal
+ * @param block Target block
+ * @param sender Transaction sender
+ * @param receiver Transaction receiver
+ * @param amount Transaction amount
+ * @param replayed Journal record to take the timestamp and nonce from, or NULL to mine the block and journal it
+ * @return 1 if successful, 0 if failed
+ */
+int commitTransactionLocked(Block *block, const char *sender, const char *receiver, double amount,
+                            const JournalRecord *replayed)
+{
+        // Check the block has room for one more transaction
+        if (block->transaction_count >= MAX_BLOCK_TRANSACTIONS)
+                return 0;
+
+        // Sealed blocks must not change while snapshots may be reading them
+        int sealed = block->index < block->chain->length - 1;
+        if (sealed && (atomic_load(&block->chain->concurrent_reads) || atomic_load(&block->chain->saving)))
+                return 0;
+
+        // Optionally refuse transfers the sender cannot cover. Transfers in
+        // the genesis block credit opening balances, so they only need a
+        // valid amount.
+        if (block->chain->enforce_balances &&
+            (block->index == 0 ? !(amount > 0) || !isfinite(amount) : !canAffordTransfer(block->chain, sender, amount)))
+                return 0;
+
+        // Changed transactions of a lazily loaded chain must not be evicted
+        if ((sealed && !pinTransactions(block)) || !reserveTransaction(block))
+                return 0;
+
+        // Intern the sender and receiver names
+        Transaction *trans = &block->transactions[block->transaction_count];
+        if (!internAccount(&block->chain->accounts, sender, &trans->sender_id) ||
+            !internAccount(&block->chain->accounts, receiver, &trans->receiver_id))
+                return 0;
+
+        // Check if the amount is valid
+        trans->amount = amount;
+        trans->timestamp = replayed ? replayed->timestamp : time(NULL);
+
+        // Everything that can fail to grow is reserved before the block
+        // changes, so the updates below cannot fail halfway
+        int merkle = block->hash_mode != HASH_MODE_LEGACY;
+        if ((merkle && !block->frontier && !buildMerkleFrontier(block)) ||
+            !reserveBalance(&block->chain->balances, trans->sender_id) ||
+            !reserveBalance(&block->chain->balances, trans->receiver_id) ||
+            !reserveTransactionIndex(&block->chain->index, trans))
+                return 0;
+
+        // A replayed transaction is only kept if it reproduces the journaled
+        // hash, so the tree it changes is saved first
+        MerkleFrontier saved_frontier;
+        unsigned char saved_root[DIGEST_SIZE];
+        unsigned long long saved_nonce = block->nonce;
+        if (replayed && merkle)
+        {
+                saved_frontier = *block->frontier;
+                memcpy(saved_root, block->merkle_root, DIGEST_SIZE);
+        }
+
+        // Legacy blocks hash their transactions directly; others extend
+        // the Merkle tree by one leaf instead of rebuilding it
+        if (merkle)
+        {
+                unsigned char leaf[1][DIGEST_SIZE];
+                hashMerkleLeaves(&block->chain->accounts, trans, 1, leaf);
+                appendMerkleLeaf(block->frontier, leaf[0]);
+                getMerkleFrontierRoot(block->frontier, block->merkle_root);
+        }
+
+        // Update the transaction count
+        block->transaction_count++;
+
+        // The journaled nonce must reproduce the journaled hash
+        unsigned char replayed_hash[DIGEST_SIZE];
+        if (replayed)
+        {
+                block->nonce = replayed->nonce;
+                calculateHash(block, replayed_hash);
+                if (memcmp(replayed_hash, replayed->hash, DIGEST_SIZE) != 0)
+                {
+                        block->transaction_count--;
+                        block->nonce = saved_nonce;
+                        if (merkle)
+                        {
+                                *block->frontier = saved_frontier;
+                                memcpy(block->merkle_root, saved_root, DIGEST_SIZE);
+                        }
+                        return 0;
+                }
+        }
+
+        // Recalculate the block hash; a sealed block's entry in the hash
+        // lookup table moves with it, the open tip has none. Validation can
+        // no longer trust the checkpoint from this block on.
+        if (sealed)
+        {
+                removeBlockHash(block->chain, block);
+                lowerValidationCheckpoint(block->chain, block->index);
+        }
+        if (replayed)
+                memcpy(block->hash, replayed_hash, DIGEST_SIZE);
+        else
+                mineBlock(block, &block->chain->last_mining);
+
+        // None of these can fail: capacity was reserved above, and the
+        // hash table had room for the entry just removed
+        applyTransactionToBalances(&block->chain->balances, trans);
+        if (sealed)
+                insertBlockHash(block->chain, block, block->index);
+        indexTransaction(&block->chain->index, trans, block->index, block->transaction_count - 1);
+
+        // Failures to journal are reported by syncJournal
+        if (!replayed && block->chain->journal)
+                journalTransaction(block->chain->journal, block, sender, receiver, trans);
+        return 1;
+}
+
+/**
+ * Displays transactions in a block
+ * @param block Block containing transactions
+ */
+void displayTransactions(Block *block)
+{
+        // Check if the block is valid
+        if (block->transaction_count == 0)
+        {
+                printf("No transactions in this block\n");
+                return;
+        }
+
+        const Transaction *transactions = getBlockTransactions(block);
+        if (!transactions)
+        {
+                printf("Error: Transactions of this block are not available\n");
+                return;
+        }
+
+        // Display each transaction; ctime_r keeps concurrent readers apart
+        const AccountDictionary *accounts = &block->chain->accounts;
+        char time_text[26];
+        printf("\nTransactions:\n");
+        for (int i = 0; i < block->transaction_count; i++)
+        {
+                printf("Transaction #%d:\n", i + 1);
+                printf("  From: %s\n", getAccountName(accounts, transactions[i].sender_id));
+                printf("  To: %s\n", getAccountName(accounts, transactions[i].receiver_id));
+                printf("  Amount: %.2f\n", transactions[i].amount);
+                printf("  Time: %s", ctime_r(&transactions[i].timestamp, time_text));
+        }
+}
+
+/**
+ * Displays information of a single block including transactions
+ * @param block Block to display
+ */
+void displayBlock(Block *block)
+{
+        // Hex is only produced here, for display
+        char previous_hex[HASH_SIZE + 1];
+        char hash_hex[HASH_SIZE + 1];
+        char time_text[26];
+        digestToHex(block->previous_hash, previous_hex);
+        digestToHex(block->hash, hash_hex);
+
+        printf("\nBlock #%d\n", block->index);
+        printf("Timestamp: %s", ctime_r(&block->timestamp, time_text));
+        printf("Data: %s\n", block->data);
+        printf("Previous Hash: %s\n", previous_hex);
+        printf("Hash: %s\n", hash_hex);
+        if (block->hash_mode != HASH_MODE_LEGACY)
+        {
+                char merkle_hex[HASH_SIZE + 1];
+                digestToHex(block->merkle_root, merkle_hex);
+                printf("Merkle Root: %s\n", merkle_hex);
+        }
+        if (block->difficulty > 0)
+                printf("Difficulty: %d, Nonce: %llu\n", block->difficulty, block->nonce);
+        displayTransactions(block);
+}
+
+/**
+ * Displays the entire blockchain
+ * @param chain Pointer to the blockchain
+ */
+void displayBlockchain(Blockchain *chain)
+{
+        // Check if the blockchain is valid
+        if (!chain)
+        {
+                printf("Blockchain is empty\n");
+                return;
+        }
+
+        ChainSnapshot snapshot;
+        beginChainRead(chain, &snapshot);
+        if (snapshot.length == 0)
+                printf("Blockchain is empty\n");
+        for (int i = 0; i < snapshot.length; i++)
+        {
+                displayBlock(getSnapshotBlock(&snapshot, i));
+        }
+        endChainRead(&snapshot);
+}
+
+/**
+ * Frees all memory allocated for the blockchain
+ * @param chain Pointer to the blockchain
+ */
+void freeBlockchain(Blockchain *chain)
+{
+        // Check if the blockchain is valid
+        if (!chain)
+                return;
+
+        // Journaled changes still pending are written out first
+        closeJournal(chain->journal);
+
+        // Open blocks may still hold a Merkle frontier
+        for (int i = 0; i < chain->length; i++)
+        {
+                free(getBlock(chain, i)->frontier);
+        }
+
+        // Transactions are released a whole slab at a time and blocks a
+        // whole segment at a time
+        freeTransactionCache(chain->cache);
+        freeTransactionPool(&chain->pool);
+        freeAccountDictionary(&chain->accounts);
+        freeBalanceIndex(&chain->balances);
+        freeChainIndex(&chain->index);
+        freeBlockHashTable(&chain->hash_table);
+        for (int i = 0; i < chain->segment_count; i++)
+        {
+                free(chain->segments[i]);
+        }
+        free(chain->segments);
+        freeEpochDomain(&chain->epochs);
+        pthread_mutex_destroy(&chain->append_lock);
+        pthread_mutex_destroy(&chain->checkpoint_lock);
+        free(chain);
+}
+
+/**
+ * Safely gets string input from user
+ * @param prompt The prompt to show user
+ * @param buffer Buffer to store input
+ * @param size Size of buffer
+ */
+void getStringInput(const char *prompt, char *buffer, size_t size)
+{
+        // Check if the buffer is valid
+        printf("%s", prompt);
+        if (fgets(buffer, size, stdin))
+        {
+                buffer[strcspn(buffer, "\n")] = 0;
+        }
+}
+
+/**
+ * Safely gets double input from user
+ * @param prompt The prompt to show user
+ * @return The double value entered
+ */
+double getDoubleInput(const char *prompt)
+{
+        // Check if the prompt is valid
+        char buffer[64];
+        double value;
+
+        while (1)
+        {
+                printf("%s", prompt);
+                if (fgets(buffer, sizeof(buffer), stdin))
+                {
+                        if (sscanf(buffer, "%lf", &value) == 1)
+                        {
+                                return value;
+                        }
+                }
+                printf("Invalid input. Please enter a valid number.\n");
+        }
+}
+
+/**
+ * Gets an optional Unix timestamp from the user
+ * @param prompt The prompt to show user
+ * @param fallback Value used when the input is blank or not a number
+ * @return The timestamp entered, or fallback
+ */
+time_t getTimeInput(const char *prompt, time_t fallback)
+{
+        char buffer[64] = "";
+        long long value;
+
+        getStringInput(prompt, buffer, sizeof(buffer));
+        if (sscanf(buffer, "%lld", &value) == 1)
+                return (time_t)value;
+        return fallback;
+}
+
+/**
+ * Saves the blockchain to a file
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the file to save to
+ * @return 1 if successful, 0 if failed
+ */
+int saveBlockchain(Blockchain *chain, const char *filename)
+{
+        if (!chain)
+                return 0;
+
+        if (!writeChainFile(filename, chain->segments, chain->length, NULL, chain->accounts.names, chain->accounts.count))
+                return 0;
+
+        saveChainState(chain, filename);
+        if (chain->journal && !resetJournal(chain->journal, chain, filename))
+                printf("Warning: Could not start the journal over after saving\n");
+        printf("Blockchain saved successfully to %s\n", filename);
+        return 1;
+}
+
+/**
+ * Writes blocks to a chain file, replacing it in a single rename
+ * @param filename Name of the file to save to
+ * @param segments Segment directory holding the blocks
+ * @param length Number of blocks to write from the directory
+ * @param tip Block written after them, or NULL
+ * @param names Account names the blocks refer to
+ * @param name_count Number of account names
+ * @return 1 if successful, 0 if failed
+ */
+int writeChainFile(const char *filename, Block **segments, int length, const Block *tip, char *const *names,
+                   int name_count)
+{
+        // Write beside the file and rename over it, since a lazily loaded
+        // chain may still be paging from the old one
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+        FILE *file = fopen(temp_filename, "wb");
+        if (!file)
+        {
+                printf("Error: Could not open file for writing\n");
+                return 0;
+        }
+
+        // Write the file header and chain length first
+        writeFileHeader(file, length + (tip ? 1 : 0), FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED);
+
+        // Write each block as a compact record, compressed a group at a time
+        // Groups are written through an io_uring where available, while
+        // the next ones are encoded
+        BlockFileWriter writer;
+        initBlockFileWriter(&writer, file, FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED);
+        writer.async = openAsyncFile(file, 1);
+        for (int b = 0; b < length && !writer.failed; b++)
+        {
+                Block *block = &segments[b >> BLOCK_SEGMENT_SHIFT][b & BLOCK_SEGMENT_MASK];
+                if (block->transaction_count > 0 && !getBlockTransactions(block))
+                        writer.failed = 1;
+                else
+                        writeBlockRecord(&writer, block);
+        }
+        if (tip && !writer.failed)
+                writeBlockRecord(&writer, tip);
+
+        // Account names are written once, after the blocks that reference
+        // them, and the block index goes last
+        long long dictionary_offset = finishBlockFileWriter(&writer) ? ftell(file) : -1;
+        if (dictionary_offset >= 0)
+                writeAccountNames(file, names, name_count);
+        if (dictionary_offset < 0 || !writeBlockFileFooter(&writer, dictionary_offset))
+        {
+                printf("Error: Could not encode blocks\n");
+                freeBlockFileWriter(&writer);
+                fclose(file);
+                remove(temp_filename);
+                return 0;
+        }
+        freeBlockFileWriter(&writer);
+
+        if (fclose(file) != 0 || rename(temp_filename, filename) != 0)
+        {
+                printf("Error: Could not write %s\n", filename);
+                remove(temp_filename);
+                return 0;
+        }
+        return 1;
+}
+
+/**
+ * Saves the indexes next to a saved chain
+ * A ledger snapshot at the full height holds every posting, so the index
+ * file is only written when the snapshot cannot be, and removed otherwise.
+ * Loading can rebuild the indexes from the blocks, so failures are
+ * reported as warnings.
+ * @param chain Pointer to the blockchain
+ * @param filename Name the chain was saved under
+ */
+void saveChainState(Blockchain *chain, const char *filename)
+{
+        char index_filename[FILENAME_BUFFER_SIZE];
+        getIndexFilename(filename, index_filename, sizeof(index_filename));
+        if (saveLedgerState(chain, filename))
+        {
+                remove(index_filename);
+                return;
+        }
+
+        printf("Warning: Could not save ledger state next to %s\n", filename);
+        if (!saveChainIndex(chain, index_filename))
+                printf("Warning: Could not save index file %s\n", index_filename);
+}
+
+/**
+ * Loads the blockchain from a file
+ * @param filename Name of the file to load from
+ * @return Pointer to loaded blockchain or NULL if failed
+ */
+Blockchain *loadBlockchain(const char *filename)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+        {
+                printf("Error: Could not open file for reading\n");
+                return NULL;
+        }
+
+        Blockchain *chain = createBlockchain();
+        if (!chain)
+        {
+                fclose(file);
+                return NULL;
+        }
+
+        // Read the header, which tells the version and chain length
+        int format, flags, length;
+        if (!readFileHeader(file, &format, &flags, &length))
+        {
+                freeBlockchain(chain);
+                fclose(file);
+                return NULL;
+        }
+
+        // Read each block; groups of compact files are read ahead through
+        // an io_uring where available, while earlier ones are decoded
+        BlockFileReader reader;
+        initBlockFileReader(&reader, file, format, flags);
+        if (format == FILE_FORMAT_COMPACT)
+                reader.async = openAsyncFile(file, 0);
+        for (int i = 0; i < length; i++)
+        {
+                Block *block = appendBlockSlot(chain);
+                if (!block || !readBlockRecord(&reader, block))
+                {
+                        printf("Error: Could not read block %d\n", i);
+                        freeBlockFileReader(&reader);
+                        freeBlockchain(chain);
+                        fclose(file);
+                        return NULL;
+                }
+
+                // Rebuild the hash lookup table in the same pass; a block is
+                // sealed once the next one is read
+                if (i > 0 && !insertBlockHash(chain, getBlock(chain, i - 1), i - 1))
+                {
+                        freeBlockFileReader(&reader);
+                        freeBlockchain(chain);
+                        fclose(file);
+                        return NULL;
+                }
+        }
+
+        // The dictionary is read through stdio, from where the blocks end
+        int positioned = closeAsyncFile(reader.async, file);
+        reader.async = NULL;
+        freeBlockFileReader(&reader);
+        if (!positioned)
+        {
+                printf("Error: Could not read blocks\n");
+                freeBlockchain(chain);
+                fclose(file);
+                return NULL;
+        }
+
+        atomic_store(&chain->published_length, length > 0 ? length - 1 : 0);
+
+        // Legacy files store names inline and were interned while reading blocks
+        if (format != FILE_FORMAT_LEGACY && !readAccountDictionary(file, &chain->accounts))
+        {
+                printf("Error: Could not read account dictionary\n");
+                freeBlockchain(chain);
+                fclose(file);
+                return NULL;
+        }
+
+        fclose(file);
+
+        for (int i = 0; i < length; i++)
+        {
+                if (!checkAccountIds(getBlock(chain, i), chain->accounts.count))
+                {
+                        printf("Error: Block %d refers to an unknown account\n", i);
+                        freeBlockchain(chain);
+                        return NULL;
+                }
+        }
+
+        if (!restoreChainState(chain, filename))
+        {
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        // The legacy hash is only accepted from the legacy format, so its
+        // verified blocks are re-hashed before they can be saved
+        if (format == FILE_FORMAT_LEGACY && !upgradeLegacyBlocks(chain))
+        {
+                printf("Error: Could not re-hash legacy blocks\n");
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        printf("Blockchain loaded and validated successfully from %s\n", filename);
+        return chain;
+}
+
+/**
+ * Re-hashes the verified blocks of a legacy file in canonical mode
+ * The legacy hash skips transaction timestamps, rounds amounts to cents
+ * and ignores input past 512 bytes. Each block instead gets a Merkle root
+ * and is linked to the new hash of the one before it, so every block hash
+ * changes.
+ * @param chain Chain just loaded and validated from a legacy file
+ * @return 1 if successful, 0 if allocation fails
+ */
+int upgradeLegacyBlocks(Blockchain *chain)
+{
+        freeBlockHashTable(&chain->hash_table);
+        for (int i = 0; i < chain->length; i++)
+        {
+                Block *block = getBlock(chain, i);
+                if (!computeMerkleRoot(&chain->accounts, block->transactions, block->transaction_count,
+                                       block->merkle_root))
+                        return 0;
+                block->hash_mode = HASH_MODE_CANONICAL;
+                if (i > 0)
+                        memcpy(block->previous_hash, getBlock(chain, i - 1)->hash, DIGEST_SIZE);
+                calculateHash(block, block->hash);
+                if (i > 0 && !insertBlockHash(chain, getBlock(chain, i - 1), i - 1))
+                        return 0;
+        }
+
+        // The checkpoint still covers the same blocks, now under new hashes
+        pthread_mutex_lock(&chain->checkpoint_lock);
+        if (chain->checkpoint.length > 0)
+                memcpy(chain->checkpoint.hash, getBlock(chain, chain->checkpoint.length - 1)->hash, DIGEST_SIZE);
+        pthread_mutex_unlock(&chain->checkpoint_lock);
+        return 1;
+}
+
+/**
+ * Validates a chain just read from a file and restores its balances and indexes
+ * @param chain Chain holding every block of the file
+ * @param filename Name of the file, used to find its indexes and ledger snapshots
+ * @return 1 if successful, 0 if the chain is invalid or its indexes cannot be built
+ */
+int restoreChainState(Blockchain *chain, const char *filename)
+{
+        // Re-validate the loaded blockchain. Only blocks verified by this
+        // process are trusted: a checkpoint stored next to the file could be
+        // replaced along with the blocks it vouches for.
+        int invalid = findFirstInvalidBlock(chain);
+        if (invalid >= 0)
+        {
+                printf("Error: Loaded blockchain is invalid at block %d\n", invalid);
+                return 0;
+        }
+
+        // New blocks continue at the difficulty of the tip
+        chain->difficulty = chain->length > 0 ? getLatestBlock(chain)->difficulty : 0;
+
+        // Indexes resume from the newest ledger snapshot that matches the
+        // verified blocks, and only the blocks after it are indexed. Without
+        // one, saved indexes that match the whole chain are still used.
+        // Balances are always computed from the verified blocks.
+        char index_filename[FILENAME_BUFFER_SIZE];
+        getIndexFilename(filename, index_filename, sizeof(index_filename));
+        int height = loadLedgerState(chain, filename);
+        if (height == 0 && loadChainIndex(chain, index_filename))
+                height = chain->length;
+        if (!replayLedger(chain, height))
+        {
+                printf("Error: Could not build indexes\n");
+                return 0;
+        }
+        return 1;
+}
+
+/**
+ * Gets the number of bytes between a file's position and its end
+ * @param file File to measure
+ * @return Remaining bytes, or -1 if the file cannot be measured
+ */
+long long getRemainingBytes(FILE *file)
+{
+        struct stat info;
+        long long offset = ftell(file);
+        if (offset < 0 || fstat(fileno(file), &info) != 0 || info.st_size < offset)
+                return -1;
+        return (long long)info.st_size - offset;
+}
+
+/**
+ * Reads one block record from a blockchain file
+ * @param file File positioned at the start of a block record
+ * @param block Block to fill
+ * @param legacy 1 if the file uses the original hex-string record layout
+ * @return 1 if successful, 0 if the record is truncated or malformed
+ */
+int readBlock(FILE *file, Block *block, int legacy)
+{
+        // Read block data
+        if (fread(&block->index, sizeof(int), 1, file) != 1 ||
+            fread(&block->timestamp, sizeof(time_t), 1, file) != 1 ||
+            fread(block->data, sizeof(char), MAX_DATA_SIZE, file) != MAX_DATA_SIZE ||
+            fread(&block->transaction_count, sizeof(int), 1, file) != 1)
+                return 0;
+        block->data[MAX_DATA_SIZE - 1] = '\0';
+        block->frontier = NULL;
+        block->difficulty = 0;
+        block->nonce = 0;
+
+        int max_transactions = legacy ? LEGACY_MAX_TRANSACTIONS : MAX_BLOCK_TRANSACTIONS;
+        if (block->transaction_count < 0 || block->transaction_count > max_transactions)
+                return 0;
+
+        // The records must be in the file before an array is sized for them
+        int count = block->transaction_count;
+        long long record_size = legacy ? (long long)sizeof(LegacyTransaction) : (long long)sizeof(Transaction);
+        if (count > 0 && getRemainingBytes(file) < record_size * count)
+                return 0;
+
+        // Read transactions into an exactly sized array from the chain's pool
+        block->transactions = allocateTransactions(&block->chain->pool, count);
+        block->transaction_capacity = count;
+        block->transaction_count = 0;
+        if (count > 0 && !block->transactions)
+                return 0;
+
+        if (legacy)
+        {
+                // Legacy records carry the account names inline
+                for (int j = 0; j < count; j++)
+                {
+                        LegacyTransaction record;
+                        Transaction *trans = &block->transactions[j];
+                        if (fread(&record, sizeof(LegacyTransaction), 1, file) != 1)
+                                return 0;
+                        record.sender[MAX_SENDER_SIZE - 1] = '\0';
+                        record.receiver[MAX_RECEIVER_SIZE - 1] = '\0';
+                        if (!internAccount(&block->chain->accounts, record.sender, &trans->sender_id) ||
+                            !internAccount(&block->chain->accounts, record.receiver, &trans->receiver_id))
+                                return 0;
+                        trans->amount = record.amount;
+                        trans->timestamp = record.timestamp;
+                }
+        }
+        else if (count > 0 && fread(block->transactions, sizeof(Transaction), count, file) != (size_t)count)
+        {
+                return 0;
+        }
+        block->transaction_count = count;
+
+        if (legacy)
+        {
+                // Legacy records store NUL-terminated hex strings
+                char previous_hex[HASH_SIZE + 1];
+                char hash_hex[HASH_SIZE + 1];
+                if (fread(previous_hex, sizeof(char), HASH_SIZE + 1, file) != HASH_SIZE + 1 ||
+                    fread(hash_hex, sizeof(char), HASH_SIZE + 1, file) != HASH_SIZE + 1)
+                        return 0;
+                previous_hex[HASH_SIZE] = '\0';
+                hash_hex[HASH_SIZE] = '\0';
+
+                block->hash_mode = HASH_MODE_LEGACY;
+                memset(block->merkle_root, 0, DIGEST_SIZE);
+                return hexToDigest(previous_hex, block->previous_hash) &&
+                       hexToDigest(hash_hex, block->hash);
+        }
+
+        // Read hash mode, proof of work, Merkle root and raw hashes
+        // Only work blocks carry a difficulty and nonce. The legacy hash
+        // does not cover every field, so it is refused outside legacy records.
+        if (fread(&block->hash_mode, sizeof(int), 1, file) != 1 ||
+            (block->hash_mode != HASH_MODE_CANONICAL && block->hash_mode != HASH_MODE_WORK))
+                return 0;
+        if (block->hash_mode == HASH_MODE_WORK &&
+            (fread(&block->difficulty, sizeof(int), 1, file) != 1 ||
+             fread(&block->nonce, sizeof(unsigned long long), 1, file) != 1 ||
+             block->difficulty < 0 || block->difficulty > MAX_DIFFICULTY))
+                return 0;
+        if (fread(block->merkle_root, sizeof(unsigned char), DIGEST_SIZE, file) != DIGEST_SIZE ||
+            fread(block->previous_hash, sizeof(unsigned char), DIGEST_SIZE, file) != DIGEST_SIZE ||
+            fread(block->hash, sizeof(unsigned char), DIGEST_SIZE, file) != DIGEST_SIZE)
+                return 0;
+
+        return 1;
+}
+
+/**
+ * Gets the current time of the monotonic clock
+ * @return Time in nanoseconds
+ */
+long long getMonotonicNs(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Gets the number of bytes a pending transaction counts against a block's byte budget
+ * @param pending Pending transaction
+ * @return Size of its names, amount and timestamp
+ */
+size_t getPendingSize(const PendingTransaction *pending)
+{
+        return strlen(pending->sender) + strlen(pending->receiver) + sizeof(double) + sizeof(time_t);
+}
+
+/**
+ * Adds a transaction to the mempool without blocking
+ * Safe to call from any number of threads. Each cell carries a sequence
+ * number that tells producers and consumers whose turn it is, so the only
+ * contended write is the compare-and-swap that claims a position.
+ * @param mempool Mempool to submit to
+ * @param sender Sender account name
+ * @param receiver Receiver account name
+ * @param amount Amount to transfer
+ * @return 1 if queued, 0 if the mempool is full or stopping
+ */
+int submitTransaction(Mempool *mempool, const char *sender, const char *receiver, double amount)
+{
+        // Announce the submission before checking for a stop, so the sealer
+        // cannot finish while this transaction is still being written
+        atomic_fetch_add(&mempool->active_submitters, 1);
+        if (atomic_load(&mempool->stopping))
+        {
+                atomic_fetch_sub(&mempool->active_submitters, 1);
+                return 0;
+        }
+
+        size_t position = atomic_load_explicit(&mempool->enqueue_position, memory_order_relaxed);
+        MempoolCell *cell;
+        for (;;)
+        {
+                cell = &mempool->cells[position & mempool->mask];
+                size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+                long long difference = (long long)sequence - (long long)position;
+                if (difference == 0)
+                {
+                        // The cell is free for this position; try to claim it
+                        if (atomic_compare_exchange_weak_explicit(&mempool->enqueue_position, &position, position + 1,
+                                                                  memory_order_relaxed, memory_order_relaxed))
+                                break;
+                }
+                else if (difference < 0)
+                {
+                        // The consumer has not freed this cell yet: the queue is full
+                        atomic_fetch_add_explicit(&mempool->full_rejections, 1, memory_order_relaxed);
+                        atomic_fetch_sub(&mempool->active_submitters, 1);
+                        return 0;
+                }
+                else
+                {
+                        position = atomic_load_explicit(&mempool->enqueue_position, memory_order_relaxed);
+                }
+        }
+
+        PendingTransaction *pending = &cell->transaction;
+        strncpy(pending->sender, sender, MAX_SENDER_SIZE - 1);
+        pending->sender[MAX_SENDER_SIZE - 1] = '\0';
+        strncpy(pending->receiver, receiver, MAX_RECEIVER_SIZE - 1);
+        pending->receiver[MAX_RECEIVER_SIZE - 1] = '\0';
+        pending->amount = amount;
+
+        // Publish the cell to consumers
+        atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+        atomic_fetch_sub(&mempool->active_submitters, 1);
+        return 1;
+}
+
+/**
+ * Takes the oldest transaction from the mempool without blocking
+ * @param mempool Mempool to take from
+ * @param pending Receives the transaction
+ * @return 1 if a transaction was taken, 0 if the mempool is empty
+ */
+int takePendingTransaction(Mempool *mempool, PendingTransaction *pending)
+{
+        size_t position = atomic_load_explicit(&mempool->dequeue_position, memory_order_relaxed);
+        MempoolCell *cell;
+        for (;;)
+        {
+                cell = &mempool->cells[position & mempool->mask];
+                size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+                long long difference = (long long)sequence - (long long)(position + 1);
+                if (difference == 0)
+                {
+                        if (atomic_compare_exchange_weak_explicit(&mempool->dequeue_position, &position, position + 1,
+                                                                  memory_order_relaxed, memory_order_relaxed))
+                                break;
+                }
+                else if (difference < 0)
+                {
+                        return 0;
+                }
+                else
+                {
+                        position = atomic_load_explicit(&mempool->dequeue_position, memory_order_relaxed);
+                }
+        }
+
+        *pending = cell->transaction;
+
+        // Hand the cell back to producers for the next lap around the ring
+        atomic_store_explicit(&cell->sequence, position + mempool->mask + 1, memory_order_release);
+        return 1;
+}
+
+/**
+ * Closes the open block by appending a new one, and reports it as sealed
+ * @param mempool Mempool whose open block is full
+ * @return 1 if successful, 0 if the new block could not be added
+ */
+int cutMempoolBlock(Mempool *mempool)
+{
+        Block *sealed = getLatestBlock(mempool->chain);
+        char data[MAX_DATA_SIZE];
+        snprintf(data, sizeof(data), "Mempool block %d", mempool->chain->length);
+        if (!addBlock(mempool->chain, data))
+                return 0;
+
+        mempool->open_bytes = 0;
+        mempool->blocks_sealed++;
+        if (mempool->config.on_sealed)
+                mempool->config.on_sealed(sealed, mempool->config.context);
+        return 1;
+}
+
+/**
+ * Sealer thread: moves pending transactions into the open block and cuts
+ * a new block when the open one reaches its transaction count, its byte
+ * budget or its latency deadline, whichever comes first
+ * @param arg Pointer to the Mempool
+ * @return Always NULL
+ */
+void *mempoolSealerMain(void *arg)
+{
+        Mempool *mempool = (Mempool *)arg;
+        const MempoolConfig *config = &mempool->config;
+        long long deadline_ns = config->max_latency_ms * 1000000LL;
+        PendingTransaction pending;
+
+        for (;;)
+        {
+                // Once stopping with no submission in flight, an empty queue stays empty
+                int draining = atomic_load(&mempool->stopping) && atomic_load(&mempool->active_submitters) == 0;
+
+                if (takePendingTransaction(mempool, &pending))
+                {
+                        Block *open = getLatestBlock(mempool->chain);
+                        size_t size = getPendingSize(&pending);
+
+                        // Cut first if this transaction does not fit the open block;
+                        // if the cut fails, the transaction is counted as failed
+                        if (open->transaction_count > 0 &&
+                            (open->transaction_count >= config->max_transactions ||
+                             (config->max_bytes > 0 && mempool->open_bytes + size > config->max_bytes)))
+                        {
+                                if (!cutMempoolBlock(mempool))
+                                {
+                                        atomic_fetch_add_explicit(&mempool->failed, 1, memory_order_relaxed);
+                                        break;
+                                }
+                                open = getLatestBlock(mempool->chain);
+                        }
+
+                        if (addTransaction(open, pending.sender, pending.receiver, pending.amount))
+                        {
+                                if (open->transaction_count == 1)
+                                        mempool->open_since_ns = getMonotonicNs();
+                                mempool->open_bytes += size;
+                                atomic_fetch_add_explicit(&mempool->accepted, 1, memory_order_relaxed);
+                        }
+                        else
+                        {
+                                atomic_fetch_add_explicit(&mempool->failed, 1, memory_order_relaxed);
+                        }
+                }
+                else if (draining)
+                {
+                        break;
+                }
+                else
+                {
+                        struct timespec idle = {0, MEMPOOL_IDLE_SLEEP_NS};
+                        nanosleep(&idle, NULL);
+                }
+
+                // Cut once the open block has waited long enough for more transactions
+                Block *open = getLatestBlock(mempool->chain);
+                if (deadline_ns > 0 && open->transaction_count > 0 &&
+                    getMonotonicNs() - mempool->open_since_ns >= deadline_ns && !cutMempoolBlock(mempool))
+                        break;
+        }
+
+        // A failed cut leaves the chain unable to grow; refuse further
+        // submissions, and count those already queued as failed once the
+        // submitters in flight have finished
+        if (!atomic_load(&mempool->stopping))
+        {
+                mempool->halted = 1;
+                atomic_store(&mempool->stopping, 1);
+        }
+        if (mempool->halted)
+        {
+                struct timespec idle = {0, MEMPOOL_IDLE_SLEEP_NS};
+                while (atomic_load(&mempool->active_submitters) > 0)
+                        nanosleep(&idle, NULL);
+                while (takePendingTransaction(mempool, &pending))
+                        atomic_fetch_add_explicit(&mempool->failed, 1, memory_order_relaxed);
+        }
+        return NULL;
+}
+
+/**
+ * Checks whether a mempool has stopped accepting transactions
+ * @param mempool Mempool to check
+ * @return 1 if it is stopping or its sealer has halted, 0 otherwise
+ */
+int isMempoolStopped(Mempool *mempool)
+{
+        return atomic_load(&mempool->stopping);
+}
+
+/**
+ * Starts a mempool and its sealer thread on a chain
+ * While the mempool runs, the sealer is the only writer to the chain.
+ * @param chain Chain to extend; its latest block is the first open block
+ * @param config Sealing limits and the sealed-block callback
+ * @return Pointer to the mempool, or NULL if it could not be started
+ */
+Mempool *createMempool(Blockchain *chain, const MempoolConfig *config)
+{
+        if (!chain || !getLatestBlock(chain) || config->capacity < 2 ||
+            (config->capacity & (config->capacity - 1)) != 0 || config->max_transactions < 1)
+                return NULL;
+
+        // Aligned so the producer and consumer positions sit on separate cache lines
+        Mempool *mempool = (Mempool *)aligned_alloc(CACHE_LINE_SIZE, sizeof(Mempool));
+        if (!mempool)
+                return NULL;
+        memset(mempool, 0, sizeof(Mempool));
+
+        mempool->cells = (MempoolCell *)malloc(sizeof(MempoolCell) * config->capacity);
+        if (!mempool->cells)
+        {
+                free(mempool);
+                return NULL;
+        }
+        for (int i = 0; i < config->capacity; i++)
+                atomic_init(&mempool->cells[i].sequence, (size_t)i);
+
+        mempool->mask = (size_t)config->capacity - 1;
+        mempool->chain = chain;
+        mempool->config = *config;
+        atomic_init(&mempool->enqueue_position, 0);
+        atomic_init(&mempool->dequeue_position, 0);
+        atomic_init(&mempool->stopping, 0);
+        atomic_init(&mempool->active_submitters, 0);
+        atomic_init(&mempool->accepted, 0);
+        atomic_init(&mempool->failed, 0);
+        atomic_init(&mempool->full_rejections, 0);
+        mempool->open_since_ns = getMonotonicNs();
+
+        if (pthread_create(&mempool->sealer, NULL, mempoolSealerMain, mempool) != 0)
+        {
+                free(mempool->cells);
+                free(mempool);
+                return NULL;
+        }
+        return mempool;
+}
+
+/**
+ * Stops accepting transactions, waits for the sealer to drain the
+ * mempool, reports the open block as sealed and frees the mempool
+ * The open block stays the chain's latest block.
+ * @param mempool Mempool to stop
+ * @param stats Receives the final counters, or NULL
+ */
+void stopMempool(Mempool *mempool, MempoolStats *stats)
+{
+        atomic_store(&mempool->stopping, 1);
+        pthread_join(mempool->sealer, NULL);
+
+        if (mempool->config.on_sealed)
+                mempool->config.on_sealed(getLatestBlock(mempool->chain), mempool->config.context);
+
+        if (stats)
+        {
+                stats->accepted = atomic_load(&mempool->accepted);
+                stats->failed = atomic_load(&mempool->failed);
+                stats->full_rejections = atomic_load(&mempool->full_rejections);
+                stats->blocks_sealed = mempool->blocks_sealed + 1;
+                stats->halted = mempool->halted;
+        }
+        free(mempool->cells);
+        free(mempool);
+}
+
+/**
+ * Makes room for more bytes at the end of a buffer
+ * @param buffer Buffer to grow
+ * @param extra Number of bytes that must fit after the current contents
+ * @return 1 if successful, 0 if allocation fails
+ */
+int reserveBytes(ByteBuffer *buffer, size_t extra)
+{
+        if (buffer->size + extra <= buffer->capacity)
+                return 1;
+
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + extra)
+                capacity *= 2;
+        unsigned char *data = (unsigned char *)realloc(buffer->data, capacity);
+        if (!data)
+                return 0;
+        buffer->data = data;
+        buffer->capacity = capacity;
+        return 1;
+}
+
+/**
+ * Frees the storage of a byte buffer
+ * @param buffer Buffer to free
+ */
+void freeByteBuffer(ByteBuffer *buffer)
+{
+        free(buffer->data);
+        memset(buffer, 0, sizeof(*buffer));
+}
+
+/**
+ * Writes an unsigned integer as a LEB128 varint: seven bits per byte,
+ * low bits first, with the top bit set on every byte but the last
+ * @param dst Destination with room for 10 bytes
+ * @param value Value to write
+ * @return Pointer just past the written bytes
+ */
+unsigned char *putVarint(unsigned char *dst, unsigned long long value)
+{
+        while (value >= 0x80)
+        {
+                *dst++ = (unsigned char)(value | 0x80);
+                value >>= 7;
+        }
+        *dst++ = (unsigned char)value;
+        return dst;
+}
+
+/**
+ * Reads a varint written by putVarint
+ * @param src Start of the varint
+ * @param end End of the readable bytes
+ * @param value Receives the value
+ * @return Pointer just past the varint, or NULL if it is truncated or too long
+ */
+const unsigned char *getVarint(const unsigned char *src, const unsigned char *end, unsigned long long *value)
+{
+        unsigned long long result = 0;
+        for (int shift = 0; shift < 64 && src < end; shift += 7)
+        {
+                unsigned char byte = *src++;
+                result |= (unsigned long long)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                        *value = result;
+                        return src;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Maps a signed value to an unsigned one so small magnitudes stay small
+ * @param value Signed value
+ * @return Zigzag encoding: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+ */
+unsigned long long zigzagEncode(long long value)
+{
+        return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+/**
+ * Reverses zigzagEncode
+ * @param value Zigzag-encoded value
+ * @return Signed value
+ */
+long long zigzagDecode(unsigned long long value)
+{
+        return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+/**
+ * Gets the compact code of a transaction amount
+ * Non-negative amounts that are a whole number of cents, which is almost
+ * all of them, are coded as the cents plus one. Anything else is coded as
+ * 0 and stored separately as the raw double, so every amount reads back
+ * bit for bit.
+ * @param amount Amount to code
+ * @return Code of the amount, 0 if it must be stored raw
+ */
+unsigned long long getAmountCode(double amount)
+{
+        if (amount >= 0 && amount < 1e15)
+        {
+                long long cents = (long long)(amount * 100.0 + 0.5);
+                if ((double)cents / 100.0 == amount && !(amount == 0 && 1 / amount < 0))
+                        return (unsigned long long)cents + 1;
+        }
+        return 0;
+}
+
+/**
+ * Writes a column of integers as byte planes
+ * The column is its width in bytes, enough for the largest value, then
+ * the lowest byte of every value, then the next byte of every value and
+ * so on. Bytes in the same position look alike, which suits zlib far
+ * better than interleaved varints.
+ * @param dst Destination with room for 1 + 8 * count bytes
+ * @param values Values to write
+ * @param count Number of values
+ * @return Pointer just past the written bytes
+ */
+unsigned char *putColumn(unsigned char *dst, const unsigned long long *values, int count)
+{
+        unsigned long long largest = 0;
+        for (int i = 0; i < count; i++)
+                largest |= values[i];
+        int width = 0;
+        while (largest >> (8 * width) && width < 8)
+                width++;
+
+        *dst++ = (unsigned char)width;
+        for (int plane = 0; plane < width; plane++)
+        {
+                for (int i = 0; i < count; i++)
+                        *dst++ = (unsigned char)(values[i] >> (8 * plane));
+        }
+        return dst;
+}
+
+/**
+ * Reads a column written by putColumn
+ * @param src Start of the column
+ * @param end End of the readable bytes
+ * @param values Receives the values
+ * @param count Number of values
+ * @param max_width Widest column the caller accepts
+ * @return Pointer just past the column, or NULL if it is truncated or too wide
+ */
+const unsigned char *getColumn(const unsigned char *src, const unsigned char *end, unsigned long long *values, int count,
+                               int max_width)
+{
+        if (src >= end || *src > max_width)
+                return NULL;
+        int width = *src++;
+        if ((unsigned long long)(end - src) < (unsigned long long)width * (unsigned long long)count)
+                return NULL;
+
+        memset(values, 0, sizeof(unsigned long long) * count);
+        for (int plane = 0; plane < width; plane++)
+        {
+                for (int i = 0; i < count; i++)
+                        values[i] |= (unsigned long long)*src++ << (8 * plane);
+        }
+        return src;
+}
+
+/**
+ * Appends the compact record of a block to a buffer
+ * Header integers are varints, timestamps are deltas, the data string is
+ * length-prefixed and the index is implied by the record's position.
+ * Transactions are stored a field at a time: senders, receivers and amount
+ * codes as byte-plane columns, then the raw amounts that have no code,
+ * then timestamp deltas. The previous hash is left out when it matches the
+ * hash of the record before, which the low bit of the stored hash mode
+ * records.
+ * @param buffer Buffer to append to
+ * @param block Block to encode
+ * @param previous Block encoded just before in the same group, or NULL
+ * @return 1 if successful, 0 if allocation fails
+ */
+int encodeCompactBlock(ByteBuffer *buffer, const Block *block, const Block *previous)
+{
+        int count = block->transaction_count;
+        const Transaction *trans = block->transactions;
+        size_t data_length = strnlen(block->data, MAX_DATA_SIZE - 1);
+        size_t bound = 6 * 10 + data_length + 3 + (size_t)count * (4 + 4 + 16 + 10) + 3 * DIGEST_SIZE;
+        unsigned long long *column = (unsigned long long *)malloc(sizeof(unsigned long long) * (count > 0 ? count : 1));
+        if (!column || !reserveBytes(buffer, bound))
+        {
+                free(column);
+                return 0;
+        }
+
+        int linked = previous && memcmp(block->previous_hash, previous->hash, DIGEST_SIZE) == 0;
+        unsigned char *dst = buffer->data + buffer->size;
+        dst = putVarint(dst, zigzagEncode((long long)(block->timestamp - (previous ? previous->timestamp : 0))));
+        dst = putVarint(dst, data_length);
+        memcpy(dst, block->data, data_length);
+        dst += data_length;
+        dst = putVarint(dst, (unsigned long long)block->hash_mode << 1 | (unsigned long long)linked);
+        if (block->hash_mode == HASH_MODE_WORK)
+        {
+                dst = putVarint(dst, (unsigned long long)block->difficulty);
+                dst = putVarint(dst, block->nonce);
+        }
+
+        dst = putVarint(dst, (unsigned long long)count);
+        if (count > 0)
+        {
+                for (int i = 0; i < count; i++)
+                        column[i] = trans[i].sender_id;
+                dst = putColumn(dst, column, count);
+                for (int i = 0; i < count; i++)
+                        column[i] = trans[i].receiver_id;
+                dst = putColumn(dst, column, count);
+                for (int i = 0; i < count; i++)
+                        column[i] = getAmountCode(trans[i].amount);
+                dst = putColumn(dst, column, count);
+                for (int i = 0; i < count; i++)
+                {
+                        if (column[i] == 0)
+                        {
+                                memcpy(dst, &trans[i].amount, sizeof(double));
+                                dst += sizeof(double);
+                        }
+                }
+
+                time_t timestamp = block->timestamp;
+                for (int i = 0; i < count; i++)
+                {
+                        dst = putVarint(dst, zigzagEncode((long long)(trans[i].timestamp - timestamp)));
+                        timestamp = trans[i].timestamp;
+                }
+        }
+        free(column);
+
+        memcpy(dst, block->merkle_root, DIGEST_SIZE);
+        dst += DIGEST_SIZE;
+        if (!linked)
+        {
+                memcpy(dst, block->previous_hash, DIGEST_SIZE);
+                dst += DIGEST_SIZE;
+        }
+        memcpy(dst, block->hash, DIGEST_SIZE);
+        dst += DIGEST_SIZE;
+
+        buffer->size = (size_t)(dst - buffer->data);
+        return 1;
+}
+
+/**
+ * Reads a compact block record written by encodeCompactBlock
+ * @param cursor Position of the record; advanced past it on success
+ * @param end End of the readable bytes
+ * @param block Block to fill; its chain must be set
+ * @param index Position of the block in the chain
+ * @param previous_timestamp Timestamp of the record before, 0 at the start of a group
+ * @param previous_hash Hash of the record before, NULL at the start of a group
+ * @param pool Pool the transactions are allocated from
+ * @param mode DECODE_SEALED, DECODE_PAGED, or DECODE_HEADERS_ONLY to leave the transactions out
+ * @return 1 if successful, 0 if the record is truncated or malformed
+ */
+int decodeCompactBlock(const unsigned char **cursor, const unsigned char *end, Block *block, int index,
+                       time_t previous_timestamp, const unsigned char *previous_hash, TransactionPool *pool, int mode)
+{
+        const unsigned char *src = *cursor;
+        unsigned long long value, data_length, hash_mode, count;
+
+        block->index = index;
+        block->frontier = NULL;
+        block->difficulty = 0;
+        block->nonce = 0;
+        block->transactions = NULL;
+        block->transaction_count = 0;
+        block->transaction_capacity = 0;
+
+        if (!(src = getVarint(src, end, &value)))
+                return 0;
+        block->timestamp = previous_timestamp + (time_t)zigzagDecode(value);
+
+        if (!(src = getVarint(src, end, &data_length)) || data_length >= MAX_DATA_SIZE ||
+            (unsigned long long)(end - src) < data_length)
+                return 0;
+        memset(block->data, 0, MAX_DATA_SIZE);
+        memcpy(block->data, src, data_length);
+        src += data_length;
+
+        if (!(src = getVarint(src, end, &hash_mode)))
+                return 0;
+        int linked = (int)(hash_mode & 1);
+        hash_mode >>= 1;
+        if ((linked && !previous_hash) || (hash_mode != HASH_MODE_CANONICAL && hash_mode != HASH_MODE_WORK))
+                return 0;
+        block->hash_mode = (int)hash_mode;
+        if (hash_mode == HASH_MODE_WORK)
+        {
+                if (!(src = getVarint(src, end, &value)) || value > MAX_DIFFICULTY ||
+                    !(src = getVarint(src, end, &block->nonce)))
+                        return 0;
+                block->difficulty = (int)value;
+        }
+
+        // Transactions go into an array from the chain's pool, or a scratch
+        // array when only the header is kept. Each takes at least the byte
+        // of its timestamp delta, so a count the record cannot hold is
+        // refused before anything is allocated.
+        if (!(src = getVarint(src, end, &count)) || count > MAX_BLOCK_TRANSACTIONS ||
+            count > (unsigned long long)(end - src))
+                return 0;
+        Transaction *trans = NULL;
+        int capacity = (int)count;
+        if (count > 0 && mode == DECODE_HEADERS_ONLY)
+        {
+                trans = (Transaction *)malloc(sizeof(Transaction) * count);
+        }
+        else if (count > 0 && mode == DECODE_PAGED)
+        {
+                int size_class = getPoolClass((int)count);
+                trans = allocateTransactionClass(pool, size_class);
+                capacity = 1 << size_class;
+        }
+        else
+        {
+                trans = allocateTransactions(pool, (int)count);
+        }
+        if (count > 0 && !trans)
+                return 0;
+        if (mode != DECODE_HEADERS_ONLY)
+        {
+                block->transactions = trans;
+                block->transaction_capacity = capacity;
+        }
+        if (count > 0)
+        {
+                int n = (int)count;
+                unsigned long long *column = (unsigned long long *)malloc(sizeof(unsigned long long) * n);
+                if (!column)
+                {
+                        if (mode == DECODE_HEADERS_ONLY)
+                                free(trans);
+                        return 0;
+                }
+
+                int ok = (src = getColumn(src, end, column, n, 4)) != NULL;
+                for (int i = 0; ok && i < n; i++)
+                        trans[i].sender_id = (unsigned int)column[i];
+                ok = ok && (src = getColumn(src, end, column, n, 4)) != NULL;
+                for (int i = 0; ok && i < n; i++)
+                        trans[i].receiver_id = (unsigned int)column[i];
+                ok = ok && (src = getColumn(src, end, column, n, 8)) != NULL;
+                for (int i = 0; ok && i < n; i++)
+                {
+                        if (column[i] > 0)
+                        {
+                                trans[i].amount = (double)(column[i] - 1) / 100.0;
+                        }
+                        else if (end - src >= (long)sizeof(double))
+                        {
+                                memcpy(&trans[i].amount, src, sizeof(double));
+                                src += sizeof(double);
+                        }
+                        else
+                        {
+                                ok = 0;
+                        }
+                }
+                free(column);
+
+                time_t timestamp = block->timestamp;
+                for (int i = 0; ok && i < n; i++)
+                {
+                        ok = (src = getVarint(src, end, &value)) != NULL;
+                        trans[i].timestamp = timestamp + (time_t)zigzagDecode(value);
+                        timestamp = trans[i].timestamp;
+                }
+                if (mode == DECODE_HEADERS_ONLY)
+                        free(trans);
+                if (!ok)
+                        return 0;
+        }
+        block->transaction_count = (int)count;
+
+        if (end - src < (linked ? 2 : 3) * DIGEST_SIZE)
+                return 0;
+        memcpy(block->merkle_root, src, DIGEST_SIZE);
+        src += DIGEST_SIZE;
+        if (linked)
+        {
+                memcpy(block->previous_hash, previous_hash, DIGEST_SIZE);
+        }
+        else
+        {
+                memcpy(block->previous_hash, src, DIGEST_SIZE);
+                src += DIGEST_SIZE;
+        }
+        memcpy(block->hash, src, DIGEST_SIZE);
+        *cursor = src + DIGEST_SIZE;
+        return 1;
+}
+
+/**
+ * Writes the header of a blockchain file
+ * @param file File to write to
+ * @param length Number of blocks (ingest patches it in once known)
+ * @param flags Any of FILE_FLAG_COMPRESSED and FILE_FLAG_INDEXED
+ */
+void writeFileHeader(FILE *file, int length, int flags)
+{
+        unsigned int version = FILE_VERSION;
+        fwrite(FILE_MAGIC, sizeof(char), 4, file);
+        fwrite(&version, sizeof(unsigned int), 1, file);
+        fwrite(&length, sizeof(int), 1, file);
+        fwrite(&flags, sizeof(int), 1, file);
+}
+
+/**
+ * Reads the header of a blockchain file of any supported version
+ * @param file File positioned at its start
+ * @param format Receives FILE_FORMAT_LEGACY, FILE_FORMAT_FIXED or FILE_FORMAT_COMPACT
+ * @param flags Receives the header flags (0 for older formats)
+ * @param length Receives the number of blocks
+ * @return 1 if successful, 0 if the header is unsupported or truncated
+ */
+int readFileHeader(FILE *file, int *format, int *flags, int *length)
+{
+        // Files without the magic header were written before the binary
+        // hash encoding and start directly with the chain length
+        char magic[4];
+        *flags = 0;
+        *format = FILE_FORMAT_LEGACY;
+        if (fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, FILE_MAGIC, 4) == 0)
+        {
+                unsigned int version;
+                if (fread(&version, sizeof(unsigned int), 1, file) != 1 ||
+                    (version != FILE_VERSION && version != FILE_VERSION_FIXED))
+                {
+                        printf("Error: Unsupported blockchain file version\n");
+                        return 0;
+                }
+                *format = version == FILE_VERSION ? FILE_FORMAT_COMPACT : FILE_FORMAT_FIXED;
+        }
+        else
+        {
+                rewind(file);
+        }
+
+        if (fread(length, sizeof(int), 1, file) != 1 || *length < 0)
+        {
+                printf("Error: Could not read chain length\n");
+                return 0;
+        }
+        if (*format == FILE_FORMAT_COMPACT &&
+            (fread(flags, sizeof(int), 1, file) != 1 || (*flags & ~(FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED)) != 0))
+        {
+                printf("Error: Unsupported blockchain file flags\n");
+                return 0;
+        }
+        return 1;
+}
+
+/**
+ * Detects whether the kernel lets this process use an io_uring
+ * @return One of the IO_BACKEND_* constants
+ */
+int detectIoBackend(void)
+{
+#ifdef ASYNC_IO_URING
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int ring_fd = (int)syscall(__NR_io_uring_setup, 1, &params);
+        if (ring_fd >= 0)
+        {
+                close(ring_fd);
+                return IO_BACKEND_URING;
+        }
+#endif
+        return IO_BACKEND_STDIO;
+}
+
+// Selected backend; -1 until first use
+atomic_int io_backend = -1;
+
+/**
+ * Gets the backend used for block group I/O, detecting it on first use
+ * @return One of the IO_BACKEND_* constants
+ */
+int getIoBackend(void)
+{
+        int backend = atomic_load(&io_backend);
+        if (backend < 0)
+        {
+                backend = detectIoBackend();
+                atomic_store(&io_backend, backend);
+        }
+        return backend;
+}
+
+/**
+ * Overrides the backend used for block group I/O, e.g. to compare them
+ * @param backend One of the IO_BACKEND_* constants
+ * @return 1 if the backend is available, 0 if it was left unchanged
+ */
+int setIoBackend(int backend)
+{
+        int supported = backend == IO_BACKEND_STDIO || backend == detectIoBackend();
+        if (supported)
+                atomic_store(&io_backend, backend);
+        return supported;
+}
+
+/**
+ * Gets a printable name for an I/O backend
+ * @param backend One of the IO_BACKEND_* constants
+ * @return Name of the backend
+ */
+const char *ioBackendName(int backend)
+{
+        return backend == IO_BACKEND_URING ? "io_uring" : "stdio";
+}
+
+/**
+ * Starts moving the block groups of a file through an io_uring
+ * Block groups then go through writeAsyncFile or readAsyncFile until
+ * closeAsyncFile hands the file back to stdio.
+ * @param file File positioned just after its header
+ * @param writing 1 to write groups from there on, 0 to read ahead to the end of the file
+ * @return Pointer to the ring, or NULL to keep using stdio
+ */
+AsyncFile *openAsyncFile(FILE *file, int writing)
+{
+#ifdef ASYNC_IO_URING
+        if (getIoBackend() != IO_BACKEND_URING)
+                return NULL;
+
+        // Writes go at explicit offsets, so stdio must not hold any back
+        struct stat info;
+        long long offset = writing && fflush(file) != 0 ? -1 : ftell(file);
+        if (offset < 0 || fstat(fileno(file), &info) != 0)
+                return NULL;
+
+        AsyncFile *async = (AsyncFile *)calloc(1, sizeof(AsyncFile));
+        if (!async)
+                return NULL;
+        async->fd = fileno(file);
+        async->writing = writing;
+        async->offset = offset;
+        async->end = info.st_size;
+        async->memory = (unsigned char *)aligned_alloc(4096, (size_t)ASYNC_IO_BUFFER_COUNT * ASYNC_IO_BUFFER_SIZE);
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        async->ring_fd = async->memory ? (int)syscall(__NR_io_uring_setup, ASYNC_IO_BUFFER_COUNT, &params) : -1;
+        if (async->ring_fd < 0)
+        {
+                free(async->memory);
+                free(async);
+                return NULL;
+        }
+
+        // Map the submission and completion rings and the submission entries
+        async->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        async->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+                if (async->cq_ring_size > async->sq_ring_size)
+                        async->sq_ring_size = async->cq_ring_size;
+                async->cq_ring_size = 0;
+        }
+        async->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        async->sq_ring = mmap(NULL, async->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              async->ring_fd, IORING_OFF_SQ_RING);
+        async->cq_ring = async->cq_ring_size == 0 ? async->sq_ring
+                                                  : mmap(NULL, async->cq_ring_size, PROT_READ | PROT_WRITE,
+                                                         MAP_SHARED | MAP_POPULATE, async->ring_fd, IORING_OFF_CQ_RING);
+        async->sqes = mmap(NULL, async->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async->ring_fd,
+                           IORING_OFF_SQES);
+        if (async->sq_ring == MAP_FAILED || async->cq_ring == MAP_FAILED || async->sqes == MAP_FAILED)
+        {
+                async->failed = 1;
+                closeAsyncFile(async, NULL);
+                return NULL;
+        }
+        unsigned char *sq = (unsigned char *)async->sq_ring;
+        unsigned char *cq = (unsigned char *)async->cq_ring;
+        async->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+        async->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+        async->sq_array = (unsigned int *)(sq + params.sq_off.array);
+        async->cq_head = (unsigned int *)(cq + params.cq_off.head);
+        async->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+        async->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+        async->cqes = cq + params.cq_off.cqes;
+
+        // Registered buffers spare the kernel mapping them on every
+        // transfer; plain transfers still work where registration is refused
+        struct iovec vectors[ASYNC_IO_BUFFER_COUNT];
+        for (int i = 0; i < ASYNC_IO_BUFFER_COUNT; i++)
+        {
+                async->buffers[i].data = async->memory + (size_t)i * ASYNC_IO_BUFFER_SIZE;
+                vectors[i].iov_base = async->buffers[i].data;
+                vectors[i].iov_len = ASYNC_IO_BUFFER_SIZE;
+        }
+        async->fixed = syscall(__NR_io_uring_register, async->ring_fd, IORING_REGISTER_BUFFERS, vectors,
+                               ASYNC_IO_BUFFER_COUNT) == 0;
+
+        // A reader requests the first chunks straight away
+        async->buffers[0].offset = offset;
+        for (int i = 0; !writing && i < ASYNC_IO_BUFFER_COUNT; i++)
+        {
+                if (!submitAsyncBuffer(async, i))
+                {
+                        closeAsyncFile(async, NULL);
+                        return NULL;
+                }
+        }
+        return async;
+#else
+        (void)file;
+        (void)writing;
+        return NULL;
+#endif
+}
+
+/**
+ * Submits the transfer of one staging buffer
+ * A writer's buffer holds length bytes for its offset. A reader's buffer
+ * is given the next chunk of the file, or left empty past the end.
+ * @param async Ring to submit to
+ * @param index Buffer to transfer, not already in flight
+ * @return 1 if submitted or nothing was left to read, 0 if failed
+ */
+int submitAsyncBuffer(AsyncFile *async, int index)
+{
+#ifdef ASYNC_IO_URING
+        AsyncBuffer *buffer = &async->buffers[index];
+        if (!async->writing)
+        {
+                long long remaining = async->end - async->offset;
+                buffer->offset = async->offset;
+                buffer->length = remaining < ASYNC_IO_BUFFER_SIZE ? (size_t)(remaining > 0 ? remaining : 0)
+                                                                  : ASYNC_IO_BUFFER_SIZE;
+                buffer->position = 0;
+                async->offset += (long long)buffer->length;
+        }
+        if (buffer->length == 0)
+                return 1;
+
+        // Only this thread submits, and each buffer has at most one entry in
+        // flight, so the ring of ASYNC_IO_BUFFER_COUNT entries never overflows
+        unsigned int tail = *async->sq_tail;
+        unsigned int slot = tail & async->sq_mask;
+        struct io_uring_sqe *sqe = &((struct io_uring_sqe *)async->sqes)[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        if (async->writing)
+                sqe->opcode = async->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        else
+                sqe->opcode = async->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = async->fd;
+        sqe->off = (unsigned long long)buffer->offset;
+        sqe->addr = (unsigned long long)(uintptr_t)buffer->data;
+        sqe->len = (unsigned int)buffer->length;
+        sqe->buf_index = (unsigned short)index;
+        sqe->user_data = (unsigned long long)index;
+        async->sq_array[slot] = slot;
+        __atomic_store_n(async->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, async->ring_fd, 1, 0, 0, NULL, 0) != 1)
+        {
+                async->failed = 1;
+                return 0;
+        }
+        buffer->in_flight = 1;
+        return 1;
+#else
+        (void)async;
+        (void)index;
+        return 0;
+#endif
+}
+
+/**
+ * Waits for the transfer of one staging buffer to complete
+ * Completions of other buffers reaped meanwhile are recorded as well.
+ * @param async Ring to wait on
+ * @param index Buffer to wait for
+ * @return 1 if the buffer was transferred in full, 0 if any transfer failed
+ */
+int waitAsyncBuffer(AsyncFile *async, int index)
+{
+#ifdef ASYNC_IO_URING
+        while (async->buffers[index].in_flight)
+        {
+                unsigned int head = *async->cq_head;
+                if (head == __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE))
+                {
+                        if (syscall(__NR_io_uring_enter, async->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                            errno != EINTR)
+                        {
+                                async->failed = 1;
+                                return 0;
+                        }
+                        continue;
+                }
+
+                // Transfers within one file are never short except on error
+                const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)async->cqes)[head & async->cq_mask];
+                AsyncBuffer *done = &async->buffers[cqe->user_data];
+                if (cqe->res < 0 || (size_t)cqe->res != done->length)
+                        async->failed = 1;
+                done->in_flight = 0;
+                __atomic_store_n(async->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+        return !async->failed;
+#else
+        (void)async;
+        (void)index;
+        return 0;
+#endif
+}
+
+/**
+ * Appends bytes to a file opened for writing with openAsyncFile
+ * Full buffers are submitted as they fill; a buffer is only waited on
+ * when it comes round for reuse.
+ * @param async Ring of the file
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return 1 if successful, 0 if a transfer failed
+ */
+int writeAsyncFile(AsyncFile *async, const void *data, size_t size)
+{
+        const unsigned char *src = (const unsigned char *)data;
+        while (size > 0 && !async->failed)
+        {
+                AsyncBuffer *buffer = &async->buffers[async->current];
+                size_t count = ASYNC_IO_BUFFER_SIZE - buffer->length;
+                if (count > size)
+                        count = size;
+                memcpy(buffer->data + buffer->length, src, count);
+                buffer->length += count;
+                async->offset += (long long)count;
+                src += count;
+                size -= count;
+                if (buffer->length < ASYNC_IO_BUFFER_SIZE)
+                        break;
+
+                // Hand the full buffer to the kernel and move on to the next
+                int next = (async->current + 1) % ASYNC_IO_BUFFER_COUNT;
+                if (!submitAsyncBuffer(async, async->current) || !waitAsyncBuffer(async, next))
+                        return 0;
+                async->current = next;
+                async->buffers[next].offset = async->offset;
+                async->buffers[next].length = 0;
+        }
+        return !async->failed;
+}
+
+/**
+ * Reads bytes from a file opened for reading with openAsyncFile
+ * A chunk is requested again for the next part of the file as soon as
+ * it has been consumed, so reads stay ahead of the caller.
+ * @param async Ring of the file
+ * @param data Buffer for the bytes
+ * @param size Number of bytes
+ * @return 1 if successful, 0 if the file ends first or a transfer failed
+ */
+int readAsyncFile(AsyncFile *async, void *data, size_t size)
+{
+        unsigned char *dst = (unsigned char *)data;
+        while (size > 0)
+        {
+                AsyncBuffer *buffer = &async->buffers[async->current];
+                if (!waitAsyncBuffer(async, async->current) || buffer->length == 0)
+                        return 0;
+
+                size_t count = buffer->length - buffer->position;
+                if (count > size)
+                        count = size;
+                memcpy(dst, buffer->data + buffer->position, count);
+                buffer->position += count;
+                dst += count;
+                size -= count;
+                if (buffer->position == buffer->length)
+                {
+                        if (!submitAsyncBuffer(async, async->current))
+                                return 0;
+                        async->current = (async->current + 1) % ASYNC_IO_BUFFER_COUNT;
+                }
+        }
+        return 1;
+}
+
+/**
+ * Finishes the transfers of a file and hands it back to stdio
+ * A writer's last buffer is written out; a reader's read-ahead is
+ * dropped. The file is positioned just after the bytes the caller wrote
+ * or consumed.
+ * @param async Ring to close, or NULL
+ * @param file File it was opened on, or NULL to leave it where it is
+ * @return 1 if every transfer succeeded, 0 if not
+ */
+int closeAsyncFile(AsyncFile *async, FILE *file)
+{
+        if (!async)
+                return 1;
+
+#ifdef ASYNC_IO_URING
+        long long position = async->offset;
+        if (async->writing)
+        {
+                if (!async->failed)
+                        submitAsyncBuffer(async, async->current);
+        }
+        else
+        {
+                const AsyncBuffer *buffer = &async->buffers[async->current];
+                if (buffer->length > 0)
+                        position = buffer->offset + (long long)buffer->position;
+        }
+
+        // The kernel may still be filling or reading the buffers
+        for (int i = 0; async->cq_head && i < ASYNC_IO_BUFFER_COUNT; i++)
+                waitAsyncBuffer(async, i);
+        int ok = !async->failed;
+        if (ok && file)
+                ok = fseek(file, (long)position, SEEK_SET) == 0;
+
+        if (async->sqes && async->sqes != MAP_FAILED)
+                munmap(async->sqes, async->sqes_size);
+        if (async->cq_ring_size > 0 && async->cq_ring && async->cq_ring != MAP_FAILED)
+                munmap(async->cq_ring, async->cq_ring_size);
+        if (async->sq_ring && async->sq_ring != MAP_FAILED)
+                munmap(async->sq_ring, async->sq_ring_size);
+        close(async->ring_fd);
+        free(async->memory);
+        free(async);
+        return ok;
+#else
+        (void)file;
+        free(async);
+        return 0;
+#endif
+}
+
+/**
+ * Starts writing the block groups of a compact file
+ * @param writer Writer to initialise
+ * @param file File positioned just after the header
+ * @param flags Flags the header was written with
+ */
+void initBlockFileWriter(BlockFileWriter *writer, FILE *file, int flags)
+{
+        memset(writer, 0, sizeof(*writer));
+        writer->file = file;
+        writer->flags = flags;
+}
+
+/**
+ * Gets the file offset the next group of a writer will be written at
+ * @param writer Writer to query
+ * @return Offset in the file, or -1 if it cannot be told
+ */
+long long tellBlockFileWriter(BlockFileWriter *writer)
+{
+        return writer->async ? writer->async->offset : ftell(writer->file);
+}
+
+/**
+ * Writes the current group as its raw size, stored size and bytes
+ * A group that does not shrink under zlib is stored as is, which the
+ * reader recognises by the two sizes being equal.
+ * @param writer Writer whose group is written
+ * @return 1 if successful, 0 if allocation fails
+ */
+int flushBlockGroup(BlockFileWriter *writer)
+{
+        if (writer->group_blocks == 0)
+                return 1;
+
+        unsigned int raw_size = (unsigned int)writer->group.size;
+        const unsigned char *stored = writer->group.data;
+        unsigned int stored_size = raw_size;
+        if (writer->flags & FILE_FLAG_COMPRESSED)
+        {
+                uLongf packed_size = compressBound(raw_size);
+                writer->packed.size = 0;
+                if (!reserveBytes(&writer->packed, packed_size))
+                        return 0;
+                if (compress2(writer->packed.data, &packed_size, writer->group.data, raw_size, FILE_COMPRESSION_LEVEL) == Z_OK &&
+                    packed_size < raw_size)
+                {
+                        stored = writer->packed.data;
+                        stored_size = (unsigned int)packed_size;
+                }
+        }
+
+        // The footer locates each record by its group and its offset in it
+        long long group_offset = tellBlockFileWriter(writer);
+        for (int i = writer->blocks_written - writer->group_blocks; i < writer->blocks_written; i++)
+                writer->offsets[i].group_offset = group_offset;
+
+        if (writer->async)
+        {
+                if (!writeAsyncFile(writer->async, &raw_size, sizeof(unsigned int)) ||
+                    !writeAsyncFile(writer->async, &stored_size, sizeof(unsigned int)) ||
+                    !writeAsyncFile(writer->async, stored, stored_size))
+                        return 0;
+        }
+        else
+        {
+                fwrite(&raw_size, sizeof(unsigned int), 1, writer->file);
+                fwrite(&stored_size, sizeof(unsigned int), 1, writer->file);
+                fwrite(stored, 1, stored_size, writer->file);
+        }
+        writer->group.size = 0;
+        writer->group_blocks = 0;
+        writer->previous = NULL;
+        return 1;
+}
+
+/**
+ * Adds one block to a compact file
+ * @param writer Writer to add to
+ * @param block Block to write
+ * @return 1 if successful, 0 if allocation fails
+ */
+int writeBlockRecord(BlockFileWriter *writer, const Block *block)
+{
+        if (writer->blocks_written == writer->offset_capacity)
+        {
+                int capacity = writer->offset_capacity ? writer->offset_capacity * 2 : FILE_GROUP_BLOCKS;
+                BlockOffset *offsets = (BlockOffset *)realloc(writer->offsets, sizeof(BlockOffset) * capacity);
+                if (!offsets)
+                {
+                        writer->failed = 1;
+                        return 0;
+                }
+                writer->offsets = offsets;
+                writer->offset_capacity = capacity;
+        }
+
+        size_t record_offset = writer->group.size;
+        if (!encodeCompactBlock(&writer->group, block, writer->previous))
+        {
+                writer->failed = 1;
+                return 0;
+        }
+        writer->offsets[writer->blocks_written].record_offset = (unsigned int)record_offset;
+        writer->offsets[writer->blocks_written].record_size = (unsigned int)(writer->group.size - record_offset);
+        writer->previous = block;
+        writer->blocks_written++;
+        if (++writer->group_blocks == FILE_GROUP_BLOCKS && !flushBlockGroup(writer))
+        {
+                writer->failed = 1;
+                return 0;
+        }
+        return 1;
+}
+
+/**
+ * Writes the last partial group and frees the writer's group buffers
+ * The record offsets are kept for writeBlockFileFooter.
+ * @param writer Writer to finish
+ * @return 1 if every block was written, 0 otherwise
+ */
+int finishBlockFileWriter(BlockFileWriter *writer)
+{
+        if (!flushBlockGroup(writer))
+                writer->failed = 1;
+
+        // The dictionary and footer go through stdio again
+        if (!closeAsyncFile(writer->async, writer->file))
+                writer->failed = 1;
+        writer->async = NULL;
+        freeByteBuffer(&writer->group);
+        freeByteBuffer(&writer->packed);
+        return !writer->failed;
+}
+
+/**
+ * Writes the block index footer at the current end of a compact file
+ * The footer holds one BlockOffset per block, then a fixed-size trailer,
+ * so a reader can find any block from the end of the file.
+ * @param writer Finished writer whose records are indexed
+ * @param dictionary_offset File offset of the account dictionary
+ * @return 1 if successful, 0 if the writer failed or the file cannot be positioned
+ */
+int writeBlockFileFooter(BlockFileWriter *writer, long long dictionary_offset)
+{
+        BlockFileFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.dictionary_offset = dictionary_offset;
+        footer.index_offset = ftell(writer->file);
+        footer.length = writer->blocks_written;
+        memcpy(footer.magic, FILE_FOOTER_MAGIC, 4);
+        if (writer->failed || footer.index_offset < 0)
+                return 0;
+
+        if (writer->blocks_written > 0)
+                fwrite(writer->offsets, sizeof(BlockOffset), writer->blocks_written, writer->file);
+        fwrite(&footer, sizeof(BlockFileFooter), 1, writer->file);
+        return 1;
+}
+
+/**
+ * Frees everything a block file writer holds
+ * @param writer Writer to free
+ */
+void freeBlockFileWriter(BlockFileWriter *writer)
+{
+        closeAsyncFile(writer->async, NULL);
+        writer->async = NULL;
+        freeByteBuffer(&writer->group);
+        freeByteBuffer(&writer->packed);
+        free(writer->offsets);
+        writer->offsets = NULL;
+        writer->offset_capacity = 0;
+}
+
+/**
+ * Starts reading the blocks of a file whose header has been read
+ * @param reader Reader to initialise
+ * @param file File positioned just after the header
+ * @param format Format reported by readFileHeader
+ * @param flags Flags reported by readFileHeader
+ */
+void initBlockFileReader(BlockFileReader *reader, FILE *file, int format, int flags)
+{
+        memset(reader, 0, sizeof(*reader));
+        reader->file = file;
+        reader->format = format;
+        reader->flags = flags;
+}
+
+/**
+ * Reads and, if needed, decompresses the next block group
+ * @param reader Reader to fill
+ * @return 1 if successful, 0 if the group is truncated or corrupt
+ */
+int readBlockGroup(BlockFileReader *reader)
+{
+        unsigned int raw_size, stored_size;
+        if (!readGroupBytes(reader, &raw_size, sizeof(unsigned int)) ||
+            !readGroupBytes(reader, &stored_size, sizeof(unsigned int)) ||
+            raw_size > FILE_GROUP_MAX_SIZE || stored_size > raw_size)
+                return 0;
+
+        reader->group.size = 0;
+        reader->position = 0;
+        reader->previous_timestamp = 0;
+        reader->previous_hash = NULL;
+        if (stored_size == raw_size)
+        {
+                if (!reserveBytes(&reader->group, raw_size) || !readGroupBytes(reader, reader->group.data, raw_size))
+                        return 0;
+                reader->group.size = raw_size;
+                return 1;
+        }
+
+        reader->packed.size = 0;
+        return reserveBytes(&reader->packed, stored_size) &&
+               readGroupBytes(reader, reader->packed.data, stored_size) &&
+               unpackBlockGroup(&reader->group, reader->packed.data, stored_size, raw_size);
+}
+
+/**
+ * Reads bytes of the block groups, from the read-ahead if there is one
+ * @param reader Reader to read for
+ * @param data Buffer for the bytes
+ * @param size Number of bytes
+ * @return 1 if successful, 0 if the file ends first
+ */
+int readGroupBytes(BlockFileReader *reader, void *data, size_t size)
+{
+        if (reader->async)
+                return readAsyncFile(reader->async, data, size);
+        return fread(data, 1, size, reader->file) == size;
+}
+
+/**
+ * Reads the next block of a file in any supported format
+ * @param reader Reader positioned at the block
+ * @param block Block to fill; its chain must be set
+ * @return 1 if successful, 0 if the record is truncated or malformed
+ */
+int readBlockRecord(BlockFileReader *reader, Block *block)
+{
+        if (reader->format != FILE_FORMAT_COMPACT)
+                return readBlock(reader->file, block, reader->format == FILE_FORMAT_LEGACY);
+
+        if (reader->position == reader->group.size && !readBlockGroup(reader))
+                return 0;
+
+        const unsigned char *cursor = reader->group.data + reader->position;
+        if (!decodeCompactBlock(&cursor, reader->group.data + reader->group.size, block, reader->blocks_read,
+                                reader->previous_timestamp, reader->previous_hash,
+                                reader->pool ? reader->pool : &block->chain->pool,
+                                reader->headers_only ? DECODE_HEADERS_ONLY : DECODE_SEALED))
+                return 0;
+        reader->position = (size_t)(cursor - reader->group.data);
+        reader->previous_timestamp = block->timestamp;
+        reader->previous_hash = block->hash;
+        reader->blocks_read++;
+        return 1;
+}
+
+/**
+ * Reads the trailer of an indexed compact file
+ * @param file Open blockchain file
+ * @param footer Receives the trailer
+ * @return 1 if the file ends with a valid trailer, 0 otherwise
+ */
+int readBlockFileFooter(FILE *file, BlockFileFooter *footer)
+{
+        if (fseek(file, -(long)sizeof(BlockFileFooter), SEEK_END) != 0 ||
+            fread(footer, sizeof(BlockFileFooter), 1, file) != 1 ||
+            memcmp(footer->magic, FILE_FOOTER_MAGIC, 4) != 0)
+                return 0;
+        return footer->dictionary_offset > 0 && footer->index_offset > 0 && footer->length >= 0;
+}
+
+/**
+ * Positions a reader at any block of an indexed compact file
+ * Reads the group holding the block, then recovers the timestamp and hash
+ * its record is coded against from the records before it in the group:
+ * every record starts with its timestamp delta and ends with its hash.
+ * @param reader Reader of the file
+ * @param offsets Index entries from the first block of the group to the block
+ * @param count Number of entries; the block's entry is the last
+ * @param index Index of the block in the chain
+ * @return 1 if successful, 0 if the entries or the group are corrupt
+ */
+int seekBlockRecord(BlockFileReader *reader, const BlockOffset *offsets, int count, int index)
+{
+        const BlockOffset *target = &offsets[count - 1];
+        if (reader->format != FILE_FORMAT_COMPACT || offsets[0].record_offset != 0 ||
+            fseek(reader->file, (long)target->group_offset, SEEK_SET) != 0 || !readBlockGroup(reader) ||
+            target->record_offset > reader->group.size)
+                return 0;
+
+        time_t timestamp = 0;
+        for (int i = 0; i < count - 1; i++)
+        {
+                unsigned long long delta;
+                if (offsets[i].record_offset >= reader->group.size ||
+                    !getVarint(reader->group.data + offsets[i].record_offset, reader->group.data + reader->group.size,
+                               &delta))
+                        return 0;
+                timestamp += (time_t)zigzagDecode(delta);
+        }
+
+        if (count > 1)
+        {
+                if (target->record_offset < DIGEST_SIZE)
+                        return 0;
+                reader->previous_timestamp = timestamp;
+                reader->previous_hash = reader->group.data + target->record_offset - DIGEST_SIZE;
+        }
+        reader->position = target->record_offset;
+        reader->blocks_read = index;
+        return 1;
+}
+
+/**
+ * Loads a range of blocks from an indexed blockchain file
+ * The footer gives the position of every block, so only the index entries
+ * and groups that hold the range are read, whatever the chain length.
+ * The blocks keep their own indexes and are checked against their hashes
+ * and each other's links. Balances and indexes are not built, since they
+ * depend on the blocks before the range.
+ * @param filename Name of the file to load from
+ * @param first Index of the first block to load
+ * @param count Number of blocks to load
+ * @return Chain holding only the requested blocks, or NULL if failed
+ */
+Blockchain *loadBlockRange(const char *filename, int first, int count)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+        {
+                printf("Error: Could not open file for reading\n");
+                return NULL;
+        }
+
+        int format, flags, length;
+        BlockFileFooter footer;
+        if (!readFileHeader(file, &format, &flags, &length))
+        {
+                fclose(file);
+                return NULL;
+        }
+        if (format != FILE_FORMAT_COMPACT || !(flags & FILE_FLAG_INDEXED) || !readBlockFileFooter(file, &footer) ||
+            footer.length != length)
+        {
+                printf("Error: %s has no block index\n", filename);
+                fclose(file);
+                return NULL;
+        }
+        if (first < 0 || count <= 0 || first > length - count)
+        {
+                printf("Error: The chain has no blocks %d to %d\n", first, first + count - 1);
+                fclose(file);
+                return NULL;
+        }
+
+        // A group holds at most FILE_GROUP_BLOCKS blocks, so its first block
+        // is among the entries just before the range
+        int entries_first = first >= FILE_GROUP_BLOCKS ? first - FILE_GROUP_BLOCKS + 1 : 0;
+        int entry_count = first + count - entries_first;
+        BlockOffset *offsets = (BlockOffset *)malloc(sizeof(BlockOffset) * entry_count);
+        Blockchain *chain = createBlockchain();
+        int ok = offsets && chain &&
+                 fseek(file, (long)(footer.index_offset + (long long)entries_first * (long long)sizeof(BlockOffset)),
+                       SEEK_SET) == 0 &&
+                 fread(offsets, sizeof(BlockOffset), entry_count, file) == (size_t)entry_count &&
+                 fseek(file, (long)footer.dictionary_offset, SEEK_SET) == 0 &&
+                 readAccountDictionary(file, &chain->accounts);
+
+        int target = first - entries_first;
+        int group_start = target;
+        while (ok && group_start > 0 && offsets[group_start - 1].group_offset == offsets[target].group_offset)
+                group_start--;
+
+        BlockFileReader reader;
+        initBlockFileReader(&reader, file, format, flags);
+        ok = ok && seekBlockRecord(&reader, offsets + group_start, target - group_start + 1, first);
+        for (int i = 0; ok && i < count; i++)
+        {
+                Block *block = appendBlockSlot(chain);
+                ok = block && readBlockRecord(&reader, block) && checkAccountIds(block, chain->accounts.count) &&
+                     (i == 0 || insertBlockHash(chain, getBlock(chain, i - 1), i - 1));
+        }
+        freeBlockFileReader(&reader);
+        free(offsets);
+        fclose(file);
+
+        if (!ok)
+        {
+                printf("Error: Could not read blocks %d to %d\n", first, first + count - 1);
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        // Every loaded block is re-hashed, and linked to the one before it
+        chain->first_index = first;
+        atomic_store(&chain->published_length, count - 1);
+        int invalid = reverifyBlockchain(chain);
+        if (invalid >= 0)
+        {
+                printf("Error: Loaded blocks are invalid at block %d\n", first + invalid);
+                freeBlockchain(chain);
+                return NULL;
+        }
+        chain->difficulty = getLatestBlock(chain)->difficulty;
+        return chain;
+}
+
+/**
+ * Prints a range of blocks from an indexed blockchain file
+ * @param filename Name of the file to read
+ * @param first Index of the first block to print
+ * @param count Number of blocks to print
+ * @return 1 if successful, 0 if the blocks could not be loaded
+ */
+int inspectBlocks(const char *filename, int first, int count)
+{
+        Blockchain *chain = loadBlockRange(filename, first, count);
+        if (!chain)
+                return 0;
+
+        for (int i = 0; i < chain->length; i++)
+        {
+                displayBlock(getBlock(chain, i));
+        }
+        freeBlockchain(chain);
+        return 1;
+}
+
+/**
+ * Frees the buffers of a block file reader
+ * @param reader Reader to free
+ */
+void freeBlockFileReader(BlockFileReader *reader)
+{
+        closeAsyncFile(reader->async, NULL);
+        reader->async = NULL;
+        freeByteBuffer(&reader->group);
+        freeByteBuffer(&reader->packed);
+}
+
+/**
+ * Decompresses a stored block group into a buffer
+ * @param group Buffer that receives the raw group
+ * @param stored Stored bytes of the group
+ * @param stored_size Number of stored bytes; equal to raw_size if the group is not compressed
+ * @param raw_size Size of the raw group
+ * @return 1 if successful, 0 if the group is corrupt or allocation fails
+ */
+int unpackBlockGroup(ByteBuffer *group, const unsigned char *stored, unsigned int stored_size, unsigned int raw_size)
+{
+        group->size = 0;
+        if (!reserveBytes(group, raw_size))
+                return 0;
+        if (stored_size == raw_size)
+        {
+                memcpy(group->data, stored, raw_size);
+        }
+        else
+        {
+                uLongf unpacked_size = raw_size;
+                if (uncompress(group->data, &unpacked_size, stored, stored_size) != Z_OK || unpacked_size != raw_size)
+                        return 0;
+        }
+        group->size = raw_size;
+        return 1;
+}
+
+/**
+ * Maps a chain file so the transactions of its blocks can be paged in
+ * @param file Open indexed compact file
+ * @param footer Trailer of the file
+ * @param paged_length Number of blocks in the file
+ * @param budget Bytes of evictable transactions to keep resident
+ * @return New cache, or NULL if the file cannot be mapped or its index is out of bounds
+ */
+TransactionCache *openTransactionCache(FILE *file, const BlockFileFooter *footer, int paged_length, size_t budget)
+{
+        struct stat info;
+        if (fstat(fileno(file), &info) != 0 || footer->index_offset < 0 ||
+            (unsigned long long)footer->index_offset + (unsigned long long)paged_length * sizeof(BlockOffset) >
+                (unsigned long long)info.st_size)
+                return NULL;
+
+        TransactionCache *cache = (TransactionCache *)calloc(1, sizeof(TransactionCache));
+        if (!cache)
+                return NULL;
+        cache->map_size = (size_t)info.st_size;
+        void *map = mmap(NULL, cache->map_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        cache->lru_prev = (int *)malloc(sizeof(int) * (paged_length > 0 ? paged_length : 1));
+        cache->lru_next = (int *)malloc(sizeof(int) * (paged_length > 0 ? paged_length : 1));
+        if (map == MAP_FAILED || !cache->lru_prev || !cache->lru_next)
+        {
+                if (map != MAP_FAILED)
+                        munmap(map, cache->map_size);
+                free(cache->lru_prev);
+                free(cache->lru_next);
+                free(cache);
+                return NULL;
+        }
+
+        cache->map = (const unsigned char *)map;
+        cache->index_offset = footer->index_offset;
+        cache->paged_length = paged_length;
+        cache->lru_head = -1;
+        cache->lru_tail = -1;
+        cache->budget = budget;
+        cache->group_offset = -1;
+        for (int i = 0; i < paged_length; i++)
+        {
+                cache->lru_prev[i] = -1;
+                cache->lru_next[i] = -1;
+        }
+        return cache;
+}
+
+/**
+ * Unmaps the file of a transaction cache and frees the cache
+ * The paged-in transactions belong to the chain's pool and are freed with it.
+ * @param cache Cache to free
+ */
+void freeTransactionCache(TransactionCache *cache)
+{
+        if (!cache)
+                return;
+        munmap((void *)cache->map, cache->map_size);
+        free(cache->lru_prev);
+        free(cache->lru_next);
+        freeByteBuffer(&cache->group);
+        free(cache);
+}
+
+/**
+ * Removes a block from the recency list
+ * @param cache Cache holding the list
+ * @param index Index of a block on the list
+ */
+void unlinkCachedBlock(TransactionCache *cache, int index)
+{
+        int prev = cache->lru_prev[index];
+        int next = cache->lru_next[index];
+        if (prev >= 0)
+                cache->lru_next[prev] = next;
+        else
+                cache->lru_head = next;
+        if (next >= 0)
+                cache->lru_prev[next] = prev;
+        else
+                cache->lru_tail = prev;
+        cache->lru_prev[index] = -1;
+        cache->lru_next[index] = -1;
+}
+
+/**
+ * Puts a block at the most recently used end of the recency list
+ * @param cache Cache holding the list
+ * @param index Index of a block not on the list
+ */
+void linkCachedBlock(TransactionCache *cache, int index)
+{
+        cache->lru_prev[index] = -1;
+        cache->lru_next[index] = cache->lru_head;
+        if (cache->lru_head >= 0)
+                cache->lru_prev[cache->lru_head] = index;
+        else
+                cache->lru_tail = index;
+        cache->lru_head = index;
+}
+
+/**
+ * Evicts the least recently used transaction arrays until more fit the budget
+ * @param chain Lazily loaded chain
+ * @param needed Bytes about to be paged in
+ */
+void evictTransactions(Blockchain *chain, size_t needed)
+{
+        TransactionCache *cache = chain->cache;
+        while (cache->lru_tail >= 0 && cache->resident_bytes + needed > cache->budget)
+        {
+                int index = cache->lru_tail;
+                Block *block = getBlock(chain, index);
+                unlinkCachedBlock(cache, index);
+                recycleTransactions(&chain->pool, block->transactions, block->transaction_capacity);
+                cache->resident_bytes -= (size_t)block->transaction_capacity * sizeof(Transaction);
+                block->transactions = NULL;
+                block->transaction_capacity = 0;
+        }
+}
+
+/**
+ * Decodes the transactions of a block from the mapped file
+ * The record is checked against the header already loaded: same hash and
+ * count, and transactions that match the Merkle root.
+ * @param block Block of a lazily loaded chain whose transactions are not resident
+ * @param pin 1 to keep the transactions until the chain is freed, 0 to make them evictable
+ * @return 1 if successful, 0 if the record is corrupt or does not match the header
+ */
+int pageInTransactions(Block *block, int pin)
+{
+        Blockchain *chain = block->chain;
+        TransactionCache *cache = chain->cache;
+        int index = block->index;
+        if (!cache || index < 0 || index >= cache->paged_length)
+                return 0;
+
+        // Records are coded against the record before them in the same group
+        BlockOffset entry, previous_entry;
+        memcpy(&entry, cache->map + cache->index_offset + (size_t)index * sizeof(BlockOffset), sizeof(BlockOffset));
+        int linked = 0;
+        if (index > 0)
+        {
+                memcpy(&previous_entry, cache->map + cache->index_offset + (size_t)(index - 1) * sizeof(BlockOffset),
+                       sizeof(BlockOffset));
+                linked = previous_entry.group_offset == entry.group_offset;
+        }
+
+        // Consecutive blocks usually share a group, so the last one is kept
+        if (entry.group_offset != cache->group_offset)
+        {
+                unsigned int raw_size, stored_size;
+                cache->group_offset = -1;
+                if (entry.group_offset < 0 || (size_t)entry.group_offset + 2 * sizeof(unsigned int) > cache->map_size)
+                        return 0;
+                memcpy(&raw_size, cache->map + entry.group_offset, sizeof(unsigned int));
+                memcpy(&stored_size, cache->map + entry.group_offset + sizeof(unsigned int), sizeof(unsigned int));
+                size_t stored_start = (size_t)entry.group_offset + 2 * sizeof(unsigned int);
+                if (raw_size > FILE_GROUP_MAX_SIZE || stored_size > raw_size ||
+                    stored_start + stored_size > cache->map_size ||
+                    !unpackBlockGroup(&cache->group, cache->map + stored_start, stored_size, raw_size))
+                        return 0;
+                cache->group_offset = entry.group_offset;
+        }
+        if ((size_t)entry.record_offset + entry.record_size > cache->group.size)
+                return 0;
+
+        Block record;
+        record.chain = chain;
+        const Block *previous = linked ? getBlock(chain, index - 1) : NULL;
+        const unsigned char *cursor = cache->group.data + entry.record_offset;
+        unsigned char root[DIGEST_SIZE];
+        int ok = decodeCompactBlock(&cursor, cursor + entry.record_size, &record, index,
+                                    previous ? previous->timestamp : 0, previous ? previous->hash : NULL, &chain->pool,
+                                    DECODE_PAGED) &&
+                 record.transaction_count == block->transaction_count &&
+                 memcmp(record.hash, block->hash, DIGEST_SIZE) == 0 && checkAccountIds(&record, chain->accounts.count) &&
+                 computeMerkleRoot(&chain->accounts, record.transactions, record.transaction_count, root) &&
+                 memcmp(root, block->merkle_root, DIGEST_SIZE) == 0;
+        if (!ok)
+        {
+                recycleTransactions(&chain->pool, record.transactions, record.transaction_capacity);
+                printf("Error: Could not page in the transactions of block %d\n", index);
+                return 0;
+        }
+
+        size_t bytes = (size_t)record.transaction_capacity * sizeof(Transaction);
+        if (!pin)
+                evictTransactions(chain, bytes);
+        block->transactions = record.transactions;
+        block->transaction_capacity = record.transaction_capacity;
+        if (pin)
+        {
+                cache->lru_prev[index] = TRANSACTION_CACHE_PINNED;
+        }
+        else
+        {
+                cache->resident_bytes += bytes;
+                linkCachedBlock(cache, index);
+        }
+        return 1;
+}
+
+/**
+ * Gets the transactions of a block, paging them in if needed
+ * On a lazily loaded chain the array stays valid only until the next
+ * block is paged in, so callers use it before touching another block.
+ * @param block Block whose transactions are needed
+ * @return The block's transactions, or NULL if it has none or they cannot be paged in
+ */
+Transaction *getBlockTransactions(Block *block)
+{
+        TransactionCache *cache = block->chain->cache;
+        if (block->transactions || block->transaction_count == 0)
+        {
+                // Recently used arrays are evicted last
+                int index = block->index;
+                if (cache && block->transactions && index < cache->paged_length &&
+                    cache->lru_prev[index] != TRANSACTION_CACHE_PINNED && cache->lru_head != index)
+                {
+                        unlinkCachedBlock(cache, index);
+                        linkCachedBlock(cache, index);
+                }
+                return block->transactions;
+        }
+        return pageInTransactions(block, 0) ? block->transactions : NULL;
+}
+
+/**
+ * Keeps the transactions of a block resident until the chain is freed,
+ * so changes made to them are not lost to eviction
+ * @param block Block about to be changed
+ * @return 1 if successful, 0 if the transactions cannot be paged in
+ */
+int pinTransactions(Block *block)
+{
+        TransactionCache *cache = block->chain->cache;
+        int index = block->index;
+        if (!cache || index >= cache->paged_length || cache->lru_prev[index] == TRANSACTION_CACHE_PINNED)
+                return 1;
+        if (!block->transactions && block->transaction_count > 0)
+                return pageInTransactions(block, 1);
+        if (block->transactions)
+        {
+                unlinkCachedBlock(cache, index);
+                cache->resident_bytes -= (size_t)block->transaction_capacity * sizeof(Transaction);
+        }
+        cache->lru_prev[index] = TRANSACTION_CACHE_PINNED;
+        return 1;
+}
+
+/**
+ * Loads only the block headers of a blockchain file, leaving transactions
+ * to be paged in from the mapped file when first used
+ * Headers are hashed and linked as in a full load. Transactions are
+ * checked against their Merkle root when they are paged in. The open tip,
+ * and blocks hashed in the original string mode, are loaded in full. Files
+ * without a block index are loaded in full.
+ * @param filename Name of the file to load from
+ * @param cache_budget Bytes of paged-in transactions to keep before evicting the least recently used
+ * @return Pointer to loaded blockchain or NULL if failed
+ */
+Blockchain *loadBlockchainLazy(const char *filename, size_t cache_budget)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+        {
+                printf("Error: Could not open file for reading\n");
+                return NULL;
+        }
+
+        int format, flags, length;
+        BlockFileFooter footer;
+        if (!readFileHeader(file, &format, &flags, &length))
+        {
+                fclose(file);
+                return NULL;
+        }
+        long header_end = ftell(file);
+        if (format != FILE_FORMAT_COMPACT || !(flags & FILE_FLAG_INDEXED) || !readBlockFileFooter(file, &footer) ||
+            footer.length != length)
+        {
+                fclose(file);
+                printf("%s has no block index, so it is loaded in full\n", filename);
+                return loadBlockchain(filename);
+        }
+
+        Blockchain *chain = createBlockchain();
+        if (chain)
+                chain->cache = openTransactionCache(file, &footer, length, cache_budget);
+        if (!chain || !chain->cache || fseek(file, header_end, SEEK_SET) != 0)
+        {
+                printf("Error: Could not map %s\n", filename);
+                freeBlockchain(chain);
+                fclose(file);
+                return NULL;
+        }
+
+        // Read each block header, skipping over its transactions
+        BlockFileReader reader;
+        initBlockFileReader(&reader, file, format, flags);
+        reader.headers_only = 1;
+        int ok = 1;
+        for (int i = 0; ok && i < length; i++)
+        {
+                Block *block = appendBlockSlot(chain);
+                ok = block && readBlockRecord(&reader, block) && (i == 0 || insertBlockHash(chain, getBlock(chain, i - 1), i - 1));
+                if (!ok)
+                        printf("Error: Could not read block %d\n", i);
+        }
+        freeBlockFileReader(&reader);
+        if (ok && (fseek(file, (long)footer.dictionary_offset, SEEK_SET) != 0 || !readAccountDictionary(file, &chain->accounts)))
+        {
+                printf("Error: Could not read account dictionary\n");
+                ok = 0;
+        }
+        fclose(file);
+
+        // The tip can still take transactions, so it stays resident
+        Block *tip = length > 0 ? getBlock(chain, length - 1) : NULL;
+        if (ok && tip && tip->transaction_count > 0)
+                ok = pageInTransactions(tip, 1);
+
+        atomic_store(&chain->published_length, length > 0 ? length - 1 : 0);
+        if (!ok || !restoreChainState(chain, filename))
+        {
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        printf("Blockchain headers loaded and validated from %s; transactions are paged in on demand\n", filename);
+        return chain;
+}
+
+/**
+ * Builds the name of one segment file of segmented storage
+ * @param filename Name of the manifest
+ * @param segment Position of the segment in the manifest
+ * @param output Buffer for the segment file name
+ * @param size Size of the buffer
+ */
+void getSegmentFilename(const char *filename, int segment, char *output, size_t size)
+{
+        snprintf(output, size, "%s.%06d", filename, segment);
+}
+
+/**
+ * Hashes the hashes of a run of blocks, so a segment can be matched
+ * against the chain without reading it back
+ * @param chain Pointer to the blockchain
+ * @param first Index of the first block
+ * @param count Number of blocks
+ * @param digest Buffer of DIGEST_SIZE bytes for the result
+ */
+void hashSegmentBlocks(Blockchain *chain, int first, int count, unsigned char *digest)
+{
+        SHA256_CTX sha256;
+        SHA256_Init(&sha256);
+        for (int i = first; i < first + count; i++)
+                SHA256_Update(&sha256, getBlock(chain, i)->hash, DIGEST_SIZE);
+        SHA256_Final(digest, &sha256);
+}
+
+/**
+ * Writes a segment manifest, replacing the previous one in a single rename
+ * @param filename Name of the manifest
+ * @param manifest Manifest to write
+ * @return 1 if successful, 0 if failed
+ */
+int writeSegmentManifest(const char *filename, const SegmentManifest *manifest)
+{
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+        FILE *file = fopen(temp_filename, "wb");
+        if (!file)
+                return 0;
+
+        unsigned int version = SEGMENT_MANIFEST_VERSION;
+        unsigned long long checksum = updateStateChecksum(STATE_CHECKSUM_SEED, manifest->segments,
+                                                          sizeof(SegmentEntry) * manifest->segment_count);
+        fwrite(SEGMENT_MANIFEST_MAGIC, sizeof(char), 4, file);
+        fwrite(&version, sizeof(unsigned int), 1, file);
+        fwrite(&manifest->segment_bytes, sizeof(long long), 1, file);
+        fwrite(&manifest->segment_count, sizeof(int), 1, file);
+        fwrite(manifest->segments, sizeof(SegmentEntry), manifest->segment_count, file);
+        fwrite(&checksum, sizeof(unsigned long long), 1, file);
+        int ok = !ferror(file);
+        if (fclose(file) != 0 || !ok || rename(temp_filename, filename) != 0)
+        {
+                remove(temp_filename);
+                return 0;
+        }
+        return 1;
+}
+
+/**
+ * Reads a segment manifest written by writeSegmentManifest
+ * @param filename Name of the manifest
+ * @param manifest Receives the manifest; free it with freeSegmentManifest
+ * @return 1 if successful, 0 if the manifest is missing or corrupt
+ */
+int readSegmentManifest(const char *filename, SegmentManifest *manifest)
+{
+        memset(manifest, 0, sizeof(*manifest));
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+                return 0;
+
+        char magic[4];
+        unsigned int version;
+        unsigned long long checksum;
+        int ok = fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, SEGMENT_MANIFEST_MAGIC, 4) == 0 &&
+                 fread(&version, sizeof(unsigned int), 1, file) == 1 && version == SEGMENT_MANIFEST_VERSION &&
+                 fread(&manifest->segment_bytes, sizeof(long long), 1, file) == 1 &&
+                 fread(&manifest->segment_count, sizeof(int), 1, file) == 1 &&
+                 manifest->segment_count > 0 && manifest->segment_count <= MAX_SEGMENT_FILES;
+        if (ok)
+        {
+                manifest->segments = (SegmentEntry *)malloc(sizeof(SegmentEntry) * manifest->segment_count);
+                ok = manifest->segments &&
+                     fread(manifest->segments, sizeof(SegmentEntry), manifest->segment_count, file) ==
+                         (size_t)manifest->segment_count &&
+                     fread(&checksum, sizeof(unsigned long long), 1, file) == 1 &&
+                     checksum == updateStateChecksum(STATE_CHECKSUM_SEED, manifest->segments,
+                                                     sizeof(SegmentEntry) * manifest->segment_count);
+        }
+        fclose(file);
+
+        // Segments must cover the chain from genesis without gaps
+        for (int s = 0; ok && s < manifest->segment_count; s++)
+        {
+                const SegmentEntry *entry = &manifest->segments[s];
+                ok = entry->first_block == (s > 0 ? manifest->segments[s - 1].first_block + manifest->segments[s - 1].block_count : 0) &&
+                     entry->block_count >= 0 && entry->first_block <= INT_MAX - entry->block_count;
+        }
+        if (!ok)
+                freeSegmentManifest(manifest);
+        return ok;
+}
+
+/**
+ * Frees the segment list of a manifest
+ * @param manifest Manifest to free
+ */
+void freeSegmentManifest(SegmentManifest *manifest)
+{
+        free(manifest->segments);
+        manifest->segments = NULL;
+        manifest->segment_count = 0;
+}
+
+/**
+ * Writes the blocks from one index on into a segment file, sealing it
+ * at the first group boundary past the size limit
+ * Only the segment that reaches the end of the chain, the active one,
+ * holds the account dictionary.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the segment file
+ * @param first Index of the first block to write
+ * @param segment_bytes Size at which the segment is sealed
+ * @param entry Receives the manifest entry of the segment
+ * @return 1 if successful, 0 if failed
+ */
+int writeSegmentFile(Blockchain *chain, const char *filename, int first, long long segment_bytes, SegmentEntry *entry)
+{
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+        FILE *file = fopen(temp_filename, "wb");
+        if (!file)
+                return 0;
+
+        // The length is patched in once the segment is sealed
+        writeFileHeader(file, 0, FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED);
+        BlockFileWriter writer;
+        initBlockFileWriter(&writer, file, FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED);
+        writer.async = openAsyncFile(file, 1);
+        int b = first;
+        while (b < chain->length && !writer.failed)
+        {
+                Block *block = getBlock(chain, b++);
+                if (block->transaction_count > 0 && !getBlockTransactions(block))
+                        writer.failed = 1;
+                else if (writeBlockRecord(&writer, block) && writer.group_blocks == 0 &&
+                         tellBlockFileWriter(&writer) >= segment_bytes)
+                        break;
+        }
+
+        long long dictionary_offset = finishBlockFileWriter(&writer) ? ftell(file) : -1;
+        if (dictionary_offset >= 0 && b == chain->length)
+        {
+                writeAccountDictionary(file, &chain->accounts);
+        }
+        else if (dictionary_offset >= 0)
+        {
+                // Sealed segments are read with the active segment's dictionary
+                int no_accounts = 0;
+                fwrite(&no_accounts, sizeof(int), 1, file);
+        }
+        int ok = dictionary_offset >= 0 && writeBlockFileFooter(&writer, dictionary_offset);
+        entry->first_block = first;
+        entry->block_count = writer.blocks_written;
+        entry->file_size = ftell(file);
+        freeBlockFileWriter(&writer);
+        fseek(file, 4 + sizeof(unsigned int), SEEK_SET);
+        fwrite(&entry->block_count, sizeof(int), 1, file);
+        ok = ok && !ferror(file);
+        if (fclose(file) != 0 || !ok || rename(temp_filename, filename) != 0)
+        {
+                remove(temp_filename);
+                return 0;
+        }
+        hashSegmentBlocks(chain, first, entry->block_count, entry->digest);
+        return 1;
+}
+
+/**
+ * Saves the blockchain as segment files listed in a manifest
+ * Sealed segments that still match the chain are kept as they are, so
+ * normally only the active segment is written. A segment is sealed once
+ * it grows past segment_bytes, and a new active segment is started. The
+ * indexes and ledger state are saved next to the manifest.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the manifest
+ * @param segment_bytes Size at which segments are sealed
+ * @return 1 if successful, 0 if failed
+ */
+int saveSegmentedChain(Blockchain *chain, const char *filename, long long segment_bytes)
+{
+        if (!chain || segment_bytes <= 0)
+                return 0;
+
+        // Keep the sealed segments whose blocks are unchanged
+        SegmentManifest previous;
+        int kept = 0;
+        unsigned char digest[DIGEST_SIZE];
+        if (readSegmentManifest(filename, &previous))
+        {
+                for (; kept < previous.segment_count - 1; kept++)
+                {
+                        const SegmentEntry *entry = &previous.segments[kept];
+                        if (entry->first_block + entry->block_count >= chain->length)
+                                break;
+                        hashSegmentBlocks(chain, entry->first_block, entry->block_count, digest);
+                        if (memcmp(digest, entry->digest, DIGEST_SIZE) != 0)
+                                break;
+                }
+        }
+
+        SegmentManifest manifest;
+        manifest.segment_bytes = segment_bytes;
+        manifest.segment_count = kept;
+        manifest.segments = (SegmentEntry *)malloc(sizeof(SegmentEntry) * (kept + 1));
+        int ok = manifest.segments != NULL;
+        if (ok && kept > 0)
+                memcpy(manifest.segments, previous.segments, sizeof(SegmentEntry) * kept);
+
+        // Write the rest of the chain, rolling over to new segments as they fill
+        int first = kept > 0 ? manifest.segments[kept - 1].first_block + manifest.segments[kept - 1].block_count : 0;
+        char segment_filename[FILENAME_BUFFER_SIZE];
+        while (ok && (first < chain->length || manifest.segment_count == kept))
+        {
+                SegmentEntry *segments = (SegmentEntry *)realloc(manifest.segments,
+                                                                 sizeof(SegmentEntry) * (manifest.segment_count + 1));
+                ok = segments && manifest.segment_count < MAX_SEGMENT_FILES;
+                if (!ok)
+                        break;
+                manifest.segments = segments;
+                getSegmentFilename(filename, manifest.segment_count, segment_filename, sizeof(segment_filename));
+                ok = writeSegmentFile(chain, segment_filename, first, segment_bytes, &manifest.segments[manifest.segment_count]);
+                if (ok)
+                        first += manifest.segments[manifest.segment_count++].block_count;
+        }
+
+        // The manifest is the commit point; segments it no longer lists go after it
+        ok = ok && writeSegmentManifest(filename, &manifest);
+        if (ok)
+        {
+                for (int s = manifest.segment_count; s < previous.segment_count; s++)
+                {
+                        getSegmentFilename(filename, s, segment_filename, sizeof(segment_filename));
+                        remove(segment_filename);
+                }
+        }
+        else
+        {
+                printf("Error: Could not write segments of %s\n", filename);
+        }
+        int written = manifest.segment_count - kept;
+        int segment_count = manifest.segment_count;
+        freeSegmentManifest(&previous);
+        freeSegmentManifest(&manifest);
+        if (!ok)
+                return 0;
+
+        saveChainState(chain, filename);
+        if (chain->journal && !resetJournal(chain->journal, chain, filename))
+                printf("Warning: Could not start the journal over after saving\n");
+        printf("Blockchain saved to %d segments of %s (%d written)\n", segment_count, filename, written);
+        return 1;
+}
+
+/**
+ * Moves every slab and recycled array of one pool into another
+ * @param into Pool that takes over the storage
+ * @param from Pool to empty
+ */
+void mergeTransactionPool(TransactionPool *into, TransactionPool *from)
+{
+        // The receiving pool keeps bump allocating from its current slab
+        if (from->slabs)
+        {
+                PoolSlab *tail = from->slabs;
+                while (tail->next)
+                        tail = tail->next;
+                if (into->slabs)
+                {
+                        tail->next = into->slabs->next;
+                        into->slabs->next = from->slabs;
+                }
+                else
+                {
+                        into->slabs = from->slabs;
+                }
+        }
+
+        for (int size_class = 0; size_class < POOL_SIZE_CLASSES; size_class++)
+        {
+                PoolFreeNode *node = from->free_lists[size_class];
+                if (!node)
+                        continue;
+                while (node->next)
+                        node = node->next;
+                node->next = into->free_lists[size_class];
+                into->free_lists[size_class] = from->free_lists[size_class];
+        }
+        into->bytes_reserved += from->bytes_reserved;
+        memset(from, 0, sizeof(*from));
+}
+
+/**
+ * Reads the blocks of one segment file into their reserved slots
+ * @param chain Chain whose slots cover the segment
+ * @param filename Name of the segment file
+ * @param entry Manifest entry of the segment
+ * @param pool Pool for the decoded transactions
+ * @return 1 if successful, 0 if the segment does not match its entry or is corrupt
+ */
+int readSegmentFile(Blockchain *chain, const char *filename, const SegmentEntry *entry, TransactionPool *pool)
+{
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+                return 0;
+
+        int format, flags, length;
+        struct stat info;
+        int ok = fstat(fileno(file), &info) == 0 && info.st_size == entry->file_size &&
+                 readFileHeader(file, &format, &flags, &length) && format == FILE_FORMAT_COMPACT &&
+                 length == entry->block_count;
+        if (ok)
+        {
+                // Records are numbered from the segment's place in the chain
+                BlockFileReader reader;
+                initBlockFileReader(&reader, file, format, flags);
+                reader.async = openAsyncFile(file, 0);
+                reader.blocks_read = entry->first_block;
+                reader.pool = pool;
+                for (int i = 0; ok && i < length; i++)
+                        ok = readBlockRecord(&reader, getBlock(chain, entry->first_block + i));
+                freeBlockFileReader(&reader);
+        }
+        fclose(file);
+        return ok;
+}
+
+// Shared state of the threads loading segment files
+typedef struct SegmentLoad
+{
+        Blockchain *chain;
+        const char *filename; // Name of the manifest
+        const SegmentManifest *manifest;
+        ValidationContext validation; // Checks the blocks of sealed segments
+        atomic_int next_segment;
+        atomic_int failed_segment; // Lowest segment that could not be read
+} SegmentLoad;
+
+// One thread loading segment files, with a pool of its own
+typedef struct SegmentWorker
+{
+        SegmentLoad *load;
+        TransactionPool pool;
+        pthread_t thread;
+        int started;
+} SegmentWorker;
+
+/**
+ * Thread entry point that loads segments until none are left
+ * Sealed segments are hash-verified as soon as they are read.
+ * @param arg Pointer to the worker's SegmentWorker
+ * @return Always NULL
+ */
+void *segmentWorkerMain(void *arg)
+{
+        SegmentWorker *worker = (SegmentWorker *)arg;
+        SegmentLoad *load = worker->load;
+        char segment_filename[FILENAME_BUFFER_SIZE];
+        int segment;
+        while ((segment = atomic_fetch_add(&load->next_segment, 1)) < load->manifest->segment_count)
+        {
+                const SegmentEntry *entry = &load->manifest->segments[segment];
+                getSegmentFilename(load->filename, segment, segment_filename, sizeof(segment_filename));
+                if (!readSegmentFile(load->chain, segment_filename, entry, &worker->pool))
+                {
+                        int current = atomic_load(&load->failed_segment);
+                        while (segment < current && !atomic_compare_exchange_weak(&load->failed_segment, &current, segment))
+                                ;
+                        continue;
+                }
+                if (segment < load->manifest->segment_count - 1)
+                        validateBlockRange(&load->validation, entry->first_block, entry->first_block + entry->block_count);
+        }
+        return NULL;
+}
+
+/**
+ * Loads a blockchain saved as segment files
+ * The segments are read on a thread each, up to one per CPU, and sealed
+ * segments are hash-verified on the thread that read them. Their links,
+ * and the active segment, are then checked as in a normal load.
+ * @param filename Name of the manifest
+ * @return Pointer to loaded blockchain or NULL if failed
+ */
+Blockchain *loadSegmentedChain(const char *filename)
+{
+        SegmentManifest manifest;
+        if (!readSegmentManifest(filename, &manifest))
+        {
+                printf("Error: Could not read segment manifest %s\n", filename);
+                return NULL;
+        }
+        const SegmentEntry *active = &manifest.segments[manifest.segment_count - 1];
+        int length = active->first_block + active->block_count;
+        int sealed_length = active->first_block;
+
+        // Sealed segments hold no names, and legacy blocks need them to be
+        // verified, so the active segment's dictionary is read first
+        char segment_filename[FILENAME_BUFFER_SIZE];
+        getSegmentFilename(filename, manifest.segment_count - 1, segment_filename, sizeof(segment_filename));
+        FILE *file = fopen(segment_filename, "rb");
+        BlockFileFooter footer;
+        Blockchain *chain = createBlockchain();
+        int ok = chain && file && readBlockFileFooter(file, &footer) &&
+                 fseek(file, (long)footer.dictionary_offset, SEEK_SET) == 0 &&
+                 readAccountDictionary(file, &chain->accounts);
+        if (file)
+                fclose(file);
+        if (!ok)
+                printf("Error: Could not read account dictionary\n");
+
+        // Every slot is reserved up front so the workers never append
+        for (int i = 0; ok && i < length; i++)
+                ok = appendBlockSlot(chain) != NULL;
+
+        if (ok)
+        {
+                SegmentLoad load;
+                load.chain = chain;
+                load.filename = filename;
+                load.manifest = &manifest;
+                atomic_init(&load.next_segment, 0);
+                atomic_init(&load.failed_segment, manifest.segment_count);
+
+                ChainSnapshot snapshot;
+                beginChainRead(chain, &snapshot);
+                load.validation.snapshot = &snapshot;
+                load.validation.start = 0;
+                load.validation.first_index = 0;
+                atomic_init(&load.validation.first_invalid, length);
+
+                int workers = getWorkerCount() < manifest.segment_count ? getWorkerCount() : manifest.segment_count;
+                SegmentWorker worker[MAX_WORKER_THREADS];
+                for (int w = 0; w < workers; w++)
+                {
+                        worker[w].load = &load;
+                        memset(&worker[w].pool, 0, sizeof(TransactionPool));
+                        worker[w].started = w > 0 && pthread_create(&worker[w].thread, NULL, segmentWorkerMain, &worker[w]) == 0;
+                }
+
+                // The calling thread works too, and picks up what failed to start
+                segmentWorkerMain(&worker[0]);
+                for (int w = 1; w < workers; w++)
+                {
+                        if (worker[w].started)
+                                pthread_join(worker[w].thread, NULL);
+                }
+                for (int w = 0; w < workers; w++)
+                        mergeTransactionPool(&chain->pool, &worker[w].pool);
+                endChainRead(&snapshot);
+
+                int failed = atomic_load(&load.failed_segment);
+                int invalid = atomic_load(&load.validation.first_invalid);
+                if (failed < manifest.segment_count)
+                {
+                        printf("Error: Could not read segment %d\n", failed);
+                        ok = 0;
+                }
+                for (int i = 0; ok && i < length; i++)
+                {
+                        if (!checkAccountIds(getBlock(chain, i), chain->accounts.count))
+                        {
+                                printf("Error: Block %d refers to an unknown account\n", i);
+                                ok = 0;
+                        }
+                }
+
+                // Links are cheap and checked in order, across segment boundaries too
+                for (int i = 1; ok && i < sealed_length && i < invalid; i++)
+                {
+                        if (!followsBlock(getBlock(chain, i), getBlock(chain, i - 1)))
+                                invalid = i;
+                }
+                if (ok && invalid < sealed_length)
+                {
+                        printf("Error: Loaded blockchain is invalid at block %d\n", invalid);
+                        ok = 0;
+                }
+        }
+
+        // A segment swapped for another with valid blocks still fails its digest
+        unsigned char digest[DIGEST_SIZE];
+        for (int s = 0; ok && s < manifest.segment_count; s++)
+        {
+                const SegmentEntry *entry = &manifest.segments[s];
+                hashSegmentBlocks(chain, entry->first_block, entry->block_count, digest);
+                if (memcmp(digest, entry->digest, DIGEST_SIZE) != 0)
+                {
+                        printf("Error: Segment %d does not match its manifest\n", s);
+                        ok = 0;
+                }
+        }
+
+        for (int i = 1; ok && i < length; i++)
+                ok = insertBlockHash(chain, getBlock(chain, i - 1), i - 1);
+        freeSegmentManifest(&manifest);
+        if (!ok)
+        {
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        // The sealed segments were verified above, so only the active one is left
+        atomic_store(&chain->published_length, length > 0 ? length - 1 : 0);
+        chain->checkpoint.length = sealed_length;
+        if (sealed_length > 0)
+                memcpy(chain->checkpoint.hash, getBlock(chain, sealed_length - 1)->hash, DIGEST_SIZE);
+        if (!restoreChainState(chain, filename))
+        {
+                freeBlockchain(chain);
+                return NULL;
+        }
+
+        printf("Blockchain loaded and validated successfully from %s\n", filename);
+        return chain;
+}
+
+/**
+ * Describes the chain state that journaled changes will apply on top of
+ * @param chain Pointer to the blockchain
+ * @param filename File the chain was saved to or loaded from, or NULL for a chain never saved
+ * @param base Receives the description
+ */
+void getJournalBase(Blockchain *chain, const char *filename, JournalBase *base)
+{
+        memset(base, 0, sizeof(*base));
+        base->length = chain->length;
+        if (chain->length > 0)
+                memcpy(base->hash, getLatestBlock(chain)->hash, DIGEST_SIZE);
+        if (filename)
+                snprintf(base->filename, sizeof(base->filename), "%s", filename);
+}
+
+/**
+ * Starts a journal over with a header and no records
+ * @param fd Journal file, opened for appending
+ * @param base Chain state the records that follow will apply on top of
+ * @return 1 if the header is durable, 0 if failed
+ */
+int writeJournalHeader(int fd, const JournalBase *base)
+{
+        unsigned char header[JOURNAL_MAX_HEADER_SIZE];
+        size_t size = encodeJournalHeader(base, header);
+        return ftruncate(fd, 0) == 0 && writeJournalBytes(fd, header, size) && fdatasync(fd) == 0;
+}
+
+/**
+ * Encodes the header of a journal
+ * @param base Chain state the records that follow apply on top of
+ * @param header Buffer of JOURNAL_MAX_HEADER_SIZE bytes
+ * @return Size of the header
+ */
+size_t encodeJournalHeader(const JournalBase *base, unsigned char *header)
+{
+        // Magic, version, base length and hash, then the base file name
+        unsigned int version = JOURNAL_VERSION;
+        unsigned short name_length = (unsigned short)strlen(base->filename);
+        unsigned char *dst = header;
+        memcpy(dst, JOURNAL_MAGIC, 4);
+        memcpy(dst + 4, &version, sizeof(unsigned int));
+        memcpy(dst + 8, &base->length, sizeof(int));
+        memcpy(dst + 12, base->hash, DIGEST_SIZE);
+        dst += 12 + DIGEST_SIZE;
+        memcpy(dst, &name_length, sizeof(unsigned short));
+        memcpy(dst + 2, base->filename, name_length);
+        dst += 2 + name_length;
+        unsigned int checksum = (unsigned int)crc32(0L, header, (uInt)(dst - header));
+        memcpy(dst, &checksum, sizeof(unsigned int));
+        return (size_t)(dst + 4 - header);
+}
+
+/**
+ * Reads the header written by writeJournalHeader
+ * @param src Start of the journal
+ * @param size Size of the journal
+ * @param base Receives the chain state the records apply on top of
+ * @return Size of the header, or 0 if it is missing or corrupt
+ */
+size_t readJournalHeader(const unsigned char *src, size_t size, JournalBase *base)
+{
+        unsigned int version;
+        unsigned short name_length;
+        size_t fixed = 12 + DIGEST_SIZE + 2;
+        if (size < fixed + 4 || memcmp(src, JOURNAL_MAGIC, 4) != 0)
+                return 0;
+        memcpy(&version, src + 4, sizeof(unsigned int));
+        memcpy(&name_length, src + 12 + DIGEST_SIZE, sizeof(unsigned short));
+        if (version != JOURNAL_VERSION || name_length >= FILENAME_BUFFER_SIZE || size < fixed + name_length + 4)
+                return 0;
+
+        unsigned int checksum;
+        memcpy(&checksum, src + fixed + name_length, sizeof(unsigned int));
+        if (checksum != (unsigned int)crc32(0L, src, (uInt)(fixed + name_length)))
+                return 0;
+
+        memset(base, 0, sizeof(*base));
+        memcpy(&base->length, src + 8, sizeof(int));
+        memcpy(base->hash, src + 12, DIGEST_SIZE);
+        memcpy(base->filename, src + fixed, name_length);
+        return base->length >= 0 ? fixed + name_length + 4 : 0;
+}
+
+/**
+ * Encodes the payload of a journal record
+ * Names and block data are length-prefixed, integers are varints and
+ * the amount is stored bit for bit.
+ * @param dst Buffer of at least JOURNAL_MAX_RECORD_SIZE bytes
+ * @param record Record to encode
+ * @return Pointer just past the encoded payload
+ */
+unsigned char *encodeJournalRecord(unsigned char *dst, const JournalRecord *record)
+{
+        *dst++ = (unsigned char)record->type;
+        dst = putVarint(dst, (unsigned long long)record->block_index);
+        dst = putVarint(dst, zigzagEncode((long long)record->timestamp));
+        if (record->type == JOURNAL_RECORD_BLOCK)
+        {
+                size_t length = strnlen(record->data, MAX_DATA_SIZE - 1);
+                dst = putVarint(dst, length);
+                memcpy(dst, record->data, length);
+                dst += length;
+                dst = putVarint(dst, (unsigned long long)record->difficulty);
+        }
+        else
+        {
+                size_t sender_length = strnlen(record->sender, MAX_SENDER_SIZE - 1);
+                size_t receiver_length = strnlen(record->receiver, MAX_RECEIVER_SIZE - 1);
+                *dst++ = (unsigned char)sender_length;
+                memcpy(dst, record->sender, sender_length);
+                dst += sender_length;
+                *dst++ = (unsigned char)receiver_length;
+                memcpy(dst, record->receiver, receiver_length);
+                dst += receiver_length;
+                memcpy(dst, &record->amount, sizeof(double));
+                dst += sizeof(double);
+        }
+        dst = putVarint(dst, record->nonce);
+        memcpy(dst, record->hash, DIGEST_SIZE);
+        return dst + DIGEST_SIZE;
+}
+
+/**
+ * Decodes a payload written by encodeJournalRecord
+ * @param src Start of the payload
+ * @param end End of the payload
+ * @param record Receives the record
+ * @return 1 if successful, 0 if the payload is malformed
+ */
+int decodeJournalRecord(const unsigned char *src, const unsigned char *end, JournalRecord *record)
+{
+        unsigned long long value;
+        memset(record, 0, sizeof(*record));
+        if (src >= end)
+                return 0;
+        record->type = *src++;
+        if (record->type != JOURNAL_RECORD_BLOCK && record->type != JOURNAL_RECORD_TRANSACTION)
+                return 0;
+        if (!(src = getVarint(src, end, &value)) || value >= INT_MAX)
+                return 0;
+        record->block_index = (int)value;
+        if (!(src = getVarint(src, end, &value)))
+                return 0;
+        record->timestamp = (time_t)zigzagDecode(value);
+
+        if (record->type == JOURNAL_RECORD_BLOCK)
+        {
+                if (!(src = getVarint(src, end, &value)) || value >= MAX_DATA_SIZE || (size_t)(end - src) < value)
+                        return 0;
+                memcpy(record->data, src, value);
+                src += value;
+                if (!(src = getVarint(src, end, &value)) || value > MAX_DIFFICULTY)
+                        return 0;
+                record->difficulty = (int)value;
+        }
+        else
+        {
+                if (src >= end || *src >= MAX_SENDER_SIZE || end - src - 1 < *src)
+                        return 0;
+                memcpy(record->sender, src + 1, *src);
+                src += 1 + *src;
+                if (src >= end || *src >= MAX_RECEIVER_SIZE || end - src - 1 < *src)
+                        return 0;
+                memcpy(record->receiver, src + 1, *src);
+                src += 1 + *src;
+                if ((size_t)(end - src) < sizeof(double))
+                        return 0;
+                memcpy(&record->amount, src, sizeof(double));
+                src += sizeof(double);
+        }
+        if (!(src = getVarint(src, end, &record->nonce)) || end - src != DIGEST_SIZE)
+                return 0;
+        memcpy(record->hash, src, DIGEST_SIZE);
+        return 1;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor
+ * @param fd File to write to
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return 1 if successful, 0 if failed
+ */
+int writeJournalBytes(int fd, const unsigned char *data, size_t size)
+{
+        while (size > 0)
+        {
+                ssize_t written = write(fd, data, size);
+                if (written < 0 && errno == EINTR)
+                        continue;
+                if (written <= 0)
+                        return 0;
+                data += written;
+                size -= (size_t)written;
+        }
+        return 1;
+}
+
+/**
+ * Queues a record for the next group commit
+ * The record is durable once syncJournal returns after it.
+ * @param journal Journal to append to
+ * @param record Record to append
+ * @return 1 if queued, 0 if the journal has failed
+ */
+int appendJournalRecord(Journal *journal, const JournalRecord *record)
+{
+        // Each record is framed by its payload length and CRC-32, so replay
+        // can tell where a torn write at the tail begins
+        unsigned char framed[JOURNAL_MAX_RECORD_SIZE];
+        unsigned char *end = encodeJournalRecord(framed + JOURNAL_RECORD_HEADER_SIZE, record);
+        unsigned int length = (unsigned int)(end - framed - JOURNAL_RECORD_HEADER_SIZE);
+        unsigned int checksum = (unsigned int)crc32(0L, framed + JOURNAL_RECORD_HEADER_SIZE, length);
+        memcpy(framed, &length, sizeof(unsigned int));
+        memcpy(framed + 4, &checksum, sizeof(unsigned int));
+        size_t size = (size_t)(end - framed);
 
-        // Combine all block data including transactions for hashing
-        snprintf(input, sizeof(input), "%d%ld%s%s%s",
-                 block->index, block->timestamp, block->data,
-                 block->previous_hash, trans_data);
+        pthread_mutex_lock(&journal->lock);
+        int ok = !journal->failed && reserveBytes(&journal->pending, size);
+        if (ok)
+        {
+                // The first record of a group starts its latency window
+                size_t before = journal->pending.size;
+                if (before == 0)
+                        journal->first_pending_ns = getMonotonicNs();
+                memcpy(journal->pending.data + before, framed, size);
+                journal->pending.size += size;
+                journal->appended_bytes += (long long)size;
+                journal->appended_records++;
+                if (before == 0 || (before < JOURNAL_GROUP_BYTES && journal->pending.size >= JOURNAL_GROUP_BYTES))
+                        pthread_cond_signal(&journal->appended);
+        }
+        else
+        {
+                journal->failed = 1;
+        }
+        pthread_mutex_unlock(&journal->lock);
+        return ok;
+}
 
-        // Calculate SHA-256 hash
-        SHA256_Init(&sha256);
-        SHA256_Update(&sha256, input, strlen(input));
-        SHA256_Final(hash, &sha256);
+/**
+ * Journals a block just appended to the chain
+ * @param journal Journal of the chain
+ * @param block New block
+ */
+void journalBlock(Journal *journal, const Block *block)
+{
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.type = JOURNAL_RECORD_BLOCK;
+        record.block_index = block->index;
+        record.timestamp = block->timestamp;
+        memcpy(record.data, block->data, MAX_DATA_SIZE);
+        record.difficulty = block->difficulty;
+        record.nonce = block->nonce;
+        memcpy(record.hash, block->hash, DIGEST_SIZE);
+        appendJournalRecord(journal, &record);
+}
+
+/**
+ * Journals a transaction just added to a block
+ * @param journal Journal of the chain
+ * @param block Block the transaction was added to, already mined
+ * @param sender Transaction sender
+ * @param receiver Transaction receiver
+ * @param trans New transaction
+ */
+void journalTransaction(Journal *journal, const Block *block, const char *sender, const char *receiver,
+                        const Transaction *trans)
+{
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.type = JOURNAL_RECORD_TRANSACTION;
+        record.block_index = block->index;
+        record.timestamp = trans->timestamp;
+        strncpy(record.sender, sender, MAX_SENDER_SIZE - 1);
+        strncpy(record.receiver, receiver, MAX_RECEIVER_SIZE - 1);
+        record.amount = trans->amount;
+        record.nonce = block->nonce;
+        memcpy(record.hash, block->hash, DIGEST_SIZE);
+        appendJournalRecord(journal, &record);
+}
+
+/**
+ * Thread entry point that writes out the journal a group at a time
+ * @param arg Pointer to the Journal
+ * @return Always NULL
+ */
+void *journalFlusherMain(void *arg)
+{
+        Journal *journal = (Journal *)arg;
+        pthread_mutex_lock(&journal->lock);
+        for (;;)
+        {
+                while (journal->pending.size == 0 && !journal->stopping)
+                        pthread_cond_wait(&journal->appended, &journal->lock);
+                if (journal->pending.size == 0)
+                        break;
+
+                // Hold the group open for the rest of its window so records
+                // appended meanwhile share its sync
+                long long deadline = journal->first_pending_ns + journal->latency_ns;
+                struct timespec until = {deadline / 1000000000LL, deadline % 1000000000LL};
+                while (!journal->stopping && journal->pending.size < JOURNAL_GROUP_BYTES && getMonotonicNs() < deadline)
+                        pthread_cond_timedwait(&journal->appended, &journal->lock, &until);
+
+                // Swap buffers so appenders carry on while the group is written
+                ByteBuffer group = journal->pending;
+                journal->pending = journal->spare;
+                long long records = journal->appended_records;
+                int skip = journal->failed;
+                journal->writing = 1;
+                pthread_mutex_unlock(&journal->lock);
+
+                // A group after a failed one is dropped, since replay stops at the gap anyway
+                int ok = !skip && writeJournalBytes(journal->fd, group.data, group.size) && fdatasync(journal->fd) == 0;
+
+                pthread_mutex_lock(&journal->lock);
+                group.size = 0;
+                journal->spare = group;
+                journal->writing = 0;
+                if (ok)
+                {
+                        journal->durable_records = records;
+                        journal->group_commits++;
+                }
+                else
+                {
+                        journal->failed = 1;
+                }
+                pthread_cond_broadcast(&journal->synced);
+        }
+        pthread_mutex_unlock(&journal->lock);
+        return NULL;
+}
+
+/**
+ * Applies one journaled change to the chain
+ * Must be called with the append lock held.
+ * @param chain Pointer to the blockchain
+ * @param record Record to apply
+ * @return 1 if successful, 0 if the record does not fit the chain
+ */
+int applyJournalRecord(Blockchain *chain, const JournalRecord *record)
+{
+        if (record->type == JOURNAL_RECORD_BLOCK)
+        {
+                // New blocks go on at the difficulty they were mined at
+                if (record->block_index != chain->length || !commitBlockLocked(chain, record->data, record))
+                        return 0;
+                chain->difficulty = record->difficulty;
+                return 1;
+        }
+
+        Block *block = getBlock(chain, record->block_index);
+        return block && commitTransactionLocked(block, record->sender, record->receiver, record->amount, record);
+}
+
+/**
+ * Applies the records of a journal in order
+ * Replay stops at the first record that is torn, fails its checksum or
+ * does not apply, since nothing after it can be trusted.
+ * @param chain Pointer to the blockchain, with the append lock held
+ * @param src First record
+ * @param size Bytes of records
+ * @param valid_size Receives the bytes of records that were applied
+ * @return Number of records applied
+ */
+int replayJournal(Blockchain *chain, const unsigned char *src, size_t size, size_t *valid_size)
+{
+        int applied = 0;
+        size_t offset = 0;
+        JournalRecord record;
+        while (size - offset >= JOURNAL_RECORD_HEADER_SIZE)
+        {
+                unsigned int length, checksum;
+                memcpy(&length, src + offset, sizeof(unsigned int));
+                memcpy(&checksum, src + offset + 4, sizeof(unsigned int));
+                const unsigned char *payload = src + offset + JOURNAL_RECORD_HEADER_SIZE;
+                if (length > JOURNAL_MAX_RECORD_SIZE || size - offset - JOURNAL_RECORD_HEADER_SIZE < length ||
+                    checksum != (unsigned int)crc32(0L, payload, length) ||
+                    !decodeJournalRecord(payload, payload + length, &record) || !applyJournalRecord(chain, &record))
+                        break;
+                offset += JOURNAL_RECORD_HEADER_SIZE + length;
+                applied++;
+        }
+        *valid_size = offset;
+        return applied;
+}
+
+/**
+ * Finds where to resume replaying a journal onto a chain saved after
+ * the journal's base
+ * @param src First record
+ * @param size Bytes of records
+ * @param block_index Index of the saved chain's tip
+ * @param hash Hash of the saved chain's tip
+ * @return Offset just past the last record that left the tip with this hash, or 0 if none did
+ */
+size_t findJournalResumePoint(const unsigned char *src, size_t size, int block_index, const unsigned char *hash)
+{
+        size_t offset = 0;
+        size_t found = 0;
+        JournalRecord record;
+        while (size - offset >= JOURNAL_RECORD_HEADER_SIZE)
+        {
+                unsigned int length, checksum;
+                memcpy(&length, src + offset, sizeof(unsigned int));
+                memcpy(&checksum, src + offset + 4, sizeof(unsigned int));
+                const unsigned char *payload = src + offset + JOURNAL_RECORD_HEADER_SIZE;
+                if (length > JOURNAL_MAX_RECORD_SIZE || size - offset - JOURNAL_RECORD_HEADER_SIZE < length ||
+                    checksum != (unsigned int)crc32(0L, payload, length) ||
+                    !decodeJournalRecord(payload, payload + length, &record))
+                        break;
+                offset += JOURNAL_RECORD_HEADER_SIZE + length;
+                if (record.block_index == block_index && memcmp(record.hash, hash, DIGEST_SIZE) == 0)
+                        found = offset;
+        }
+        return found;
+}
+
+/**
+ * Replaces a journal with a new header and the given records, in a
+ * single rename
+ * @param filename Name of the journal
+ * @param base Chain state the records apply on top of
+ * @param records Framed records to keep
+ * @param size Bytes of records
+ * @return Descriptor of the new journal opened for appending, or -1 if failed
+ */
+int rewriteJournal(const char *filename, const JournalBase *base, const unsigned char *records, size_t size)
+{
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+        int fd = open(temp_filename, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0)
+                return -1;
+
+        unsigned char header[JOURNAL_MAX_HEADER_SIZE];
+        size_t header_size = encodeJournalHeader(base, header);
+        if (!writeJournalBytes(fd, header, header_size) || !writeJournalBytes(fd, records, size) ||
+            fdatasync(fd) != 0 || rename(temp_filename, filename) != 0)
+        {
+                close(fd);
+                remove(temp_filename);
+                return -1;
+        }
+        return fd;
+}
+
+/**
+ * Moves the base of a journal forward to a chain state saved while
+ * changes carried on, keeping only the records made after it
+ * @param journal Journal to rebase
+ * @param base Chain state the saved file holds
+ * @param offset Journal size when that state was captured
+ * @return 1 if successful, 0 if failed
+ */
+int rebaseJournal(Journal *journal, const JournalBase *base, long long offset)
+{
+        pthread_mutex_lock(&journal->lock);
+        while (journal->pending.size > 0 || journal->writing)
+                pthread_cond_wait(&journal->synced, &journal->lock);
+
+        // Records made since the capture are few, so they are simply
+        // copied; appenders wait on the lock meanwhile
+        long long size = journal->appended_bytes - offset;
+        unsigned char *records = (unsigned char *)malloc(size > 0 ? (size_t)size : 1);
+        int ok = !journal->failed && size >= 0 && records &&
+                 pread(journal->fd, records, (size_t)size, (off_t)offset) == (ssize_t)size;
+        int fd = ok ? rewriteJournal(journal->filename, base, records, (size_t)size) : -1;
+        if (fd >= 0)
+        {
+                close(journal->fd);
+                journal->fd = fd;
+                journal->appended_bytes = lseek(fd, 0, SEEK_END);
+        }
+        free(records);
+        pthread_mutex_unlock(&journal->lock);
+        return fd >= 0;
+}
+
+/**
+ * Opens the journal of a chain and starts its flusher thread
+ * With replay set, the changes a journal recorded on top of this very
+ * chain are applied first and a torn tail is cut off. Otherwise, or if
+ * the journal was recording another chain, it is started over.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the journal
+ * @param base_name File the chain was loaded from, or NULL for a new chain
+ * @param replay 1 to apply the records already in the journal
+ * @param latency_ms Longest a change waits for others to share its sync
+ * @return Pointer to the journal to store in chain->journal, or NULL if failed
+ */
+Journal *openJournal(Blockchain *chain, const char *filename, const char *base_name, int replay, long long latency_ms)
+{
+        int fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+                printf("Error: Could not open journal %s\n", filename);
+                return NULL;
+        }
+
+        JournalBase base, current;
+        getJournalBase(chain, base_name, &current);
+        struct stat info;
+        int resumed = 0;
+        if (replay && fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+                size_t size = (size_t)info.st_size;
+                void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                const unsigned char *src = (const unsigned char *)mapped;
+                size_t header_size = mapped != MAP_FAILED ? readJournalHeader(src, size, &base) : 0;
+
+                // Replay from the start if the journal starts where this chain
+                // does, or else from just after the change that brought the
+                // journal's chain to this chain's tip, as happens when a
+                // background save finished but the journal was not yet rebased
+                size_t start = 0;
+                if (header_size > 0 && base.length == current.length && memcmp(base.hash, current.hash, DIGEST_SIZE) == 0)
+                        start = header_size;
+                else if (header_size > 0 && current.length > 0)
+                {
+                        size_t resume = findJournalResumePoint(src + header_size, size - header_size,
+                                                               current.length - 1, current.hash);
+                        if (resume > 0)
+                                start = header_size + resume;
+                }
+
+                if (start > 0)
+                {
+                        size_t valid_size;
+                        pthread_mutex_lock(&chain->append_lock);
+                        int applied = replayJournal(chain, src + start, size - start, &valid_size);
+                        pthread_mutex_unlock(&chain->append_lock);
+
+                        // New records go after the last good one; a journal
+                        // resumed part way is started over from this chain
+                        if (start == header_size)
+                        {
+                                resumed = start + valid_size == size ||
+                                          (ftruncate(fd, (off_t)(start + valid_size)) == 0 && fdatasync(fd) == 0);
+                        }
+                        else
+                        {
+                                int rebased = rewriteJournal(filename, &current, src + start, valid_size);
+                                if (rebased >= 0)
+                                {
+                                        close(fd);
+                                        fd = rebased;
+                                        resumed = 1;
+                                }
+                        }
+                        printf("Recovered %d journaled changes from %s", applied, filename);
+                        if (start + valid_size < size)
+                                printf(" (%zu bytes of torn or invalid records dropped)", size - start - valid_size);
+                        printf("\n");
+                }
+                else if (header_size > 0)
+                {
+                        printf("Warning: Journal %s does not start at this chain; its changes are discarded\n", filename);
+                }
+                if (mapped != MAP_FAILED)
+                        munmap(mapped, size);
+        }
+        if (!resumed && !writeJournalHeader(fd, &current))
+        {
+                printf("Error: Could not write journal %s\n", filename);
+                close(fd);
+                return NULL;
+        }
+
+        // Group windows are timed on the monotonic clock
+        Journal *journal = (Journal *)calloc(1, sizeof(Journal));
+        pthread_condattr_t attr;
+        if (!journal || pthread_condattr_init(&attr) != 0)
+        {
+                free(journal);
+                close(fd);
+                return NULL;
+        }
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        journal->fd = fd;
+        snprintf(journal->filename, sizeof(journal->filename), "%s", filename);
+        journal->appended_bytes = lseek(fd, 0, SEEK_END);
+        journal->latency_ns = latency_ms > 0 ? latency_ms * 1000000LL : 0;
+        pthread_mutex_init(&journal->lock, NULL);
+        pthread_cond_init(&journal->appended, &attr);
+        pthread_cond_init(&journal->synced, NULL);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&journal->flusher, NULL, journalFlusherMain, journal) != 0)
+        {
+                printf("Error: Could not start the journal flusher\n");
+                pthread_mutex_destroy(&journal->lock);
+                pthread_cond_destroy(&journal->appended);
+                pthread_cond_destroy(&journal->synced);
+                free(journal);
+                close(fd);
+                return NULL;
+        }
+        return journal;
+}
+
+/**
+ * Waits until every change journaled so far is durable
+ * @param journal Journal to wait on, or NULL
+ * @return 1 if the changes are durable, 0 if the journal has failed
+ */
+int syncJournal(Journal *journal)
+{
+        if (!journal)
+                return 1;
+
+        pthread_mutex_lock(&journal->lock);
+        long long target = journal->appended_records;
+        while (!journal->failed && journal->durable_records < target)
+                pthread_cond_wait(&journal->synced, &journal->lock);
+        int ok = !journal->failed;
+        pthread_mutex_unlock(&journal->lock);
+        return ok;
+}
+
+/**
+ * Starts a journal over once the chain it records has been saved
+ * @param journal Journal of the chain
+ * @param chain Pointer to the blockchain
+ * @param base_name File the chain was just saved to
+ * @return 1 if successful, 0 if failed
+ */
+int resetJournal(Journal *journal, Blockchain *chain, const char *base_name)
+{
+        // No change may slip in between describing the chain and truncating
+        pthread_mutex_lock(&chain->append_lock);
+        pthread_mutex_lock(&journal->lock);
+        while (journal->pending.size > 0 || journal->writing)
+                pthread_cond_wait(&journal->synced, &journal->lock);
+
+        JournalBase base;
+        getJournalBase(chain, base_name, &base);
+        journal->failed = !writeJournalHeader(journal->fd, &base);
+        journal->appended_bytes = lseek(journal->fd, 0, SEEK_END);
+        int ok = !journal->failed;
+        pthread_mutex_unlock(&journal->lock);
+        pthread_mutex_unlock(&chain->append_lock);
+        return ok;
+}
+
+/**
+ * Writes out the pending changes of a journal and closes it
+ * @param journal Journal to close, or NULL
+ */
+void closeJournal(Journal *journal)
+{
+        if (!journal)
+                return;
+
+        pthread_mutex_lock(&journal->lock);
+        journal->stopping = 1;
+        pthread_cond_signal(&journal->appended);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->flusher, NULL);
+
+        close(journal->fd);
+        pthread_mutex_destroy(&journal->lock);
+        pthread_cond_destroy(&journal->appended);
+        pthread_cond_destroy(&journal->synced);
+        freeByteBuffer(&journal->pending);
+        freeByteBuffer(&journal->spare);
+        free(journal);
+}
+
+/**
+ * Rebuilds the chain a journal was recording: loads the file it was last
+ * saved to and replays the changes made since
+ * @param filename Name of the journal
+ * @param latency_ms Longest a change waits for others to share its sync
+ * @return Pointer to the recovered blockchain with its journal open, or NULL if there is nothing to recover
+ */
+Blockchain *recoverBlockchain(const char *filename, long long latency_ms)
+{
+        // Only the header is needed to find the base
+        unsigned char header[JOURNAL_MAX_HEADER_SIZE];
+        FILE *file = fopen(filename, "rb");
+        if (!file)
+                return NULL;
+        size_t size = fread(header, 1, sizeof(header), file);
+        fclose(file);
+
+        JournalBase base;
+        if (readJournalHeader(header, size, &base) == 0)
+        {
+                printf("Warning: Journal %s is corrupt and was not replayed\n", filename);
+                return NULL;
+        }
+
+        // The base is a segment manifest if it reads as one
+        SegmentManifest manifest;
+        Blockchain *chain;
+        if (base.length == 0)
+        {
+                chain = createBlockchain();
+        }
+        else if (readSegmentManifest(base.filename, &manifest))
+        {
+                freeSegmentManifest(&manifest);
+                chain = loadSegmentedChain(base.filename);
+        }
+        else
+        {
+                chain = loadBlockchain(base.filename);
+        }
+        if (!chain)
+        {
+                printf("Error: Could not load %s to replay journal %s onto\n", base.filename, filename);
+                return NULL;
+        }
+
+        chain->journal = openJournal(chain, filename, base.length > 0 ? base.filename : NULL, 1, latency_ms);
+        return chain;
+}
+
+/**
+ * Writes the copy of a chain taken by startBackgroundSave
+ * @param arg The BackgroundSave
+ * @return NULL
+ */
+void *backgroundSaveMain(void *arg)
+{
+        BackgroundSave *save = (BackgroundSave *)arg;
+        Blockchain *chain = save->chain;
+
+        // Names arrays the snapshot may see are kept until it ends, and
+        // every one holds at least the names counted when it began
+        int ok = writeChainFile(save->filename, save->snapshot.segments, save->snapshot.sealed_length,
+                                save->has_tip ? &save->tip : NULL, atomic_load(&chain->accounts.visible_names),
+                                save->account_count);
+
+        // The journal now only needs the changes made after the copy. The
+        // side files are left to be rebuilt: loading tells they are stale
+        // from the hash they record.
+        if (ok && chain->journal && !rebaseJournal(chain->journal, &save->base, save->journal_offset))
+                printf("Warning: Could not move the journal on to %s\n", save->filename);
+
+        endChainRead(&save->snapshot);
+        atomic_store(&chain->saving, 0);
+        atomic_store(&save->status, ok ? SAVE_SUCCEEDED : SAVE_FAILED);
+        if (save->on_complete)
+                save->on_complete(save->filename, ok, save->context);
+        return NULL;
+}
+
+/**
+ * Starts saving a chain on a background thread
+ * The sealed blocks are saved in place and the open tip as it is now, so
+ * the chain can keep growing meanwhile. Changes made after this call
+ * stay journaled on top of the saved file. Until the save is finished,
+ * transactions are not added to sealed blocks, and the chain must not be
+ * reloaded, saved again or freed.
+ * @param chain Pointer to the blockchain
+ * @param filename Name of the file to save to
+ * @param on_complete Called on the save thread when it is done, or NULL
+ * @param context Passed to on_complete
+ * @return Save to pass to finishBackgroundSave, or NULL if it could not start
+ */
+BackgroundSave *startBackgroundSave(Blockchain *chain, const char *filename, SaveCompletedCallback on_complete,
+                                    void *context)
+{
+        // Paging changes the blocks of a lazily loaded chain as they are read
+        if (!chain || chain->cache || atomic_load(&chain->saving))
+                return NULL;
+
+        BackgroundSave *save = (BackgroundSave *)calloc(1, sizeof(BackgroundSave));
+        if (!save)
+                return NULL;
+        save->chain = chain;
+        snprintf(save->filename, sizeof(save->filename), "%s", filename);
+        save->on_complete = on_complete;
+        save->context = context;
+        atomic_init(&save->status, SAVE_RUNNING);
+
+        // Only the tip is copied, so appends wait no longer than that
+        pthread_mutex_lock(&chain->append_lock);
+        beginChainRead(chain, &save->snapshot);
+        int ok = 1;
+        if (chain->length > save->snapshot.sealed_length)
+        {
+                const Block *tip = getBlock(chain, save->snapshot.sealed_length);
+                save->tip = *tip;
+                save->tip.frontier = NULL;
+                save->tip.transactions = NULL;
+                save->tip.transaction_capacity = tip->transaction_count;
+                if (tip->transaction_count > 0)
+                {
+                        size_t size = (size_t)tip->transaction_count * sizeof(Transaction);
+                        save->tip.transactions = (Transaction *)malloc(size);
+                        ok = save->tip.transactions != NULL;
+                        if (ok)
+                                memcpy(save->tip.transactions, tip->transactions, size);
+                }
+                save->has_tip = 1;
+        }
+        save->account_count = chain->accounts.count;
+        getJournalBase(chain, filename, &save->base);
+        if (chain->journal)
+        {
+                pthread_mutex_lock(&chain->journal->lock);
+                save->journal_offset = chain->journal->appended_bytes;
+                pthread_mutex_unlock(&chain->journal->lock);
+        }
+        if (ok)
+                atomic_store(&chain->saving, 1);
+        pthread_mutex_unlock(&chain->append_lock);
+
+        if (ok && pthread_create(&save->thread, NULL, backgroundSaveMain, save) != 0)
+        {
+                atomic_store(&chain->saving, 0);
+                ok = 0;
+        }
+        if (!ok)
+        {
+                endChainRead(&save->snapshot);
+                free(save->tip.transactions);
+                free(save);
+                return NULL;
+        }
+        return save;
+}
+
+/**
+ * Gets the state of a background save without waiting for it
+ * @param save Save started by startBackgroundSave
+ * @return SAVE_RUNNING, SAVE_SUCCEEDED or SAVE_FAILED
+ */
+int getBackgroundSaveStatus(BackgroundSave *save)
+{
+        return atomic_load(&save->status);
+}
+
+/**
+ * Waits for a background save to end and frees it
+ * @param save Save started by startBackgroundSave
+ * @return 1 if the chain was saved, 0 if failed
+ */
+int finishBackgroundSave(BackgroundSave *save)
+{
+        pthread_join(save->thread, NULL);
+        int ok = atomic_load(&save->status) == SAVE_SUCCEEDED;
+        free(save->tip.transactions);
+        free(save);
+        return ok;
+}
+
+/**
+ * Reports the outcome of the menu's background save once it has ended
+ * @param save Pending save, or NULL; cleared once reported
+ * @param wait 1 to wait for a running save, 0 to leave it running
+ * @return 1 if no save is pending any more, 0 if it is still running
+ */
+int reportBackgroundSave(BackgroundSave **save, int wait)
+{
+        if (!*save)
+                return 1;
+        if (!wait && getBackgroundSaveStatus(*save) == SAVE_RUNNING)
+                return 0;
+
+        if (finishBackgroundSave(*save))
+                printf("Background save finished successfully!\n");
+        else
+                printf("Background save failed!\n");
+        *save = NULL;
+        return 1;
+}
+
+/**
+ * Initializes a hand-off queue between two pipeline stages
+ * @param queue Queue to initialize
+ */
+void initIngestQueue(IngestQueue *queue)
+{
+        queue->head = 0;
+        queue->count = 0;
+        queue->closed = 0;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->changed, NULL);
+}
+
+/**
+ * Adds an item to a queue, waiting while it is full
+ * @param queue Queue to add to
+ * @param item Item to add
+ * @return 1 if added, 0 if the queue was closed
+ */
+int pushIngestQueue(IngestQueue *queue, void *item)
+{
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == INGEST_QUEUE_SIZE && !queue->closed)
+                pthread_cond_wait(&queue->changed, &queue->lock);
+
+        int added = !queue->closed;
+        if (added)
+        {
+                queue->items[(queue->head + queue->count) % INGEST_QUEUE_SIZE] = item;
+                queue->count++;
+                pthread_cond_broadcast(&queue->changed);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        return added;
+}
+
+/**
+ * Takes the oldest item from a queue, waiting while it is empty
+ * @param queue Queue to take from
+ * @return The item, or NULL once the queue is closed and drained
+ */
+void *popIngestQueue(IngestQueue *queue)
+{
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->closed)
+                pthread_cond_wait(&queue->changed, &queue->lock);
+
+        void *item = NULL;
+        if (queue->count > 0)
+        {
+                item = queue->items[queue->head];
+                queue->head = (queue->head + 1) % INGEST_QUEUE_SIZE;
+                queue->count--;
+                pthread_cond_broadcast(&queue->changed);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        return item;
+}
+
+/**
+ * Closes a queue: waiting producers give up and consumers drain what is left
+ * @param queue Queue to close
+ */
+void closeIngestQueue(IngestQueue *queue)
+{
+        pthread_mutex_lock(&queue->lock);
+        queue->closed = 1;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Frees the synchronization objects of a queue
+ * @param queue Queue to destroy
+ */
+void destroyIngestQueue(IngestQueue *queue)
+{
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->changed);
+}
+
+/**
+ * Reader stage: fills free chunks from the input and passes them on
+ * @param arg Pointer to the IngestPipeline
+ * @return Always NULL
+ */
+void *ingestReaderMain(void *arg)
+{
+        IngestPipeline *pipeline = (IngestPipeline *)arg;
+        IngestChunk *chunk;
 
-        // Convert hash to hex string
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        while ((chunk = (IngestChunk *)popIngestQueue(&pipeline->free_chunks)) != NULL)
         {
-                sprintf(output + (i * 2), "%02x", hash[i]);
+                chunk->length = fread(chunk->data, 1, INGEST_CHUNK_SIZE, pipeline->input);
+                if (chunk->length == 0 || !pushIngestQueue(&pipeline->full_chunks, chunk))
+                        break;
         }
-        output[HASH_SIZE] = '\0';
+
+        // An empty read means end of input (or a read error, checked by the caller)
+        closeIngestQueue(&pipeline->full_chunks);
+        return NULL;
 }
 
 /**
- * Creates a new block
- * @param index Block index
- * @param data Block data
- * @param previous_hash Hash of previous block
- * @return Pointer to new block or NULL if creation fails
+ * Writer stage: appends sealed blocks to the output file as they arrive
+ * @param arg Pointer to the IngestPipeline
+ * @return Always NULL
  */
-Block *createBlock(int index, const char *data, const char *previous_hash)
+void *ingestWriterMain(void *arg)
 {
-        // Allocate memory for the block
-        Block *block = (Block *)malloc(sizeof(Block));
-        if (!block)
-                return NULL;
+        IngestPipeline *pipeline = (IngestPipeline *)arg;
+        Block *block;
 
-        // Initialize block data
-        block->index = index;
-        block->timestamp = time(NULL);
-        block->transaction_count = 0;
-        strncpy(block->data, data, MAX_DATA_SIZE - 1);
-        block->data[MAX_DATA_SIZE - 1] = '\0';
-        strncpy(block->previous_hash, previous_hash, HASH_SIZE);
-        block->previous_hash[HASH_SIZE] = '\0';
-        block->next = NULL;
+        while ((block = (Block *)popIngestQueue(&pipeline->sealed_blocks)) != NULL)
+        {
+                writeBlockRecord(&pipeline->writer, block);
+        }
 
-        // Calculate hash for the new block
-        calculateHash(block, block->hash);
-        return block;
+        // The last group is written before the main thread adds the dictionary
+        finishBlockFileWriter(&pipeline->writer);
+        pipeline->blocks_written = pipeline->writer.failed ? -1 : pipeline->writer.blocks_written;
+        return NULL;
 }
 
 /**
- * Adds a new block to the blockchain
- * @param chain Pointer to the blockchain
- * @param data Data for the new block
- * @return 1 if successful, 0 if failed
+ * Copies one CSV field, removing surrounding quotes and whitespace
+ * @param field Start of the field
+ * @param length Length of the field
+ * @param output Buffer for the field
+ * @param size Size of the buffer
+ * @return 1 if the field fits the buffer, 0 otherwise
  */
-int addBlock(Blockchain *chain, const char *data)
+int copyCsvField(const char *field, size_t length, char *output, size_t size)
 {
-        // Check if the blockchain is valid
-        if (!chain)
-                return 0;
-
-        if (!chain->head)
+        while (length > 0 && (*field == ' ' || *field == '\t'))
         {
-                chain->head = createBlock(0, data, "0");
-                if (!chain->head)
-                        return 0;
-                chain->length = 1;
-                return 1;
+                field++;
+                length--;
         }
-
-        // Create a new block and add it to the end of the chain
-        Block *current = chain->head;
-        while (current->next)
+        while (length > 0 && (field[length - 1] == ' ' || field[length - 1] == '\t' || field[length - 1] == '\r'))
+                length--;
+        if (length >= 2 && field[0] == '"' && field[length - 1] == '"')
         {
-                current = current->next;
+                field++;
+                length -= 2;
         }
 
-        // Create a new block with the index of the last block + 1
-        Block *newBlock = createBlock(chain->length, data, current->hash);
-        if (!newBlock)
+        if (length >= size)
                 return 0;
-
-        // Link the new block to the end of the chain
-        current->next = newBlock;
-        chain->length++;
-
+        memcpy(output, field, length);
+        output[length] = '\0';
         return 1;
 }
 
 /**
- * Validates the integrity of the blockchain
- * @param chain Pointer to the blockchain
- * @return 1 if valid, 0 if invalid
+ * Parses a CSV line of the form sender,receiver,amount
+ * @param line Line without its newline, NUL-terminated
+ * @param sender Buffer of MAX_SENDER_SIZE bytes
+ * @param receiver Buffer of MAX_RECEIVER_SIZE bytes
+ * @param amount Receives the amount
+ * @return 1 if the line is a valid transaction, 0 otherwise
  */
-int validateBlockchain(Blockchain *chain)
+int parseCsvTransaction(const char *line, char *sender, char *receiver, double *amount)
 {
-        // Check if the blockchain is valid
-        if (!chain || !chain->head)
-                return 1;
-        // Check if the chain is empty
-        Block *current = chain->head->next;
-        Block *previous = chain->head;
-        char calculated_hash[HASH_SIZE + 1];
-
-        // Validate each block in the chain
-        while (current)
-        {
-                // Check if the previous hash matches
-                calculateHash(previous, calculated_hash);
-                if (strcmp(current->previous_hash, calculated_hash) != 0)
-                {
-                        return 0;
-                }
-
-                calculateHash(current, calculated_hash);
-                if (strcmp(current->hash, calculated_hash) != 0)
-                {
-                        return 0;
-                }
+        const char *first = strchr(line, ',');
+        const char *second = first ? strchr(first + 1, ',') : NULL;
+        if (!second)
+                return 0;
 
-                previous = current;
-                current = current->next;
-        }
+        char amount_field[64];
+        char *end;
+        if (!copyCsvField(line, first - line, sender, MAX_SENDER_SIZE) ||
+            !copyCsvField(first + 1, second - first - 1, receiver, MAX_RECEIVER_SIZE) ||
+            !copyCsvField(second + 1, strlen(second + 1), amount_field, sizeof(amount_field)))
+                return 0;
 
-        return 1;
+        *amount = strtod(amount_field, &end);
+        return end != amount_field && *end == '\0' && sender[0] && receiver[0];
 }
 
 /**
- * Adds a new transaction to a block
- * @param block Target block
- * @param sender Transaction sender
- * @param receiver Transaction receiver
- * @param amount Transaction amount
- * @return 1 if successful, 0 if failed
+ * Tells whether a CSV line that did not parse is a header
+ * A header has the three fields of a transaction, and its amount field is
+ * not a number, like "sender,receiver,amount".
+ * @param line Line without its newline, NUL-terminated
+ * @return 1 if the line looks like a header, 0 otherwise
  */
-int addTransaction(Block *block, const char *sender, const char *receiver, double amount)
+int isCsvHeader(const char *line)
 {
-        // Check if the block is valid
-        if (!block || block->transaction_count >= MAX_TRANSACTIONS)
+        const char *first = strchr(line, ',');
+        const char *second = first ? strchr(first + 1, ',') : NULL;
+        char amount_field[64];
+        char *end;
+        if (!second || !copyCsvField(second + 1, strlen(second + 1), amount_field, sizeof(amount_field)))
                 return 0;
 
-        // Check if the transaction data is valid
-        Transaction *trans = &block->transactions[block->transaction_count];
-        strncpy(trans->sender, sender, MAX_SENDER_SIZE - 1);
-        trans->sender[MAX_SENDER_SIZE - 1] = '\0';
-
-        // Check if the receiver data is valid
-        strncpy(trans->receiver, receiver, MAX_RECEIVER_SIZE - 1);
-        trans->receiver[MAX_RECEIVER_SIZE - 1] = '\0';
-
-        // Check if the amount is valid
-        trans->amount = amount;
-        trans->timestamp = time(NULL);
-
-        // Update the transaction count
-        block->transaction_count++;
-
-        // Recalculate the block hash
-        calculateHash(block, block->hash);
-        return 1;
+        strtod(amount_field, &end);
+        return end == amount_field;
 }
 
 /**
- * Displays transactions in a block
- * @param block Block containing transactions
+ * Finds a key in a flat JSON object and returns where its value starts
+ * @param line JSON object text
+ * @param key Key to look for, without quotes
+ * @return Pointer to the first character of the value, or NULL if absent
  */
-void displayTransactions(Block *block)
+const char *findJsonValue(const char *line, const char *key)
 {
-        // Check if the block is valid
-        if (block->transaction_count == 0)
+        size_t key_length = strlen(key);
+        for (const char *p = strchr(line, '"'); p; p = strchr(p + 1, '"'))
         {
-                printf("No transactions in this block\n");
-                return;
-        }
+                if (strncmp(p + 1, key, key_length) != 0 || p[key_length + 1] != '"')
+                        continue;
 
-        // Display each transaction
-        printf("\nTransactions:\n");
-        for (int i = 0; i < block->transaction_count; i++)
-        {
-                printf("Transaction #%d:\n", i + 1);
-                printf("  From: %s\n", block->transactions[i].sender);
-                printf("  To: %s\n", block->transactions[i].receiver);
-                printf("  Amount: %.2f\n", block->transactions[i].amount);
-                printf("  Time: %s", ctime(&block->transactions[i].timestamp));
+                const char *value = p + key_length + 2;
+                while (*value == ' ' || *value == '\t')
+                        value++;
+                if (*value != ':')
+                        continue;
+                value++;
+                while (*value == ' ' || *value == '\t')
+                        value++;
+                return value;
         }
+        return NULL;
 }
 
 /**
- * Displays information of a single block including transactions
- * @param block Block to display
+ * Copies a JSON string value, decoding simple escapes
+ * @param value Value starting at its opening quote
+ * @param output Buffer for the string
+ * @param size Size of the buffer
+ * @return 1 if the value is a string that fits the buffer, 0 otherwise
  */
-void displayBlock(Block *block)
+int copyJsonString(const char *value, char *output, size_t size)
 {
-        // Check if the block is valid
-        printf("\nBlock #%d\n", block->index);
-        printf("Timestamp: %s", ctime(&block->timestamp));
-        printf("Data: %s\n", block->data);
-        printf("Previous Hash: %s\n", block->previous_hash);
-        printf("Hash: %s\n", block->hash);
-        displayTransactions(block);
+        if (!value || *value != '"')
+                return 0;
+
+        size_t length = 0;
+        for (value++; *value && *value != '"'; value++)
+        {
+                char c = *value;
+                if (c == '\\')
+                {
+                        value++;
+                        c = *value == 'n' ? '\n' : *value == 't' ? '\t' : *value;
+                        if (!c)
+                                return 0;
+                }
+                if (length + 1 >= size)
+                        return 0;
+                output[length++] = c;
+        }
+        output[length] = '\0';
+        return *value == '"';
 }
 
 /**
- * Displays the entire blockchain
- * @param chain Pointer to the blockchain
+ * Parses a JSON line of the form {"sender": "...", "receiver": "...", "amount": ...}
+ * @param line Line without its newline, NUL-terminated
+ * @param sender Buffer of MAX_SENDER_SIZE bytes
+ * @param receiver Buffer of MAX_RECEIVER_SIZE bytes
+ * @param amount Receives the amount
+ * @return 1 if the line is a valid transaction, 0 otherwise
  */
-void displayBlockchain(Blockchain *chain)
+int parseJsonTransaction(const char *line, char *sender, char *receiver, double *amount)
 {
-        // Check if the blockchain is valid
-        if (!chain || !chain->head)
-        {
-                printf("Blockchain is empty\n");
-                return;
-        }
+        const char *value = findJsonValue(line, "amount");
+        char *end;
+        if (!value || !copyJsonString(findJsonValue(line, "sender"), sender, MAX_SENDER_SIZE) ||
+            !copyJsonString(findJsonValue(line, "receiver"), receiver, MAX_RECEIVER_SIZE))
+                return 0;
 
-        Block *current = chain->head;
-        while (current)
-        {
-                displayBlock(current);
-                current = current->next;
-        }
+        *amount = strtod(value, &end);
+        return end != value && sender[0] && receiver[0];
 }
 
 /**
- * Frees all memory allocated for the blockchain
- * @param chain Pointer to the blockchain
+ * Parses one input line and submits it to the mempool
+ * @param pipeline Ingest state
+ * @param line Line without its newline, NUL-terminated
+ * @return 1 to continue, 0 if the mempool has stopped
  */
-void freeBlockchain(Blockchain *chain)
+int ingestLine(IngestPipeline *pipeline, char *line)
 {
-        // Check if the blockchain is valid
-        if (!chain)
-                return;
+        char sender[MAX_SENDER_SIZE];
+        char receiver[MAX_RECEIVER_SIZE];
+        double amount;
 
-        Block *current = chain->head;
-        while (current)
+        pipeline->lines++;
+        const char *start = line;
+        while (*start == ' ' || *start == '\t')
+                start++;
+        if (*start == '\0' || *start == '\r')
+                return 1;
+
+        // Lines starting with a brace are JSON unless a format was forced
+        int json = pipeline->format == INGEST_FORMAT_JSONL ||
+                   (pipeline->format == INGEST_FORMAT_AUTO && *start == '{');
+        int parsed = json ? parseJsonTransaction(start, sender, receiver, &amount)
+                          : parseCsvTransaction(start, sender, receiver, &amount);
+        if (!parsed)
         {
-                Block *temp = current;
-                current = current->next;
-                free(temp);
+                // A CSV header line is not an error, but a first line with a
+                // numeric amount is a malformed transaction
+                if (pipeline->lines == 1 && !json && isCsvHeader(start))
+                        return 1;
+                if (pipeline->rejected++ < INGEST_MAX_REPORTED_ERRORS)
+                        printf("Warning: Skipping malformed line %lld\n", pipeline->lines);
+                return 1;
         }
-        free(chain);
+
+        // Wait for room while the sealer catches up
+        while (!submitTransaction(pipeline->mempool, sender, receiver, amount))
+        {
+                if (isMempoolStopped(pipeline->mempool))
+                        return 0;
+                sched_yield();
+        }
+        return 1;
 }
 
 /**
- * Safely gets string input from user
- * @param prompt The prompt to show user
- * @param buffer Buffer to store input
- * @param size Size of buffer
+ * Hands a block closed by the mempool sealer to the writer stage
+ * addBlock has compacted it, and it is never modified again.
+ * @param block Sealed block
+ * @param context Pointer to the IngestPipeline
  */
-void getStringInput(const char *prompt, char *buffer, size_t size)
+void queueSealedBlock(Block *block, void *context)
 {
-        // Check if the buffer is valid
-        printf("%s", prompt);
-        if (fgets(buffer, size, stdin))
-        {
-                buffer[strcspn(buffer, "\n")] = 0;
-        }
+        IngestPipeline *pipeline = (IngestPipeline *)context;
+        pushIngestQueue(&pipeline->sealed_blocks, block);
 }
 
 /**
- * Safely gets double input from user
- * @param prompt The prompt to show user
- * @return The double value entered
+ * Parses the chunks passed on by the reader, one line at a time
+ * Lines split across chunks are reassembled in a carry buffer.
+ * @param pipeline Ingest state
+ * @return 1 if the whole input was ingested, 0 otherwise
  */
-double getDoubleInput(const char *prompt)
+int ingestChunks(IngestPipeline *pipeline)
 {
-        // Check if the prompt is valid
-        char buffer[64];
-        double value;
+        char carry[INGEST_LINE_SIZE];
+        size_t carry_length = 0;
+        int overlong = 0;
+        IngestChunk *chunk;
 
-        while (1)
+        while ((chunk = (IngestChunk *)popIngestQueue(&pipeline->full_chunks)) != NULL)
         {
-                printf("%s", prompt);
-                if (fgets(buffer, sizeof(buffer), stdin))
+                pipeline->bytes += chunk->length;
+                char *p = chunk->data;
+                char *end = chunk->data + chunk->length;
+
+                while (p < end)
                 {
-                        if (sscanf(buffer, "%lf", &value) == 1)
+                        char *newline = (char *)memchr(p, '\n', end - p);
+                        size_t length = (newline ? newline : end) - p;
+
+                        // Collect the line in the carry buffer if it continues from,
+                        // or into, another chunk
+                        if (carry_length > 0 || !newline)
                         {
-                                return value;
+                                if (carry_length + length >= INGEST_LINE_SIZE)
+                                        overlong = 1;
+                                else
+                                        memcpy(carry + carry_length, p, length);
+                                carry_length += length;
+                        }
+
+                        if (!newline)
+                                break;
+
+                        int ok = 1;
+                        if (overlong)
+                        {
+                                pipeline->lines++;
+                                if (pipeline->rejected++ < INGEST_MAX_REPORTED_ERRORS)
+                                        printf("Warning: Skipping overlong line %lld\n", pipeline->lines);
+                        }
+                        else if (carry_length > 0)
+                        {
+                                carry[carry_length] = '\0';
+                                ok = ingestLine(pipeline, carry);
+                        }
+                        else
+                        {
+                                *newline = '\0';
+                                ok = ingestLine(pipeline, p);
                         }
+                        if (!ok)
+                        {
+                                pushIngestQueue(&pipeline->free_chunks, chunk);
+                                return 0;
+                        }
+                        carry_length = 0;
+                        overlong = 0;
+                        p = newline + 1;
                 }
-                printf("Invalid input. Please enter a valid number.\n");
+
+                pushIngestQueue(&pipeline->free_chunks, chunk);
         }
+
+        // The last line may have no newline
+        if (overlong)
+        {
+                pipeline->lines++;
+                pipeline->rejected++;
+        }
+        else if (carry_length > 0)
+        {
+                carry[carry_length] = '\0';
+                return ingestLine(pipeline, carry);
+        }
+        return 1;
 }
 
 /**
- * Saves the blockchain to a file
- * @param chain Pointer to the blockchain
- * @param filename Name of the file to save to
+ * Replays transactions from a CSV or JSON-lines file into a new chain
+ * The input is read in large chunks by a reader thread and parsed on the
+ * calling thread into a mempool, whose sealer thread hashes them into
+ * blocks. Sealed blocks are written to the output by a writer thread
+ * while later blocks are still being built.
+ * @param input_name File to read, or "-" for stdin
+ * @param output_name Blockchain file to write
+ * @param format INGEST_FORMAT_AUTO, INGEST_FORMAT_CSV or INGEST_FORMAT_JSONL
+ * @param sealing Limits that decide when blocks are cut; the callback is set here
+ * @param snapshot_interval Sealed blocks between background ledger snapshots, 0 for none
+ * @param file_flags FILE_FLAG_COMPRESSED to compress the output, FILE_FLAG_INDEXED to add a block index
  * @return 1 if successful, 0 if failed
  */
-int saveBlockchain(Blockchain *chain, const char *filename)
+int ingestTransactions(const char *input_name, const char *output_name, int format, const MempoolConfig *sealing,
+                       int snapshot_interval, int file_flags)
 {
-        if (!chain)
-                return 0;
+        IngestPipeline pipeline;
+        memset(&pipeline, 0, sizeof(pipeline));
+        pipeline.format = format;
 
-        FILE *file = fopen(filename, "wb");
-        if (!file)
+        int from_stdin = strcmp(input_name, "-") == 0;
+        pipeline.input = from_stdin ? stdin : fopen(input_name, "rb");
+        if (!pipeline.input)
         {
-                printf("Error: Could not open file for writing\n");
+                printf("Error: Could not open %s for reading\n", input_name);
                 return 0;
         }
+        // Chunks are already large, so stdio buffering would only add a copy
+        setvbuf(pipeline.input, NULL, _IONBF, 0);
 
-        // Write chain length first
-        fwrite(&chain->length, sizeof(int), 1, file);
-
-        // Write each block
-        Block *current = chain->head;
-        while (current)
+        // Write beside the output and rename over it once complete, so a
+        // failed ingest leaves an existing file untouched
+        char temp_filename[FILENAME_BUFFER_SIZE];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", output_name);
+        pipeline.output = fopen(temp_filename, "wb");
+        pipeline.chain = createBlockchain();
+        IngestChunk *chunks = (IngestChunk *)malloc(sizeof(IngestChunk) * INGEST_CHUNK_COUNT);
+        if (!pipeline.output || !pipeline.chain || !chunks || !addBlock(pipeline.chain, "Genesis Block"))
         {
-                // Write block data
-                fwrite(&current->index, sizeof(int), 1, file);
-                fwrite(&current->timestamp, sizeof(time_t), 1, file);
-                fwrite(current->data, sizeof(char), MAX_DATA_SIZE, file);
-                fwrite(&current->transaction_count, sizeof(int), 1, file);
-
-                // Write transactions
-                for (int i = 0; i < current->transaction_count; i++)
+                printf("Error: Could not start ingest into %s\n", output_name);
+                if (pipeline.output)
                 {
-                        fwrite(&current->transactions[i], sizeof(Transaction), 1, file);
+                        fclose(pipeline.output);
+                        remove(temp_filename);
                 }
+                if (!from_stdin)
+                        fclose(pipeline.input);
+                freeBlockchain(pipeline.chain);
+                free(chunks);
+                return 0;
+        }
 
-                // Write hashes
-                fwrite(current->previous_hash, sizeof(char), HASH_SIZE + 1, file);
-                fwrite(current->hash, sizeof(char), HASH_SIZE + 1, file);
+        // The chain length is patched in once all blocks are written
+        writeFileHeader(pipeline.output, 0, file_flags);
+        initBlockFileWriter(&pipeline.writer, pipeline.output, file_flags);
 
-                current = current->next;
-        }
+        initIngestQueue(&pipeline.free_chunks);
+        initIngestQueue(&pipeline.full_chunks);
+        initIngestQueue(&pipeline.sealed_blocks);
+        for (int i = 0; i < INGEST_CHUNK_COUNT; i++)
+                pushIngestQueue(&pipeline.free_chunks, &chunks[i]);
 
-        fclose(file);
-        printf("Blockchain saved successfully to %s\n", filename);
-        return 1;
-}
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-/**
- * Loads the blockchain from a file
- * @param filename Name of the file to load from
- * @return Pointer to loaded blockchain or NULL if failed
- */
-Blockchain *loadBlockchain(const char *filename)
-{
-        FILE *file = fopen(filename, "rb");
-        if (!file)
+        MempoolConfig config = *sealing;
+        config.on_sealed = queueSealedBlock;
+        config.context = &pipeline;
+        MempoolStats stats;
+        memset(&stats, 0, sizeof(stats));
+
+        // Ledger snapshots are taken from sealed blocks without holding up the sealer
+        LedgerSnapshotter *snapshotter = NULL;
+        if (snapshot_interval > 0 && !(snapshotter = startLedgerSnapshots(pipeline.chain, output_name, snapshot_interval)))
+                printf("Warning: Could not start ledger snapshots\n");
+
+        pthread_t reader, writer;
+        int reader_started = pthread_create(&reader, NULL, ingestReaderMain, &pipeline) == 0;
+        int writer_started = pthread_create(&writer, NULL, ingestWriterMain, &pipeline) == 0;
+        pipeline.mempool = reader_started && writer_started ? createMempool(pipeline.chain, &config) : NULL;
+        int ok = pipeline.mempool != NULL;
+        if (ok)
         {
-                printf("Error: Could not open file for reading\n");
-                return NULL;
-        }
+                ok = ingestChunks(&pipeline);
 
-        Blockchain *chain = createBlockchain();
-        if (!chain)
+                // Drain the mempool; the open block is complete once the input ends
+                stopMempool(pipeline.mempool, &stats);
+                ok = ok && !stats.halted;
+                pipeline.transactions = stats.accepted;
+                pipeline.rejected += stats.failed;
+        }
+        else
         {
-                fclose(file);
-                return NULL;
+                printf("Error: Could not start ingest threads\n");
         }
 
-        // Read chain length
-        int length;
-        if (fread(&length, sizeof(int), 1, file) != 1)
+        int snapshots = stopLedgerSnapshots(snapshotter);
+
+        // Stop the reader if parsing gave up early, and let the writer drain
+        closeIngestQueue(&pipeline.free_chunks);
+        closeIngestQueue(&pipeline.sealed_blocks);
+        if (reader_started)
+                pthread_join(reader, NULL);
+        if (writer_started)
+                pthread_join(writer, NULL);
+        if (ferror(pipeline.input))
         {
-                printf("Error: Could not read chain length\n");
-                freeBlockchain(chain);
-                fclose(file);
-                return NULL;
+                printf("Error: Could not read %s\n", input_name);
+                ok = 0;
         }
 
-        // Read each block
-        for (int i = 0; i < length; i++)
+        // Finish the file: account dictionary, block index, then chain length
+        if (ok)
         {
-                Block *block = (Block *)malloc(sizeof(Block));
-                if (!block)
-                {
-                        freeBlockchain(chain);
-                        fclose(file);
-                        return NULL;
-                }
+                long long dictionary_offset = ftell(pipeline.output);
+                writeAccountDictionary(pipeline.output, &pipeline.chain->accounts);
+                if ((file_flags & FILE_FLAG_INDEXED) && !writeBlockFileFooter(&pipeline.writer, dictionary_offset))
+                        ok = 0;
+                fseek(pipeline.output, 4 + sizeof(unsigned int), SEEK_SET);
+                fwrite(&pipeline.blocks_written, sizeof(int), 1, pipeline.output);
+                ok = ok && pipeline.blocks_written == pipeline.chain->length;
+        }
+        freeBlockFileWriter(&pipeline.writer);
+        if (ferror(pipeline.output))
+                ok = 0;
+        if (fclose(pipeline.output) != 0)
+                ok = 0;
+        if (ok && rename(temp_filename, output_name) != 0)
+                ok = 0;
+        if (!ok)
+                remove(temp_filename);
 
-                // Read block data
-                fread(&block->index, sizeof(int), 1, file);
-                fread(&block->timestamp, sizeof(time_t), 1, file);
-                fread(block->data, sizeof(char), MAX_DATA_SIZE, file);
-                fread(&block->transaction_count, sizeof(int), 1, file);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
 
-                // Read transactions
-                for (int j = 0; j < block->transaction_count; j++)
-                {
-                        fread(&block->transactions[j], sizeof(Transaction), 1, file);
-                }
+        if (ok)
+        {
+                saveChainState(pipeline.chain, output_name);
+
+                printf("Ingested %lld transactions into %d blocks from %lld lines (%lld rejected)\n",
+                       pipeline.transactions, pipeline.chain->length, pipeline.lines, pipeline.rejected);
+                printf("%.3f s, %.0f transactions/s, %.1f MB/s\n", seconds,
+                       seconds > 0 ? pipeline.transactions / seconds : 0,
+                       seconds > 0 ? pipeline.bytes / seconds / 1e6 : 0);
+                if (snapshot_interval > 0)
+                        printf("%d ledger snapshots written in the background\n", snapshots);
+                printf("Blockchain saved successfully to %s\n", output_name);
+        }
+        else
+        {
+                printf("Error: Ingest into %s failed\n", output_name);
+        }
 
-                // Read hashes
-                fread(block->previous_hash, sizeof(char), HASH_SIZE + 1, file);
-                fread(block->hash, sizeof(char), HASH_SIZE + 1, file);
+        destroyIngestQueue(&pipeline.free_chunks);
+        destroyIngestQueue(&pipeline.full_chunks);
+        destroyIngestQueue(&pipeline.sealed_blocks);
+        if (!from_stdin)
+                fclose(pipeline.input);
+        freeBlockchain(pipeline.chain);
+        free(chunks);
+        return ok;
+}
 
-                block->next = NULL;
+/**
+ * Runs the non-interactive batch mode from command line arguments
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return Process exit status
+ */
+int runBatchMode(int argc, char **argv)
+{
+        const char *input_name = NULL;
+        const char *output_name = NULL;
+        int format = INGEST_FORMAT_AUTO;
+        int snapshot_interval = 0;
+        const char *inspect_name = NULL;
+        int first_block = 0;
+        int block_count = 1;
+        const char *segment_name = NULL;
+        long long segment_bytes = SEGMENT_FILE_DEFAULT_BYTES;
+        int file_flags = FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED;
+        MempoolConfig sealing;
+        memset(&sealing, 0, sizeof(sealing));
+        sealing.capacity = MEMPOOL_DEFAULT_CAPACITY;
+        sealing.max_transactions = INGEST_DEFAULT_BLOCK_SIZE;
+        int valid = 1;
 
-                // Add block to chain
-                if (!chain->head)
+        for (int i = 1; i < argc && valid; i++)
+        {
+                // Every option takes a value
+                if (i + 1 >= argc)
                 {
-                        chain->head = block;
+                        valid = 0;
+                        break;
                 }
+                const char *value = argv[++i];
+
+                if (strcmp(argv[i - 1], "--ingest") == 0)
+                        input_name = value;
+                else if (strcmp(argv[i - 1], "--output") == 0)
+                        output_name = value;
+                else if (strcmp(argv[i - 1], "--block-size") == 0)
+                        valid = (sealing.max_transactions = atoi(value)) > 0 && sealing.max_transactions <= MAX_BLOCK_TRANSACTIONS;
+                else if (strcmp(argv[i - 1], "--block-bytes") == 0)
+                        valid = (sealing.max_bytes = (size_t)atoll(value)) > 0;
+                else if (strcmp(argv[i - 1], "--block-latency-ms") == 0)
+                        valid = (sealing.max_latency_ms = atoll(value)) > 0;
+                else if (strcmp(argv[i - 1], "--snapshot-interval") == 0)
+                        valid = (snapshot_interval = atoi(value)) > 0;
+                else if (strcmp(argv[i - 1], "--compression") == 0 && strcmp(value, "zlib") == 0)
+                        file_flags = FILE_FLAG_COMPRESSED | FILE_FLAG_INDEXED;
+                else if (strcmp(argv[i - 1], "--compression") == 0 && strcmp(value, "none") == 0)
+                        file_flags = FILE_FLAG_INDEXED;
+                else if (strcmp(argv[i - 1], "--inspect") == 0)
+                        inspect_name = value;
+                else if (strcmp(argv[i - 1], "--block") == 0)
+                        valid = (first_block = atoi(value)) >= 0;
+                else if (strcmp(argv[i - 1], "--count") == 0)
+                        valid = (block_count = atoi(value)) > 0;
+                else if (strcmp(argv[i - 1], "--segment") == 0)
+                        segment_name = value;
+                else if (strcmp(argv[i - 1], "--segment-size") == 0)
+                        valid = (segment_bytes = atoll(value)) > 0;
+                else if (strcmp(argv[i - 1], "--format") == 0 && strcmp(value, "csv") == 0)
+                        format = INGEST_FORMAT_CSV;
+                else if (strcmp(argv[i - 1], "--format") == 0 && strcmp(value, "jsonl") == 0)
+                        format = INGEST_FORMAT_JSONL;
                 else
-                {
-                        Block *current = chain->head;
-                        while (current->next)
-                        {
-                                current = current->next;
-                        }
-                        current->next = block;
-                }
+                        valid = 0;
         }
 
-        chain->length = length;
-        fclose(file);
-
-        // Re-validate the loaded blockchain
-        if (!validateBlockchain(chain))
+        if (!valid || (input_name != NULL) + (inspect_name != NULL) + (segment_name != NULL) != 1)
         {
-                printf("Error: Loaded blockchain is invalid\n");
+                printf("Usage: %s --ingest FILE|- [--format csv|jsonl] [--block-size N] [--block-bytes N]\n"
+                       "          [--block-latency-ms N] [--snapshot-interval N] [--compression zlib|none]\n"
+                       "          [--output FILE]\n"
+                       "       %s --inspect FILE [--block N] [--count N]\n"
+                       "       %s --segment FILE [--segment-size N] [--output MANIFEST]\n",
+                       argv[0], argv[0], argv[0]);
+                return 1;
+        }
+        if (inspect_name)
+                return inspectBlocks(inspect_name, first_block, block_count) ? 0 : 1;
+        if (!output_name)
+                output_name = segment_name ? SEGMENT_MANIFEST_FILENAME : FILENAME;
+        if (segment_name)
+        {
+                // Converts a chain file to segmented storage
+                Blockchain *chain = loadBlockchain(segment_name);
+                int ok = chain && saveSegmentedChain(chain, output_name, segment_bytes);
                 freeBlockchain(chain);
-                return NULL;
+                return ok ? 0 : 1;
         }
-
-        printf("Blockchain loaded and validated successfully from %s\n", filename);
-        return chain;
-}
\ No newline at end of file
+        return ingestTransactions(input_name, output_name, format, &sealing, snapshot_interval, file_flags) ? 0 : 1;
+}
@@ -0,0 +1,458 @@
+/**
+ * This program checks that loading rejects tampered files written by
+ * blockchain_full_persistent.c.
+ *
+ * Each test builds a small chain, saves it, changes the saved file the way
+ * an attacker could, and expects loadBlockchain to refuse the result.
+ * It prints one line per test and exits with status 1 if any test failed.
+ */
+
+#define BLOCKCHAIN_NO_MAIN
+#include "blockchain_full_persistent.c"
+
+// Constants
+#define TEST_FILE "load_test.dat"
+#define TEST_MANIFEST "load_test.seg"
+
+/**
+ * Builds a three-block chain with a few transfers between named accounts
+ * @return Pointer to the chain or NULL if failed
+ */
+Blockchain *createTestChain(void)
+{
+        Blockchain *chain = createBlockchain();
+        if (!chain)
+                return NULL;
+
+        int ok = addBlock(chain, "Genesis Block") && addBlock(chain, "First") &&
+                 addTransaction(getLatestBlock(chain), "alice", "bob", 5.0) &&
+                 addTransaction(getLatestBlock(chain), "carol", "bob", 2.0) && addBlock(chain, "Second") &&
+                 addTransaction(getLatestBlock(chain), "bob", "alice", 1.0);
+        if (!ok)
+        {
+                freeBlockchain(chain);
+                return NULL;
+        }
+        return chain;
+}
+
+/**
+ * Removes the test file and everything saved next to it
+ */
+void removeTestFiles(void)
+{
+        char filename[FILENAME_BUFFER_SIZE];
+        remove(TEST_FILE);
+        getIndexFilename(TEST_FILE, filename, sizeof(filename));
+        remove(filename);
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+        {
+                getStateFilename(TEST_FILE, slot, filename, sizeof(filename));
+                remove(filename);
+                getStateFilename(TEST_MANIFEST, slot, filename, sizeof(filename));
+                remove(filename);
+        }
+        remove(TEST_MANIFEST);
+        getIndexFilename(TEST_MANIFEST, filename, sizeof(filename));
+        remove(filename);
+        getSegmentFilename(TEST_MANIFEST, 0, filename, sizeof(filename));
+        remove(filename);
+}
+
+/**
+ * Recomputes the Merkle roots and hashes of a chain from one block on,
+ * as someone rewriting a saved chain would
+ * @param chain Chain whose blocks were changed
+ * @param first First changed block
+ */
+void resealBlocks(Blockchain *chain, int first)
+{
+        for (int i = first; i < chain->length; i++)
+        {
+                Block *block = getBlock(chain, i);
+                if (i > 0)
+                        memcpy(block->previous_hash, getBlock(chain, i - 1)->hash, DIGEST_SIZE);
+                computeMerkleRoot(&chain->accounts, block->transactions, block->transaction_count, block->merkle_root);
+                calculateHash(block, block->hash);
+        }
+}
+
+/**
+ * Loads the test file and reports whether it was refused
+ * @return 1 if loading failed, 0 if the file was accepted
+ */
+int expectLoadFailure(void)
+{
+        Blockchain *chain = loadBlockchain(TEST_FILE);
+        if (!chain)
+                return 1;
+
+        freeBlockchain(chain);
+        return 0;
+}
+
+/**
+ * Overwrites bytes of the ledger state snapshot in slot 0 and recomputes
+ * its checksum, as someone forging the file would
+ * @param offset Offset of the bytes from the start of the file
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return 1 if successful, 0 otherwise
+ */
+int patchStateFile(long offset, const void *data, size_t size)
+{
+        char filename[FILENAME_BUFFER_SIZE];
+        getStateFilename(TEST_FILE, 0, filename, sizeof(filename));
+        FILE *file = fopen(filename, "r+b");
+        if (!file)
+                return 0;
+
+        LedgerStateHeader header;
+        unsigned char *body = NULL;
+        long body_size = 0;
+        int ok = fseek(file, 0, SEEK_END) == 0 && (body_size = ftell(file) - (long)sizeof(header)) >= 0 &&
+                 offset >= (long)sizeof(header) && offset + (long)size <= (long)sizeof(header) + body_size &&
+                 (body = (unsigned char *)malloc((size_t)body_size + 1)) != NULL && fseek(file, 0, SEEK_SET) == 0 &&
+                 fread(&header, sizeof(header), 1, file) == 1 &&
+                 fread(body, 1, (size_t)body_size, file) == (size_t)body_size;
+        if (ok)
+        {
+                memcpy(body + offset - (long)sizeof(header), data, size);
+                header.checksum = updateStateChecksum(STATE_CHECKSUM_SEED, body, (size_t)body_size);
+                ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                     fwrite(body, 1, (size_t)body_size, file) == (size_t)body_size;
+        }
+        free(body);
+        return fclose(file) == 0 && ok;
+}
+
+/**
+ * Checks that a loaded chain has the same indexes as the chain it was saved from
+ * @param loaded Chain read back from the test file, or NULL
+ * @param original Chain the file was saved from
+ * @return 1 if every posting list matches, 0 otherwise
+ */
+int sameIndexes(Blockchain *loaded, Blockchain *original)
+{
+        if (!loaded || loaded->index.blocks.count != original->index.blocks.count ||
+            loaded->index.transactions.count != original->index.transactions.count)
+                return 0;
+        for (int id = 0; id < original->accounts.count; id++)
+        {
+                const PostingList *a = &loaded->index.accounts[id];
+                const PostingList *b = &original->index.accounts[id];
+                if (a->count != b->count || (a->count > 0 && memcmp(a->items, b->items, a->count * sizeof(Posting)) != 0))
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Swaps two names in the saved account dictionary, which would turn
+ * "alice -> bob" into "bob -> alice" if the names were not hashed
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testSwappedAccountNames(void)
+{
+        Blockchain *chain = createTestChain();
+        if (!chain)
+                return 0;
+
+        char *names[3] = {chain->accounts.names[1], chain->accounts.names[0], chain->accounts.names[2]};
+        int ok = chain->accounts.count == 3 &&
+                 writeChainFile(TEST_FILE, chain->segments, chain->length, NULL, names, chain->accounts.count);
+        freeBlockchain(chain);
+        return ok && expectLoadFailure();
+}
+
+/**
+ * Gives a transaction a sender ID far past the dictionary, with the
+ * hashes recomputed so that only the ID check can catch it
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testUnknownAccountId(void)
+{
+        Blockchain *chain = createTestChain();
+        if (!chain)
+                return 0;
+
+        getBlock(chain, 1)->transactions[0].sender_id = 0x80000000u;
+        resealBlocks(chain, 1);
+        int ok = writeChainFile(TEST_FILE, chain->segments, chain->length, NULL, chain->accounts.names,
+                                chain->accounts.count) &&
+                 saveSegmentedChain(chain, TEST_MANIFEST, SEGMENT_FILE_DEFAULT_BYTES);
+        freeBlockchain(chain);
+        ok = ok && expectLoadFailure();
+
+        // Partial and segmented loads check the IDs too
+        Blockchain *range = ok ? loadBlockRange(TEST_FILE, 1, 1) : NULL;
+        Blockchain *segmented = ok ? loadSegmentedChain(TEST_MANIFEST) : NULL;
+        ok = ok && !range && !segmented;
+        freeBlockchain(range);
+        freeBlockchain(segmented);
+
+        // Lazily loaded blocks are checked when their transactions are paged in
+        Blockchain *lazy = ok ? loadBlockchainLazy(TEST_FILE, TRANSACTION_CACHE_DEFAULT_BYTES) : NULL;
+        ok = ok && (!lazy || !getBlockTransactions(getBlock(lazy, 1)));
+        freeBlockchain(lazy);
+        return ok;
+}
+
+/**
+ * Points a posting of a saved index file past the end of the chain; the
+ * index must be rebuilt rather than used
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testIndexPostingOutOfRange(void)
+{
+        Blockchain *chain = createTestChain();
+        int ok = chain && saveBlockchain(chain, TEST_FILE);
+
+        // Without ledger snapshots, as when one could not be saved, loading
+        // takes the indexes from the index file
+        char filename[FILENAME_BUFFER_SIZE];
+        for (int slot = 0; slot < STATE_FILE_SLOTS; slot++)
+        {
+                getStateFilename(TEST_FILE, slot, filename, sizeof(filename));
+                remove(filename);
+        }
+        getIndexFilename(TEST_FILE, filename, sizeof(filename));
+        if (ok)
+                chain->index.blocks.items[0].block_index = 1000000;
+        ok = ok && saveChainIndex(chain, filename);
+        freeBlockchain(chain);
+
+        Blockchain *loaded = ok ? loadBlockchain(TEST_FILE) : NULL;
+        ok = loaded != NULL;
+        for (int i = 0; ok && i < loaded->index.blocks.count; i++)
+                ok = loaded->index.blocks.items[i].block_index < loaded->length;
+        freeBlockchain(loaded);
+        return ok;
+}
+
+/**
+ * Gives the first account of a ledger snapshot a history far longer than
+ * the file, with the checksum recomputed; the snapshot must be rejected
+ * and the indexes rebuilt
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testStateHistoryCount(void)
+{
+        Blockchain *chain = createTestChain();
+        int ok = chain && saveBlockchain(chain, TEST_FILE);
+
+        // The account histories follow the block and transaction postings,
+        // each starting with its length
+        ByteBuffer lists = {0};
+        unsigned char count[10];
+        size_t count_size = putVarint(count, 100000000) - count;
+        ok = ok && encodePostingList(&lists, &chain->index.blocks) &&
+             encodePostingList(&lists, &chain->index.transactions) &&
+             patchStateFile((long)sizeof(LedgerStateHeader) + (long)lists.size, count, count_size);
+        freeByteBuffer(&lists);
+        Blockchain *loaded = ok ? loadBlockchain(TEST_FILE) : NULL;
+        ok = ok && sameIndexes(loaded, chain);
+        freeBlockchain(loaded);
+        freeBlockchain(chain);
+        return ok;
+}
+
+/**
+ * Points the first posting of alice's history in a ledger snapshot at
+ * carol's transfer, with the checksum recomputed; the postings must be
+ * rebuilt from the blocks, and balances never come from the snapshot
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testStateForgedPosting(void)
+{
+        Blockchain *chain = createTestChain();
+        int ok = chain && saveBlockchain(chain, TEST_FILE) && chain->index.accounts[0].count > 0;
+
+        // Alice's history follows the block and transaction postings, and
+        // moving a posting to the next slot keeps its encoded size
+        ByteBuffer lists = {0};
+        ByteBuffer history = {0};
+        Posting forged_items[2];
+        PostingList forged = {forged_items, 0, 2};
+        if (ok)
+        {
+                forged.count = chain->index.accounts[0].count < 2 ? chain->index.accounts[0].count : 2;
+                memcpy(forged_items, chain->index.accounts[0].items, forged.count * sizeof(Posting));
+                forged_items[0].tx_slot = 1;
+        }
+        ok = ok && chain->index.accounts[0].count == forged.count && encodePostingList(&lists, &chain->index.blocks) &&
+             encodePostingList(&lists, &chain->index.transactions) && encodePostingList(&history, &forged) &&
+             patchStateFile((long)sizeof(LedgerStateHeader) + (long)lists.size, history.data, history.size);
+        freeByteBuffer(&lists);
+        freeByteBuffer(&history);
+        Blockchain *loaded = ok ? loadBlockchain(TEST_FILE) : NULL;
+        ok = ok && sameIndexes(loaded, chain);
+        for (int id = 0; ok && id < chain->accounts.count; id++)
+                ok = loaded->balances.balances[id] == chain->balances.balances[id];
+        freeBlockchain(loaded);
+        freeBlockchain(chain);
+        return ok;
+}
+
+/**
+ * Writes a chain in the fixed-width layout of version 3 files, which store
+ * each block's index instead of deriving it from the block's position
+ * @param chain Chain to write
+ * @return 1 if successful, 0 otherwise
+ */
+int writeFixedChainFile(Blockchain *chain)
+{
+        FILE *file = fopen(TEST_FILE, "wb");
+        if (!file)
+                return 0;
+
+        unsigned int version = FILE_VERSION_FIXED;
+        fwrite(FILE_MAGIC, sizeof(char), 4, file);
+        fwrite(&version, sizeof(unsigned int), 1, file);
+        fwrite(&chain->length, sizeof(int), 1, file);
+        for (int i = 0; i < chain->length; i++)
+        {
+                Block *block = getBlock(chain, i);
+                fwrite(&block->index, sizeof(int), 1, file);
+                fwrite(&block->timestamp, sizeof(time_t), 1, file);
+                fwrite(block->data, sizeof(char), MAX_DATA_SIZE, file);
+                fwrite(&block->transaction_count, sizeof(int), 1, file);
+                if (block->transaction_count > 0)
+                        fwrite(block->transactions, sizeof(Transaction), block->transaction_count, file);
+                fwrite(&block->hash_mode, sizeof(int), 1, file);
+                if (block->hash_mode == HASH_MODE_WORK)
+                {
+                        fwrite(&block->difficulty, sizeof(int), 1, file);
+                        fwrite(&block->nonce, sizeof(unsigned long long), 1, file);
+                }
+                fwrite(block->merkle_root, sizeof(unsigned char), DIGEST_SIZE, file);
+                fwrite(block->previous_hash, sizeof(unsigned char), DIGEST_SIZE, file);
+                fwrite(block->hash, sizeof(unsigned char), DIGEST_SIZE, file);
+        }
+        writeAccountDictionary(file, &chain->accounts);
+        return fclose(file) == 0;
+}
+
+/**
+ * Gives a block of a version 3 file the index of another position, with
+ * the hashes recomputed so that only the index check can catch it
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testBlockIndexMismatch(void)
+{
+        Blockchain *chain = createTestChain();
+        if (!chain)
+                return 0;
+
+        // The unchanged chain loads, so the layout written is right
+        int ok = writeFixedChainFile(chain) && !expectLoadFailure();
+        getBlock(chain, 1)->index = 2;
+        resealBlocks(chain, 1);
+        ok = ok && writeFixedChainFile(chain);
+        freeBlockchain(chain);
+        return ok && expectLoadFailure();
+}
+
+/**
+ * Marks a block of a version 3 file as hashed in the legacy string mode,
+ * which skips transaction timestamps, and changes one of its timestamps
+ * after the block was hashed; only legacy files may use that mode
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testLegacyHashMode(void)
+{
+        Blockchain *chain = createTestChain();
+        if (!chain)
+                return 0;
+
+        Block *block = getBlock(chain, 1);
+        block->hash_mode = HASH_MODE_LEGACY;
+        resealBlocks(chain, 1);
+        block->transactions[0].timestamp += 3600;
+        int ok = writeFixedChainFile(chain);
+        freeBlockchain(chain);
+        return ok && expectLoadFailure();
+}
+
+/**
+ * Claims the largest transaction count for the last block of a version 3
+ * file, far more records than the file holds
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testTransactionCountPastEnd(void)
+{
+        Blockchain *chain = createTestChain();
+        int ok = chain && writeFixedChainFile(chain);
+        long offset = 0;
+        for (int i = 0; ok && i < chain->length - 1; i++)
+        {
+                Block *block = getBlock(chain, i);
+                offset += (long)(sizeof(int) + sizeof(time_t) + MAX_DATA_SIZE + sizeof(int) +
+                                 sizeof(Transaction) * block->transaction_count + sizeof(int) + 3 * DIGEST_SIZE);
+                if (block->hash_mode == HASH_MODE_WORK)
+                        offset += (long)(sizeof(int) + sizeof(unsigned long long));
+        }
+        freeBlockchain(chain);
+
+        // Header: magic, version and length; then the block's index, timestamp and data
+        FILE *file = ok ? fopen(TEST_FILE, "r+b") : NULL;
+        int count = MAX_BLOCK_TRANSACTIONS;
+        ok = file && fseek(file, 4 + 4 + 4 + offset + 4 + (long)sizeof(time_t) + MAX_DATA_SIZE, SEEK_SET) == 0 &&
+             fwrite(&count, sizeof(int), 1, file) == 1;
+        if (file)
+                ok = fclose(file) == 0 && ok;
+        return ok && expectLoadFailure();
+}
+
+/**
+ * Mines a block and then one at a lower difficulty after it; each block
+ * meets its own target, but the chain must not be accepted
+ * @return 1 if the test passed, 0 otherwise
+ */
+int testLoweredDifficulty(void)
+{
+        Blockchain *chain = createBlockchain();
+        if (!chain)
+                return 0;
+
+        int ok = addBlock(chain, "Genesis Block");
+        chain->difficulty = 4;
+        ok = ok && addBlock(chain, "Mined");
+        chain->difficulty = 0;
+        ok = ok && addBlock(chain, "Not mined") && validateBlockchain(chain) == 0 &&
+             writeChainFile(TEST_FILE, chain->segments, chain->length, NULL, chain->accounts.names,
+                            chain->accounts.count);
+        freeBlockchain(chain);
+        return ok && expectLoadFailure();
+}
+
+// Main function
+int main(void)
+{
+        struct
+        {
+                const char *name;
+                int (*run)(void);
+        } tests[] = {
+            {"swapped account names", testSwappedAccountNames},
+            {"unknown account ID", testUnknownAccountId},
+            {"index posting out of range", testIndexPostingOutOfRange},
+            {"ledger snapshot history count", testStateHistoryCount},
+            {"forged ledger snapshot posting", testStateForgedPosting},
+            {"block index mismatch", testBlockIndexMismatch},
+            {"legacy hash mode outside legacy files", testLegacyHashMode},
+            {"lowered difficulty", testLoweredDifficulty},
+            {"transaction count past end of file", testTransactionCountPastEnd},
+        };
+
+        int failed = 0;
+        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        {
+                removeTestFiles();
+                int passed = tests[i].run();
+                printf("%s: %s\n", passed ? "PASS" : "FAIL", tests[i].name);
+                failed += !passed;
+        }
+        removeTestFiles();
+        return failed > 0;
+}